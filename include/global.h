@@ -75,6 +75,7 @@
 #include <event2/dns.h>
 #include <event2/http.h>
 #include <event2/http_struct.h>
+#include <event2/thread.h>
 
 #ifdef SSL_ENABLED
 #include <event2/bufferevent_ssl.h>
@@ -87,9 +88,27 @@
 typedef struct _Application Application;
 typedef struct _TBFSMng TBFSMng;
 typedef struct _TrackerClient TrackerClient;
+typedef struct _UdpTracker UdpTracker;
+typedef struct _TrackerTiers TrackerTiers;
 typedef struct _Torrent Torrent;
 typedef struct _PeerMng PeerMng;
 typedef struct _Peer Peer;
+typedef struct _PeerClient PeerClient;
+typedef struct _SuperSeed SuperSeed;
+typedef struct _Shard Shard;
+typedef struct _ShardPool ShardPool;
+typedef struct _Snapshot Snapshot;
+typedef struct _TrackerServer TrackerServer;
+typedef struct _Dht Dht;
+typedef struct _Lsd Lsd;
+typedef struct _DnsCache DnsCache;
+typedef struct _Metainfo Metainfo;
+
+// peer address, network byte order
+typedef struct {
+    guint32 addr;
+    guint16 port;
+} PeerEndpoint;
 
 typedef struct  {
     const gchar *header;
@@ -106,6 +125,10 @@ ConfData *application_get_conf (Application *app);
 struct event_base *application_get_evbase (Application *app);
 struct evdns_base *application_get_dnsbase (Application *app);
 TBFSMng *application_get_mng (Application *app);
-TrackerClient *application_get_tracker_client (Application *app);
+TrackerTiers *application_get_tracker_tiers (Application *app);
+ShardPool *application_get_shard_pool (Application *app);
+Dht *application_get_dht (Application *app);
+Lsd *application_get_lsd (Application *app);
+DnsCache *application_get_dns_cache (Application *app);
 
 #endif
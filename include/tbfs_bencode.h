@@ -20,6 +20,7 @@
 #include "global.h"
 
 typedef struct _BValue BValue;
+typedef struct _BParser BParser;
 
 typedef enum {
     BT_NONE = 0,
@@ -29,7 +30,24 @@ typedef enum {
     BT_DICT = 4,
 } BType;
 
+// flat token of bvalue_tokenize (): offset and length of string data or int digits,
+// containers span their whole encoding and are followed by their children
+typedef struct {
+    guint32 offset;
+    guint32 length;
+    guint32 children; // list items, dict keys and values
+    guint32 next; // index of the token following this value with all its children
+    guint8 type; // BType
+} BToken;
+
+#define BTOKEN_ERROR_INVALID -1 // malformed input
+#define BTOKEN_ERROR_NOMEM -2 // more than max_tokens tokens
+#define BTOKEN_ERROR_PART -3 // input ends in the middle of the value
+#define BTOKEN_MAX_DEPTH 64
+#define BTOKEN_STACK_TOKENS 128 // enough for typical tracker responses
+
 BValue *bvalue_create_from_buff (struct evbuffer *in);
+// frees the whole tree, must be called for the root only
 void bvalue_destroy (BValue *bval);
 
 BType bvalue_get_type (BValue *bval);
@@ -51,6 +69,76 @@ GList *bvalue_get_list (BValue *bval);
 // dict
 gboolean bvalue_is_dict (BValue *bval);
 BValue *bvalue_dict_get_value (BValue *bval, const gchar *key);
+BValue *bvalue_dict_get_value_binary (BValue *bval, const guint8 *key, gsize key_len);
+
+typedef void (*BValueDictForeachFunc) (const guint8 *key, gsize key_len, BValue *value, gpointer data);
+void bvalue_dict_foreach (BValue *bval, BValueDictForeachFunc func, gpointer data);
+
+// streaming encoder, writes canonical bencode into an evbuffer or a caller buffer.
+// dict keys must be added in sorted order, any misuse fails the encoder
+#define BENCODER_MAX_DEPTH 16
+#define BENCODER_KEY_LEN 32 // prefix of the last dict key kept for the order check
+
+typedef struct {
+    guint8 type; // BT_LIST or BT_DICT
+    gboolean has_key; // dict: at least one key is added
+    gboolean expect_value; // dict: key is added, value is not
+    gsize key_len;
+    guint8 key[BENCODER_KEY_LEN];
+} BEncoderLevel;
+
+typedef struct {
+    struct evbuffer *evb;
+    guint8 *buf;
+    gsize buf_size;
+    gsize len; // bytes written, with a caller buffer: bytes required
+    gsize pending; // bytes left of a string started by bencoder_string_begin ()
+    guint depth;
+    gboolean done;
+    gboolean failed;
+    BEncoderLevel levels[BENCODER_MAX_DEPTH];
+} BEncoder;
+
+void bencoder_init (BEncoder *enc, guint8 *buf, gsize buf_size);
+void bencoder_init_evbuffer (BEncoder *enc, struct evbuffer *evb);
+gboolean bencoder_finish (BEncoder *enc);
+
+void bencoder_begin_dict (BEncoder *enc);
+void bencoder_begin_list (BEncoder *enc);
+void bencoder_end (BEncoder *enc);
+void bencoder_key (BEncoder *enc, const gchar *key);
+void bencoder_key_binary (BEncoder *enc, const void *key, gsize len);
+void bencoder_int (BEncoder *enc, gint64 i);
+void bencoder_string (BEncoder *enc, const gchar *str);
+void bencoder_binary (BEncoder *enc, const void *data, gsize len);
+// string of len bytes written in pieces with bencoder_append ()
+void bencoder_string_begin (BEncoder *enc, gsize len);
+void bencoder_append (BEncoder *enc, const void *data, gsize len);
+
+// tokens
+gint bvalue_tokenize (const guint8 *buf, gsize buf_len, BToken *tokens, guint max_tokens, gsize *consumed);
+const guint8 *btoken_get_string (const guint8 *buf, const BToken *token, gsize *len);
+gboolean btoken_get_int (const guint8 *buf, const BToken *token, gint64 *i);
+gint btoken_dict_get (const guint8 *buf, const BToken *tokens, guint dict, const gchar *key);
+gint btoken_dict_get_binary (const guint8 *buf, const BToken *tokens, guint dict, const guint8 *key, gsize key_len);
+
+// resumable parser: bytes are fed as they arrive, tokens are offsets from the start of the stream
+BParser *bparser_create (void);
+void bparser_destroy (BParser *p);
+void bparser_reset (BParser *p);
+gint bparser_feed (BParser *p, const guint8 *data, gsize len, gsize *consumed);
+gint bparser_feed_buffer (BParser *p, struct evbuffer *in);
+const BToken *bparser_get_tokens (BParser *p, guint *count);
+gsize bparser_get_length (BParser *p);
+BValue *bvalue_create_from_parser (BParser *p, struct evbuffer *in);
+
+// raw
+const guint8 *bvalue_raw_dict_get_string (const guint8 *buf, gsize buf_len, const gchar *key, gsize *len);
+gboolean bvalue_raw_dict_get_int (const guint8 *buf, gsize buf_len, const gchar *key, gint64 *i);
+const guint8 *bvalue_raw_dict_get_value (const guint8 *buf, gsize buf_len, const gchar *key, gsize *len);
+
+typedef void (*BValueRawStringFunc) (const guint8 *str, gsize len, gpointer data);
+gboolean bvalue_raw_list_foreach_string (const guint8 *buf, gsize buf_len, BValueRawStringFunc func, gpointer data);
 
 
 void bvalue_print_string (BValue *bval, GString *str, int tabs);
@@ -23,11 +23,19 @@ typedef struct _Bitfield Bitfield;
 
 Bitfield *tbfs_bitfield_create (guint32 bit_count);
 void tbfs_bitfield_destroy (Bitfield *bf);
+Bitfield *tbfs_bitfield_init (gpointer mem, guint32 bit_count);
+gsize tbfs_bitfield_sizeof (guint32 bit_count);
 
 void tbfs_bitfield_set_bit (Bitfield *bf, guint32 bit);
+gboolean tbfs_bitfield_get_bit (Bitfield *bf, guint32 bit);
+guint32 tbfs_bitfield_get_bit_count (Bitfield *bf);
 guint32 tbfs_bitfield_get_length (Bitfield *bf);
-void *tbfs_bitfield_get_bits (Bitfield *bf);
 
 guint32 tbfs_bitfield_get_set_bits (Bitfield *bf);
+const guint8 *tbfs_bitfield_peek_bits (Bitfield *bf);
+gboolean tbfs_bitfield_set_bits (Bitfield *bf, const guint8 *bits, guint32 len);
+
+gboolean tbfs_bitfield_or (Bitfield *dst, Bitfield *src);
+gint64 tbfs_bitfield_find_next_and_not (Bitfield *a, Bitfield *b, guint32 from);
 
 #endif
@@ -24,5 +24,7 @@ typedef struct _CmdServer CmdServer;
 CmdServer *tbfs_cmd_server_create (Application *app);
 void tbfs_cmd_server_destroy (CmdServer *server);
 
+struct evhttp *tbfs_cmd_server_get_httpd (CmdServer *server);
+
 #endif
 
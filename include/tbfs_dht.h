@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _TBFS_DHT_H_
+#define _TBFS_DHT_H_
+
+#include "global.h"
+
+// called for every batch of peers found by a lookup, info_hash is a hex string
+typedef void (*Dht_on_peers_cb) (const gchar *info_hash, const PeerEndpoint *endpoints, guint count, gpointer ctx);
+
+Dht *tbfs_dht_create (Application *app);
+void tbfs_dht_destroy (Dht *dht);
+
+void tbfs_dht_get_peers (Dht *dht, const gchar *info_hash, gboolean announce, Dht_on_peers_cb on_peers_cb, gpointer ctx);
+void tbfs_dht_add_node (Dht *dht, const PeerEndpoint *endpoint);
+gboolean tbfs_dht_save (Dht *dht);
+
+guint tbfs_dht_get_node_count (Dht *dht);
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _TBFS_METAINFO_H_
+#define _TBFS_METAINFO_H_
+
+#include "global.h"
+
+Metainfo *tbfs_metainfo_load (const gchar *path);
+void tbfs_metainfo_destroy (Metainfo *mi);
+
+const gchar *tbfs_metainfo_get_info_hash (Metainfo *mi);
+guint32 tbfs_metainfo_get_piece_count (Metainfo *mi);
+
+const guint8 *tbfs_metainfo_get_piece_hash (Metainfo *mi, guint32 piece_idx);
+
+#endif
@@ -20,10 +20,18 @@
 #include "global.h"
 #include "tbfs_torrent.h"
 
+typedef void (*TBFSMng_on_stopped_cb) (gpointer ctx);
+
 TBFSMng *tbfs_mng_create (Application *app);
 void tbfs_mng_destroy (TBFSMng *mng);
+void tbfs_mng_stop (TBFSMng *mng, TBFSMng_on_stopped_cb on_stopped_cb, gpointer ctx);
 
 Torrent *tbfs_mng_torrent_register (TBFSMng *mng, const gchar *info_hash, guint32 total_pieces);
+Torrent *tbfs_mng_torrent_register_delayed (TBFSMng *mng, const gchar *info_hash, guint32 total_pieces, gint64 announce_delay);
 Torrent *tbfs_mng_torrent_get (TBFSMng *mng, const gchar *info_hash);
+void tbfs_mng_torrent_wants_peers (TBFSMng *mng, Torrent *torrent);
+void tbfs_mng_add_local_peers (TBFSMng *mng, const gchar *info_hash, const PeerEndpoint *endpoints, guint count);
+guint tbfs_mng_load_metainfo_dir (TBFSMng *mng, const gchar *dir, gboolean seed);
+gsize tbfs_mng_torrent_data_sizeof (void);
 
 #endif
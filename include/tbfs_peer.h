@@ -30,6 +30,15 @@ void tbfs_peer_destroy (Peer *peer);
 
 const gchar *tbfs_peer_get_id (Peer *peer);
 const gchar *tbfs_peer_get_info_hash (Peer *peer);
+void tbfs_peer_get_addr (Peer *peer, guint32 *addr, guint16 *port);
+const PeerEndpoint *tbfs_peer_get_endpoint (Peer *peer);
+gboolean tbfs_peer_is_local (Peer *peer);
+void tbfs_peer_set_local (Peer *peer, gboolean local);
+gsize tbfs_peer_sizeof (void);
+
+guint tbfs_peer_endpoint_hash (gconstpointer v);
+gboolean tbfs_peer_endpoint_equal (gconstpointer a, gconstpointer b);
+void tbfs_peer_set_client (Peer *peer, PeerClient *client);
 
 void tbfs_peer_on_pieces_request_cb (Peer *peer);
 void tbfs_peer_on_info_print_cb (Peer *peer, struct evbuffer *buf, PrintFormat *print_format);
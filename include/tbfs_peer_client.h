@@ -20,15 +20,14 @@
 #include "global.h"
 #include "tbfs_peer_server.h"
 
-typedef struct _PeerClient PeerClient;
-
-PeerClient *tbfs_peer_client_create (Application *app, evutil_socket_t fd);
-PeerClient *tbfs_peer_client_create_with_addr (Application *app, struct sockaddr_in *sin);
+PeerClient *tbfs_peer_client_create (Application *app, Shard *shard, evutil_socket_t fd);
+PeerClient *tbfs_peer_client_create_with_addr (Application *app, Shard *shard, struct sockaddr_in *sin);
 void tbfs_peer_client_destroy (PeerClient *client);
 
 void tbfs_peer_client_set_peer (PeerClient *client, Peer *peer);
 
 void tbfs_peer_client_connect_get_piece (PeerClient *client);
+void tbfs_peer_client_send_have (PeerClient *client, guint32 piece_idx);
 
 #endif
 
@@ -21,16 +21,21 @@
 #include "tbfs_torrent.h"
 #include "tbfs_peer.h"
 
+typedef void (*PeerMngForeachFunc) (Peer *peer, gpointer data);
 
 PeerMng *tbfs_peer_mng_create (Application *app, Torrent *torrent);
 void tbfs_peer_mng_destroy (PeerMng *mng);
 
 Application *tbfs_peer_mng_get_app (PeerMng *mng);
 const gchar *tbfs_peer_mng_get_info_hash (PeerMng *mng);
+Shard *tbfs_peer_mng_get_shard (PeerMng *mng);
 
 void tbfs_peer_mng_peer_add (PeerMng *mng, const gchar *peer_id, guint32 addr, guint16 port);
+guint tbfs_peer_mng_peers_add (PeerMng *mng, const gchar *peer_id, const PeerEndpoint *endpoints, guint count);
+guint tbfs_peer_mng_local_peers_add (PeerMng *mng, const gchar *peer_id, const PeerEndpoint *endpoints, guint count);
 void tbfs_peer_mng_peers_updated (PeerMng *mng);
 gint tbfs_peer_mng_peer_count (PeerMng *mng);
+void tbfs_peer_mng_foreach_peer (PeerMng *mng, PeerMngForeachFunc func, gpointer data);
 
 void tbfs_peer_mng_torrent_piece_added (PeerMng *mng, guint32 piece_id);
 Peer *tbfs_peer_mng_get_peer (PeerMng *mng, const gchar *peer_id);
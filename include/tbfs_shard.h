@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _TBFS_SHARD_H_
+#define _TBFS_SHARD_H_
+
+#include "global.h"
+
+typedef void (*ShardTaskFunc) (gpointer data);
+
+ShardPool *tbfs_shard_pool_create (Application *app);
+void tbfs_shard_pool_destroy (ShardPool *pool);
+
+gboolean tbfs_shard_pool_start (ShardPool *pool);
+void tbfs_shard_pool_stop (ShardPool *pool);
+
+guint tbfs_shard_pool_get_count (ShardPool *pool);
+Shard *tbfs_shard_pool_get_shard (ShardPool *pool, const gchar *info_hash);
+Shard *tbfs_shard_pool_get_main (ShardPool *pool);
+Shard *tbfs_shard_pool_get_shard_nth (ShardPool *pool, guint n);
+
+struct event_base *tbfs_shard_get_evbase (Shard *shard);
+guint tbfs_shard_get_id (Shard *shard);
+
+void tbfs_shard_run (Shard *shard, ShardTaskFunc func, gpointer data);
+void tbfs_shard_run_full (Shard *shard, ShardTaskFunc func, gpointer data, GDestroyNotify cancel);
+
+void tbfs_shard_torrent_add (Shard *shard, Torrent *torrent);
+Torrent *tbfs_shard_torrent_get (Shard *shard, const gchar *info_hash);
+void tbfs_shard_torrent_foreach (Shard *shard, GHFunc func, gpointer data);
+void tbfs_shard_torrent_set_active (Shard *shard, Torrent *torrent);
+guint tbfs_shard_get_active_count (Shard *shard);
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _TBFS_SNAPSHOT_H_
+#define _TBFS_SNAPSHOT_H_
+
+#include "global.h"
+
+typedef void (*Snapshot_on_saved_cb) (gpointer ctx);
+
+Snapshot *tbfs_snapshot_create (Application *app);
+void tbfs_snapshot_destroy (Snapshot *snap);
+
+gboolean tbfs_snapshot_load (Snapshot *snap, TBFSMng *mng);
+void tbfs_snapshot_save (Snapshot *snap, Snapshot_on_saved_cb on_saved_cb, gpointer ctx);
+
+#endif
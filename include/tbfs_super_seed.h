@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _TBFS_SUPER_SEED_H_
+#define _TBFS_SUPER_SEED_H_
+
+#include "global.h"
+#include "tbfs_torrent.h"
+#include "tbfs_peer_client.h"
+
+SuperSeed *tbfs_super_seed_create (Torrent *torrent);
+void tbfs_super_seed_destroy (SuperSeed *ss);
+
+void tbfs_super_seed_peer_add (SuperSeed *ss, PeerClient *client);
+void tbfs_super_seed_peer_remove (SuperSeed *ss, PeerClient *client);
+void tbfs_super_seed_peer_bitfield (SuperSeed *ss, PeerClient *client, const guint8 *bits, guint32 len);
+void tbfs_super_seed_peer_have (SuperSeed *ss, PeerClient *client, guint32 piece_idx);
+
+#endif
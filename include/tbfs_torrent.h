@@ -21,19 +21,55 @@
 #include "tbfs_peer.h"
 #include "tbfs_bitfield.h"
 
+// known peer record: addr:u32 port:u16 peer_id[PEER_ID_LENGTH], host byte order
+#define TORRENT_PEER_RECORD_LEN (4 + 2 + PEER_ID_LENGTH)
+
+typedef void (*TorrentPeerFunc) (const gchar *peer_id, guint32 addr, guint16 port, gpointer data);
+
 
 Torrent *tbfs_torrent_create (Application *app, const gchar *info_hash, guint32 total_pieces);
 void tbfs_torrent_destroy (Torrent *torrent);
+gsize tbfs_torrent_sizeof (guint32 total_pieces);
+
+gboolean tbfs_torrent_is_active (Torrent *torrent);
+gboolean tbfs_torrent_try_hibernate (Torrent *torrent, time_t now, gint32 idle_sec);
+void tbfs_torrent_client_connected (Torrent *torrent);
+void tbfs_torrent_client_disconnected (Torrent *torrent);
 
 //void torrent_add_peer (Torrent *torrent, Peer *peer);
 //void torrent_remove_peer (Torrent *torrent, Peer *peer);
 void tbfs_torrent_add_peer_addr (Torrent *torrent, const gchar *peer_id, guint32 addr, guint16 port);
+void tbfs_torrent_add_peer_endpoints (Torrent *torrent, const gchar *peer_id, const PeerEndpoint *endpoints, guint count);
+void tbfs_torrent_add_local_peer_endpoints (Torrent *torrent, const gchar *peer_id, const PeerEndpoint *endpoints, guint count);
+void tbfs_torrent_add_known_peers (Torrent *torrent, const guint8 *recs, guint count);
+void tbfs_torrent_foreach_known_peer (Torrent *torrent, TorrentPeerFunc func, gpointer data);
 void tbfs_torrent_add_piece (Torrent *torrent, guint32 piece_id);
+void tbfs_torrent_set_piece_have (Torrent *torrent, guint32 piece_id);
+void tbfs_torrent_set_pieces_have_bits (Torrent *torrent, const guint8 *bits, guint32 len);
+gboolean tbfs_torrent_is_complete (Torrent *torrent);
+guint32 tbfs_torrent_get_pieces_missing (Torrent *torrent);
+gint32 tbfs_torrent_get_numwant (Torrent *torrent);
+
+void tbfs_torrent_add_transferred (Torrent *torrent, guint64 uploaded, guint64 downloaded);
+guint64 tbfs_torrent_get_uploaded (Torrent *torrent);
+guint64 tbfs_torrent_get_downloaded (Torrent *torrent);
+
+void tbfs_torrent_set_super_seed (Torrent *torrent, gboolean super_seed);
+SuperSeed *tbfs_torrent_get_super_seed (Torrent *torrent);
 
 Bitfield *tbfs_torrent_get_bitfield_pieces_have (Torrent *torrent);
 Bitfield *tbfs_torrent_get_bitfield_pieces_want (Torrent *torrent);
+GBytes *tbfs_torrent_get_bitfield_msg (Torrent *torrent);
+void tbfs_torrent_set_bitfield_msg (Torrent *torrent, GBytes *msg);
 void tbfs_torrent_peers_updated (Torrent *torrent);
 
 const gchar *tbfs_torrent_get_info_hash (Torrent *torrent);
+const uint8_t *tbfs_torrent_get_sha1 (Torrent *torrent);
+guint32 tbfs_torrent_get_total_pieces (Torrent *torrent);
+PeerMng *tbfs_torrent_get_peer_mng (Torrent *torrent);
+Shard *tbfs_torrent_get_shard (Torrent *torrent);
+void tbfs_torrent_set_metainfo (Torrent *torrent, Metainfo *mi);
+Metainfo *tbfs_torrent_get_metainfo (Torrent *torrent);
+struct event_base *tbfs_torrent_get_evbase (Torrent *torrent);
 void tbfs_torrent_info_print (Torrent *torrent, struct evbuffer *buf, PrintFormat *print_format);
 #endif
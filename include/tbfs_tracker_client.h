@@ -23,18 +23,51 @@ typedef enum {
     TE_started = 0,
     TE_stopped = 1,
     TE_completed = 2,
+    TE_none = 3, // regular announce
 } TrackerEvent;
 
+typedef PeerEndpoint PeerAddr;
+
+typedef struct {
+    gchar info_hash[2 * SHA_DIGEST_LENGTH + 1];
+    gint64 complete; // seeders
+    gint64 incomplete; // leechers
+    gint64 downloaded;
+} TrackerScrapeInfo;
+
+// torrent state reported in announces
 typedef struct {
-    guint32 addr4;
-    guint16 port;
-} PeerAddr;
+    guint64 uploaded;
+    guint64 downloaded;
+    guint64 left;
+    gint32 numwant; // -1: tracker's default
+} TrackerAnnounceStats;
 
-typedef void (*TrackerClient_on_request_done_cb) (gboolean status, gpointer ctx, gchar *info_hash, GList *l_peer_addrs);
+// intervals are 0 if tracker did not send them
+typedef struct {
+    const PeerAddr *peer_addrs;
+    guint peer_count;
+    gint32 interval;
+    gint32 min_interval;
+    const gchar *failure_reason; // tracker rejected the request, status is FALSE
+} TrackerAnnounceReply;
 
-TrackerClient *tbfs_tracker_client_create (Application *app);
+// reply is NULL if tracker could not be reached or its response was not understood
+typedef void (*TrackerClient_on_request_done_cb) (gboolean status, gpointer ctx, gchar *info_hash,
+    const TrackerAnnounceReply *reply);
+typedef void (*TrackerClient_on_scrape_done_cb) (gboolean status, gpointer ctx, TrackerScrapeInfo *infos, guint count);
+
+TrackerClient *tbfs_tracker_client_create (Application *app, const gchar *url);
+const gchar *tbfs_tracker_client_get_url (TrackerClient *client);
 void tbfs_tracker_client_destroy (TrackerClient *client);
 
-void tbfs_tracker_client_send_request (TrackerClient *client, const gchar *info_hash, TrackerEvent event_type, 
-    TrackerClient_on_request_done_cb on_request_done_cb, gpointer ctx);
+void tbfs_tracker_client_send_request (TrackerClient *client, const gchar *info_hash, const TrackerAnnounceStats *stats,
+    TrackerEvent event_type, TrackerClient_on_request_done_cb on_request_done_cb, gpointer ctx);
+void tbfs_tracker_client_send_batch_request (TrackerClient *client, const gchar **info_hashes, const TrackerAnnounceStats *stats,
+    guint count, TrackerEvent event_type, TrackerClient_on_request_done_cb on_request_done_cb, gpointer ctx);
+void tbfs_tracker_client_scrape (TrackerClient *client, const gchar **info_hashes, guint count,
+    TrackerClient_on_scrape_done_cb on_scrape_done_cb, gpointer ctx);
+
+PeerAddr *tbfs_tracker_client_decode_peers (const guint8 *compact, gsize len, guint *count);
+
 #endif
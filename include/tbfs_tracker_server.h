@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _TBFS_TRACKER_SERVER_H_
+#define _TBFS_TRACKER_SERVER_H_
+
+#include "global.h"
+
+TrackerServer *tbfs_tracker_server_create (Application *app, struct evhttp *cmd_httpd);
+void tbfs_tracker_server_destroy (TrackerServer *server);
+
+guint tbfs_tracker_server_get_swarm_count (TrackerServer *server);
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _TBFS_TRACKER_TIERS_H_
+#define _TBFS_TRACKER_TIERS_H_
+
+#include "global.h"
+#include "tbfs_tracker_client.h"
+
+TrackerTiers *tbfs_tracker_tiers_create (Application *app);
+void tbfs_tracker_tiers_destroy (TrackerTiers *tiers);
+
+void tbfs_tracker_tiers_send_request (TrackerTiers *tiers, const gchar *info_hash, const TrackerAnnounceStats *stats,
+    TrackerEvent event_type, TrackerClient_on_request_done_cb on_request_done_cb, gpointer ctx);
+void tbfs_tracker_tiers_send_batch_request (TrackerTiers *tiers, const gchar **info_hashes, const TrackerAnnounceStats *stats,
+    guint count, TrackerEvent event_type, TrackerClient_on_request_done_cb on_request_done_cb, gpointer ctx);
+void tbfs_tracker_tiers_scrape (TrackerTiers *tiers, const gchar **info_hashes, guint count,
+    TrackerClient_on_scrape_done_cb on_scrape_done_cb, gpointer ctx);
+
+#endif
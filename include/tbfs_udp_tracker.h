@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#ifndef _TBFS_UDP_TRACKER_H_
+#define _TBFS_UDP_TRACKER_H_
+
+#include "global.h"
+#include "tbfs_tracker_client.h"
+
+UdpTracker *tbfs_udp_tracker_create (Application *app, const gchar *host, gint port);
+void tbfs_udp_tracker_destroy (UdpTracker *ut);
+
+void tbfs_udp_tracker_announce (UdpTracker *ut, const gchar *info_hash, const TrackerAnnounceStats *stats, TrackerEvent event_type,
+    TrackerClient_on_request_done_cb on_request_done_cb, gpointer ctx);
+void tbfs_udp_tracker_scrape (UdpTracker *ut, const gchar **info_hashes, guint count,
+    TrackerClient_on_scrape_done_cb on_scrape_done_cb, gpointer ctx);
+
+#endif
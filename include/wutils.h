@@ -116,6 +116,9 @@ gchar *str_remove_quotes (gchar *str);
 
 void sha1_to_hexstr (gchar *out, const uint8_t *sha1);
 void hexstr_to_sha1 (uint8_t *out, const char *in);
+gboolean sha1_hexstr_is_valid (const gchar *str);
+guint sha1_hash (gconstpointer v);
+gboolean sha1_equal (gconstpointer a, gconstpointer b);
 void escape_sha1 (char * out, const uint8_t *sha1);
 
 // file utils
@@ -136,6 +139,25 @@ gint wrange_count (WRange *range);
 guint64 wrange_length (WRange *range);
 void wrange_print (WRange *range);
 
+// min-heap
+typedef struct _WHeap WHeap;
+typedef struct {
+    gint64 key;
+    guint idx; // position in the heap
+    gpointer data;
+} WHeapNode;
+
+WHeap *wheap_create (void);
+void wheap_destroy (WHeap *heap);
+void wheap_node_init (WHeapNode *node, gpointer data);
+gboolean wheap_node_is_queued (WHeapNode *node);
+void wheap_push (WHeap *heap, WHeapNode *node, gint64 key);
+void wheap_remove (WHeap *heap, WHeapNode *node);
+void wheap_update (WHeap *heap, WHeapNode *node, gint64 key);
+WHeapNode *wheap_peek (WHeap *heap);
+WHeapNode *wheap_pop (WHeap *heap);
+guint wheap_size (WHeap *heap);
+
 // get min / max of integer types
 #define type_bits(t) ((t) (sizeof(t) * (CHAR_BIT)))
 #define int_max(t) ((t) (~ ((t) (((t) 1) << ((t)type_bits(t) - 1)))))
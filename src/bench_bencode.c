@@ -0,0 +1,601 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "global.h"
+#include "tbfs_bencode.h"
+
+// Compares the evbuffer based recursive bencode parser the node used before
+// with the tokenizer, the resumable parser and the arena tree builder, and
+// hand-formatted replies with BEncoder.
+// usage: bench_bencode [iterations]
+
+/*{{{ struct */
+typedef struct {
+    const gchar *name;
+    guint8 *data;
+    gsize len;
+} BenchInput;
+
+typedef void (*BenchFunc) (BenchInput *in, gpointer ctx);
+
+#define BENCH_PEERS 50
+#define BENCH_PIECES 1024
+#define BENCH_FILES 100
+#define BENCH_CHUNK 1400 // parser is fed with TCP sized pieces
+#define BENCH_TOKENS 1024
+/*}}}*/
+
+/*{{{ old parser */
+// copy of the original parser, kept here only as the baseline
+typedef struct {
+    BType type;
+    gint32 strlen;
+
+    union {
+        gchar *str;
+        gint64 integer;
+        GList *list;
+        GHashTable *h_dict;
+    } value;
+} OldBValue;
+
+static OldBValue *old_bvalue_create_from_buff (struct evbuffer *in);
+
+static void old_bvalue_destroy (OldBValue *bval)
+{
+    GList *l;
+
+    switch (bval->type) {
+        case BT_STRING:
+            g_free (bval->value.str);
+            break;
+        case BT_LIST:
+            for (l = g_list_first (bval->value.list); l; l = g_list_next (l))
+                old_bvalue_destroy ((OldBValue *) l->data);
+            g_list_free (bval->value.list);
+            break;
+        case BT_DICT:
+            g_hash_table_destroy (bval->value.h_dict);
+            break;
+        default:
+            break;
+    }
+
+    g_free (bval);
+}
+
+static gchar *old_bvalue_parse_string (struct evbuffer *in, gint32 *len)
+{
+    gchar *str;
+    gchar *clen;
+    struct evbuffer_ptr pos;
+    gchar tmp[1];
+
+    pos = evbuffer_search (in, ":", 1, NULL);
+    clen = g_new0 (gchar, pos.pos + 1);
+    evbuffer_remove (in, clen, pos.pos);
+    clen[pos.pos] = '\0';
+
+    *len = atoi (clen);
+    g_free (clen);
+
+    evbuffer_remove (in, tmp, 1);
+
+    str = g_new0 (gchar, *len + 1);
+    evbuffer_remove (in, str, *len);
+    str[*len] = '\0';
+
+    return str;
+}
+
+static gint64 old_bvalue_parse_int (struct evbuffer *in)
+{
+    gchar tmp[1];
+    struct evbuffer_ptr pos;
+    gchar *str;
+    gint64 i;
+
+    evbuffer_remove (in, tmp, 1);
+
+    pos = evbuffer_search (in, "e", 1, NULL);
+    str = g_new0 (gchar, pos.pos + 1);
+    evbuffer_remove (in, str, pos.pos);
+    str[pos.pos] = '\0';
+
+    i = atoll (str);
+    g_free (str);
+
+    evbuffer_remove (in, tmp, 1);
+
+    return i;
+}
+
+static GList *old_bvalue_parse_list (struct evbuffer *in)
+{
+    gchar tmp[1];
+    gchar c;
+    GList *l = NULL;
+
+    evbuffer_remove (in, tmp, 1);
+    evbuffer_copyout (in, &c, 1);
+
+    while (c != 'e' && evbuffer_get_length (in) > 1) {
+        l = g_list_append (l, old_bvalue_create_from_buff (in));
+        evbuffer_copyout (in, &c, 1);
+    }
+
+    evbuffer_remove (in, tmp, 1);
+
+    return l;
+}
+
+static void old_bvalue_dict_item_free (gpointer data)
+{
+    old_bvalue_destroy ((OldBValue *) data);
+}
+
+static GHashTable *old_bvalue_parse_dict (struct evbuffer *in)
+{
+    GHashTable *h_dict;
+    gchar tmp[1];
+    gchar c;
+
+    evbuffer_remove (in, tmp, 1);
+    evbuffer_copyout (in, &c, 1);
+
+    h_dict = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, old_bvalue_dict_item_free);
+
+    while (c != 'e' && evbuffer_get_length (in) > 1) {
+        OldBValue *key = old_bvalue_create_from_buff (in);
+        OldBValue *value = old_bvalue_create_from_buff (in);
+
+        g_hash_table_insert (h_dict, g_strdup (key->value.str), value);
+        old_bvalue_destroy (key);
+        evbuffer_copyout (in, &c, 1);
+    }
+
+    evbuffer_remove (in, tmp, 1);
+
+    return h_dict;
+}
+
+static OldBValue *old_bvalue_create_from_buff (struct evbuffer *in)
+{
+    OldBValue *bval;
+    gchar c;
+
+    if (!evbuffer_get_length (in))
+        return NULL;
+
+    evbuffer_copyout (in, &c, 1);
+
+    bval = g_new0 (OldBValue, 1);
+    if (g_ascii_isdigit (c)) {
+        bval->type = BT_STRING;
+        bval->value.str = old_bvalue_parse_string (in, &bval->strlen);
+    } else if (c == 'i') {
+        bval->type = BT_INT;
+        bval->value.integer = old_bvalue_parse_int (in);
+    } else if (c == 'l') {
+        bval->type = BT_LIST;
+        bval->value.list = old_bvalue_parse_list (in);
+    } else if (c == 'd') {
+        bval->type = BT_DICT;
+        bval->value.h_dict = old_bvalue_parse_dict (in);
+    } else {
+        g_free (bval);
+        bval = NULL;
+    }
+
+    return bval;
+}
+/*}}}*/
+
+/*{{{ compare */
+typedef struct {
+    OldBValue *old;
+    guint count;
+    gboolean ok;
+} BenchCompareData;
+
+static gboolean bench_compare (OldBValue *old, BValue *bval);
+
+static void bench_compare_dict_cb (const guint8 *key, gsize key_len, BValue *value, gpointer data)
+{
+    BenchCompareData *cdata = (BenchCompareData *) data;
+    gchar *s_key = g_strndup ((const gchar *) key, key_len);
+    OldBValue *old = g_hash_table_lookup (cdata->old->value.h_dict, s_key);
+
+    if (!old || !bench_compare (old, value))
+        cdata->ok = FALSE;
+    cdata->count++;
+    g_free (s_key);
+}
+
+// TRUE if both trees hold the same values
+static gboolean bench_compare (OldBValue *old, BValue *bval)
+{
+    BenchCompareData cdata;
+    GList *l_old, *l;
+    guint8 *str;
+    gint32 len;
+
+    if (!old || !bval || old->type != bvalue_get_type (bval))
+        return FALSE;
+
+    switch (old->type) {
+        case BT_STRING:
+            str = bvalue_get_binary_string (bval, &len);
+            return len == old->strlen && !memcmp (str, old->value.str, len);
+        case BT_INT:
+            return old->value.integer == bvalue_get_int (bval);
+        case BT_LIST:
+            l = bvalue_get_list (bval);
+            for (l_old = old->value.list; l_old && l; l_old = l_old->next, l = l->next) {
+                if (!bench_compare ((OldBValue *) l_old->data, (BValue *) l->data))
+                    return FALSE;
+            }
+            return !l_old && !l;
+        case BT_DICT:
+            cdata.old = old;
+            cdata.count = 0;
+            cdata.ok = TRUE;
+            bvalue_dict_foreach (bval, bench_compare_dict_cb, &cdata);
+            return cdata.ok && cdata.count == g_hash_table_size (old->value.h_dict);
+        default:
+            return FALSE;
+    }
+}
+/*}}}*/
+
+/*{{{ inputs */
+static void bench_input_set (BenchInput *in, const gchar *name, struct evbuffer *evb)
+{
+    in->name = name;
+    in->len = evbuffer_get_length (evb);
+    in->data = g_malloc (in->len);
+    evbuffer_remove (evb, in->data, in->len);
+}
+
+// non-compact announce reply, a dict per peer
+static void bench_input_announce (BenchInput *in, struct evbuffer *evb)
+{
+    BEncoder enc;
+    gchar s[64];
+    guint i;
+
+    bencoder_init_evbuffer (&enc, evb);
+    bencoder_begin_dict (&enc);
+    bencoder_key (&enc, "complete");
+    bencoder_int (&enc, 20);
+    bencoder_key (&enc, "incomplete");
+    bencoder_int (&enc, BENCH_PEERS - 20);
+    bencoder_key (&enc, "interval");
+    bencoder_int (&enc, 1800);
+    bencoder_key (&enc, "peers");
+    bencoder_begin_list (&enc);
+    for (i = 0; i < BENCH_PEERS; i++) {
+        bencoder_begin_dict (&enc);
+        bencoder_key (&enc, "ip");
+        g_snprintf (s, sizeof (s), "10.0.%u.%u", i / 256, i % 256);
+        bencoder_string (&enc, s);
+        bencoder_key (&enc, "peer id");
+        g_snprintf (s, sizeof (s), "-TB0100-%012u", i);
+        bencoder_string (&enc, s);
+        bencoder_key (&enc, "port");
+        bencoder_int (&enc, 6881 + i);
+        bencoder_end (&enc);
+    }
+    bencoder_end (&enc);
+    bencoder_end (&enc);
+    bencoder_finish (&enc);
+
+    bench_input_set (in, "announce", evb);
+}
+
+static void bench_input_metainfo (BenchInput *in, struct evbuffer *evb)
+{
+    BEncoder enc;
+    guint8 *pieces;
+    guint i;
+
+    pieces = g_malloc (BENCH_PIECES * SHA_DIGEST_LENGTH);
+    for (i = 0; i < BENCH_PIECES * SHA_DIGEST_LENGTH; i++)
+        pieces[i] = (guint8) (i * 131 + 7);
+
+    bencoder_init_evbuffer (&enc, evb);
+    bencoder_begin_dict (&enc);
+    bencoder_key (&enc, "announce");
+    bencoder_string (&enc, "http://tracker.example.com:6969/announce");
+    bencoder_key (&enc, "info");
+    bencoder_begin_dict (&enc);
+    bencoder_key (&enc, "length");
+    bencoder_int (&enc, (gint64) BENCH_PIECES * 262144);
+    bencoder_key (&enc, "name");
+    bencoder_string (&enc, "bench.bin");
+    bencoder_key (&enc, "piece length");
+    bencoder_int (&enc, 262144);
+    bencoder_key (&enc, "pieces");
+    bencoder_binary (&enc, pieces, BENCH_PIECES * SHA_DIGEST_LENGTH);
+    bencoder_end (&enc);
+    bencoder_end (&enc);
+    bencoder_finish (&enc);
+
+    g_free (pieces);
+    bench_input_set (in, "metainfo", evb);
+}
+/*}}}*/
+
+/*{{{ decode */
+static void bench_decode_old (BenchInput *in, gpointer ctx)
+{
+    struct evbuffer *evb = (struct evbuffer *) ctx;
+
+    evbuffer_add (evb, in->data, in->len);
+    old_bvalue_destroy (old_bvalue_create_from_buff (evb));
+    evbuffer_drain (evb, evbuffer_get_length (evb));
+}
+
+static void bench_decode_tree (BenchInput *in, gpointer ctx)
+{
+    struct evbuffer *evb = (struct evbuffer *) ctx;
+
+    evbuffer_add (evb, in->data, in->len);
+    bvalue_destroy (bvalue_create_from_buff (evb));
+    evbuffer_drain (evb, evbuffer_get_length (evb));
+}
+
+static void bench_decode_tokens (BenchInput *in, gpointer ctx)
+{
+    BToken *tokens = (BToken *) ctx;
+
+    if (bvalue_tokenize (in->data, in->len, tokens, BENCH_TOKENS, NULL) <= 0)
+        abort ();
+}
+
+static void bench_decode_parser (BenchInput *in, gpointer ctx)
+{
+    BParser *p = (BParser *) ctx;
+    gsize pos;
+    gint res = BTOKEN_ERROR_PART;
+
+    bparser_reset (p);
+    for (pos = 0; pos < in->len && res == BTOKEN_ERROR_PART; pos += BENCH_CHUNK)
+        res = bparser_feed (p, in->data + pos, MIN (BENCH_CHUNK, in->len - pos), NULL);
+    if (res <= 0)
+        abort ();
+}
+/*}}}*/
+
+/*{{{ encode */
+typedef struct {
+    struct evbuffer *evb;
+    guint8 *buf;
+    gsize buf_size;
+    guint8 hashes[BENCH_FILES][SHA_DIGEST_LENGTH]; // sorted
+} BenchEncodeData;
+
+// scrape reply formatted by hand, as the embedded tracker used to do
+static void bench_encode_printf_add (BenchEncodeData *edata)
+{
+    guint i;
+
+    evbuffer_add (edata->evb, "d5:filesd", 9);
+    for (i = 0; i < BENCH_FILES; i++) {
+        evbuffer_add_printf (edata->evb, "%d:", SHA_DIGEST_LENGTH);
+        evbuffer_add (edata->evb, edata->hashes[i], SHA_DIGEST_LENGTH);
+        evbuffer_add_printf (edata->evb, "d8:completei%ue10:downloadedi%ue10:incompletei%uee", i, i * 3, i * 2);
+    }
+    evbuffer_add (edata->evb, "ee", 2);
+}
+
+static void bench_encode_printf (G_GNUC_UNUSED BenchInput *in, gpointer ctx)
+{
+    BenchEncodeData *edata = (BenchEncodeData *) ctx;
+
+    bench_encode_printf_add (edata);
+    evbuffer_drain (edata->evb, evbuffer_get_length (edata->evb));
+}
+
+static void bench_encode_files (BEncoder *enc, BenchEncodeData *edata)
+{
+    guint i;
+
+    bencoder_begin_dict (enc);
+    bencoder_key (enc, "files");
+    bencoder_begin_dict (enc);
+    for (i = 0; i < BENCH_FILES; i++) {
+        bencoder_key_binary (enc, edata->hashes[i], SHA_DIGEST_LENGTH);
+        bencoder_begin_dict (enc);
+        bencoder_key (enc, "complete");
+        bencoder_int (enc, i);
+        bencoder_key (enc, "downloaded");
+        bencoder_int (enc, i * 3);
+        bencoder_key (enc, "incomplete");
+        bencoder_int (enc, i * 2);
+        bencoder_end (enc);
+    }
+    bencoder_end (enc);
+    bencoder_end (enc);
+}
+
+static void bench_encode_evbuffer (G_GNUC_UNUSED BenchInput *in, gpointer ctx)
+{
+    BenchEncodeData *edata = (BenchEncodeData *) ctx;
+    BEncoder enc;
+
+    bencoder_init_evbuffer (&enc, edata->evb);
+    bench_encode_files (&enc, edata);
+    if (!bencoder_finish (&enc))
+        abort ();
+    evbuffer_drain (edata->evb, evbuffer_get_length (edata->evb));
+}
+
+static void bench_encode_buf (G_GNUC_UNUSED BenchInput *in, gpointer ctx)
+{
+    BenchEncodeData *edata = (BenchEncodeData *) ctx;
+    BEncoder enc;
+
+    bencoder_init (&enc, edata->buf, edata->buf_size);
+    bench_encode_files (&enc, edata);
+    if (!bencoder_finish (&enc))
+        abort ();
+}
+
+static gint bench_hash_cmp (gconstpointer a, gconstpointer b)
+{
+    return memcmp (a, b, SHA_DIGEST_LENGTH);
+}
+
+// both encoders must produce the same bytes
+static gboolean bench_encode_check (BenchEncodeData *edata)
+{
+    BEncoder enc;
+    gsize len;
+    gboolean ok;
+
+    bencoder_init (&enc, edata->buf, edata->buf_size);
+    bench_encode_files (&enc, edata);
+    if (!bencoder_finish (&enc))
+        return FALSE;
+
+    bench_encode_printf_add (edata);
+    len = evbuffer_get_length (edata->evb);
+    ok = len == enc.len && !memcmp (evbuffer_pullup (edata->evb, -1), edata->buf, len);
+    evbuffer_drain (edata->evb, len);
+
+    return ok;
+}
+/*}}}*/
+
+/*{{{ run */
+// ns per call
+static gdouble bench_run (BenchFunc func, BenchInput *in, gpointer ctx, guint iters)
+{
+    gint64 start;
+    guint i;
+
+    // warm up caches and the allocator
+    for (i = 0; i < iters / 10 + 1; i++)
+        func (in, ctx);
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < iters; i++)
+        func (in, ctx);
+
+    return (gdouble) (g_get_monotonic_time () - start) * 1000.0 / iters;
+}
+
+static void bench_print (const gchar *input, const gchar *what, gdouble ns, gdouble base_ns)
+{
+    printf ("%-10s %-24s %12.0f ns/op %8.1fx\n", input, what, ns, base_ns / ns);
+}
+
+static gboolean bench_decode_input (BenchInput *in, struct evbuffer *evb, BToken *tokens, BParser *p, guint iters)
+{
+    OldBValue *old;
+    BValue *bval;
+    gboolean ok;
+    gdouble base;
+
+    // both parsers must agree before they are timed
+    evbuffer_add (evb, in->data, in->len);
+    old = old_bvalue_create_from_buff (evb);
+    evbuffer_drain (evb, evbuffer_get_length (evb));
+    evbuffer_add (evb, in->data, in->len);
+    bval = bvalue_create_from_buff (evb);
+    evbuffer_drain (evb, evbuffer_get_length (evb));
+    ok = bench_compare (old, bval);
+    if (old)
+        old_bvalue_destroy (old);
+    if (bval)
+        bvalue_destroy (bval);
+    if (!ok) {
+        fprintf (stderr, "%s: parsers disagree !\n", in->name);
+        return FALSE;
+    }
+
+    printf ("%s: %zu bytes\n", in->name, in->len);
+    base = bench_run (bench_decode_old, in, evb, iters);
+    bench_print (in->name, "old evbuffer tree", base, base);
+    bench_print (in->name, "arena tree", bench_run (bench_decode_tree, in, evb, iters), base);
+    bench_print (in->name, "bvalue_tokenize", bench_run (bench_decode_tokens, in, tokens, iters), base);
+    bench_print (in->name, "BParser, chunked", bench_run (bench_decode_parser, in, p, iters), base);
+
+    return TRUE;
+}
+/*}}}*/
+
+int main (int argc, char *argv[])
+{
+    BenchInput inputs[2];
+    BenchEncodeData *edata;
+    struct evbuffer *evb;
+    BToken *tokens;
+    BParser *p;
+    guint iters = 10000;
+    gdouble base;
+    guint i, j;
+    int ret = 0;
+
+    if (argc > 1)
+        iters = MAX (1, atoi (argv[1]));
+
+    log_level = LOG_err;
+
+    evb = evbuffer_new ();
+    tokens = g_new (BToken, BENCH_TOKENS);
+    p = bparser_create ();
+
+    bench_input_announce (&inputs[0], evb);
+    bench_input_metainfo (&inputs[1], evb);
+
+    for (i = 0; i < G_N_ELEMENTS (inputs); i++) {
+        if (!bench_decode_input (&inputs[i], evb, tokens, p, iters))
+            ret = 1;
+    }
+
+    edata = g_new0 (BenchEncodeData, 1);
+    edata->evb = evb;
+    edata->buf_size = BENCH_FILES * 128;
+    edata->buf = g_malloc (edata->buf_size);
+    // no NUL bytes, the old parser keys dicts by C strings
+    for (i = 0; i < BENCH_FILES; i++)
+        for (j = 0; j < SHA_DIGEST_LENGTH; j++)
+            edata->hashes[i][j] = (guint8) ((i * 2654435761u >> (j % 24)) | 1);
+    qsort (edata->hashes, BENCH_FILES, SHA_DIGEST_LENGTH, bench_hash_cmp);
+
+    if (!bench_encode_check (edata)) {
+        fprintf (stderr, "scrape: encoders disagree !\n");
+        ret = 1;
+    } else {
+        printf ("scrape: %u files\n", BENCH_FILES);
+        base = bench_run (bench_encode_printf, NULL, edata, iters);
+        bench_print ("scrape", "evbuffer_add_printf", base, base);
+        bench_print ("scrape", "BEncoder, evbuffer", bench_run (bench_encode_evbuffer, NULL, edata, iters), base);
+        bench_print ("scrape", "BEncoder, buffer", bench_run (bench_encode_buf, NULL, edata, iters), base);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (inputs); i++)
+        g_free (inputs[i].data);
+    g_free (edata->buf);
+    g_free (edata);
+    bparser_destroy (p);
+    g_free (tokens);
+    evbuffer_free (evb);
+
+    return ret;
+}
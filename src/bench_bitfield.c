@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "global.h"
+#include "tbfs_bitfield.h"
+
+// Compares per-bit loops over tbfs_bitfield_get_bit () with the word kernels
+// behind find_next_and_not, or and set_bits. Results are checked before timing.
+// usage: bench_bitfield [pieces] [iterations]
+
+/*{{{ struct */
+typedef struct {
+    Bitfield *have; // ours
+    Bitfield *peer; // what the peer has
+    Bitfield *dst;
+    guint8 *dst_bits; // dst is reset to these before every merge
+    guint8 *scratch;
+    gint64 result;
+} BenchBfData;
+
+typedef void (*BenchFunc) (BenchBfData *data);
+/*}}}*/
+
+static guint64 bench_rand (guint64 *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// about percent of bits set
+static void bench_bf_fill (Bitfield *bf, guint percent, guint64 *state)
+{
+    guint32 i;
+
+    for (i = 0; i < tbfs_bitfield_get_bit_count (bf); i++) {
+        if (bench_rand (state) % 100 < percent)
+            tbfs_bitfield_set_bit (bf, i);
+    }
+}
+
+/*{{{ pieces we have and the peer doesn't */
+static void bench_scan_bits (BenchBfData *data)
+{
+    guint32 i;
+    gint64 count = 0;
+
+    for (i = 0; i < tbfs_bitfield_get_bit_count (data->have); i++) {
+        if (tbfs_bitfield_get_bit (data->have, i) && !tbfs_bitfield_get_bit (data->peer, i))
+            count++;
+    }
+    data->result = count;
+}
+
+static void bench_scan_words (BenchBfData *data)
+{
+    gint64 idx;
+    gint64 count = 0;
+
+    for (idx = tbfs_bitfield_find_next_and_not (data->have, data->peer, 0); idx >= 0;
+         idx = tbfs_bitfield_find_next_and_not (data->have, data->peer, idx + 1))
+        count++;
+    data->result = count;
+}
+/*}}}*/
+
+/*{{{ merge a peer Bitfield message */
+static void bench_or_bits (BenchBfData *data)
+{
+    guint32 i;
+
+    tbfs_bitfield_set_bits (data->dst, data->dst_bits, tbfs_bitfield_get_length (data->dst));
+    for (i = 0; i < tbfs_bitfield_get_bit_count (data->peer); i++) {
+        if (tbfs_bitfield_get_bit (data->peer, i))
+            tbfs_bitfield_set_bit (data->dst, i);
+    }
+    data->result = tbfs_bitfield_get_set_bits (data->dst);
+}
+
+static void bench_or_words (BenchBfData *data)
+{
+    tbfs_bitfield_set_bits (data->dst, data->dst_bits, tbfs_bitfield_get_length (data->dst));
+    tbfs_bitfield_or (data->dst, data->peer);
+    data->result = tbfs_bitfield_get_set_bits (data->dst);
+}
+/*}}}*/
+
+/*{{{ load and count */
+static void bench_load_bits (BenchBfData *data)
+{
+    guint32 i;
+    gint64 count = 0;
+
+    memcpy (data->scratch, tbfs_bitfield_peek_bits (data->peer), tbfs_bitfield_get_length (data->peer));
+    for (i = 0; i < tbfs_bitfield_get_bit_count (data->peer); i++) {
+        if (data->scratch[i >> 3u] & (0x80 >> (i & 7u)))
+            count++;
+    }
+    data->result = count;
+}
+
+static void bench_load_words (BenchBfData *data)
+{
+    tbfs_bitfield_set_bits (data->dst, tbfs_bitfield_peek_bits (data->peer), tbfs_bitfield_get_length (data->peer));
+    data->result = tbfs_bitfield_get_set_bits (data->dst);
+}
+/*}}}*/
+
+/*{{{ run */
+// ns per call
+static gdouble bench_run (BenchFunc func, BenchBfData *data, guint iters)
+{
+    gint64 start;
+    guint i;
+
+    for (i = 0; i < iters / 10 + 1; i++)
+        func (data);
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < iters; i++)
+        func (data);
+
+    return (gdouble) (g_get_monotonic_time () - start) * 1000.0 / iters;
+}
+
+// both variants must give the same result before they are timed
+static gboolean bench_pair (const gchar *what, BenchFunc f_bits, BenchFunc f_words, BenchBfData *data, guint iters)
+{
+    gint64 expected;
+    gdouble ns_bits, ns_words;
+
+    f_bits (data);
+    expected = data->result;
+    f_words (data);
+    if (data->result != expected) {
+        fprintf (stderr, "%s: per-bit %"G_GINT64_FORMAT" != words %"G_GINT64_FORMAT" !\n", what, expected, data->result);
+        return FALSE;
+    }
+
+    ns_bits = bench_run (f_bits, data, iters);
+    ns_words = bench_run (f_words, data, iters);
+    printf ("%-22s per-bit %10.0f ns/op  words %8.0f ns/op %8.1fx\n", what, ns_bits, ns_words, ns_bits / ns_words);
+
+    return TRUE;
+}
+/*}}}*/
+
+int main (int argc, char *argv[])
+{
+    BenchBfData data;
+    guint32 pieces = 16384;
+    guint iters = 10000;
+    guint64 state = G_GUINT64_CONSTANT (0x2545F4914F6CDD1D);
+    int ret = 0;
+
+    if (argc > 1)
+        pieces = MAX (1, atoi (argv[1]));
+    if (argc > 2)
+        iters = MAX (1, atoi (argv[2]));
+
+    log_level = LOG_err;
+
+    data.have = tbfs_bitfield_create (pieces);
+    data.peer = tbfs_bitfield_create (pieces);
+    data.dst = tbfs_bitfield_create (pieces);
+    bench_bf_fill (data.have, 50, &state);
+    bench_bf_fill (data.peer, 90, &state);
+    bench_bf_fill (data.dst, 10, &state);
+    data.dst_bits = g_malloc (tbfs_bitfield_get_length (data.dst));
+    memcpy (data.dst_bits, tbfs_bitfield_peek_bits (data.dst), tbfs_bitfield_get_length (data.dst));
+    data.scratch = g_malloc (tbfs_bitfield_get_length (data.dst));
+
+#ifdef __AVX2__
+    printf ("pieces: %u, kernels: AVX2\n", pieces);
+#else
+    printf ("pieces: %u, kernels: scalar\n", pieces);
+#endif
+
+    if (!bench_pair ("have & ~peer scan", bench_scan_bits, bench_scan_words, &data, iters))
+        ret = 1;
+    if (!bench_pair ("or peer bitfield", bench_or_bits, bench_or_words, &data, iters))
+        ret = 1;
+    if (!bench_pair ("load and count", bench_load_bits, bench_load_words, &data, iters))
+        ret = 1;
+
+    g_free (data.scratch);
+    g_free (data.dst_bits);
+    tbfs_bitfield_destroy (data.dst);
+    tbfs_bitfield_destroy (data.peer);
+    tbfs_bitfield_destroy (data.have);
+
+    return ret;
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "global.h"
+#include "tbfs_mng.h"
+#include "tbfs_shard.h"
+#include "tbfs_torrent.h"
+#include "tbfs_peer_mng.h"
+#if defined (__GLIBC__)
+#include <malloc.h>
+#endif
+
+// Registers N dormant torrents and N known peers the way the node does and
+// reports the memory they really take, heap and RSS deltas per object.
+// usage: bench_footprint [torrents] [peers] [pieces]
+
+/*{{{ struct */
+struct _Application {
+    ConfData *conf;
+    struct event_base *evbase;
+    ShardPool *shard_pool;
+    TBFSMng *mng;
+};
+
+typedef struct {
+    gint64 heap; // bytes in use by malloc, -1 if unknown
+    gint64 rss;
+} BenchMem;
+
+// peers are spread over torrents, like a tracker reply fills a PeerMng
+#define BENCH_PEERS_PER_TORRENT 1000
+/*}}}*/
+
+/*{{{ Application */
+ConfData *application_get_conf (Application *app)
+{
+    return app->conf;
+}
+
+struct event_base *application_get_evbase (Application *app)
+{
+    return app->evbase;
+}
+
+struct evdns_base *application_get_dnsbase (G_GNUC_UNUSED Application *app)
+{
+    return NULL;
+}
+
+TBFSMng *application_get_mng (Application *app)
+{
+    return app->mng;
+}
+
+TrackerTiers *application_get_tracker_tiers (G_GNUC_UNUSED Application *app)
+{
+    return NULL;
+}
+
+ShardPool *application_get_shard_pool (Application *app)
+{
+    return app->shard_pool;
+}
+
+Dht *application_get_dht (G_GNUC_UNUSED Application *app)
+{
+    return NULL;
+}
+
+Lsd *application_get_lsd (G_GNUC_UNUSED Application *app)
+{
+    return NULL;
+}
+
+DnsCache *application_get_dns_cache (G_GNUC_UNUSED Application *app)
+{
+    return NULL;
+}
+/*}}}*/
+
+/*{{{ memory */
+static void bench_mem_get (BenchMem *mem)
+{
+    FILE *f;
+    long pages = 0;
+
+#if defined (__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2 ();
+    mem->heap = mi.uordblks + mi.hblkhd;
+#else
+    mem->heap = -1;
+#endif
+
+    f = fopen ("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf (f, "%*s %ld", &pages) != 1)
+            pages = 0;
+        fclose (f);
+    }
+    mem->rss = (gint64) pages * sysconf (_SC_PAGESIZE);
+}
+
+static void bench_mem_print (const gchar *what, const BenchMem *before, const BenchMem *after, guint64 count)
+{
+    if (!count)
+        return;
+
+    if (after->heap >= 0)
+        printf ("%s: %"G_GUINT64_FORMAT" objects, heap %.1f bytes/object, rss %.1f bytes/object\n", what, count,
+            (gdouble) (after->heap - before->heap) / count, (gdouble) (after->rss - before->rss) / count);
+    else
+        printf ("%s: %"G_GUINT64_FORMAT" objects, rss %.1f bytes/object\n", what, count,
+            (gdouble) (after->rss - before->rss) / count);
+}
+/*}}}*/
+
+// unique, uniformly spread info_hash for the i-th torrent
+static void bench_info_hash (guint64 i, gchar *out)
+{
+    uint8_t sha1[SHA_DIGEST_LENGTH];
+    guint64 h = i * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15);
+
+    memset (sha1, 0, sizeof (sha1));
+    memcpy (sha1, &h, sizeof (h));
+    memcpy (sha1 + sizeof (h), &i, sizeof (i));
+    sha1_to_hexstr (out, sha1);
+}
+
+static void bench_conf_init (ConfData *conf)
+{
+    // a single shard runs in the main loop, timers never fire during the run
+    conf_set_int (conf, "app.shards", 1);
+    conf_set_int (conf, "torrent.idle_sec", 0);
+    conf_set_boolean (conf, "torrent.super_seed", FALSE);
+    conf_set_int (conf, "torrent.piece_length", 1024 * 1024);
+    conf_set_int (conf, "torrent.max_peers", 50);
+    conf_set_int (conf, "tracker.check_sec", 3600);
+    conf_set_int (conf, "tracker.torrent_check_sec", 10);
+    conf_set_int (conf, "tracker.announce_jitter_sec", 5);
+    conf_set_int (conf, "tracker.announce_max_sec", 1800);
+    conf_set_boolean (conf, "tracker.scrape", FALSE);
+    conf_set_boolean (conf, "tracker.batch_announce", FALSE);
+    conf_set_int (conf, "tracker.batch_size", 50);
+    conf_set_int (conf, "tracker.backoff_max_sec", 900);
+    conf_set_int (conf, "dht.search_sec", 300);
+    conf_set_string (conf, "peer.default_id", "xxxxxxxxxxxxxxxxxxxx");
+    conf_set_int (conf, "peer_client.check_sec", 3600);
+}
+
+int main (int argc, char *argv[])
+{
+    Application *app;
+    BenchMem m_start, m_torrents, m_pmngs, m_peers;
+    guint64 torrents = 1000000;
+    guint64 peers = 1000000;
+    guint32 pieces = 1024;
+    guint64 pmng_count;
+    PeerMng **pmngs;
+    PeerEndpoint *endpoints;
+    const gchar *peer_id;
+    gchar info_hash[2 * SHA_DIGEST_LENGTH + 1];
+    guint64 i;
+
+    if (argc > 1)
+        torrents = g_ascii_strtoull (argv[1], NULL, 10);
+    if (argc > 2)
+        peers = g_ascii_strtoull (argv[2], NULL, 10);
+    if (argc > 3)
+        pieces = g_ascii_strtoull (argv[3], NULL, 10);
+
+    // peers are attached to the first torrents
+    pmng_count = (peers + BENCH_PEERS_PER_TORRENT - 1) / BENCH_PEERS_PER_TORRENT;
+    if (pmng_count > torrents) {
+        fprintf (stderr, "Need at least %"G_GUINT64_FORMAT" torrents for %"G_GUINT64_FORMAT" peers\n", pmng_count, peers);
+        return 1;
+    }
+
+    log_level = LOG_err;
+
+    app = g_new0 (Application, 1);
+    app->conf = conf_create ();
+    bench_conf_init (app->conf);
+    app->evbase = event_base_new ();
+    if (!app->evbase) {
+        fprintf (stderr, "Failed to create event base\n");
+        return 1;
+    }
+    app->shard_pool = tbfs_shard_pool_create (app);
+    if (!app->shard_pool) {
+        fprintf (stderr, "Failed to create shard pool\n");
+        return 1;
+    }
+    app->mng = tbfs_mng_create (app);
+
+    pmngs = g_new0 (PeerMng *, pmng_count);
+    endpoints = g_new0 (PeerEndpoint, BENCH_PEERS_PER_TORRENT);
+    peer_id = conf_get_string (app->conf, "peer.default_id");
+
+    bench_mem_get (&m_start);
+
+    // dormant torrents: Torrent, have bitfield, TorrentData and the TBFSMng / Shard entries
+    for (i = 0; i < torrents; i++) {
+        bench_info_hash (i, info_hash);
+        if (!tbfs_mng_torrent_register (app->mng, info_hash, pieces)) {
+            fprintf (stderr, "Failed to register torrent %s\n", info_hash);
+            return 1;
+        }
+    }
+    // run queued shard tasks, torrents are added to the shard there
+    event_base_loop (app->evbase, EVLOOP_NONBLOCK);
+
+    bench_mem_get (&m_torrents);
+
+    for (i = 0; i < pmng_count; i++) {
+        bench_info_hash (i, info_hash);
+        pmngs[i] = tbfs_peer_mng_create (app, tbfs_mng_torrent_get (app->mng, info_hash));
+    }
+
+    bench_mem_get (&m_pmngs);
+
+    // known peers: Peer and its PeerMng entries
+    for (i = 0; i < peers; i++) {
+        guint n = i % BENCH_PEERS_PER_TORRENT;
+
+        endpoints[n].addr = (guint32) i;
+        endpoints[n].port = 6881;
+        if (n == BENCH_PEERS_PER_TORRENT - 1 || i == peers - 1)
+            tbfs_peer_mng_peers_add (pmngs[i / BENCH_PEERS_PER_TORRENT], peer_id, endpoints, n + 1);
+    }
+
+    bench_mem_get (&m_peers);
+
+    printf ("torrents: %"G_GUINT64_FORMAT", pieces: %u, peers: %"G_GUINT64_FORMAT"\n", torrents, pieces, peers);
+    printf ("sizeof: Torrent %zu, TorrentData %zu, Peer %zu\n",
+        tbfs_torrent_sizeof (pieces), tbfs_mng_torrent_data_sizeof (), tbfs_peer_sizeof ());
+    bench_mem_print ("dormant torrent", &m_start, &m_torrents, torrents);
+    bench_mem_print ("PeerMng", &m_torrents, &m_pmngs, pmng_count);
+    bench_mem_print ("known peer", &m_pmngs, &m_peers, peers);
+    printf ("total rss: %"G_GINT64_FORMAT" MB\n", m_peers.rss / (1024 * 1024));
+
+    for (i = 0; i < pmng_count; i++)
+        tbfs_peer_mng_destroy (pmngs[i]);
+    g_free (pmngs);
+    g_free (endpoints);
+
+    tbfs_mng_destroy (app->mng);
+    tbfs_shard_pool_destroy (app->shard_pool);
+    event_base_free (app->evbase);
+    conf_destroy (app->conf);
+    g_free (app);
+
+    return 0;
+}
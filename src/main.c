@@ -17,9 +17,16 @@
 #include "global.h"
 #include "tbfs_peer_server.h"
 #include "tbfs_cmd_server.h"
+#include "tbfs_tracker_server.h"
 #include "tbfs_mng.h"
-#include "tbfs_tracker_client.h"
+#include "tbfs_tracker_tiers.h"
 #include "tbfs_storage_mng.h"
+#include "tbfs_shard.h"
+#include "tbfs_snapshot.h"
+#include "tbfs_dht.h"
+#include "tbfs_lsd.h"
+#include "tbfs_dns_cache.h"
+#include "tbfs_metainfo.h"
 
 /*{{{ structs */
 struct _Application {
@@ -28,17 +35,27 @@ struct _Application {
 
     struct event_base *evbase;
     struct evdns_base *dns_base;
+    DnsCache *dns_cache;
     PeerServer *peer_server;
     CmdServer *cmd_server;
+    TrackerServer *tracker_server;
     TBFSMng *mng;
-    TrackerClient *tracker_client;
+    TrackerTiers *tracker_tiers;
     StorageMng *storage_mng;
+    ShardPool *shard_pool;
+    Snapshot *snapshot;
+    Dht *dht;
+    Lsd *lsd;
 
     GHashTable *h_torrents;
 
     struct event *sigint_ev;
     struct event *sigpipe_ev;
     struct event *sigusr1_ev;
+
+    gboolean stopping; // waiting for trackers to ack "stopped" and for the last snapshot
+    gboolean trackers_stopped;
+    gboolean snapshot_saved;
 };
 
 #define APP_LOG "main"
@@ -65,29 +82,67 @@ TBFSMng *application_get_mng (Application *app)
     return app->mng;
 }
 
-TrackerClient *application_get_tracker_client (Application *app)
+TrackerTiers *application_get_tracker_tiers (Application *app)
+{
+    return app->tracker_tiers;
+}
+
+ShardPool *application_get_shard_pool (Application *app)
+{
+    return app->shard_pool;
+}
+
+// NULL if DHT is disabled
+Dht *application_get_dht (Application *app)
+{
+    return app->dht;
+}
+
+// NULL if LSD is disabled
+Lsd *application_get_lsd (Application *app)
 {
-    return app->tracker_client;
+    return app->lsd;
+}
+
+DnsCache *application_get_dns_cache (Application *app)
+{
+    return app->dns_cache;
 }
 
 static void application_destroy (Application *app)
 {
+    // worker threads must be stopped before destroying objects they own
+    if (app->shard_pool)
+        tbfs_shard_pool_stop (app->shard_pool);
+    if (app->snapshot)
+        tbfs_snapshot_destroy (app->snapshot);
     if (app->peer_server)
         tbfs_peer_server_destroy (app->peer_server);
+    // may be mounted on cmd_server's httpd
+    if (app->tracker_server)
+        tbfs_tracker_server_destroy (app->tracker_server);
     if (app->cmd_server)
         tbfs_cmd_server_destroy (app->cmd_server);
+    if (app->dht)
+        tbfs_dht_destroy (app->dht);
+    if (app->lsd)
+        tbfs_lsd_destroy (app->lsd);
     if (app->mng)
         tbfs_mng_destroy (app->mng);
-    if (app->tracker_client)
-        tbfs_tracker_client_destroy (app->tracker_client);
+    if (app->tracker_tiers)
+        tbfs_tracker_tiers_destroy (app->tracker_tiers);
     if (app->storage_mng)
         tbfs_storage_mng_destroy (app->storage_mng);
+    if (app->shard_pool)
+        tbfs_shard_pool_destroy (app->shard_pool);
     if (app->sigint_ev)
         event_free (app->sigint_ev);
     if (app->sigpipe_ev)
         event_free (app->sigpipe_ev);
     if (app->sigusr1_ev)
         event_free (app->sigusr1_ev);
+    if (app->dns_cache)
+        tbfs_dns_cache_destroy (app->dns_cache);
     if (app->dns_base)
         evdns_base_free (app->dns_base, 0);
     if (app->evbase)
@@ -160,20 +215,78 @@ static void sigpipe_cb (G_GNUC_UNUSED evutil_socket_t sig, G_GNUC_UNUSED short e
 }
 
 // XXX: re-read config or do some useful work here
-static void sigusr1_cb (G_GNUC_UNUSED evutil_socket_t sig, G_GNUC_UNUSED short events, G_GNUC_UNUSED void *user_data)
+// save engine state
+static void sigusr1_cb (G_GNUC_UNUSED evutil_socket_t sig, G_GNUC_UNUSED short events, void *user_data)
 {
+    Application *app = (Application *) user_data;
+
     LOG_err (APP_LOG, "Got SIGUSR1");
+
+    if (app->snapshot)
+        tbfs_snapshot_save (app->snapshot, NULL, NULL);
 }
 
 // terminate application, freeing all used memory
+static void application_try_exit (Application *app)
+{
+    if (app->trackers_stopped && app->snapshot_saved)
+        event_base_loopexit (app->evbase, NULL);
+}
+
+static void application_on_mng_stopped_cb (gpointer ctx)
+{
+    Application *app = (Application *) ctx;
+
+    app->trackers_stopped = TRUE;
+    application_try_exit (app);
+}
+
+// trackers didn't reply in time
+static void application_on_stop_timeout_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    Application *app = (Application *) arg;
+
+    if (app->trackers_stopped)
+        return;
+
+    LOG_msg (APP_LOG, "Timeout waiting for trackers, exiting");
+    app->trackers_stopped = TRUE;
+    application_try_exit (app);
+}
+
+static void application_on_snapshot_saved_cb (gpointer ctx)
+{
+    Application *app = (Application *) ctx;
+
+    app->snapshot_saved = TRUE;
+    application_try_exit (app);
+}
+
 static void sigint_cb (G_GNUC_UNUSED evutil_socket_t sig, G_GNUC_UNUSED short events, void *user_data)
 {
     Application *app = (Application *) user_data;
+    struct timeval tv;
 
     LOG_err (APP_LOG, "Got SIGINT");
 
-    // terminate after running all active events 
-    event_base_loopexit (app->evbase, NULL);
+    // the second SIGINT terminates immediately
+    if (app->stopping || !app->mng) {
+        event_base_loopexit (app->evbase, NULL);
+        return;
+    }
+    app->stopping = TRUE;
+
+    // state is saved while shards are still running
+    app->snapshot_saved = app->snapshot == NULL;
+    if (app->snapshot)
+        tbfs_snapshot_save (app->snapshot, application_on_snapshot_saved_cb, app);
+
+    // send "stopped" to trackers, but do not wait for them forever
+    tv.tv_sec = conf_get_int (app->conf, "tracker.stop_timeout_sec");
+    tv.tv_usec = 0;
+    event_base_once (app->evbase, -1, EV_TIMEOUT, application_on_stop_timeout_cb, app, &tv);
+
+    tbfs_mng_stop (app->mng, application_on_mng_stopped_cb, app);
 }
 /*}}}*/
 
@@ -247,9 +360,23 @@ int main (G_GNUC_UNUSED int argc, G_GNUC_UNUSED char *argv[])
         conf_set_int (app->conf, "tracker.port", 6969);
         conf_set_int (app->conf, "tracker.timeout", 30);
         conf_set_int (app->conf, "tracker.retries", 2);
+        conf_set_int (app->conf, "tracker.retry_delay_sec", 2);
         conf_set_int (app->conf, "tracker.check_sec", 1);
         conf_set_boolean (app->conf, "tracker.compact", TRUE);
         conf_set_int (app->conf, "tracker.torrent_check_sec", 10);
+        conf_set_int (app->conf, "tracker.announce_jitter_sec", 5);
+        conf_set_int (app->conf, "tracker.announce_max_sec", 1800);
+        conf_set_boolean (app->conf, "tracker.scrape", FALSE);
+        conf_set_boolean (app->conf, "tracker.batch_announce", FALSE);
+        conf_set_int (app->conf, "tracker.batch_size", 50);
+        conf_set_int (app->conf, "tracker.udp_timeout_sec", 15);
+        conf_set_int (app->conf, "tracker.connections", 4);
+        conf_set_int (app->conf, "tracker.max_requests", 16);
+        conf_set_string (app->conf, "tracker.tiers", "");
+        conf_set_int (app->conf, "tracker.tier_parallel", 2);
+        conf_set_int (app->conf, "tracker.tier_timeout_sec", 5);
+        conf_set_int (app->conf, "tracker.backoff_max_sec", 900);
+        conf_set_int (app->conf, "tracker.stop_timeout_sec", 3);
         //conf_set_string (app->conf, "tracker.announce_url", "http://127.0.0.1:6969/announce");
         //conf_set_string (app->conf, "tracker.announce_url", "http://10.0.0.197:6969/announce");
         conf_set_string (app->conf, "tracker.announce_url", "http://10.0.0.149:6969/announce");
@@ -257,6 +384,39 @@ int main (G_GNUC_UNUSED int argc, G_GNUC_UNUSED char *argv[])
         conf_set_string (app->conf, "peer.default_id", "xxxxxxxxxxxxxxxxxxxx");
         conf_set_int (app->conf, "peer_client.check_sec", 10);
         conf_set_string (app->conf, "storage.dir", "storage/");
+        conf_set_boolean (app->conf, "torrent.super_seed", FALSE);
+        conf_set_int (app->conf, "torrent.idle_sec", 300);
+        conf_set_int (app->conf, "torrent.max_peers", 50);
+        conf_set_int (app->conf, "torrent.piece_length", 262144);
+        conf_set_int (app->conf, "app.shards", 1);
+        conf_set_string (app->conf, "snapshot.file", "tbfs.snapshot");
+        conf_set_int (app->conf, "snapshot.interval_sec", 300);
+        conf_set_int (app->conf, "snapshot.max_peers", 50);
+        conf_set_int (app->conf, "snapshot.announce_spread_sec", 600);
+        conf_set_boolean (app->conf, "tracker_server.enabled", FALSE);
+        conf_set_string (app->conf, "tracker_server.listen", "0.0.0.0");
+        conf_set_int (app->conf, "tracker_server.port", 0); // 0: serve on cmd_server
+        conf_set_int (app->conf, "tracker_server.interval_sec", 300);
+        conf_set_int (app->conf, "tracker_server.min_interval_sec", 30);
+        conf_set_int (app->conf, "tracker_server.numwant", 50);
+        conf_set_int (app->conf, "tracker_server.max_numwant", 200);
+        conf_set_boolean (app->conf, "dht.enabled", FALSE);
+        conf_set_int (app->conf, "dht.port", 0); // 0: peer_server.port
+        conf_set_string (app->conf, "dht.bootstrap", "router.bittorrent.com:6881,dht.transmissionbt.com:6881");
+        conf_set_string (app->conf, "dht.state_file", "dht.state");
+        conf_set_int (app->conf, "dht.query_timeout_sec", 5);
+        conf_set_int (app->conf, "dht.search_sec", 900);
+        conf_set_boolean (app->conf, "lsd.enabled", FALSE);
+        conf_set_int (app->conf, "lsd.interval_sec", 300);
+        conf_set_int (app->conf, "lsd.reply_sec", 30);
+        conf_set_int (app->conf, "lsd.max_datagrams_sec", 4);
+        conf_set_int (app->conf, "lsd.ttl", 1);
+        conf_set_int (app->conf, "dns.min_ttl_sec", 30);
+        conf_set_int (app->conf, "dns.max_ttl_sec", 3600);
+        conf_set_int (app->conf, "dns.retry_sec", 30);
+        conf_set_int (app->conf, "dns.idle_sec", 3600);
+        conf_set_string (app->conf, "metainfo.dir", ""); // empty: don't load .torrent files
+        conf_set_boolean (app->conf, "metainfo.seed", FALSE);
     }
 
     if (verbose)
@@ -309,6 +469,13 @@ int main (G_GNUC_UNUSED int argc, G_GNUC_UNUSED char *argv[])
         return -1;
     }
 
+    // shards use their own event bases, libevent must be thread-safe
+    if (evthread_use_pthreads () < 0) {
+        LOG_err (APP_LOG, "Failed to enable libevent threading support !");
+        application_destroy (app);
+        return -1;
+    }
+
     app->evbase = event_base_new ();
     if (!app->evbase) {
         LOG_err (APP_LOG, "Failed to create event base !");
@@ -322,6 +489,7 @@ int main (G_GNUC_UNUSED int argc, G_GNUC_UNUSED char *argv[])
         application_destroy (app);
         return -1;
     }
+    app->dns_cache = tbfs_dns_cache_create (app);
 
 /*{{{ signal handlers*/
     // SIGINT
@@ -353,6 +521,13 @@ int main (G_GNUC_UNUSED int argc, G_GNUC_UNUSED char *argv[])
     event_add (app->sigusr1_ev, NULL);
 /*}}}*/
 
+    app->shard_pool = tbfs_shard_pool_create (app);
+    if (!app->shard_pool) {
+        LOG_err (APP_LOG, "Failed to create ShardPool !");
+        application_destroy (app);
+        return -1;
+    }
+
     app->mng = tbfs_mng_create (app);
     if (!app->mng) {
         LOG_err (APP_LOG, "Failed to create TBFSMng !");
@@ -375,6 +550,15 @@ int main (G_GNUC_UNUSED int argc, G_GNUC_UNUSED char *argv[])
         return -1;
     }
 
+    if (conf_get_boolean (app->conf, "tracker_server.enabled")) {
+        app->tracker_server = tbfs_tracker_server_create (app, tbfs_cmd_server_get_httpd (app->cmd_server));
+        if (!app->tracker_server) {
+            LOG_err (APP_LOG, "Failed to create TrackerServer !");
+            application_destroy (app);
+            return -1;
+        }
+    }
+
     app->peer_server = tbfs_peer_server_create (app);
     if (!app->peer_server) {
         LOG_err (APP_LOG, "Failed to create PeerServer !");
@@ -382,16 +566,54 @@ int main (G_GNUC_UNUSED int argc, G_GNUC_UNUSED char *argv[])
         return -1;
     }
 
-    app->tracker_client = tbfs_tracker_client_create (app);
-    if (!app->tracker_client) {
-        LOG_err (APP_LOG, "Failed to create TrackerClient !");
+    app->tracker_tiers = tbfs_tracker_tiers_create (app);
+    if (!app->tracker_tiers) {
+        LOG_err (APP_LOG, "Failed to create TrackerTiers !");
         application_destroy (app);
         return -1;
     }
 
+    if (conf_get_boolean (app->conf, "dht.enabled")) {
+        app->dht = tbfs_dht_create (app);
+        if (!app->dht) {
+            LOG_err (APP_LOG, "Failed to create Dht !");
+            application_destroy (app);
+            return -1;
+        }
+    }
+
+    if (conf_get_boolean (app->conf, "lsd.enabled")) {
+        app->lsd = tbfs_lsd_create (app);
+        if (!app->lsd) {
+            LOG_err (APP_LOG, "Failed to create Lsd !");
+            application_destroy (app);
+            return -1;
+        }
+    }
+
+    app->snapshot = tbfs_snapshot_create (app);
+    if (!app->snapshot) {
+        LOG_err (APP_LOG, "Failed to create Snapshot !");
+        application_destroy (app);
+        return -1;
+    }
+    // restore torrents saved by the previous run
+    tbfs_snapshot_load (app->snapshot, app->mng);
+
+    if (conf_get_string (app->conf, "metainfo.dir") && *conf_get_string (app->conf, "metainfo.dir"))
+        tbfs_mng_load_metainfo_dir (app->mng, conf_get_string (app->conf, "metainfo.dir"),
+            conf_get_boolean (app->conf, "metainfo.seed"));
+
     if (!conf_get_boolean (app->conf, "app.foreground"))
         wutils_daemonize ();
 
+    // threads must be started after fork ()
+    if (!tbfs_shard_pool_start (app->shard_pool)) {
+        LOG_err (APP_LOG, "Failed to start shards !");
+        application_destroy (app);
+        return -1;
+    }
+
     // start the loop
     event_base_dispatch (app->evbase);
 
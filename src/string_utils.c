@@ -122,6 +122,38 @@ void sha1_to_hexstr (gchar *out, const uint8_t *sha1)
     *out = '\0';
 }
 
+// TRUE if str is exactly 2 * SHA_DIGEST_LENGTH hex digits
+gboolean sha1_hexstr_is_valid (const gchar *str)
+{
+    int i;
+
+    if (!str)
+        return FALSE;
+
+    for (i = 0; i < 2 * SHA_DIGEST_LENGTH; i++) {
+        if (!g_ascii_isxdigit (str[i]))
+            return FALSE;
+    }
+
+    return str[i] == '\0';
+}
+
+// GHashTable helpers for binary SHA_DIGEST_LENGTH keys
+guint sha1_hash (gconstpointer v)
+{
+    guint h;
+
+    // digest bytes are already uniformly distributed
+    memcpy (&h, v, sizeof (h));
+    return h;
+}
+
+gboolean sha1_equal (gconstpointer a, gconstpointer b)
+{
+    return !memcmp (a, b, SHA_DIGEST_LENGTH);
+}
+
+// in must be a valid hex string, see sha1_hexstr_is_valid ()
 void hexstr_to_sha1 (uint8_t *out, const char *in)
 {
     int i;
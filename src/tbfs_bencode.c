@@ -17,108 +17,231 @@
 #include "tbfs_bencode.h"
 
 /*{{{ structs*/
+typedef struct {
+    BValue *key; // BT_STRING
+    BValue *value;
+} BDictItem;
+
+// trees are allocated in a single block: nodes in token order (root first), strings, list links and dict items
 struct _BValue {
     BType type;
     gint32 strlen;
+    guint32 count; // list items, dict items
+    guint8 sorted; // dict keys are strictly increasing, lookups use binary search
 
     union {
         gchar *str;
         gint64 integer;
         GList *list;
-        GHashTable *h_dict;
+        BDictItem *items; // in encoding order
     } value;
 };
 
-#define B_LOG "benc"
-/*}}}*/
+// bump allocator, the size of a tree is known from its tokens in advance
+typedef struct {
+    guint8 *data;
+    gsize size;
+    gsize used;
+} BArena;
+
+#define BARENA_ALIGN(size) (((size) + 7) & ~(gsize) 7)
+
+typedef enum {
+    BPS_Value = 0, // next value or end of the container
+    BPS_Int = 1,
+    BPS_StrLen = 2,
+    BPS_Str = 3,
+} BParserState;
+
+struct _BParser {
+    GArray *a_tokens; // BToken
+    guint32 stack[BTOKEN_MAX_DEPTH]; // open containers
+    guint depth;
+    gsize pos; // bytes of the stream consumed
+    BParserState state;
+    gsize num; // int digits or string length read so far, bytes of string left
+    gint result; // BTOKEN_ERROR_PART until the value is complete or invalid
+};
 
-/*{{{ declaration */
-static gchar *bvalue_parse_string (struct evbuffer *in, gint32 *len);
-static gint64 bvalue_parse_int (struct evbuffer *in);
-static GList *bvalue_parse_list (struct evbuffer *in);
-static GHashTable *bvalue_parse_dict (struct evbuffer *in);
+#define B_LOG "benc"
 /*}}}*/
 
 /*{{{ create / destroy*/
-BValue *bvalue_create_from_buff (struct evbuffer *in)
+static gpointer barena_alloc (BArena *arena, gsize size)
 {
-    BValue *bval = NULL;
-    size_t len;
-    gchar c;
+    gpointer p;
 
+    size = BARENA_ALIGN (size);
+    g_assert (arena->used + size <= arena->size);
+    p = arena->data + arena->used;
+    arena->used += size;
 
-    len = evbuffer_get_length (in);
+    return p;
+}
 
-    if (!len) {
-        return NULL;
+// bytes needed for a tree of count tokens
+static gsize bvalue_tokens_size (const BToken *tokens, guint count)
+{
+    gsize size = BARENA_ALIGN (count * sizeof (BValue));
+    guint i;
+
+    for (i = 0; i < count; i++) {
+        if (tokens[i].type == BT_STRING)
+            size += BARENA_ALIGN (tokens[i].length + 1);
+        else if (tokens[i].type == BT_LIST)
+            size += BARENA_ALIGN (tokens[i].children * sizeof (GList));
+        else if (tokens[i].type == BT_DICT)
+            size += BARENA_ALIGN (tokens[i].children / 2 * sizeof (BDictItem));
     }
 
-    evbuffer_copyout (in, &c, 1);
+    return size;
+}
 
-    if (g_ascii_isdigit (c)) {
-        gchar *str;
-        gint32 strlen;
-        str = bvalue_parse_string (in, &strlen);
-        
-        bval = g_new0 (BValue, 1);
-        bval->type = BT_STRING;
-        bval->value.str = str;
-        bval->strlen = strlen;
-    } else if (c == 'i') {
-        gint64 i;
-        i = bvalue_parse_int (in);
-
-        bval = g_new0 (BValue, 1);
-        bval->type = BT_INT;
-        bval->value.integer = i;
-    } else if (c == 'l') {
-        GList *l;
-
-        l = bvalue_parse_list (in);
-
-        bval = g_new0 (BValue, 1);
-        bval->type = BT_LIST;
-        bval->value.list = l;
-    } else if (c == 'd') {
-        GHashTable *h;
-
-        h = bvalue_parse_dict (in);
-
-        bval = g_new0 (BValue, 1);
-        bval->type = BT_DICT;
-        bval->value.h_dict = h;
+static gint bvalue_key_cmp (BValue *bkey, const guint8 *key, gsize key_len)
+{
+    gint cmp;
 
-    } else {
-        bval = NULL;
-    }
+    cmp = memcmp (bkey->value.str, key, MIN ((gsize) bkey->strlen, key_len));
+    if (cmp)
+        return cmp;
+    if ((gsize) bkey->strlen == key_len)
+        return 0;
 
-    return bval;
+    return (gsize) bkey->strlen < key_len ? -1 : 1;
 }
 
-void bvalue_destroy (BValue *bval)
+// fills node i and its children, strings are copied out of buf
+static void bvalue_build (BArena *arena, BValue *nodes, const guint8 *buf, const BToken *tokens, guint i)
 {
-    switch (bval->type) {
-        case BT_INT:
-            break;
+    const BToken *tok = &tokens[i];
+    BValue *bval = &nodes[i];
+    guint j, n;
+
+    bval->type = tok->type;
+
+    switch (tok->type) {
         case BT_STRING:
-            g_free (bval->value.str);
+            bval->value.str = barena_alloc (arena, tok->length + 1);
+            memcpy (bval->value.str, buf + tok->offset, tok->length);
+            bval->value.str[tok->length] = '\0';
+            bval->strlen = tok->length;
+            break;
+        case BT_INT:
+            btoken_get_int (buf, tok, &bval->value.integer);
             break;
         case BT_LIST: {
-            GList *l;
-            for (l = g_list_first (bval->value.list); l; l = g_list_next (l)) {
-                BValue *tmp = (BValue *) l->data;
-                bvalue_destroy (tmp);
+            GList *links;
+
+            bval->count = tok->children;
+            if (!bval->count)
+                break;
+            links = barena_alloc (arena, bval->count * sizeof (GList));
+            for (j = i + 1, n = 0; n < bval->count; j = tokens[j].next, n++) {
+                links[n].data = &nodes[j];
+                links[n].prev = n ? &links[n - 1] : NULL;
+                links[n].next = n + 1 < bval->count ? &links[n + 1] : NULL;
+                bvalue_build (arena, nodes, buf, tokens, j);
             }
-            g_list_free (bval->value.list);
+            bval->value.list = links;
             break;
         }
-        case BT_DICT:
-            g_hash_table_destroy (bval->value.h_dict);
+        case BT_DICT: {
+            BDictItem *items;
+
+            bval->count = tok->children / 2;
+            bval->sorted = TRUE;
+            if (!bval->count)
+                break;
+            items = barena_alloc (arena, bval->count * sizeof (BDictItem));
+            for (j = i + 1, n = 0; n < bval->count; j = tokens[tokens[j].next].next, n++) {
+                items[n].key = &nodes[j];
+                items[n].value = &nodes[tokens[j].next];
+                bvalue_build (arena, nodes, buf, tokens, j);
+                bvalue_build (arena, nodes, buf, tokens, tokens[j].next);
+
+                if (n && bvalue_key_cmp (items[n - 1].key, (const guint8 *) items[n].key->value.str, items[n].key->strlen) >= 0)
+                    bval->sorted = FALSE;
+            }
+            bval->value.items = items;
             break;
+        }
         default:
             break;
     }
+}
+
+// the whole tree is one allocation owned by the root
+static BValue *bvalue_create_from_tokens (const guint8 *buf, const BToken *tokens, guint count)
+{
+    BArena arena;
+    BValue *nodes;
+
+    arena.size = bvalue_tokens_size (tokens, count);
+    arena.data = g_malloc (arena.size);
+    arena.used = 0;
+
+    nodes = barena_alloc (&arena, count * sizeof (BValue));
+    memset (nodes, 0, count * sizeof (BValue));
+    bvalue_build (&arena, nodes, buf, tokens, 0);
+
+    return nodes;
+}
 
+// parsed value is removed from the buffer
+BValue *bvalue_create_from_buff (struct evbuffer *in)
+{
+    BToken stack_tokens[BTOKEN_STACK_TOKENS];
+    BToken *tokens = stack_tokens;
+    const guint8 *buf;
+    gsize len, consumed = 0;
+    gint count;
+    BValue *bval;
+
+    len = evbuffer_get_length (in);
+    if (!len)
+        return NULL;
+    buf = evbuffer_pullup (in, -1);
+
+    count = bvalue_tokenize (buf, len, tokens, G_N_ELEMENTS (stack_tokens), &consumed);
+    // every token takes at least 2 bytes
+    if (count == BTOKEN_ERROR_NOMEM) {
+        tokens = g_new (BToken, len / 2 + 1);
+        count = bvalue_tokenize (buf, len, tokens, len / 2 + 1, &consumed);
+    }
+
+    if (count <= 0) {
+        LOG_debug (B_LOG, "Failed to parse bencoded data (%d) !", count);
+        bval = NULL;
+    } else {
+        bval = bvalue_create_from_tokens (buf, tokens, count);
+        evbuffer_drain (in, consumed);
+    }
+
+    if (tokens != stack_tokens)
+        g_free (tokens);
+
+    return bval;
+}
+
+// builds the tree from a complete parser value at the start of in, the value is removed from in
+BValue *bvalue_create_from_parser (BParser *p, struct evbuffer *in)
+{
+    const guint8 *buf;
+    BValue *bval;
+
+    if (p->result <= 0 || evbuffer_get_length (in) < p->pos)
+        return NULL;
+
+    buf = evbuffer_pullup (in, p->pos);
+    bval = bvalue_create_from_tokens (buf, (const BToken *) p->a_tokens->data, p->a_tokens->len);
+    evbuffer_drain (in, p->pos);
+
+    return bval;
+}
+
+// only a root can be destroyed, it frees the whole tree
+void bvalue_destroy (BValue *bval)
+{
     g_free (bval);
 }
 /*}}}*/
@@ -149,34 +272,10 @@ gboolean bvalue_is_dict (BValue *bval)
     return (bval->type == BT_DICT);
 }
 
+
 /*}}}*/
 
 /*{{{ string */
-static gchar *bvalue_parse_string (struct evbuffer *in, gint32 *len)
-{
-    gchar *str;
-    gchar *clen;
-    struct evbuffer_ptr pos;
-    gchar tmp[1];
-
-    pos = evbuffer_search (in, ":", 1, NULL);
-    clen = g_new0 (gchar, pos.pos + 1);
-    evbuffer_remove (in, clen, pos.pos);
-    clen[pos.pos] = '\0';
-
-    *len = atoi (clen);
-    g_free (clen);
-    
-    // remove ":"
-    evbuffer_remove (in, tmp, 1);
-
-    str = g_new0 (gchar, *len + 1);
-    evbuffer_remove (in, str, *len);
-    str[*len] = '\0';
-
-    return str;
-}
-
 // it could be binary !
 gchar *bvalue_get_string (BValue *bval)
 {
@@ -192,153 +291,855 @@ guint8 *bvalue_get_binary_string (BValue *bval, gint32 *len)
 /*}}}*/
 
 /*{{{ int*/
-static gint64 bvalue_parse_int (struct evbuffer *in)
+gint64 bvalue_get_int (BValue *bval)
 {
-    gchar tmp[1];
-    struct evbuffer_ptr pos;
-    gchar *str;
-    guint64 i;
-    
-    // remove "i"
-    evbuffer_remove (in, tmp, 1);
+    return bval->value.integer;
+}
 
-    pos = evbuffer_search (in, "e", 1, NULL);
-    str = g_new0 (gchar, pos.pos + 1);
+/*}}}*/
 
-    evbuffer_remove (in, str, pos.pos);
-    str[pos.pos] = '\0';
+/*{{{ list*/
+GList *bvalue_get_list (BValue *bval)
+{
+    if (!bvalue_is_list (bval)) {
+        LOG_err (B_LOG, "BValue is not a list !");
+        return NULL;
+    }
 
-    i = atoll (str);
-    g_free (str);
+    return bval->value.list;
+}
+/*}}}*/
 
-    // remove "e"
-    evbuffer_remove (in, tmp, 1);
-    
-    return i;
+/*{{{ dict */
+BValue *bvalue_dict_get_value (BValue *bval, const gchar *key)
+{
+    return bvalue_dict_get_value_binary (bval, (const guint8 *) key, strlen (key));
 }
 
-gint64 bvalue_get_int (BValue *bval)
+BValue *bvalue_dict_get_value_binary (BValue *bval, const guint8 *key, gsize key_len)
 {
-    return bval->value.integer;
+    guint lo = 0;
+    guint hi = bval->count;
+    guint i;
+
+    // keys of non canonical input are scanned
+    if (!bval->sorted) {
+        for (i = 0; i < bval->count; i++) {
+            if (!bvalue_key_cmp (bval->value.items[i].key, key, key_len))
+                return bval->value.items[i].value;
+        }
+        return NULL;
+    }
+
+    while (lo < hi) {
+        gint cmp;
+
+        i = lo + (hi - lo) / 2;
+        cmp = bvalue_key_cmp (bval->value.items[i].key, key, key_len);
+        if (!cmp)
+            return bval->value.items[i].value;
+        if (cmp < 0)
+            lo = i + 1;
+        else
+            hi = i;
+    }
+
+    return NULL;
+}
+
+// items are visited in encoding order
+void bvalue_dict_foreach (BValue *bval, BValueDictForeachFunc func, gpointer data)
+{
+    guint i;
+
+    for (i = 0; i < bval->count; i++) {
+        BValue *bkey = bval->value.items[i].key;
+
+        func ((const guint8 *) bkey->value.str, bkey->strlen, bval->value.items[i].value, data);
+    }
 }
 
 /*}}}*/
 
-/*{{{ list*/
-static GList *bvalue_parse_list (struct evbuffer *in)
+/*{{{ tokens */
+// parses a single value at buf into a flat array, every container is followed by its children,
+// nothing is copied: strings and ints are referenced by offsets into buf
+// returns the number of tokens or BTOKEN_ERROR_*, consumed is set to the length of the value
+gint bvalue_tokenize (const guint8 *buf, gsize buf_len, BToken *tokens, guint max_tokens, gsize *consumed)
 {
-    gchar tmp[1];
-    gchar c;
-    BValue *value;
-    GList *l = NULL;
-    GList *l_tmp;
-    size_t len;
-    
-    // remove "l"
-    evbuffer_remove (in, tmp, 1);
+    const guint8 *p = buf;
+    const guint8 *end = buf + buf_len;
+    guint stack[BTOKEN_MAX_DEPTH]; // open containers
+    guint depth = 0;
+    guint count = 0;
+
+    if (buf_len > G_MAXUINT32)
+        return BTOKEN_ERROR_INVALID;
+
+    do {
+        BToken *tok;
+
+        if (p >= end)
+            return BTOKEN_ERROR_PART;
+
+        if (*p == 'e') {
+            if (!depth)
+                return BTOKEN_ERROR_INVALID;
+            tok = &tokens[stack[--depth]];
+            if (tok->type == BT_DICT && tok->children % 2)
+                return BTOKEN_ERROR_INVALID;
+            p++;
+            tok->length = (p - buf) - tok->offset;
+            tok->next = count;
+            continue;
+        }
 
-    evbuffer_copyout (in, &c, 1);
+        if (count >= max_tokens)
+            return BTOKEN_ERROR_NOMEM;
 
-    len = evbuffer_get_length (in);
+        if (depth) {
+            BToken *parent = &tokens[stack[depth - 1]];
 
-    while (c != 'e' && len > 1) {
-        value = bvalue_create_from_buff (in);
-        
-        if (!value) {
-            // free already created list
-            for (l_tmp = g_list_first (l); l_tmp; l_tmp = g_list_next (l_tmp)) {
-                BValue *val = (BValue *) l_tmp->data;
-                bvalue_destroy (val);
+            // dict keys are strings
+            if (parent->type == BT_DICT && !(parent->children % 2) && !g_ascii_isdigit (*p))
+                return BTOKEN_ERROR_INVALID;
+            parent->children++;
+        }
+
+        tok = &tokens[count++];
+        tok->children = 0;
+        tok->next = count;
+
+        if (*p == 'i') {
+            const guint8 *digits = ++p;
+            const guint8 *start;
+
+            if (p < end && *p == '-')
+                p++;
+            for (start = p; p < end && g_ascii_isdigit (*p); p++);
+            if (p >= end)
+                return BTOKEN_ERROR_PART;
+            if (*p != 'e' || p == start || p - start > 20)
+                return BTOKEN_ERROR_INVALID;
+
+            tok->type = BT_INT;
+            tok->offset = digits - buf;
+            tok->length = p - digits;
+            p++;
+
+        } else if (*p == 'l' || *p == 'd') {
+            if (depth >= BTOKEN_MAX_DEPTH)
+                return BTOKEN_ERROR_INVALID;
+
+            tok->type = *p == 'l' ? BT_LIST : BT_DICT;
+            tok->offset = p - buf;
+            stack[depth++] = count - 1;
+            p++;
+
+        } else if (g_ascii_isdigit (*p)) {
+            gsize len = 0;
+
+            for (; p < end && g_ascii_isdigit (*p); p++) {
+                len = len * 10 + (*p - '0');
+                if (len > buf_len)
+                    return BTOKEN_ERROR_INVALID;
             }
-            g_list_free (l);
-            return NULL;
+            if (p >= end)
+                return BTOKEN_ERROR_PART;
+            if (*p != ':')
+                return BTOKEN_ERROR_INVALID;
+            p++;
+            if (len > (gsize) (end - p))
+                return BTOKEN_ERROR_PART;
+
+            tok->type = BT_STRING;
+            tok->offset = p - buf;
+            tok->length = len;
+            p += len;
+
+        } else {
+            return BTOKEN_ERROR_INVALID;
         }
+    } while (depth);
 
-        l = g_list_append (l, value);
-        len = evbuffer_get_length (in);
-        evbuffer_copyout (in, &c, 1);
-    }
-    
-    // remove "e"
-    evbuffer_remove (in, tmp, 1);
-    
-    return l;
+    if (consumed)
+        *consumed = p - buf;
+
+    return count;
 }
 
-GList *bvalue_get_list (BValue *bval)
+const guint8 *btoken_get_string (const guint8 *buf, const BToken *token, gsize *len)
 {
-    if (!bvalue_is_list (bval)) {
-        LOG_err (B_LOG, "BValue is not a list !");
+    if (token->type != BT_STRING)
         return NULL;
+
+    *len = token->length;
+    return buf + token->offset;
+}
+
+gboolean btoken_get_int (const guint8 *buf, const BToken *token, gint64 *i)
+{
+    gchar tmp[24];
+
+    if (token->type != BT_INT || token->length >= sizeof (tmp))
+        return FALSE;
+
+    memcpy (tmp, buf + token->offset, token->length);
+    tmp[token->length] = '\0';
+    *i = g_ascii_strtoll (tmp, NULL, 10);
+
+    return TRUE;
+}
+
+// index of the value of key in dict token, -1 if there is no such key
+gint btoken_dict_get_binary (const guint8 *buf, const BToken *tokens, guint dict, const guint8 *key, gsize key_len)
+{
+    guint i, n;
+
+    if (tokens[dict].type != BT_DICT)
+        return -1;
+
+    for (i = dict + 1, n = 0; n < tokens[dict].children; n += 2) {
+        const BToken *k = &tokens[i];
+
+        if (k->length == key_len && !memcmp (buf + k->offset, key, key_len))
+            return k->next;
+        i = tokens[k->next].next;
     }
 
-    return bval->value.list;
+    return -1;
+}
+
+gint btoken_dict_get (const guint8 *buf, const BToken *tokens, guint dict, const gchar *key)
+{
+    return btoken_dict_get_binary (buf, tokens, dict, (const guint8 *) key, strlen (key));
 }
 /*}}}*/
 
-/*{{{ dict */
+/*{{{ parser */
+BParser *bparser_create (void)
+{
+    BParser *p;
+
+    p = g_new0 (BParser, 1);
+    p->a_tokens = g_array_sized_new (FALSE, FALSE, sizeof (BToken), BTOKEN_STACK_TOKENS);
+    p->result = BTOKEN_ERROR_PART;
 
-static void bvalue_dict_item_free (gpointer data)
+    return p;
+}
+
+void bparser_destroy (BParser *p)
 {
-    BValue *value = (BValue *) data;
-    bvalue_destroy (value);
+    g_array_free (p->a_tokens, TRUE);
+    g_free (p);
 }
 
-static GHashTable *bvalue_parse_dict (struct evbuffer *in)
+// ready to parse a new stream
+void bparser_reset (BParser *p)
 {
-    GHashTable *h_dict = NULL;
-    gchar tmp[1];
-    gchar c;
-    BValue *key;
-    gchar *key_str;
-    BValue *value;
-    size_t len;
-    
-    // remove "d"
-    evbuffer_remove (in, tmp, 1);
+    g_array_set_size (p->a_tokens, 0);
+    p->depth = 0;
+    p->pos = 0;
+    p->state = BPS_Value;
+    p->num = 0;
+    p->result = BTOKEN_ERROR_PART;
+}
 
-    evbuffer_copyout (in, &c, 1);
+static BToken *bparser_top (BParser *p)
+{
+    return &g_array_index (p->a_tokens, BToken, p->a_tokens->len - 1);
+}
 
-    len = evbuffer_get_length (in);
+// current value is complete
+static void bparser_value_done (BParser *p)
+{
+    p->state = BPS_Value;
+    if (!p->depth)
+        p->result = p->a_tokens->len;
+}
 
-    h_dict = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, bvalue_dict_item_free);
+static gboolean bparser_token_new (BParser *p, guint8 c, BType type, gsize offset)
+{
+    BToken tok;
 
-    while (c != 'e' && len > 1) {
-        key = bvalue_create_from_buff (in);
-        if (!bvalue_is_string (key))  {
-            LOG_err (B_LOG, "Failed parsing Bencode Dict !");
-            //XXX
-            return NULL;
+    if (p->depth) {
+        BToken *parent = &g_array_index (p->a_tokens, BToken, p->stack[p->depth - 1]);
+
+        // dict keys are strings
+        if (parent->type == BT_DICT && !(parent->children % 2) && type != BT_STRING)
+            return FALSE;
+        parent->children++;
+    }
+
+    tok.type = type;
+    tok.offset = offset;
+    tok.length = 0;
+    tok.children = 0;
+    tok.next = p->a_tokens->len + 1;
+    g_array_append_val (p->a_tokens, tok);
+
+    if (type == BT_STRING)
+        p->num = c - '0';
+    else
+        p->num = 0;
+
+    return TRUE;
+}
+
+// parses until the value is complete, consumed is the number of data bytes used
+gint bparser_feed (BParser *p, const guint8 *data, gsize len, gsize *consumed)
+{
+    const guint8 *c = data;
+    const guint8 *end = data + len;
+
+    if (p->pos + len > G_MAXUINT32 && p->result == BTOKEN_ERROR_PART)
+        p->result = BTOKEN_ERROR_INVALID;
+
+    while (c < end && p->result == BTOKEN_ERROR_PART) {
+        gsize offset = p->pos + (c - data);
+        BToken *tok;
+
+        switch (p->state) {
+            case BPS_Value:
+                if (*c == 'e') {
+                    if (!p->depth) {
+                        p->result = BTOKEN_ERROR_INVALID;
+                        break;
+                    }
+                    tok = &g_array_index (p->a_tokens, BToken, p->stack[--p->depth]);
+                    if (tok->type == BT_DICT && tok->children % 2) {
+                        p->result = BTOKEN_ERROR_INVALID;
+                        break;
+                    }
+                    tok->length = offset + 1 - tok->offset;
+                    tok->next = p->a_tokens->len;
+                    c++;
+                    bparser_value_done (p);
+
+                } else if (*c == 'l' || *c == 'd') {
+                    if (p->depth >= BTOKEN_MAX_DEPTH || !bparser_token_new (p, *c, *c == 'l' ? BT_LIST : BT_DICT, offset)) {
+                        p->result = BTOKEN_ERROR_INVALID;
+                        break;
+                    }
+                    p->stack[p->depth++] = p->a_tokens->len - 1;
+                    c++;
+
+                } else if (*c == 'i') {
+                    if (!bparser_token_new (p, *c, BT_INT, offset + 1)) {
+                        p->result = BTOKEN_ERROR_INVALID;
+                        break;
+                    }
+                    p->state = BPS_Int;
+                    c++;
+
+                } else if (g_ascii_isdigit (*c)) {
+                    if (!bparser_token_new (p, *c, BT_STRING, offset)) {
+                        p->result = BTOKEN_ERROR_INVALID;
+                        break;
+                    }
+                    p->state = BPS_StrLen;
+                    c++;
+
+                } else {
+                    p->result = BTOKEN_ERROR_INVALID;
+                }
+                break;
+
+            case BPS_Int:
+                tok = bparser_top (p);
+                if (*c == '-' && !tok->length) {
+                    tok->length++;
+                } else if (g_ascii_isdigit (*c) && p->num < 20) {
+                    tok->length++;
+                    p->num++;
+                } else if (*c == 'e' && p->num) {
+                    bparser_value_done (p);
+                } else {
+                    p->result = BTOKEN_ERROR_INVALID;
+                    break;
+                }
+                c++;
+                break;
+
+            case BPS_StrLen:
+                if (g_ascii_isdigit (*c)) {
+                    p->num = p->num * 10 + (*c - '0');
+                    if (p->num > G_MAXUINT32) {
+                        p->result = BTOKEN_ERROR_INVALID;
+                        break;
+                    }
+                } else if (*c == ':') {
+                    tok = bparser_top (p);
+                    tok->offset = offset + 1;
+                    tok->length = p->num;
+                    if (p->num)
+                        p->state = BPS_Str;
+                    else
+                        bparser_value_done (p);
+                } else {
+                    p->result = BTOKEN_ERROR_INVALID;
+                    break;
+                }
+                c++;
+                break;
+
+            // string data is skipped at once
+            case BPS_Str: {
+                gsize n = MIN (p->num, (gsize) (end - c));
+
+                c += n;
+                p->num -= n;
+                if (!p->num)
+                    bparser_value_done (p);
+                break;
+            }
         }
-        key_str = bvalue_get_string (key);
-        if (!key_str) {
-            LOG_err (B_LOG, "Failed parsing Bencode Dict !");
-            //XXX
+    }
+
+    p->pos += c - data;
+    if (consumed)
+        *consumed = c - data;
+
+    return p->result;
+}
+
+// feeds the bytes of in not seen yet, nothing is removed from in
+gint bparser_feed_buffer (BParser *p, struct evbuffer *in)
+{
+    struct evbuffer_ptr ptr;
+    struct evbuffer_iovec vec[8];
+    gint n, i;
+
+    while (p->result == BTOKEN_ERROR_PART && p->pos < evbuffer_get_length (in)) {
+        if (evbuffer_ptr_set (in, &ptr, p->pos, EVBUFFER_PTR_SET) < 0)
+            break;
+        n = evbuffer_peek (in, -1, &ptr, vec, G_N_ELEMENTS (vec));
+        for (i = 0; i < MIN (n, (gint) G_N_ELEMENTS (vec)) && p->result == BTOKEN_ERROR_PART; i++)
+            bparser_feed (p, vec[i].iov_base, vec[i].iov_len, NULL);
+    }
+
+    return p->result;
+}
+
+const BToken *bparser_get_tokens (BParser *p, guint *count)
+{
+    *count = p->a_tokens->len;
+    return (const BToken *) p->a_tokens->data;
+}
+
+// length of the complete value
+gsize bparser_get_length (BParser *p)
+{
+    return p->pos;
+}
+/*}}}*/
+
+/*{{{ encoder */
+void bencoder_init (BEncoder *enc, guint8 *buf, gsize buf_size)
+{
+    memset (enc, 0, sizeof (BEncoder));
+    enc->buf = buf;
+    enc->buf_size = buf_size;
+}
+
+void bencoder_init_evbuffer (BEncoder *enc, struct evbuffer *evb)
+{
+    memset (enc, 0, sizeof (BEncoder));
+    enc->evb = evb;
+}
+
+// TRUE if exactly one complete value is written and it fits the buffer
+gboolean bencoder_finish (BEncoder *enc)
+{
+    if (enc->failed || !enc->done)
+        return FALSE;
+
+    return enc->evb || enc->len <= enc->buf_size;
+}
+
+static void bencoder_fail (BEncoder *enc, const gchar *reason)
+{
+    if (!enc->failed)
+        LOG_err (B_LOG, "Bencoder failed: %s !", reason);
+    enc->failed = TRUE;
+}
+
+// bytes past the end of a caller buffer are only counted
+static void bencoder_write (BEncoder *enc, const void *data, gsize len)
+{
+    if (enc->evb)
+        evbuffer_add (enc->evb, data, len);
+    else if (enc->len + len <= enc->buf_size)
+        memcpy (enc->buf + enc->len, data, len);
+    enc->len += len;
+}
+
+// writes prefix, decimal value and suffix (if any)
+static void bencoder_write_number (BEncoder *enc, gchar prefix, guint64 value, gboolean negative, gchar suffix)
+{
+    gchar tmp[24];
+    gchar *p = tmp + sizeof (tmp);
+
+    *--p = suffix;
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    if (negative)
+        *--p = '-';
+    if (prefix)
+        *--p = prefix;
+
+    bencoder_write (enc, p, tmp + sizeof (tmp) - p);
+}
+
+static gboolean bencoder_value_start (BEncoder *enc)
+{
+    BEncoderLevel *level;
+
+    if (enc->failed)
+        return FALSE;
+    if (enc->pending) {
+        bencoder_fail (enc, "string is not complete");
+        return FALSE;
+    }
+    if (!enc->depth) {
+        if (enc->done) {
+            bencoder_fail (enc, "value is already complete");
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    level = &enc->levels[enc->depth - 1];
+    if (level->type == BT_DICT) {
+        if (!level->expect_value) {
+            bencoder_fail (enc, "dict value without a key");
+            return FALSE;
+        }
+        level->expect_value = FALSE;
+    }
+
+    return TRUE;
+}
+
+static void bencoder_value_end (BEncoder *enc)
+{
+    if (!enc->depth)
+        enc->done = TRUE;
+}
+
+static void bencoder_begin (BEncoder *enc, BType type)
+{
+    BEncoderLevel *level;
+
+    if (!bencoder_value_start (enc))
+        return;
+    if (enc->depth >= BENCODER_MAX_DEPTH) {
+        bencoder_fail (enc, "too deep");
+        return;
+    }
+
+    level = &enc->levels[enc->depth++];
+    level->type = type;
+    level->has_key = FALSE;
+    level->expect_value = FALSE;
+    bencoder_write (enc, type == BT_DICT ? "d" : "l", 1);
+}
+
+void bencoder_begin_dict (BEncoder *enc)
+{
+    bencoder_begin (enc, BT_DICT);
+}
+
+void bencoder_begin_list (BEncoder *enc)
+{
+    bencoder_begin (enc, BT_LIST);
+}
+
+void bencoder_end (BEncoder *enc)
+{
+    if (enc->failed)
+        return;
+    if (!enc->depth || enc->pending || enc->levels[enc->depth - 1].expect_value) {
+        bencoder_fail (enc, "unexpected end");
+        return;
+    }
+
+    enc->depth--;
+    bencoder_write (enc, "e", 1);
+    bencoder_value_end (enc);
+}
+
+// keys are compared as raw strings, only the stored prefix of a long previous key is checked
+static gboolean bencoder_key_sorted (BEncoderLevel *level, const guint8 *key, gsize len)
+{
+    gsize stored = MIN (level->key_len, BENCODER_KEY_LEN);
+    gint cmp;
+
+    if (!level->has_key)
+        return TRUE;
+
+    cmp = memcmp (key, level->key, MIN (len, stored));
+    if (cmp)
+        return cmp > 0;
+    if (len > BENCODER_KEY_LEN && level->key_len > BENCODER_KEY_LEN)
+        return TRUE;
+
+    return len > level->key_len;
+}
+
+void bencoder_key_binary (BEncoder *enc, const void *key, gsize len)
+{
+    BEncoderLevel *level;
+
+    if (enc->failed)
+        return;
+    if (!enc->depth || enc->pending) {
+        bencoder_fail (enc, "key outside of a dict");
+        return;
+    }
+
+    level = &enc->levels[enc->depth - 1];
+    if (level->type != BT_DICT || level->expect_value) {
+        bencoder_fail (enc, "key outside of a dict");
+        return;
+    }
+    if (!bencoder_key_sorted (level, key, len)) {
+        bencoder_fail (enc, "dict keys are not sorted");
+        return;
+    }
+
+    level->has_key = TRUE;
+    level->expect_value = TRUE;
+    level->key_len = len;
+    memcpy (level->key, key, MIN (len, BENCODER_KEY_LEN));
+
+    bencoder_write_number (enc, 0, len, FALSE, ':');
+    bencoder_write (enc, key, len);
+}
+
+void bencoder_key (BEncoder *enc, const gchar *key)
+{
+    bencoder_key_binary (enc, key, strlen (key));
+}
+
+void bencoder_int (BEncoder *enc, gint64 i)
+{
+    if (!bencoder_value_start (enc))
+        return;
+
+    // negate as unsigned, G_MININT64 has no positive counterpart
+    bencoder_write_number (enc, 'i', i < 0 ? -(guint64) i : (guint64) i, i < 0, 'e');
+    bencoder_value_end (enc);
+}
+
+void bencoder_string_begin (BEncoder *enc, gsize len)
+{
+    if (!bencoder_value_start (enc))
+        return;
+
+    bencoder_write_number (enc, 0, len, FALSE, ':');
+    enc->pending = len;
+    if (!len)
+        bencoder_value_end (enc);
+}
+
+void bencoder_append (BEncoder *enc, const void *data, gsize len)
+{
+    if (enc->failed)
+        return;
+    if (len > enc->pending) {
+        bencoder_fail (enc, "string is longer than declared");
+        return;
+    }
+
+    bencoder_write (enc, data, len);
+    enc->pending -= len;
+    if (!enc->pending && len)
+        bencoder_value_end (enc);
+}
+
+void bencoder_binary (BEncoder *enc, const void *data, gsize len)
+{
+    bencoder_string_begin (enc, len);
+    bencoder_append (enc, data, len);
+}
+
+void bencoder_string (BEncoder *enc, const gchar *str)
+{
+    bencoder_binary (enc, str, strlen (str));
+}
+/*}}}*/
+
+/*{{{ raw */
+// reads "<len>:" string header, returns pointer to string data or NULL
+static const guint8 *bvalue_raw_string (const guint8 *p, const guint8 *end, gsize *len)
+{
+    gsize l = 0;
+
+    if (p >= end || !g_ascii_isdigit (*p))
+        return NULL;
+
+    while (p < end && g_ascii_isdigit (*p)) {
+        l = l * 10 + (*p - '0');
+        if (l > (gsize) (end - p))
+            return NULL;
+        p++;
+    }
+
+    if (p >= end || *p != ':' || l > (gsize) (end - p - 1))
+        return NULL;
+
+    *len = l;
+    return p + 1;
+}
+
+// returns pointer past the value at p or NULL if it is malformed
+static const guint8 *bvalue_raw_skip (const guint8 *p, const guint8 *end)
+{
+    guint depth = 0;
+
+    do {
+        const guint8 *s;
+        gsize len;
+
+        if (p >= end)
             return NULL;
+
+        if (*p == 'i') {
+            p = memchr (p, 'e', end - p);
+            if (!p)
+                return NULL;
+            p++;
+        } else if (*p == 'l' || *p == 'd') {
+            depth++;
+            p++;
+        } else if (*p == 'e') {
+            if (!depth)
+                return NULL;
+            depth--;
+            p++;
+        } else {
+            s = bvalue_raw_string (p, end, &len);
+            if (!s)
+                return NULL;
+            p = s + len;
         }
+    } while (depth);
+
+    return p;
+}
+
+// returns pointer to the value of top-level dict key
+static const guint8 *bvalue_raw_dict_find (const guint8 *buf, gsize buf_len, const gchar *key)
+{
+    const guint8 *p = buf;
+    const guint8 *end = buf + buf_len;
+    gsize key_len = strlen (key);
 
-        value = bvalue_create_from_buff (in);
+    if (!buf || !buf_len || *p != 'd')
+        return NULL;
+    p++;
 
-        g_hash_table_insert (h_dict, g_strdup (key_str), value);
+    while (p < end && *p != 'e') {
+        const guint8 *k;
+        gsize k_len;
 
-        bvalue_destroy (key);
+        k = bvalue_raw_string (p, end, &k_len);
+        if (!k)
+            return NULL;
+        p = k + k_len;
 
+        if (k_len == key_len && !memcmp (k, key, key_len))
+            return p;
 
-        len = evbuffer_get_length (in);
-        evbuffer_copyout (in, &c, 1);
+        p = bvalue_raw_skip (p, end);
+        if (!p)
+            return NULL;
     }
-    // remove "e"
-    evbuffer_remove (in, tmp, 1);
-    
-    return h_dict;
+
+    return NULL;
 }
 
+// looks up string value of top-level dict key without building BValue tree
+const guint8 *bvalue_raw_dict_get_string (const guint8 *buf, gsize buf_len, const gchar *key, gsize *len)
+{
+    const guint8 *p;
 
-BValue *bvalue_dict_get_value (BValue *bval, const gchar *key)
+    p = bvalue_raw_dict_find (buf, buf_len, key);
+    if (!p)
+        return NULL;
+
+    return bvalue_raw_string (p, buf + buf_len, len);
+}
+
+// span of any value of top-level dict key, used to reach nested dicts and lists
+const guint8 *bvalue_raw_dict_get_value (const guint8 *buf, gsize buf_len, const gchar *key, gsize *len)
 {
-    return (BValue *)g_hash_table_lookup (bval->value.h_dict, key);
+    const guint8 *p;
+    const guint8 *v_end;
+
+    p = bvalue_raw_dict_find (buf, buf_len, key);
+    if (!p)
+        return NULL;
+
+    v_end = bvalue_raw_skip (p, buf + buf_len);
+    if (!v_end)
+        return NULL;
+
+    *len = v_end - p;
+    return p;
 }
 
+// calls func for every item of a list of strings, returns FALSE if buf is not such a list
+gboolean bvalue_raw_list_foreach_string (const guint8 *buf, gsize buf_len, BValueRawStringFunc func, gpointer data)
+{
+    const guint8 *p = buf;
+    const guint8 *end = buf + buf_len;
+
+    if (!buf || !buf_len || *p != 'l')
+        return FALSE;
+    p++;
+
+    while (p < end && *p != 'e') {
+        const guint8 *s;
+        gsize len;
+
+        s = bvalue_raw_string (p, end, &len);
+        if (!s)
+            return FALSE;
+        func (s, len, data);
+        p = s + len;
+    }
+
+    return p < end;
+}
+
+gboolean bvalue_raw_dict_get_int (const guint8 *buf, gsize buf_len, const gchar *key, gint64 *i)
+{
+    const guint8 *p;
+    const guint8 *end = buf + buf_len;
+    gchar tmp[24];
+    gsize len;
+
+    p = bvalue_raw_dict_find (buf, buf_len, key);
+    if (!p || *p != 'i')
+        return FALSE;
+    p++;
+
+    for (len = 0; p + len < end && p[len] != 'e'; len++)
+        if (len >= sizeof (tmp) - 1)
+            return FALSE;
+    if (p + len >= end)
+        return FALSE;
+
+    memcpy (tmp, p, len);
+    tmp[len] = '\0';
+    *i = g_ascii_strtoll (tmp, NULL, 10);
+
+    return TRUE;
+}
 /*}}}*/
 
 /*{{{ misc*/
@@ -347,7 +1148,7 @@ typedef struct {
     int tabs;
 } DictHelper;
 
-static void bvalue_get_dict_string (gpointer key, gpointer value, gpointer data)
+static void bvalue_get_dict_string (const guint8 *key, gsize key_len, BValue *value, gpointer data)
 {
     gchar *tab_s;
     DictHelper *hlp = (DictHelper *) data;
@@ -362,10 +1163,10 @@ static void bvalue_get_dict_string (gpointer key, gpointer value, gpointer data)
         tab_s = g_strdup ("");
     }
 
-    g_string_append_printf (hlp->str, "%s%s", tab_s, (gchar *)key);
+    g_string_append_printf (hlp->str, "%s%.*s", tab_s, (int) key_len, key);
     g_free (tab_s);
 
-    bvalue_print_string ((BValue *)value, hlp->str, hlp->tabs);
+    bvalue_print_string (value, hlp->str, hlp->tabs);
 }
 
 void bvalue_print_string (BValue *bval, GString *str, int tabs)
@@ -391,7 +1192,7 @@ void bvalue_print_string (BValue *bval, GString *str, int tabs)
             g_string_append_printf (str, "%sINT: %ld\n", tab_s, bval->value.integer);
             break;
         case BT_LIST:
-            g_string_append_printf (str, "%sLIST: %d\n", tab_s, g_list_length (bval->value.list));
+            g_string_append_printf (str, "%sLIST: %u\n", tab_s, bval->count);
             tabs++;
             for (l = g_list_first (bval->value.list); l; l = g_list_next (l)) {
                 BValue *tmp = (BValue *) l->data;
@@ -401,12 +1202,12 @@ void bvalue_print_string (BValue *bval, GString *str, int tabs)
         case BT_DICT: {
             DictHelper *hlp;
 
-            g_string_append_printf (str, "%sDICT: %d\n", tab_s, g_hash_table_size (bval->value.h_dict));
+            g_string_append_printf (str, "%sDICT: %u\n", tab_s, bval->count);
             
             hlp = g_new0 (DictHelper, 1);
             hlp->str = str;
             hlp->tabs = tabs + 1;
-            g_hash_table_foreach (bval->value.h_dict, bvalue_get_dict_string, hlp);
+            bvalue_dict_foreach (bval, bvalue_get_dict_string, hlp);
             g_free (hlp);
             break;
         }
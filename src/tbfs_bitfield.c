@@ -15,27 +15,46 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "tbfs_bitfield.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
+// header and bits share one allocation,
+// bits are kept in wire order (MSB first) inside 64-bit words, spare bits are always zero
 struct _Bitfield {
-    guint8 *bits;
-    guint32 len;
+    guint32 len; // bytes on the wire
     guint32 bit_count;
     guint32 set_count;
+    guint32 word_count; // also keeps words 8 bytes aligned
+    guint64 words[];
 };
 
 #define BF_LOG "bf"
 
+#define BF_BYTES(bf) ((guint8 *) (bf)->words)
+
 static size_t get_bytes_needed (guint32 bit_count);
+static guint32 get_words_needed (guint32 bit_count);
 
 /*{{{ create / destroy */
 Bitfield *tbfs_bitfield_create (guint32 bit_count)
 {
     Bitfield *bf;
 
-    bf = g_new0 (Bitfield, 1);
+    bf = g_malloc0 (tbfs_bitfield_sizeof (bit_count));
+
+    return tbfs_bitfield_init (bf, bit_count);
+}
+
+// initialize bitfield in zeroed memory of tbfs_bitfield_sizeof (bit_count) bytes,
+// lets owner embed bitfield into its own allocation, mem must be 8 bytes aligned
+Bitfield *tbfs_bitfield_init (gpointer mem, guint32 bit_count)
+{
+    Bitfield *bf = (Bitfield *) mem;
+
     bf->bit_count = bit_count;
     bf->len = get_bytes_needed (bit_count);
-    bf->bits = g_new0 (guint8, bf->len);
+    bf->word_count = get_words_needed (bit_count);
     bf->set_count = 0;
 
     LOG_debug (BF_LOG, "For %u bits len: %u", bit_count, bf->len);
@@ -45,9 +64,14 @@ Bitfield *tbfs_bitfield_create (guint32 bit_count)
 
 void tbfs_bitfield_destroy (Bitfield *bf)
 {
-    g_free (bf->bits);
     g_free (bf);
 }
+
+// memory used by a bitfield of bit_count bits
+gsize tbfs_bitfield_sizeof (guint32 bit_count)
+{
+    return sizeof (Bitfield) + get_words_needed (bit_count) * sizeof (guint64);
+}
 /*}}}*/
 
 static size_t get_bytes_needed (guint32 bit_count)
@@ -55,30 +79,205 @@ static size_t get_bytes_needed (guint32 bit_count)
     return (bit_count + 7u) / 8u;
 }
 
+static guint32 get_words_needed (guint32 bit_count)
+{
+    return (bit_count + 63u) / 64u;
+}
+
 void tbfs_bitfield_set_bit (Bitfield *bf, guint32 bit)
 {
-    bf->bits[bit >> 3u] |= (0x80 >> (bit & 7u));
+    if (bit >= bf->bit_count) {
+        LOG_err (BF_LOG, "Bit %u is out of range (%u) !", bit, bf->bit_count);
+        return;
+    }
+
+    // do not count the same bit twice
+    if (tbfs_bitfield_get_bit (bf, bit))
+        return;
+
+    BF_BYTES (bf)[bit >> 3u] |= (0x80 >> (bit & 7u));
     bf->set_count++;
     
-    LOG_debug (BF_LOG, "Set %u bit, %x", bit, bf->bits);
+    LOG_debug (BF_LOG, "Set %u bit, %u set", bit, bf->set_count);
 }
 
-guint32 tbfs_bitfield_get_length (Bitfield *bf)
+gboolean tbfs_bitfield_get_bit (Bitfield *bf, guint32 bit)
 {
-    return bf->len;
+    if (bit >= bf->bit_count)
+        return FALSE;
+
+    return (BF_BYTES (bf)[bit >> 3u] & (0x80 >> (bit & 7u))) != 0;
 }
 
-void *tbfs_bitfield_get_bits (Bitfield *bf)
+guint32 tbfs_bitfield_get_bit_count (Bitfield *bf)
 {
-    uint8_t * bits;
-    
-    bits = g_new0 (uint8_t, bf->len);
-    memcpy (bits, bf->bits, bf->len);
+    return bf->bit_count;
+}
 
-    return bits;
+guint32 tbfs_bitfield_get_length (Bitfield *bf)
+{
+    return bf->len;
 }
 
 guint32 tbfs_bitfield_get_set_bits (Bitfield *bf)
 {
     return bf->set_count;
 }
+
+// returns internal buffer, must not be freed
+const guint8 *tbfs_bitfield_peek_bits (Bitfield *bf)
+{
+    return BF_BYTES (bf);
+}
+
+/*{{{ word kernels */
+#ifdef __AVX2__
+// per 64-bit lane popcount of v, nibble lookup table
+static inline __m256i bf_popcount_256 (__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8 (
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8 (0x0F);
+    __m256i lo, hi, cnt;
+
+    lo = _mm256_and_si256 (v, low_mask);
+    hi = _mm256_and_si256 (_mm256_srli_epi16 (v, 4), low_mask);
+    cnt = _mm256_add_epi8 (_mm256_shuffle_epi8 (lookup, lo), _mm256_shuffle_epi8 (lookup, hi));
+
+    return _mm256_sad_epu8 (cnt, _mm256_setzero_si256 ());
+}
+
+static inline guint64 bf_sum_256 (__m256i v)
+{
+    return (guint64) _mm256_extract_epi64 (v, 0) + (guint64) _mm256_extract_epi64 (v, 1) +
+        (guint64) _mm256_extract_epi64 (v, 2) + (guint64) _mm256_extract_epi64 (v, 3);
+}
+#endif
+
+// dst |= src over n words, returns the number of bits set in dst
+static guint32 bf_or_words (guint64 *dst, const guint64 *src, guint32 n)
+{
+    guint64 count = 0;
+    guint32 i = 0;
+
+#ifdef __AVX2__
+    __m256i acc = _mm256_setzero_si256 ();
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i d = _mm256_or_si256 (_mm256_loadu_si256 ((const __m256i *) (dst + i)),
+            _mm256_loadu_si256 ((const __m256i *) (src + i)));
+
+        _mm256_storeu_si256 ((__m256i *) (dst + i), d);
+        acc = _mm256_add_epi64 (acc, bf_popcount_256 (d));
+    }
+    count = bf_sum_256 (acc);
+#endif
+
+    for (; i < n; i++) {
+        dst[i] |= src[i];
+        count += __builtin_popcountll (dst[i]);
+    }
+
+    return (guint32) count;
+}
+
+static guint32 bf_popcount_words (const guint64 *words, guint32 n)
+{
+    guint64 count = 0;
+    guint32 i = 0;
+
+#ifdef __AVX2__
+    __m256i acc = _mm256_setzero_si256 ();
+
+    for (; i + 4 <= n; i += 4)
+        acc = _mm256_add_epi64 (acc, bf_popcount_256 (_mm256_loadu_si256 ((const __m256i *) (words + i))));
+    count = bf_sum_256 (acc);
+#endif
+
+    for (; i < n; i++)
+        count += __builtin_popcountll (words[i]);
+
+    return (guint32) count;
+}
+
+// index of the first bit >= from set in a and clear in b, -1 if none
+static gint64 bf_find_next_words (const guint64 *a, const guint64 *b, guint32 n, guint32 from)
+{
+    guint32 i = from >> 6u;
+    guint64 w;
+
+    if (i >= n)
+        return -1;
+
+    // words hold bytes in wire order, big endian value puts bit 0 at the top
+    w = GUINT64_FROM_BE (a[i] & ~b[i]) & (G_MAXUINT64 >> (from & 63u));
+    if (w)
+        return ((gint64) i << 6) + __builtin_clzll (w);
+
+    for (i++; i < n; i++) {
+#ifdef __AVX2__
+        // skip empty 256-bit blocks
+        if (i + 4 <= n) {
+            __m256i v = _mm256_andnot_si256 (_mm256_loadu_si256 ((const __m256i *) (b + i)),
+                _mm256_loadu_si256 ((const __m256i *) (a + i)));
+
+            if (_mm256_testz_si256 (v, v)) {
+                i += 3;
+                continue;
+            }
+        }
+#endif
+        w = a[i] & ~b[i];
+        if (w)
+            return ((gint64) i << 6) + __builtin_clzll (GUINT64_FROM_BE (w));
+    }
+
+    return -1;
+}
+/*}}}*/
+
+/*{{{ algebra */
+// dst |= src, both must have the same bit count
+gboolean tbfs_bitfield_or (Bitfield *dst, Bitfield *src)
+{
+    if (dst->bit_count != src->bit_count) {
+        LOG_err (BF_LOG, "Bitfield size mismatch: %u != %u !", dst->bit_count, src->bit_count);
+        return FALSE;
+    }
+
+    dst->set_count = bf_or_words (dst->words, src->words, dst->word_count);
+
+    return TRUE;
+}
+
+// index of the first bit >= from which is set in a and clear in b, -1 if none
+gint64 tbfs_bitfield_find_next_and_not (Bitfield *a, Bitfield *b, guint32 from)
+{
+    if (a->bit_count != b->bit_count) {
+        LOG_err (BF_LOG, "Bitfield size mismatch: %u != %u !", a->bit_count, b->bit_count);
+        return -1;
+    }
+
+    return bf_find_next_words (a->words, b->words, a->word_count, from);
+}
+/*}}}*/
+
+// replace all bits, len must match bitfield length
+gboolean tbfs_bitfield_set_bits (Bitfield *bf, const guint8 *bits, guint32 len)
+{
+    if (len != bf->len) {
+        LOG_err (BF_LOG, "Bitfield length mismatch: %u != %u !", len, bf->len);
+        return FALSE;
+    }
+
+    memcpy (BF_BYTES (bf), bits, len);
+
+    // spare bits of the last byte must be cleared
+    if (bf->bit_count & 7u)
+        BF_BYTES (bf)[len - 1] &= (guint8) (0xFF << (8 - (bf->bit_count & 7u)));
+
+    bf->set_count = bf_popcount_words (bf->words, bf->word_count);
+
+    return TRUE;
+}
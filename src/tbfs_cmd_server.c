@@ -16,6 +16,8 @@
  */
 #include "tbfs_cmd_server.h"
 #include "tbfs_mng.h"
+#include "tbfs_shard.h"
+#include "tbfs_bitfield.h"
 
 /*{{{ structs */
 struct _CmdServer {
@@ -65,6 +67,12 @@ void tbfs_cmd_server_destroy (CmdServer *server)
     evhttp_free (server->httpd);
     g_free (server);
 }
+
+// other modules (embedded tracker) may mount their handlers here
+struct evhttp *tbfs_cmd_server_get_httpd (CmdServer *server)
+{
+    return server->httpd;
+}
 /*}}}*/
 
 /*{{{ HTTP gen cb*/
@@ -76,8 +84,40 @@ static void tbfs_cmd_server_on_http_gen_cb (struct evhttp_request *req, G_GNUC_U
 /*}}}*/
 
 /*{{{ on_add_torrent_cb */
+typedef struct {
+    Torrent *torrent;
+    gboolean seed;
+    gint super_seed; // -1 if not set
+    gboolean has_piece;
+    guint32 piece;
+} CmdTorrentAddData;
+
+// runs in the torrent's shard
+static void tbfs_cmd_server_on_add_torrent_task (CmdTorrentAddData *data)
+{
+    // we hold all pieces of this torrent
+    if (data->seed) {
+        guint32 i, total_pieces;
+
+        total_pieces = tbfs_bitfield_get_bit_count (tbfs_torrent_get_bitfield_pieces_have (data->torrent));
+        for (i = 0; i < total_pieces; i++)
+            tbfs_torrent_set_piece_have (data->torrent, i);
+    }
+
+    if (data->super_seed >= 0)
+        tbfs_torrent_set_super_seed (data->torrent, data->super_seed != 0);
+
+    // add a piece
+    if (data->has_piece)
+        tbfs_torrent_add_piece (data->torrent, data->piece);
+
+    g_free (data);
+}
+
 // Add torrent and piece
 // x.x.x.x/cmd_torrent_add?info_hash=xxxx&total_pieces=n&piece=n
+// origin node which holds all pieces:
+// x.x.x.x/cmd_torrent_add?info_hash=xxxx&total_pieces=n&seed=1[&super_seed=1]
 static void tbfs_cmd_server_on_add_torrent_cb (struct evhttp_request *req, void *ctx)
 {
     CmdServer *server = (CmdServer *) ctx;
@@ -87,7 +127,10 @@ static void tbfs_cmd_server_on_add_torrent_cb (struct evhttp_request *req, void
     const gchar *info_hash;
     const gchar *s_piece;
     const gchar *s_total_pieces;
+    const gchar *s_seed;
+    const gchar *s_super_seed;
     Torrent *torrent;
+    CmdTorrentAddData *data;
 
     LOG_debug (CSRV_LOG, "[%s:%d] URL: %s", req->remote_host, req->remote_port, req->uri);
 
@@ -108,6 +151,13 @@ static void tbfs_cmd_server_on_add_torrent_cb (struct evhttp_request *req, void
         return;
     }
 
+    if (!sha1_hexstr_is_valid (info_hash)) {
+        LOG_err (CSRV_LOG, "Invalid \"info_hash\" parameter: %s !", info_hash);
+        evhttp_send_reply (req, HTTP_BADREQUEST, "Bad Request", NULL);
+        evhttp_clear_headers (&q_params);
+        return;
+    }
+
     s_total_pieces = http_find_header (&q_params, "total_pieces");
     if (!s_total_pieces) {
         LOG_err (CSRV_LOG, "Required \"total_pieces\" parameter not found !");
@@ -116,8 +166,11 @@ static void tbfs_cmd_server_on_add_torrent_cb (struct evhttp_request *req, void
         return;
     }
     
+    s_seed = http_find_header (&q_params, "seed");
+    s_super_seed = http_find_header (&q_params, "super_seed");
+
     s_piece = http_find_header (&q_params, "piece");
-    if (!s_piece) {
+    if (!s_piece && !s_seed) {
         LOG_err (CSRV_LOG, "Required \"piece\" parameter not found !");
         evhttp_send_reply (req, HTTP_NOCONTENT, "Not Found", NULL);
         evhttp_clear_headers (&q_params);
@@ -135,8 +188,14 @@ static void tbfs_cmd_server_on_add_torrent_cb (struct evhttp_request *req, void
         return;
     }
     
-    // add a piece
-    tbfs_torrent_add_piece (torrent, evutil_strtoll (s_piece, NULL, 10));
+    data = g_new0 (CmdTorrentAddData, 1);
+    data->torrent = torrent;
+    data->seed = s_seed && evutil_strtoll (s_seed, NULL, 10);
+    data->super_seed = s_super_seed ? evutil_strtoll (s_super_seed, NULL, 10) != 0 : -1;
+    data->has_piece = s_piece != NULL;
+    data->piece = s_piece ? evutil_strtoll (s_piece, NULL, 10) : 0;
+
+    tbfs_shard_run_full (tbfs_torrent_get_shard (torrent), (ShardTaskFunc) tbfs_cmd_server_on_add_torrent_task, data, g_free);
 
     evb = evbuffer_new ();
     evhttp_send_reply (req, HTTP_OK, "OK", evb);
@@ -147,17 +206,62 @@ static void tbfs_cmd_server_on_add_torrent_cb (struct evhttp_request *req, void
 /*}}}*/
 
 /*{{{ on_info_torrent_cb*/
+typedef struct {
+    Application *app;
+    struct evhttp_request *req;
+    struct evhttp_connection *evcon; // NULL if client disconnected before the reply
+    Torrent *torrent;
+    struct evbuffer *evb;
+} CmdTorrentInfoData;
+
+static void tbfs_cmd_server_info_torrent_data_free (CmdTorrentInfoData *data)
+{
+    evbuffer_free (data->evb);
+    g_free (data);
+}
+
+// client went away while the shard was printing, req must not be touched anymore
+static void tbfs_cmd_server_on_info_torrent_close_cb (G_GNUC_UNUSED struct evhttp_connection *evcon, void *ctx)
+{
+    CmdTorrentInfoData *data = (CmdTorrentInfoData *) ctx;
+
+    data->evcon = NULL;
+}
+
+// runs in the main loop
+static void tbfs_cmd_server_on_info_torrent_reply_task (CmdTorrentInfoData *data)
+{
+    if (data->evcon) {
+        evhttp_connection_set_closecb (data->evcon, NULL, NULL);
+        evhttp_send_reply (data->req, HTTP_OK, "OK", data->evb);
+    } else {
+        LOG_debug (CSRV_LOG, "Client disconnected, dropping torrent info reply");
+    }
+
+    tbfs_cmd_server_info_torrent_data_free (data);
+}
+
+// runs in the torrent's shard
+static void tbfs_cmd_server_on_info_torrent_task (CmdTorrentInfoData *data)
+{
+    PrintFormat *print_format = NULL;
+
+    tbfs_torrent_info_print (data->torrent, data->evb, print_format);
+
+    tbfs_shard_run_full (tbfs_shard_pool_get_main (application_get_shard_pool (data->app)),
+        (ShardTaskFunc) tbfs_cmd_server_on_info_torrent_reply_task, data, (GDestroyNotify) tbfs_cmd_server_info_torrent_data_free);
+}
+
 // Print torrent info
 // x.x.x.x/cmd_torrent_info?info_hash=xxxx
 static void tbfs_cmd_server_on_info_torrent_cb (struct evhttp_request *req, void *ctx)
 {
     CmdServer *server = (CmdServer *) ctx;
-    struct evbuffer *evb = NULL;
     const gchar *query;
     struct evkeyvalq q_params;
     const gchar *info_hash;
     Torrent *torrent;
-    PrintFormat *print_format;
+    CmdTorrentInfoData *data;
 
     LOG_debug (CSRV_LOG, "[%s:%d] URL: %s", req->remote_host, req->remote_port, req->uri);
 
@@ -187,10 +291,16 @@ static void tbfs_cmd_server_on_info_torrent_cb (struct evhttp_request *req, void
         return;
     }
 
-    evb = evbuffer_new ();
-    tbfs_torrent_info_print (torrent, evb, print_format);
-    evhttp_send_reply (req, HTTP_OK, "OK", evb);
-    evbuffer_free (evb);
+    // torrent is owned by its shard, the reply is sent back from the main loop
+    data = g_new0 (CmdTorrentInfoData, 1);
+    data->app = server->app;
+    data->req = req;
+    data->evcon = evhttp_request_get_connection (req);
+    data->torrent = torrent;
+    data->evb = evbuffer_new ();
+    evhttp_connection_set_closecb (data->evcon, tbfs_cmd_server_on_info_torrent_close_cb, data);
+    tbfs_shard_run_full (tbfs_torrent_get_shard (torrent), (ShardTaskFunc) tbfs_cmd_server_on_info_torrent_task, data,
+        (GDestroyNotify) tbfs_cmd_server_info_torrent_data_free);
     
     evhttp_clear_headers (&q_params);
 }
@@ -0,0 +1,1300 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "tbfs_dht.h"
+#include "tbfs_bencode.h"
+#include "tbfs_peer.h"
+
+/*{{{ struct */
+// BEP 5: DHT Protocol, Kademlia over bencoded UDP messages (KRPC)
+#define DHT_ID_LEN SHA_DIGEST_LENGTH
+#define DHT_BUCKETS (DHT_ID_LEN * 8)
+#define DHT_K 8 // bucket size, nodes returned by find_node / get_peers
+#define DHT_ALPHA 3 // parallel queries of a lookup
+#define DHT_SEARCH_NODES 16 // closest nodes tracked by a lookup
+#define DHT_MAX_SEARCHES 64 // lookups running at once, the rest wait in a queue
+#define DHT_MAX_QUERIES 1024 // queries in flight
+#define DHT_NODE_COMPACT_LEN 26 // id, ip, port
+#define DHT_MAX_PKT 1500
+#define DHT_MAX_TOKEN_LEN 20
+#define DHT_TOKEN_LEN 8
+#define DHT_TOKEN_ROTATE_SEC 300
+#define DHT_NODE_STALE_SEC 900 // questionable node is pinged before it may be replaced
+#define DHT_NODE_MAX_FAILS 3
+#define DHT_PEER_TTL_SEC 1800
+#define DHT_MAX_STORED_PEERS 100 // per info_hash
+#define DHT_MAX_VALUES 50 // peers returned by get_peers
+#define DHT_MAINTENANCE_SEC 60
+#define DHT_SAVE_SEC 600
+
+typedef enum {
+    DQ_Ping = 0,
+    DQ_FindNode = 1,
+    DQ_GetPeers = 2,
+    DQ_AnnouncePeer = 3,
+} DhtQueryType;
+
+static const gchar *dht_query_names[] = { "ping", "find_node", "get_peers", "announce_peer" };
+
+typedef struct {
+    guint8 id[DHT_ID_LEN];
+    PeerEndpoint endpoint;
+    time_t last_seen; // last message received from the node
+    guint8 failed; // unanswered queries in a row
+} DhtNode;
+
+typedef enum {
+    DSN_New = 0,
+    DSN_Queried = 1,
+    DSN_Replied = 2,
+    DSN_Failed = 3,
+} DhtSearchNodeState;
+
+typedef struct {
+    guint8 id[DHT_ID_LEN];
+    PeerEndpoint endpoint;
+    guint8 state; // DhtSearchNodeState
+    guint8 token_len;
+    guint8 token[DHT_MAX_TOKEN_LEN];
+} DhtSearchNode;
+
+// iterative lookup of the nodes closest to target
+typedef struct {
+    Dht *dht;
+    DhtQueryType type; // DQ_FindNode or DQ_GetPeers
+    GBytes *target;
+    gchar s_info_hash[SHA_DIGEST_LENGTH * 2 + 1];
+
+    DhtSearchNode nodes[DHT_SEARCH_NODES]; // ordered by distance to target
+    guint node_count;
+    guint inflight;
+
+    gboolean announce;
+    guint peers_found;
+    Dht_on_peers_cb on_peers_cb;
+    gpointer ctx;
+} DhtSearch;
+
+typedef struct {
+    Dht *dht;
+    DhtQueryType type;
+    guint32 tid;
+    PeerEndpoint endpoint;
+    guint8 node_id[DHT_ID_LEN];
+    gboolean has_node_id; // bootstrap nodes are queried before their ids are known
+    DhtSearch *search; // lookup the query belongs to, NULL if none
+    struct event *ev_timeout;
+} DhtQuery;
+
+typedef struct {
+    PeerEndpoint endpoint;
+    time_t announced;
+} DhtStoredPeer;
+
+struct _Dht {
+    Application *app;
+
+    guint8 id[DHT_ID_LEN];
+    evutil_socket_t fd;
+    struct event *ev_read;
+    struct event *ev_timer;
+
+    GQueue *buckets[DHT_BUCKETS]; // DhtNode, least recently seen first, index is the prefix length shared with id
+    guint node_count;
+
+    GHashTable *h_queries; // transaction_id -> DhtQuery, queries in flight
+    GHashTable *h_searches; // target (GBytes) -> DhtSearch, running and pending
+    GQueue *q_pending; // DhtSearch waiting for a free slot
+    gboolean starting_pending;
+    guint32 next_tid;
+    GHashTable *h_storage; // info_hash (GBytes) -> GArray of DhtStoredPeer, announced to us
+    GArray *a_bootstrap; // PeerEndpoint
+
+    guint8 secret[DHT_TOKEN_LEN];
+    guint8 prev_secret[DHT_TOKEN_LEN]; // tokens stay valid for one more rotation
+    time_t secret_time;
+    time_t last_saved;
+
+    gchar *state_file;
+    guint16 peer_port; // announced to other nodes
+    gint32 query_timeout_sec;
+};
+
+#define DHT_LOG "dht"
+
+static void tbfs_dht_on_read_cb (evutil_socket_t fd, short events, void *arg);
+static void tbfs_dht_on_timer_cb (evutil_socket_t fd, short events, void *arg);
+static void tbfs_dht_on_query_timeout_cb (evutil_socket_t fd, short events, void *arg);
+static void tbfs_dht_search_destroy (DhtSearch *search);
+static void tbfs_dht_bootstrap (Dht *dht);
+static gboolean tbfs_dht_load (Dht *dht);
+static DhtSearch *tbfs_dht_search_create (Dht *dht, DhtQueryType type, const guint8 *target);
+static void tbfs_dht_search_add_node (DhtSearch *search, const guint8 *id, const PeerEndpoint *endpoint);
+/*}}}*/
+
+/*{{{ create / destroy */
+static void tbfs_dht_storage_free (GArray *a_peers)
+{
+    g_array_free (a_peers, TRUE);
+}
+
+// bootstrap nodes are resolved once at startup, "host:port" separated by commas
+static void tbfs_dht_resolve_bootstrap (Dht *dht, const gchar *nodes)
+{
+    gchar **a_nodes;
+    gint i;
+
+    a_nodes = g_strsplit (nodes, ",", -1);
+    for (i = 0; a_nodes[i]; i++) {
+        struct evutil_addrinfo hints;
+        struct evutil_addrinfo *ai = NULL;
+        gchar *host = g_strstrip (a_nodes[i]);
+        gchar *port;
+        PeerEndpoint endpoint;
+        int res;
+
+        port = strrchr (host, ':');
+        if (!*host || !port)
+            continue;
+        *port = '\0';
+        port++;
+
+        memset (&hints, 0, sizeof (hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        res = evutil_getaddrinfo (host, port, &hints, &ai);
+        if (res || !ai) {
+            LOG_err (DHT_LOG, "Failed to resolve DHT bootstrap node %s: %s", host, evutil_gai_strerror (res));
+            continue;
+        }
+
+        endpoint.addr = ((struct sockaddr_in *) ai->ai_addr)->sin_addr.s_addr;
+        endpoint.port = ((struct sockaddr_in *) ai->ai_addr)->sin_port;
+        g_array_append_val (dht->a_bootstrap, endpoint);
+        evutil_freeaddrinfo (ai);
+    }
+    g_strfreev (a_nodes);
+}
+
+// DHT shares the peer port: TCP is served by PeerServer, UDP by the DHT
+Dht *tbfs_dht_create (Application *app)
+{
+    Dht *dht;
+    ConfData *conf = application_get_conf (app);
+    struct sockaddr_in sin;
+    struct timeval tv;
+    gint port;
+    guint i;
+
+    dht = g_new0 (Dht, 1);
+    dht->app = app;
+    dht->fd = -1;
+    for (i = 0; i < DHT_BUCKETS; i++)
+        dht->buckets[i] = g_queue_new ();
+    dht->h_queries = g_hash_table_new (g_direct_hash, g_direct_equal);
+    dht->h_searches = g_hash_table_new_full (g_bytes_hash, g_bytes_equal, NULL, (GDestroyNotify) tbfs_dht_search_destroy);
+    dht->q_pending = g_queue_new ();
+    dht->next_tid = g_random_int ();
+    dht->h_storage = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+        (GDestroyNotify) g_bytes_unref, (GDestroyNotify) tbfs_dht_storage_free);
+    dht->a_bootstrap = g_array_new (FALSE, FALSE, sizeof (PeerEndpoint));
+    dht->state_file = g_strdup (conf_get_string (conf, "dht.state_file"));
+    dht->peer_port = conf_get_int (conf, "peer_server.port");
+    dht->query_timeout_sec = MAX (1, conf_get_int (conf, "dht.query_timeout_sec"));
+
+    port = conf_get_int (conf, "dht.port");
+    if (port <= 0)
+        port = dht->peer_port;
+
+    // node id is kept across restarts, so other nodes' routing tables stay valid
+    if (!tbfs_dht_load (dht)) {
+        for (i = 0; i < DHT_ID_LEN; i++)
+            dht->id[i] = g_random_int_range (0, 256);
+    }
+    for (i = 0; i < DHT_TOKEN_LEN; i++)
+        dht->secret[i] = g_random_int_range (0, 256);
+    memcpy (dht->prev_secret, dht->secret, DHT_TOKEN_LEN);
+    dht->secret_time = time (NULL);
+    dht->last_saved = time (NULL);
+
+    tbfs_dht_resolve_bootstrap (dht, conf_get_string (conf, "dht.bootstrap"));
+
+    dht->fd = socket (AF_INET, SOCK_DGRAM, 0);
+    if (dht->fd < 0) {
+        LOG_err (DHT_LOG, "Failed to create UDP socket: %s", strerror (errno));
+        tbfs_dht_destroy (dht);
+        return NULL;
+    }
+    evutil_make_socket_nonblocking (dht->fd);
+    evutil_make_listen_socket_reuseable (dht->fd);
+
+    memset (&sin, 0, sizeof (sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons (port);
+    if (inet_pton (AF_INET, conf_get_string (conf, "peer_server.listen"), &sin.sin_addr) != 1 ||
+        bind (dht->fd, (struct sockaddr *) &sin, sizeof (sin)) < 0)
+    {
+        LOG_err (DHT_LOG, "Failed to bind DHT socket to port %d: %s", port, strerror (errno));
+        tbfs_dht_destroy (dht);
+        return NULL;
+    }
+
+    dht->ev_read = event_new (application_get_evbase (app), dht->fd, EV_READ | EV_PERSIST, tbfs_dht_on_read_cb, dht);
+    event_add (dht->ev_read, NULL);
+
+    dht->ev_timer = event_new (application_get_evbase (app), -1, EV_PERSIST, tbfs_dht_on_timer_cb, dht);
+    tv.tv_sec = DHT_MAINTENANCE_SEC;
+    tv.tv_usec = 0;
+    event_add (dht->ev_timer, &tv);
+
+    LOG_msg (DHT_LOG, "DHT node is listening on UDP port %d", port);
+
+    tbfs_dht_bootstrap (dht);
+
+    return dht;
+}
+
+static void tbfs_dht_query_destroy (DhtQuery *query)
+{
+    event_free (query->ev_timeout);
+    g_free (query);
+}
+
+void tbfs_dht_destroy (Dht *dht)
+{
+    GList *l_queries, *l;
+    guint i;
+
+    if (dht->node_count)
+        tbfs_dht_save (dht);
+
+    // queries reference searches
+    l_queries = g_hash_table_get_values (dht->h_queries);
+    for (l = l_queries; l; l = g_list_next (l))
+        tbfs_dht_query_destroy ((DhtQuery *) l->data);
+    g_list_free (l_queries);
+    g_hash_table_destroy (dht->h_queries);
+    g_queue_free (dht->q_pending);
+    g_hash_table_destroy (dht->h_searches);
+    g_hash_table_destroy (dht->h_storage);
+
+    for (i = 0; i < DHT_BUCKETS; i++) {
+        g_queue_foreach (dht->buckets[i], (GFunc) g_free, NULL);
+        g_queue_free (dht->buckets[i]);
+    }
+    g_array_free (dht->a_bootstrap, TRUE);
+
+    if (dht->ev_timer)
+        event_free (dht->ev_timer);
+    if (dht->ev_read)
+        event_free (dht->ev_read);
+    if (dht->fd >= 0)
+        evutil_closesocket (dht->fd);
+    g_free (dht->state_file);
+    g_free (dht);
+}
+
+guint tbfs_dht_get_node_count (Dht *dht)
+{
+    return dht->node_count;
+}
+/*}}}*/
+
+/*{{{ routing table */
+// number of leading bits id shares with ours, DHT_BUCKETS for our own id
+static guint tbfs_dht_bucket_index (Dht *dht, const guint8 *id)
+{
+    guint i;
+
+    for (i = 0; i < DHT_ID_LEN; i++) {
+        guint8 x = id[i] ^ dht->id[i];
+
+        if (x)
+            return i * 8 + __builtin_clz (x) - (sizeof (unsigned int) - 1) * 8;
+    }
+
+    return DHT_BUCKETS;
+}
+
+// compares XOR distances of a and b to target
+static gint dht_distance_cmp (const guint8 *target, const guint8 *a, const guint8 *b)
+{
+    guint i;
+
+    for (i = 0; i < DHT_ID_LEN; i++) {
+        guint8 da = a[i] ^ target[i];
+        guint8 db = b[i] ^ target[i];
+
+        if (da != db)
+            return da < db ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static GList *tbfs_dht_bucket_find (GQueue *bucket, const guint8 *id)
+{
+    GList *l;
+
+    for (l = bucket->head; l; l = g_list_next (l))
+        if (!memcmp (((DhtNode *) l->data)->id, id, DHT_ID_LEN))
+            return l;
+
+    return NULL;
+}
+
+static gboolean tbfs_dht_query_send (Dht *dht, DhtQueryType type, const PeerEndpoint *endpoint, const guint8 *node_id,
+    const guint8 *target, const guint8 *token, gsize token_len, DhtSearch *search);
+
+// node sent us a valid message: it is moved to the tail of its bucket or added if there is room,
+// long-lived nodes are preferred, so a full bucket only replaces failed ones
+static void tbfs_dht_node_seen (Dht *dht, const guint8 *id, const PeerEndpoint *endpoint)
+{
+    GQueue *bucket;
+    GList *l;
+    DhtNode *node;
+    guint idx;
+    time_t now = time (NULL);
+
+    idx = tbfs_dht_bucket_index (dht, id);
+    if (idx >= DHT_BUCKETS || !endpoint->port)
+        return;
+    bucket = dht->buckets[idx];
+
+    l = tbfs_dht_bucket_find (bucket, id);
+    if (l) {
+        node = (DhtNode *) l->data;
+        node->endpoint = *endpoint;
+        node->last_seen = now;
+        node->failed = 0;
+        g_queue_unlink (bucket, l);
+        g_queue_push_tail_link (bucket, l);
+        return;
+    }
+
+    if (g_queue_get_length (bucket) >= DHT_K) {
+        node = (DhtNode *) g_queue_peek_head (bucket);
+
+        if (node->failed < DHT_NODE_MAX_FAILS - 1) {
+            // make sure the oldest node is still alive, the new one is dropped
+            if (now - node->last_seen > DHT_NODE_STALE_SEC)
+                tbfs_dht_query_send (dht, DQ_Ping, &node->endpoint, node->id, NULL, NULL, 0, NULL);
+            return;
+        }
+
+        g_free (g_queue_pop_head (bucket));
+        dht->node_count--;
+    }
+
+    node = g_new0 (DhtNode, 1);
+    memcpy (node->id, id, DHT_ID_LEN);
+    node->endpoint = *endpoint;
+    node->last_seen = now;
+    g_queue_push_tail (bucket, node);
+    dht->node_count++;
+}
+
+static void tbfs_dht_node_failed (Dht *dht, const guint8 *id)
+{
+    GQueue *bucket;
+    GList *l;
+    DhtNode *node;
+    guint idx;
+
+    idx = tbfs_dht_bucket_index (dht, id);
+    if (idx >= DHT_BUCKETS)
+        return;
+    bucket = dht->buckets[idx];
+
+    l = tbfs_dht_bucket_find (bucket, id);
+    if (!l)
+        return;
+
+    node = (DhtNode *) l->data;
+    if (++node->failed >= DHT_NODE_MAX_FAILS) {
+        g_queue_delete_link (bucket, l);
+        g_free (node);
+        dht->node_count--;
+    }
+}
+
+// up to max nodes of the routing table closest to target, returns their number
+static guint tbfs_dht_closest_nodes (Dht *dht, const guint8 *target, DhtNode **nodes, guint max)
+{
+    guint i, count = 0;
+
+    for (i = 0; i < DHT_BUCKETS; i++) {
+        GList *l;
+
+        for (l = dht->buckets[i]->head; l; l = g_list_next (l)) {
+            DhtNode *node = (DhtNode *) l->data;
+            guint pos;
+
+            if (node->failed)
+                continue;
+
+            // insertion into a short sorted array
+            for (pos = count; pos > 0 && dht_distance_cmp (target, node->id, nodes[pos - 1]->id) < 0; pos--) {
+                if (pos < max)
+                    nodes[pos] = nodes[pos - 1];
+            }
+            if (pos < max) {
+                nodes[pos] = node;
+                if (count < max)
+                    count++;
+            }
+        }
+    }
+
+    return count;
+}
+
+// "nodes" string of find_node and get_peers replies
+static guint tbfs_dht_compact_nodes (Dht *dht, const guint8 *target, guint8 *out)
+{
+    DhtNode *nodes[DHT_K];
+    guint i, count;
+
+    count = tbfs_dht_closest_nodes (dht, target, nodes, DHT_K);
+    for (i = 0; i < count; i++) {
+        guint8 *p = out + i * DHT_NODE_COMPACT_LEN;
+
+        memcpy (p, nodes[i]->id, DHT_ID_LEN);
+        memcpy (p + DHT_ID_LEN, &nodes[i]->endpoint.addr, 4);
+        memcpy (p + DHT_ID_LEN + 4, &nodes[i]->endpoint.port, 2);
+    }
+
+    return count * DHT_NODE_COMPACT_LEN;
+}
+
+// PORT message or manually added node, its id is learned from the reply
+void tbfs_dht_add_node (Dht *dht, const PeerEndpoint *endpoint)
+{
+    tbfs_dht_query_send (dht, DQ_FindNode, endpoint, NULL, dht->id, NULL, 0, NULL);
+}
+/*}}}*/
+
+/*{{{ state */
+// state file: d2:id20:<node id>5:nodes<compact nodes>e
+static gboolean tbfs_dht_load (Dht *dht)
+{
+    gchar *contents = NULL;
+    gsize len;
+    const guint8 *id;
+    const guint8 *nodes;
+    gsize id_len, nodes_len, i;
+    GError *error = NULL;
+    DhtSearch *search;
+
+    if (!dht->state_file || !*dht->state_file)
+        return FALSE;
+
+    if (!g_file_get_contents (dht->state_file, &contents, &len, &error)) {
+        LOG_debug (DHT_LOG, "DHT state is not loaded: %s", error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    id = bvalue_raw_dict_get_string ((const guint8 *) contents, len, "id", &id_len);
+    if (!id || id_len != DHT_ID_LEN) {
+        LOG_err (DHT_LOG, "DHT state file %s is corrupted !", dht->state_file);
+        g_free (contents);
+        return FALSE;
+    }
+    memcpy (dht->id, id, DHT_ID_LEN);
+
+    // saved nodes are only trusted after they reply to the bootstrap lookup
+    nodes = bvalue_raw_dict_get_string ((const guint8 *) contents, len, "nodes", &nodes_len);
+    if (nodes && nodes_len % DHT_NODE_COMPACT_LEN == 0) {
+        search = tbfs_dht_search_create (dht, DQ_FindNode, dht->id);
+
+        for (i = 0; i < nodes_len; i += DHT_NODE_COMPACT_LEN) {
+            PeerEndpoint endpoint;
+
+            memcpy (&endpoint.addr, nodes + i + DHT_ID_LEN, 4);
+            memcpy (&endpoint.port, nodes + i + DHT_ID_LEN + 4, 2);
+            tbfs_dht_search_add_node (search, nodes + i, &endpoint);
+        }
+    }
+
+    LOG_msg (DHT_LOG, "DHT state is loaded, %"G_GSIZE_FORMAT" saved nodes", nodes ? nodes_len / DHT_NODE_COMPACT_LEN : 0);
+
+    g_free (contents);
+    return TRUE;
+}
+
+// good nodes are saved closest first
+gboolean tbfs_dht_save (Dht *dht)
+{
+    DhtNode *nodes[DHT_SEARCH_NODES];
+    guint8 buf[64 + DHT_SEARCH_NODES * DHT_NODE_COMPACT_LEN];
+    BEncoder enc;
+    GError *error = NULL;
+    guint i, count;
+    gboolean res;
+
+    if (!dht->state_file || !*dht->state_file)
+        return FALSE;
+
+    count = tbfs_dht_closest_nodes (dht, dht->id, nodes, DHT_SEARCH_NODES);
+
+    bencoder_init (&enc, buf, sizeof (buf));
+    bencoder_begin_dict (&enc);
+    bencoder_key (&enc, "id");
+    bencoder_binary (&enc, dht->id, DHT_ID_LEN);
+    bencoder_key (&enc, "nodes");
+    bencoder_string_begin (&enc, count * DHT_NODE_COMPACT_LEN);
+    for (i = 0; i < count; i++) {
+        bencoder_append (&enc, nodes[i]->id, DHT_ID_LEN);
+        bencoder_append (&enc, &nodes[i]->endpoint.addr, 4);
+        bencoder_append (&enc, &nodes[i]->endpoint.port, 2);
+    }
+    bencoder_end (&enc);
+    if (!bencoder_finish (&enc))
+        return FALSE;
+
+    res = g_file_set_contents (dht->state_file, (const gchar *) buf, enc.len, &error);
+    if (!res) {
+        LOG_err (DHT_LOG, "Failed to save DHT state to %s: %s", dht->state_file, error->message);
+        g_error_free (error);
+    } else {
+        LOG_debug (DHT_LOG, "DHT state is saved, %u nodes", count);
+    }
+
+    dht->last_saved = time (NULL);
+
+    return res;
+}
+/*}}}*/
+
+/*{{{ messages */
+static void tbfs_dht_send (Dht *dht, const PeerEndpoint *endpoint, BEncoder *enc)
+{
+    struct sockaddr_in sin;
+
+    if (!bencoder_finish (enc))
+        return;
+
+    memset (&sin, 0, sizeof (sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = endpoint->addr;
+    sin.sin_port = endpoint->port;
+
+    if (sendto (dht->fd, enc->buf, enc->len, 0, (struct sockaddr *) &sin, sizeof (sin)) < 0)
+        LOG_debug (DHT_LOG, "Failed to send DHT message: %s", strerror (errno));
+}
+
+// token is a keyed hash of the requester's address, so only it can announce with it
+static void tbfs_dht_make_token (const guint8 *secret, guint32 addr, guint8 *token)
+{
+    guint8 md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+
+    HMAC (EVP_sha1 (), secret, DHT_TOKEN_LEN, (const guint8 *) &addr, sizeof (addr), md, &md_len);
+    memcpy (token, md, DHT_TOKEN_LEN);
+}
+
+static gboolean tbfs_dht_token_valid (Dht *dht, guint32 addr, const guint8 *token, gsize token_len)
+{
+    guint8 expected[DHT_TOKEN_LEN];
+
+    if (token_len != DHT_TOKEN_LEN)
+        return FALSE;
+
+    tbfs_dht_make_token (dht->secret, addr, expected);
+    if (!memcmp (expected, token, DHT_TOKEN_LEN))
+        return TRUE;
+
+    tbfs_dht_make_token (dht->prev_secret, addr, expected);
+    return !memcmp (expected, token, DHT_TOKEN_LEN);
+}
+
+// target is info_hash for get_peers / announce_peer and node id for find_node,
+// FALSE if too many queries are in flight
+static gboolean tbfs_dht_query_send (Dht *dht, DhtQueryType type, const PeerEndpoint *endpoint, const guint8 *node_id,
+    const guint8 *target, const guint8 *token, gsize token_len, DhtSearch *search)
+{
+    DhtQuery *query;
+    guint8 buf[DHT_MAX_PKT];
+    BEncoder enc;
+    struct timeval tv;
+
+    if (g_hash_table_size (dht->h_queries) >= DHT_MAX_QUERIES) {
+        LOG_debug (DHT_LOG, "Too many DHT queries in flight, %s query is dropped", dht_query_names[type]);
+        return FALSE;
+    }
+
+    query = g_new0 (DhtQuery, 1);
+    query->dht = dht;
+    query->type = type;
+    query->endpoint = *endpoint;
+    query->search = search;
+    if (node_id) {
+        memcpy (query->node_id, node_id, DHT_ID_LEN);
+        query->has_node_id = TRUE;
+    }
+    // ends within DHT_MAX_QUERIES steps, ids are reused only after the counter wraps
+    do {
+        query->tid = dht->next_tid++;
+    } while (g_hash_table_lookup (dht->h_queries, GUINT_TO_POINTER (query->tid)));
+    query->ev_timeout = evtimer_new (application_get_evbase (dht->app), tbfs_dht_on_query_timeout_cb, query);
+    g_hash_table_insert (dht->h_queries, GUINT_TO_POINTER (query->tid), query);
+
+    bencoder_init (&enc, buf, sizeof (buf));
+    bencoder_begin_dict (&enc);
+    bencoder_key (&enc, "a");
+    bencoder_begin_dict (&enc);
+    bencoder_key (&enc, "id");
+    bencoder_binary (&enc, dht->id, DHT_ID_LEN);
+    if (type == DQ_GetPeers || type == DQ_AnnouncePeer) {
+        bencoder_key (&enc, "info_hash");
+        bencoder_binary (&enc, target, DHT_ID_LEN);
+    }
+    if (type == DQ_AnnouncePeer) {
+        bencoder_key (&enc, "port");
+        bencoder_int (&enc, dht->peer_port);
+    }
+    if (type == DQ_FindNode) {
+        bencoder_key (&enc, "target");
+        bencoder_binary (&enc, target, DHT_ID_LEN);
+    }
+    if (type == DQ_AnnouncePeer) {
+        bencoder_key (&enc, "token");
+        bencoder_binary (&enc, token, token_len);
+    }
+    bencoder_end (&enc);
+    bencoder_key (&enc, "q");
+    bencoder_string (&enc, dht_query_names[type]);
+    bencoder_key (&enc, "t");
+    bencoder_binary (&enc, &query->tid, 4);
+    bencoder_key (&enc, "y");
+    bencoder_string (&enc, "q");
+    bencoder_end (&enc);
+
+    tbfs_dht_send (dht, endpoint, &enc);
+
+    tv.tv_sec = dht->query_timeout_sec;
+    tv.tv_usec = 0;
+    evtimer_add (query->ev_timeout, &tv);
+
+    return TRUE;
+}
+
+// starts the "r" dict with our id, the caller adds the rest of its keys
+static void tbfs_dht_reply_begin (Dht *dht, BEncoder *enc, guint8 *buf, gsize buf_size)
+{
+    bencoder_init (enc, buf, buf_size);
+    bencoder_begin_dict (enc);
+    bencoder_key (enc, "r");
+    bencoder_begin_dict (enc);
+    bencoder_key (enc, "id");
+    bencoder_binary (enc, dht->id, DHT_ID_LEN);
+}
+
+static void tbfs_dht_reply_send (Dht *dht, BEncoder *enc, const PeerEndpoint *endpoint, const guint8 *tid, gsize tid_len)
+{
+    bencoder_end (enc);
+    bencoder_key (enc, "t");
+    bencoder_binary (enc, tid, tid_len);
+    bencoder_key (enc, "y");
+    bencoder_string (enc, "r");
+    bencoder_end (enc);
+
+    tbfs_dht_send (dht, endpoint, enc);
+}
+
+static void tbfs_dht_send_error (Dht *dht, const PeerEndpoint *endpoint, const guint8 *tid, gsize tid_len,
+    gint code, const gchar *msg)
+{
+    guint8 buf[128];
+    BEncoder enc;
+
+    bencoder_init (&enc, buf, sizeof (buf));
+    bencoder_begin_dict (&enc);
+    bencoder_key (&enc, "e");
+    bencoder_begin_list (&enc);
+    bencoder_int (&enc, code);
+    bencoder_string (&enc, msg);
+    bencoder_end (&enc);
+    bencoder_key (&enc, "t");
+    bencoder_binary (&enc, tid, tid_len);
+    bencoder_key (&enc, "y");
+    bencoder_string (&enc, "e");
+    bencoder_end (&enc);
+
+    tbfs_dht_send (dht, endpoint, &enc);
+}
+/*}}}*/
+
+/*{{{ searches */
+static DhtSearch *tbfs_dht_search_find (Dht *dht, const guint8 *target)
+{
+    GBytes *key;
+    DhtSearch *search;
+
+    key = g_bytes_new_static (target, DHT_ID_LEN);
+    search = g_hash_table_lookup (dht->h_searches, key);
+    g_bytes_unref (key);
+
+    return search;
+}
+
+static gint tbfs_dht_search_node_find (DhtSearch *search, const guint8 *id)
+{
+    guint i;
+
+    for (i = 0; i < search->node_count; i++)
+        if (!memcmp (search->nodes[i].id, id, DHT_ID_LEN))
+            return i;
+
+    return -1;
+}
+
+// keeps nodes ordered by distance, the farthest one is dropped if there is no room
+static void tbfs_dht_search_add_node (DhtSearch *search, const guint8 *id, const PeerEndpoint *endpoint)
+{
+    const guint8 *target = g_bytes_get_data (search->target, NULL);
+    DhtSearchNode *snode;
+    guint pos;
+
+    if (!endpoint->port || !memcmp (id, search->dht->id, DHT_ID_LEN) || tbfs_dht_search_node_find (search, id) >= 0)
+        return;
+
+    for (pos = 0; pos < search->node_count && dht_distance_cmp (target, search->nodes[pos].id, id) < 0; pos++);
+    if (pos >= DHT_SEARCH_NODES)
+        return;
+
+    if (search->node_count == DHT_SEARCH_NODES)
+        search->node_count--;
+    memmove (&search->nodes[pos + 1], &search->nodes[pos], (search->node_count - pos) * sizeof (DhtSearchNode));
+    search->node_count++;
+
+    snode = &search->nodes[pos];
+    memset (snode, 0, sizeof (DhtSearchNode));
+    memcpy (snode->id, id, DHT_ID_LEN);
+    snode->endpoint = *endpoint;
+}
+
+static DhtSearch *tbfs_dht_search_create (Dht *dht, DhtQueryType type, const guint8 *target)
+{
+    DhtSearch *search;
+
+    search = g_new0 (DhtSearch, 1);
+    search->dht = dht;
+    search->type = type;
+    search->target = g_bytes_new (target, DHT_ID_LEN);
+    sha1_to_hexstr (search->s_info_hash, target);
+
+    g_hash_table_insert (dht->h_searches, search->target, search);
+
+    return search;
+}
+
+static void tbfs_dht_search_destroy (DhtSearch *search)
+{
+    g_bytes_unref (search->target);
+    g_free (search);
+}
+
+static void tbfs_dht_search_start_pending (Dht *dht);
+
+// announces to the closest nodes which gave us a token
+static void tbfs_dht_search_done (DhtSearch *search)
+{
+    Dht *dht = search->dht;
+    guint i, announced = 0;
+
+    if (search->type == DQ_GetPeers && search->announce) {
+        for (i = 0; i < search->node_count && announced < DHT_K; i++) {
+            DhtSearchNode *snode = &search->nodes[i];
+
+            if (snode->state != DSN_Replied || !snode->token_len)
+                continue;
+
+            tbfs_dht_query_send (dht, DQ_AnnouncePeer, &snode->endpoint, snode->id,
+                g_bytes_get_data (search->target, NULL), snode->token, snode->token_len, NULL);
+            announced++;
+        }
+    }
+
+    if (search->type == DQ_GetPeers)
+        LOG_debug (DHT_LOG, "[t: %s] DHT lookup is done, peers found: %u, announced to %u nodes",
+            search->s_info_hash, search->peers_found, announced);
+    else
+        LOG_debug (DHT_LOG, "DHT node lookup is done, routing table has %u nodes", dht->node_count);
+
+    g_hash_table_remove (dht->h_searches, search->target);
+
+    tbfs_dht_search_start_pending (dht);
+}
+
+// queries up to DHT_ALPHA not yet queried nodes,
+// lookup is over when the DHT_K closest known nodes have replied or nobody is left to ask
+static void tbfs_dht_search_step (DhtSearch *search)
+{
+    guint i, replied = 0;
+
+    for (i = 0; i < search->node_count && replied < DHT_K && search->inflight < DHT_ALPHA; i++) {
+        DhtSearchNode *snode = &search->nodes[i];
+
+        if (snode->state == DSN_Replied) {
+            replied++;
+            continue;
+        }
+        if (snode->state != DSN_New)
+            continue;
+
+        if (!tbfs_dht_query_send (search->dht, search->type, &snode->endpoint, snode->id,
+            g_bytes_get_data (search->target, NULL), NULL, 0, search))
+        {
+            snode->state = DSN_Failed;
+            continue;
+        }
+        snode->state = DSN_Queried;
+        search->inflight++;
+    }
+
+    if (!search->inflight)
+        tbfs_dht_search_done (search);
+}
+
+// lookup starts from the closest nodes of the routing table
+static void tbfs_dht_search_start (DhtSearch *search)
+{
+    DhtNode *nodes[DHT_SEARCH_NODES];
+    guint i, count;
+
+    count = tbfs_dht_closest_nodes (search->dht, g_bytes_get_data (search->target, NULL), nodes, DHT_SEARCH_NODES);
+    for (i = 0; i < count; i++)
+        tbfs_dht_search_add_node (search, nodes[i]->id, &nodes[i]->endpoint);
+
+    if (search->type == DQ_GetPeers)
+        LOG_debug (DHT_LOG, "[t: %s] Starting DHT lookup, %u nodes to ask", search->s_info_hash, search->node_count);
+
+    tbfs_dht_search_step (search);
+}
+
+// queued lookups are started while there are free slots,
+// a lookup which ends right away is not allowed to recurse into the queue
+static void tbfs_dht_search_start_pending (Dht *dht)
+{
+    if (dht->starting_pending)
+        return;
+
+    dht->starting_pending = TRUE;
+    while (!g_queue_is_empty (dht->q_pending) &&
+        g_hash_table_size (dht->h_searches) - g_queue_get_length (dht->q_pending) < DHT_MAX_SEARCHES)
+        tbfs_dht_search_start ((DhtSearch *) g_queue_pop_head (dht->q_pending));
+    dht->starting_pending = FALSE;
+}
+
+static void tbfs_dht_search_query_done (DhtSearch *search, const guint8 *id, DhtSearchNodeState state)
+{
+    gint idx = id ? tbfs_dht_search_node_find (search, id) : -1;
+
+    if (idx >= 0 && search->nodes[idx].state == DSN_Queried)
+        search->nodes[idx].state = state;
+
+    search->inflight--;
+    tbfs_dht_search_step (search);
+}
+
+static void tbfs_dht_on_value_cb (const guint8 *str, gsize len, gpointer data)
+{
+    GArray *a_peers = (GArray *) data;
+    PeerEndpoint endpoint;
+
+    if (len != 6)
+        return;
+
+    memcpy (&endpoint.addr, str, 4);
+    memcpy (&endpoint.port, str + 4, 2);
+    if (endpoint.port)
+        g_array_append_val (a_peers, endpoint);
+}
+
+static void tbfs_dht_search_on_reply (DhtSearch *search, const guint8 *id, const guint8 *r, gsize r_len)
+{
+    const guint8 *nodes;
+    const guint8 *token;
+    const guint8 *values;
+    gsize nodes_len, token_len, values_len, i;
+    gint idx;
+
+    nodes = bvalue_raw_dict_get_string (r, r_len, "nodes", &nodes_len);
+    if (nodes && nodes_len % DHT_NODE_COMPACT_LEN == 0) {
+        for (i = 0; i < nodes_len; i += DHT_NODE_COMPACT_LEN) {
+            PeerEndpoint endpoint;
+
+            memcpy (&endpoint.addr, nodes + i + DHT_ID_LEN, 4);
+            memcpy (&endpoint.port, nodes + i + DHT_ID_LEN + 4, 2);
+            tbfs_dht_search_add_node (search, nodes + i, &endpoint);
+        }
+    }
+
+    idx = tbfs_dht_search_node_find (search, id);
+    token = bvalue_raw_dict_get_string (r, r_len, "token", &token_len);
+    if (idx >= 0 && token && token_len <= DHT_MAX_TOKEN_LEN) {
+        memcpy (search->nodes[idx].token, token, token_len);
+        search->nodes[idx].token_len = token_len;
+    }
+
+    values = bvalue_raw_dict_get_value (r, r_len, "values", &values_len);
+    if (search->type == DQ_GetPeers && values) {
+        GArray *a_peers = g_array_new (FALSE, FALSE, sizeof (PeerEndpoint));
+
+        bvalue_raw_list_foreach_string (values, values_len, tbfs_dht_on_value_cb, a_peers);
+        if (a_peers->len && search->on_peers_cb) {
+            search->peers_found += a_peers->len;
+            search->on_peers_cb (search->s_info_hash, (const PeerEndpoint *) a_peers->data, a_peers->len, search->ctx);
+        }
+        g_array_free (a_peers, TRUE);
+    }
+
+    tbfs_dht_search_query_done (search, id, DSN_Replied);
+}
+
+// lookup of our own id fills the routing table, bootstrap nodes are asked if it is almost empty
+static void tbfs_dht_bootstrap (Dht *dht)
+{
+    DhtSearch *search;
+    guint i;
+
+    search = tbfs_dht_search_find (dht, dht->id);
+    if (search && search->inflight)
+        return;
+    if (!search)
+        search = tbfs_dht_search_create (dht, DQ_FindNode, dht->id);
+
+    if (dht->node_count < DHT_K) {
+        for (i = 0; i < dht->a_bootstrap->len; i++) {
+            if (tbfs_dht_query_send (dht, DQ_FindNode, &g_array_index (dht->a_bootstrap, PeerEndpoint, i), NULL,
+                dht->id, NULL, 0, search))
+                search->inflight++;
+        }
+    }
+
+    tbfs_dht_search_start (search);
+}
+
+// peers are reported through on_peers_cb as replies arrive, we are announced at the end if asked
+void tbfs_dht_get_peers (Dht *dht, const gchar *info_hash, gboolean announce, Dht_on_peers_cb on_peers_cb, gpointer ctx)
+{
+    DhtSearch *search;
+    guint8 target[DHT_ID_LEN];
+
+    hexstr_to_sha1 (target, info_hash);
+
+    if (tbfs_dht_search_find (dht, target)) {
+        LOG_debug (DHT_LOG, "[t: %s] DHT lookup is already running", info_hash);
+        return;
+    }
+
+    search = tbfs_dht_search_create (dht, DQ_GetPeers, target);
+    search->announce = announce;
+    search->on_peers_cb = on_peers_cb;
+    search->ctx = ctx;
+
+    g_queue_push_tail (dht->q_pending, search);
+    tbfs_dht_search_start_pending (dht);
+}
+/*}}}*/
+
+/*{{{ incoming */
+static gboolean dht_str_equal (const guint8 *s, gsize len, const gchar *str)
+{
+    return s && len == strlen (str) && !memcmp (s, str, len);
+}
+
+static void tbfs_dht_storage_add (Dht *dht, const guint8 *info_hash, const PeerEndpoint *endpoint)
+{
+    GBytes *key;
+    GArray *a_peers;
+    DhtStoredPeer peer;
+    guint i, oldest = 0;
+
+    key = g_bytes_new (info_hash, DHT_ID_LEN);
+    a_peers = g_hash_table_lookup (dht->h_storage, key);
+    if (!a_peers) {
+        a_peers = g_array_new (FALSE, FALSE, sizeof (DhtStoredPeer));
+        g_hash_table_insert (dht->h_storage, key, a_peers);
+    } else {
+        g_bytes_unref (key);
+    }
+
+    for (i = 0; i < a_peers->len; i++) {
+        DhtStoredPeer *stored = &g_array_index (a_peers, DhtStoredPeer, i);
+
+        if (tbfs_peer_endpoint_equal (&stored->endpoint, endpoint)) {
+            stored->announced = time (NULL);
+            return;
+        }
+        if (stored->announced < g_array_index (a_peers, DhtStoredPeer, oldest).announced)
+            oldest = i;
+    }
+
+    if (a_peers->len >= DHT_MAX_STORED_PEERS)
+        g_array_remove_index_fast (a_peers, oldest);
+
+    peer.endpoint = *endpoint;
+    peer.announced = time (NULL);
+    g_array_append_val (a_peers, peer);
+}
+
+// "r" keys after "id": nodes, token, values
+static void tbfs_dht_on_get_peers (Dht *dht, const PeerEndpoint *endpoint, const guint8 *info_hash, BEncoder *enc)
+{
+    guint8 nodes[DHT_K * DHT_NODE_COMPACT_LEN];
+    guint8 token[DHT_TOKEN_LEN];
+    GBytes *key;
+    GArray *a_peers;
+    guint i;
+
+    bencoder_key (enc, "nodes");
+    bencoder_binary (enc, nodes, tbfs_dht_compact_nodes (dht, info_hash, nodes));
+
+    tbfs_dht_make_token (dht->secret, endpoint->addr, token);
+    bencoder_key (enc, "token");
+    bencoder_binary (enc, token, DHT_TOKEN_LEN);
+
+    key = g_bytes_new_static (info_hash, DHT_ID_LEN);
+    a_peers = g_hash_table_lookup (dht->h_storage, key);
+    g_bytes_unref (key);
+
+    if (a_peers && a_peers->len) {
+        bencoder_key (enc, "values");
+        bencoder_begin_list (enc);
+        for (i = 0; i < MIN (a_peers->len, DHT_MAX_VALUES); i++) {
+            DhtStoredPeer *stored = &g_array_index (a_peers, DhtStoredPeer, i);
+
+            bencoder_string_begin (enc, 6);
+            bencoder_append (enc, &stored->endpoint.addr, 4);
+            bencoder_append (enc, &stored->endpoint.port, 2);
+        }
+        bencoder_end (enc);
+    }
+}
+
+static void tbfs_dht_on_query (Dht *dht, const PeerEndpoint *endpoint, const guint8 *msg, gsize msg_len,
+    const guint8 *tid, gsize tid_len)
+{
+    const guint8 *q;
+    const guint8 *a;
+    const guint8 *id;
+    const guint8 *target;
+    gsize q_len, a_len, id_len, target_len;
+    guint8 buf[DHT_MAX_PKT];
+    BEncoder enc;
+
+    q = bvalue_raw_dict_get_string (msg, msg_len, "q", &q_len);
+    a = bvalue_raw_dict_get_value (msg, msg_len, "a", &a_len);
+    id = a ? bvalue_raw_dict_get_string (a, a_len, "id", &id_len) : NULL;
+    if (!q || !id || id_len != DHT_ID_LEN) {
+        tbfs_dht_send_error (dht, endpoint, tid, tid_len, 203, "Protocol Error");
+        return;
+    }
+
+    tbfs_dht_node_seen (dht, id, endpoint);
+
+    if (dht_str_equal (q, q_len, "ping")) {
+        tbfs_dht_reply_begin (dht, &enc, buf, sizeof (buf));
+        tbfs_dht_reply_send (dht, &enc, endpoint, tid, tid_len);
+        return;
+    }
+
+    if (dht_str_equal (q, q_len, "find_node"))
+        target = bvalue_raw_dict_get_string (a, a_len, "target", &target_len);
+    else if (dht_str_equal (q, q_len, "get_peers") || dht_str_equal (q, q_len, "announce_peer"))
+        target = bvalue_raw_dict_get_string (a, a_len, "info_hash", &target_len);
+    else {
+        tbfs_dht_send_error (dht, endpoint, tid, tid_len, 204, "Method Unknown");
+        return;
+    }
+
+    if (!target || target_len != DHT_ID_LEN) {
+        tbfs_dht_send_error (dht, endpoint, tid, tid_len, 203, "Protocol Error");
+        return;
+    }
+
+    tbfs_dht_reply_begin (dht, &enc, buf, sizeof (buf));
+
+    if (dht_str_equal (q, q_len, "find_node")) {
+        guint8 nodes[DHT_K * DHT_NODE_COMPACT_LEN];
+
+        bencoder_key (&enc, "nodes");
+        bencoder_binary (&enc, nodes, tbfs_dht_compact_nodes (dht, target, nodes));
+
+    } else if (dht_str_equal (q, q_len, "get_peers")) {
+        tbfs_dht_on_get_peers (dht, endpoint, target, &enc);
+
+    } else {
+        const guint8 *token;
+        gsize token_len;
+        gint64 port = 0;
+        gint64 implied_port = 0;
+        PeerEndpoint peer;
+
+        token = bvalue_raw_dict_get_string (a, a_len, "token", &token_len);
+        if (!token || !tbfs_dht_token_valid (dht, endpoint->addr, token, token_len)) {
+            tbfs_dht_send_error (dht, endpoint, tid, tid_len, 203, "Bad Token");
+            return;
+        }
+
+        bvalue_raw_dict_get_int (a, a_len, "implied_port", &implied_port);
+        bvalue_raw_dict_get_int (a, a_len, "port", &port);
+
+        peer.addr = endpoint->addr;
+        peer.port = implied_port ? endpoint->port : htons ((guint16) port);
+        if (peer.port)
+            tbfs_dht_storage_add (dht, target, &peer);
+    }
+
+    tbfs_dht_reply_send (dht, &enc, endpoint, tid, tid_len);
+}
+
+// reply or error to one of our queries
+static void tbfs_dht_on_response (Dht *dht, const PeerEndpoint *endpoint, const guint8 *msg, gsize msg_len,
+    const guint8 *tid, gsize tid_len, gboolean is_error)
+{
+    DhtQuery *query;
+    guint32 id_tid;
+    const guint8 *r;
+    const guint8 *id = NULL;
+    gsize r_len, id_len;
+
+    if (tid_len != 4)
+        return;
+    memcpy (&id_tid, tid, 4);
+
+    query = g_hash_table_lookup (dht->h_queries, GUINT_TO_POINTER (id_tid));
+    if (!query || !tbfs_peer_endpoint_equal (&query->endpoint, endpoint))
+        return;
+    g_hash_table_remove (dht->h_queries, GUINT_TO_POINTER (id_tid));
+
+    r = is_error ? NULL : bvalue_raw_dict_get_value (msg, msg_len, "r", &r_len);
+    if (r)
+        id = bvalue_raw_dict_get_string (r, r_len, "id", &id_len);
+
+    if (!id || id_len != DHT_ID_LEN) {
+        LOG_debug (DHT_LOG, "DHT %s query failed: %s", dht_query_names[query->type], is_error ? "error reply" : "invalid reply");
+        if (query->search)
+            tbfs_dht_search_query_done (query->search, query->has_node_id ? query->node_id : NULL, DSN_Failed);
+        tbfs_dht_query_destroy (query);
+        return;
+    }
+
+    tbfs_dht_node_seen (dht, id, endpoint);
+
+    if (query->search)
+        tbfs_dht_search_on_reply (query->search, id, r, r_len);
+
+    tbfs_dht_query_destroy (query);
+}
+
+static void tbfs_dht_on_read_cb (evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    Dht *dht = (Dht *) arg;
+    guint8 msg[DHT_MAX_PKT];
+    struct sockaddr_in sin;
+    socklen_t sin_len;
+    gssize len;
+
+    for (;;) {
+        const guint8 *y;
+        const guint8 *tid;
+        gsize y_len, tid_len;
+        PeerEndpoint endpoint;
+
+        sin_len = sizeof (sin);
+        len = recvfrom (fd, msg, sizeof (msg), 0, (struct sockaddr *) &sin, &sin_len);
+        if (len <= 0)
+            break;
+
+        endpoint.addr = sin.sin_addr.s_addr;
+        endpoint.port = sin.sin_port;
+
+        y = bvalue_raw_dict_get_string (msg, len, "y", &y_len);
+        tid = bvalue_raw_dict_get_string (msg, len, "t", &tid_len);
+        if (!y || y_len != 1 || !tid)
+            continue;
+
+        if (*y == 'q')
+            tbfs_dht_on_query (dht, &endpoint, msg, len, tid, tid_len);
+        else if (*y == 'r' || *y == 'e')
+            tbfs_dht_on_response (dht, &endpoint, msg, len, tid, tid_len, *y == 'e');
+    }
+}
+
+static void tbfs_dht_on_query_timeout_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    DhtQuery *query = (DhtQuery *) arg;
+    Dht *dht = query->dht;
+
+    g_hash_table_remove (dht->h_queries, GUINT_TO_POINTER (query->tid));
+
+    if (query->has_node_id)
+        tbfs_dht_node_failed (dht, query->node_id);
+    if (query->search)
+        tbfs_dht_search_query_done (query->search, query->has_node_id ? query->node_id : NULL, DSN_Failed);
+
+    tbfs_dht_query_destroy (query);
+}
+/*}}}*/
+
+/*{{{ maintenance */
+static gboolean tbfs_dht_storage_expire (G_GNUC_UNUSED gpointer key, gpointer value, gpointer data)
+{
+    GArray *a_peers = (GArray *) value;
+    time_t now = *(time_t *) data;
+    guint i;
+
+    for (i = a_peers->len; i > 0; i--)
+        if (now - g_array_index (a_peers, DhtStoredPeer, i - 1).announced > DHT_PEER_TTL_SEC)
+            g_array_remove_index_fast (a_peers, i - 1);
+
+    return a_peers->len == 0;
+}
+
+static void tbfs_dht_on_timer_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    Dht *dht = (Dht *) arg;
+    time_t now = time (NULL);
+    guint i;
+
+    if (now - dht->secret_time >= DHT_TOKEN_ROTATE_SEC) {
+        memcpy (dht->prev_secret, dht->secret, DHT_TOKEN_LEN);
+        for (i = 0; i < DHT_TOKEN_LEN; i++)
+            dht->secret[i] = g_random_int_range (0, 256);
+        dht->secret_time = now;
+    }
+
+    g_hash_table_foreach_remove (dht->h_storage, tbfs_dht_storage_expire, &now);
+
+    // the least recently seen node of every bucket is checked
+    for (i = 0; i < DHT_BUCKETS; i++) {
+        DhtNode *node = (DhtNode *) g_queue_peek_head (dht->buckets[i]);
+
+        if (node && now - node->last_seen > DHT_NODE_STALE_SEC)
+            tbfs_dht_query_send (dht, DQ_Ping, &node->endpoint, node->id, NULL, NULL, 0, NULL);
+    }
+
+    if (dht->node_count < DHT_K)
+        tbfs_dht_bootstrap (dht);
+
+    if (dht->node_count && now - dht->last_saved >= DHT_SAVE_SEC)
+        tbfs_dht_save (dht);
+}
+/*}}}*/
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "tbfs_dns_cache.h"
+
+/*{{{ struct */
+// A records of tracker hosts, resolved asynchronously and refreshed before their TTL expires,
+// so (re)connects never wait for DNS once a host is known
+#define DNS_CACHE_CHECK_SEC 5
+#define DNS_CACHE_REFRESH_AHEAD_SEC 10
+
+struct _DnsCache {
+    Application *app;
+
+    GHashTable *h_entries; // host -> DnsEntry
+    struct event *ev_timer;
+
+    gint32 min_ttl_sec;
+    gint32 max_ttl_sec;
+    gint32 retry_sec; // delay after a failed resolve, old addresses are still used
+    gint32 idle_sec; // entries unused for so long are not refreshed and dropped once expired
+};
+
+typedef struct {
+    DnsCache *cache;
+    gchar *host;
+
+    GArray *a_addrs; // guint32, network byte order
+    guint next; // round robin among a_addrs
+    time_t expires;
+    time_t last_used;
+    struct evdns_request *req; // resolve in flight
+} DnsEntry;
+
+#define DNS_LOG "dns"
+
+static void tbfs_dns_cache_on_timer_cb (evutil_socket_t fd, short events, void *arg);
+static void tbfs_dns_cache_entry_destroy (DnsEntry *entry);
+/*}}}*/
+
+/*{{{ create / destroy */
+DnsCache *tbfs_dns_cache_create (Application *app)
+{
+    DnsCache *cache;
+    ConfData *conf = application_get_conf (app);
+    struct timeval tv;
+
+    cache = g_new0 (DnsCache, 1);
+    cache->app = app;
+    cache->h_entries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) tbfs_dns_cache_entry_destroy);
+    cache->min_ttl_sec = MAX (1, conf_get_int (conf, "dns.min_ttl_sec"));
+    cache->max_ttl_sec = MAX (cache->min_ttl_sec, conf_get_int (conf, "dns.max_ttl_sec"));
+    cache->retry_sec = MAX (1, conf_get_int (conf, "dns.retry_sec"));
+    cache->idle_sec = conf_get_int (conf, "dns.idle_sec");
+
+    cache->ev_timer = event_new (application_get_evbase (app), -1, EV_PERSIST, tbfs_dns_cache_on_timer_cb, cache);
+    tv.tv_sec = DNS_CACHE_CHECK_SEC;
+    tv.tv_usec = 0;
+    event_add (cache->ev_timer, &tv);
+
+    return cache;
+}
+
+void tbfs_dns_cache_destroy (DnsCache *cache)
+{
+    event_free (cache->ev_timer);
+    g_hash_table_destroy (cache->h_entries);
+    g_free (cache);
+}
+
+static void tbfs_dns_cache_entry_destroy (DnsEntry *entry)
+{
+    // callback is called with DNS_ERR_CANCEL and doesn't touch the entry
+    if (entry->req)
+        evdns_cancel_request (application_get_dnsbase (entry->cache->app), entry->req);
+    g_array_free (entry->a_addrs, TRUE);
+    g_free (entry->host);
+    g_free (entry);
+}
+/*}}}*/
+
+/*{{{ resolve */
+static void tbfs_dns_cache_on_resolved_cb (int result, char type, int count, int ttl, void *addresses, void *arg)
+{
+    DnsEntry *entry = (DnsEntry *) arg;
+    DnsCache *cache;
+    time_t now;
+
+    if (result == DNS_ERR_CANCEL)
+        return;
+
+    cache = entry->cache;
+    entry->req = NULL;
+    now = time (NULL);
+
+    if (result != DNS_ERR_NONE || type != DNS_IPv4_A || count <= 0) {
+        LOG_err (DNS_LOG, "Failed to resolve %s: %s, %u cached addresses are kept", entry->host,
+            evdns_err_to_string (result), entry->a_addrs->len);
+        entry->expires = now + cache->retry_sec;
+        return;
+    }
+
+    g_array_set_size (entry->a_addrs, 0);
+    g_array_append_vals (entry->a_addrs, addresses, count);
+    entry->next = g_random_int_range (0, count);
+    entry->expires = now + CLAMP (ttl, cache->min_ttl_sec, cache->max_ttl_sec);
+
+    LOG_debug (DNS_LOG, "Resolved %s: %d addresses, TTL: %d sec", entry->host, count, ttl);
+}
+
+static void tbfs_dns_cache_entry_resolve (DnsEntry *entry)
+{
+    if (entry->req)
+        return;
+
+    entry->req = evdns_base_resolve_ipv4 (application_get_dnsbase (entry->cache->app), entry->host, 0,
+        tbfs_dns_cache_on_resolved_cb, entry);
+    if (!entry->req) {
+        LOG_err (DNS_LOG, "Failed to start resolving %s !", entry->host);
+        entry->expires = time (NULL) + entry->cache->retry_sec;
+    }
+}
+
+static DnsEntry *tbfs_dns_cache_entry_get (DnsCache *cache, const gchar *host)
+{
+    DnsEntry *entry;
+
+    entry = g_hash_table_lookup (cache->h_entries, host);
+    if (!entry) {
+        entry = g_new0 (DnsEntry, 1);
+        entry->cache = cache;
+        entry->host = g_strdup (host);
+        entry->a_addrs = g_array_new (FALSE, FALSE, sizeof (guint32));
+        // key points into the DnsEntry
+        g_hash_table_insert (cache->h_entries, entry->host, entry);
+        tbfs_dns_cache_entry_resolve (entry);
+    }
+    entry->last_used = time (NULL);
+
+    return entry;
+}
+
+// returns the next cached address of host, FALSE if it is not resolved yet (resolving is started then)
+// IP address literals are returned as is
+gboolean tbfs_dns_cache_lookup (DnsCache *cache, const gchar *host, guint32 *addr)
+{
+    DnsEntry *entry;
+    struct in_addr in;
+
+    if (inet_pton (AF_INET, host, &in) == 1) {
+        *addr = in.s_addr;
+        return TRUE;
+    }
+
+    entry = tbfs_dns_cache_entry_get (cache, host);
+    if (!entry->a_addrs->len)
+        return FALSE;
+
+    *addr = g_array_index (entry->a_addrs, guint32, entry->next % entry->a_addrs->len);
+    entry->next++;
+
+    return TRUE;
+}
+
+// TRUE if addr is still one of the host's addresses
+gboolean tbfs_dns_cache_contains (DnsCache *cache, const gchar *host, guint32 addr)
+{
+    DnsEntry *entry;
+    struct in_addr in;
+    guint i;
+
+    if (inet_pton (AF_INET, host, &in) == 1)
+        return in.s_addr == addr;
+
+    entry = g_hash_table_lookup (cache->h_entries, host);
+    if (!entry)
+        return FALSE;
+
+    for (i = 0; i < entry->a_addrs->len; i++)
+        if (g_array_index (entry->a_addrs, guint32, i) == addr)
+            return TRUE;
+
+    return FALSE;
+}
+/*}}}*/
+
+/*{{{ refresh */
+// used entries are refreshed shortly before they expire, idle ones are dropped
+static gboolean tbfs_dns_cache_entry_check (G_GNUC_UNUSED gpointer key, gpointer value, gpointer data)
+{
+    DnsEntry *entry = (DnsEntry *) value;
+    time_t now = *(time_t *) data;
+
+    if (now < entry->expires - DNS_CACHE_REFRESH_AHEAD_SEC)
+        return FALSE;
+
+    if (entry->cache->idle_sec > 0 && now - entry->last_used > entry->cache->idle_sec)
+        return now >= entry->expires;
+
+    tbfs_dns_cache_entry_resolve (entry);
+
+    return FALSE;
+}
+
+static void tbfs_dns_cache_on_timer_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    DnsCache *cache = (DnsCache *) arg;
+    time_t now = time (NULL);
+
+    g_hash_table_foreach_remove (cache->h_entries, tbfs_dns_cache_entry_check, &now);
+}
+/*}}}*/
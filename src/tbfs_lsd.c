@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "tbfs_lsd.h"
+#include "tbfs_mng.h"
+
+/*{{{ struct */
+// BEP 14: Local Service Discovery, announces are multicast to the local segment:
+//   BT-SEARCH * HTTP/1.1\r\nHost: ..\r\nPort: ..\r\nInfohash: ..\r\n[Infohash: ..\r\n]cookie: ..\r\n\r\n\r\n
+#define LSD_GROUP "239.192.152.143"
+#define LSD_PORT 6771
+#define LSD_MAX_PKT 1400
+#define LSD_MAX_HASHES 20 // info_hashes per datagram, keeps it under LSD_MAX_PKT
+#define LSD_COOKIE_LEN 8
+
+struct _Lsd {
+    Application *app;
+
+    evutil_socket_t fd;
+    struct sockaddr_in group;
+    struct event *ev_read;
+    struct event *ev_timer;
+
+    GQueue *q_pending; // LsdTorrent waiting to be sent
+    GList *l_last_new; // new torrents are queued in order up to here, ahead of the rest
+    GHashTable *h_torrents; // info_hash -> LsdTorrent, pending or announced within interval_sec
+    time_t last_expired;
+
+    gchar cookie[LSD_COOKIE_LEN * 2 + 1]; // our own announces are ignored
+    guint16 peer_port;
+    gint32 interval_sec; // per torrent announce interval
+    gint32 reply_sec; // a torrent is re-announced when somebody else announces it
+    guint32 max_datagrams; // per second
+};
+
+typedef struct {
+    gchar info_hash[SHA_DIGEST_LENGTH * 2 + 1];
+    time_t announced;
+    gboolean pending;
+} LsdTorrent;
+
+#define LSD_LOG "lsd"
+
+static void tbfs_lsd_on_read_cb (evutil_socket_t fd, short events, void *arg);
+static void tbfs_lsd_on_timer_cb (evutil_socket_t fd, short events, void *arg);
+/*}}}*/
+
+/*{{{ create / destroy */
+Lsd *tbfs_lsd_create (Application *app)
+{
+    Lsd *lsd;
+    ConfData *conf = application_get_conf (app);
+    struct sockaddr_in sin;
+    struct ip_mreq mreq;
+    struct timeval tv;
+    guchar ttl, loop = 1;
+    int on = 1;
+    guint i;
+
+    lsd = g_new0 (Lsd, 1);
+    lsd->app = app;
+    lsd->fd = -1;
+    lsd->q_pending = g_queue_new ();
+    lsd->h_torrents = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+    lsd->last_expired = time (NULL);
+    lsd->peer_port = conf_get_int (conf, "peer_server.port");
+    lsd->interval_sec = MAX (1, conf_get_int (conf, "lsd.interval_sec"));
+    lsd->reply_sec = conf_get_int (conf, "lsd.reply_sec");
+    lsd->max_datagrams = MAX (1, conf_get_int (conf, "lsd.max_datagrams_sec"));
+    for (i = 0; i < LSD_COOKIE_LEN; i++)
+        g_snprintf (lsd->cookie + i * 2, 3, "%02x", g_random_int_range (0, 256));
+
+    memset (&lsd->group, 0, sizeof (lsd->group));
+    lsd->group.sin_family = AF_INET;
+    lsd->group.sin_port = htons (LSD_PORT);
+    inet_pton (AF_INET, LSD_GROUP, &lsd->group.sin_addr);
+
+    lsd->fd = socket (AF_INET, SOCK_DGRAM, 0);
+    if (lsd->fd < 0) {
+        LOG_err (LSD_LOG, "Failed to create UDP socket: %s", strerror (errno));
+        tbfs_lsd_destroy (lsd);
+        return NULL;
+    }
+    evutil_make_socket_nonblocking (lsd->fd);
+
+    // every node on the host listens on the same port
+    setsockopt (lsd->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+#ifdef SO_REUSEPORT
+    setsockopt (lsd->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on));
+#endif
+
+    memset (&sin, 0, sizeof (sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons (LSD_PORT);
+    sin.sin_addr.s_addr = htonl (INADDR_ANY);
+    if (bind (lsd->fd, (struct sockaddr *) &sin, sizeof (sin)) < 0) {
+        LOG_err (LSD_LOG, "Failed to bind LSD socket: %s", strerror (errno));
+        tbfs_lsd_destroy (lsd);
+        return NULL;
+    }
+
+    mreq.imr_multiaddr = lsd->group.sin_addr;
+    mreq.imr_interface.s_addr = htonl (INADDR_ANY);
+    if (setsockopt (lsd->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof (mreq)) < 0) {
+        LOG_err (LSD_LOG, "Failed to join multicast group %s: %s", LSD_GROUP, strerror (errno));
+        tbfs_lsd_destroy (lsd);
+        return NULL;
+    }
+
+    // announces must not leave the segment, nodes on the same host must see each other
+    ttl = MAX (1, conf_get_int (conf, "lsd.ttl"));
+    setsockopt (lsd->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof (ttl));
+    setsockopt (lsd->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof (loop));
+
+    lsd->ev_read = event_new (application_get_evbase (app), lsd->fd, EV_READ | EV_PERSIST, tbfs_lsd_on_read_cb, lsd);
+    event_add (lsd->ev_read, NULL);
+
+    lsd->ev_timer = event_new (application_get_evbase (app), -1, EV_PERSIST, tbfs_lsd_on_timer_cb, lsd);
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    event_add (lsd->ev_timer, &tv);
+
+    LOG_msg (LSD_LOG, "Local Service Discovery is using %s:%d", LSD_GROUP, LSD_PORT);
+
+    return lsd;
+}
+
+void tbfs_lsd_destroy (Lsd *lsd)
+{
+    if (lsd->ev_timer)
+        event_free (lsd->ev_timer);
+    if (lsd->ev_read)
+        event_free (lsd->ev_read);
+    if (lsd->fd >= 0)
+        evutil_closesocket (lsd->fd);
+    // queued torrents are owned by h_torrents
+    g_queue_free (lsd->q_pending);
+    g_hash_table_destroy (lsd->h_torrents);
+    g_free (lsd);
+}
+/*}}}*/
+
+/*{{{ announce */
+// queues info_hash unless it's already pending or was announced less than min_sec ago,
+// new torrents go ahead of the periodic announces
+static void tbfs_lsd_queue (Lsd *lsd, const gchar *info_hash, gint32 min_sec, gboolean first)
+{
+    LsdTorrent *ltorrent;
+
+    ltorrent = g_hash_table_lookup (lsd->h_torrents, info_hash);
+    if (!ltorrent) {
+        ltorrent = g_new0 (LsdTorrent, 1);
+        g_strlcpy (ltorrent->info_hash, info_hash, sizeof (ltorrent->info_hash));
+        // key points into the LsdTorrent
+        g_hash_table_insert (lsd->h_torrents, ltorrent->info_hash, ltorrent);
+    } else if (ltorrent->pending || time (NULL) - ltorrent->announced < min_sec) {
+        return;
+    }
+
+    ltorrent->pending = TRUE;
+    if (!first) {
+        g_queue_push_tail (lsd->q_pending, ltorrent);
+    } else if (lsd->l_last_new) {
+        g_queue_insert_after (lsd->q_pending, lsd->l_last_new, ltorrent);
+        lsd->l_last_new = g_list_next (lsd->l_last_new);
+    } else {
+        g_queue_push_head (lsd->q_pending, ltorrent);
+        lsd->l_last_new = lsd->q_pending->head;
+    }
+}
+
+// announces are batched and sent by the timer, at most once per interval_sec per torrent
+void tbfs_lsd_announce (Lsd *lsd, const gchar *info_hash)
+{
+    tbfs_lsd_queue (lsd, info_hash, lsd->interval_sec, FALSE);
+}
+
+// just added torrent, sent with the next datagram
+void tbfs_lsd_announce_new (Lsd *lsd, const gchar *info_hash)
+{
+    tbfs_lsd_queue (lsd, info_hash, lsd->interval_sec, TRUE);
+}
+
+static void tbfs_lsd_send_pending (Lsd *lsd)
+{
+    GString *msg;
+    time_t now = time (NULL);
+    guint i;
+
+    msg = g_string_sized_new (LSD_MAX_PKT);
+    g_string_append_printf (msg, "BT-SEARCH * HTTP/1.1\r\nHost: %s:%d\r\nPort: %u\r\n", LSD_GROUP, LSD_PORT, lsd->peer_port);
+    for (i = 0; i < LSD_MAX_HASHES && !g_queue_is_empty (lsd->q_pending); i++) {
+        LsdTorrent *ltorrent;
+
+        if (lsd->q_pending->head == lsd->l_last_new)
+            lsd->l_last_new = NULL;
+        ltorrent = g_queue_pop_head (lsd->q_pending);
+
+        g_string_append_printf (msg, "Infohash: %s\r\n", ltorrent->info_hash);
+        ltorrent->pending = FALSE;
+        ltorrent->announced = now;
+    }
+    g_string_append_printf (msg, "cookie: %s\r\n\r\n\r\n", lsd->cookie);
+
+    if (sendto (lsd->fd, msg->str, msg->len, 0, (struct sockaddr *) &lsd->group, sizeof (lsd->group)) < 0)
+        LOG_debug (LSD_LOG, "Failed to send LSD announce: %s", strerror (errno));
+    else
+        LOG_debug (LSD_LOG, "Announced %u torrents", i);
+
+    g_string_free (msg, TRUE);
+}
+
+// once interval_sec passed the entry doesn't limit anything, torrents which are
+// no longer announced (dormant or removed) don't stay in h_torrents
+static gboolean tbfs_lsd_torrent_expired (G_GNUC_UNUSED gpointer key, gpointer value, gpointer data)
+{
+    LsdTorrent *ltorrent = (LsdTorrent *) value;
+    Lsd *lsd = (Lsd *) data;
+
+    return !ltorrent->pending && lsd->last_expired - ltorrent->announced >= lsd->interval_sec;
+}
+
+static void tbfs_lsd_on_timer_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    Lsd *lsd = (Lsd *) arg;
+    time_t now = time (NULL);
+    guint i;
+
+    for (i = 0; i < lsd->max_datagrams && !g_queue_is_empty (lsd->q_pending); i++)
+        tbfs_lsd_send_pending (lsd);
+
+    if (now - lsd->last_expired >= lsd->interval_sec) {
+        lsd->last_expired = now;
+        g_hash_table_foreach_remove (lsd->h_torrents, tbfs_lsd_torrent_expired, lsd);
+    }
+}
+/*}}}*/
+
+/*{{{ receive */
+static void tbfs_lsd_on_message (Lsd *lsd, const struct sockaddr_in *sin, gchar *msg)
+{
+    TBFSMng *mng = application_get_mng (lsd->app);
+    GPtrArray *a_info_hashes;
+    PeerEndpoint endpoint;
+    gchar **lines;
+    guint port = 0;
+    gboolean own = FALSE;
+    guint i;
+
+    if (!g_str_has_prefix (msg, "BT-SEARCH * HTTP/1.1\r\n"))
+        return;
+
+    a_info_hashes = g_ptr_array_new_with_free_func (g_free);
+    lines = g_strsplit (msg, "\r\n", -1);
+    for (i = 1; lines[i] && *lines[i]; i++) {
+        gchar *value = strchr (lines[i], ':');
+
+        if (!value)
+            continue;
+        *value = '\0';
+        value = g_strstrip (value + 1);
+
+        if (!g_ascii_strcasecmp (lines[i], "Port"))
+            port = atoi (value);
+        else if (!g_ascii_strcasecmp (lines[i], "cookie"))
+            own = !strcmp (value, lsd->cookie);
+        else if (!g_ascii_strcasecmp (lines[i], "Infohash") && strlen (value) == SHA_DIGEST_LENGTH * 2)
+            g_ptr_array_add (a_info_hashes, g_ascii_strdown (value, -1));
+    }
+    g_strfreev (lines);
+
+    if (!own && port && port <= G_MAXUINT16) {
+        endpoint.addr = sin->sin_addr.s_addr;
+        endpoint.port = htons (port);
+
+        for (i = 0; i < a_info_hashes->len; i++) {
+            const gchar *info_hash = g_ptr_array_index (a_info_hashes, i);
+
+            if (!tbfs_mng_torrent_get (mng, info_hash))
+                continue;
+
+            LOG_debug (LSD_LOG, "[t: %s] Local peer %s:%u", info_hash, inet_ntoa (sin->sin_addr), port);
+            tbfs_mng_add_local_peers (mng, info_hash, &endpoint, 1);
+            // so the new node learns about us without waiting for our next announce
+            tbfs_lsd_queue (lsd, info_hash, lsd->reply_sec, FALSE);
+        }
+    }
+
+    g_ptr_array_free (a_info_hashes, TRUE);
+}
+
+static void tbfs_lsd_on_read_cb (evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    Lsd *lsd = (Lsd *) arg;
+    gchar msg[LSD_MAX_PKT + 1];
+    struct sockaddr_in sin;
+    socklen_t sin_len;
+    gssize len;
+
+    for (;;) {
+        sin_len = sizeof (sin);
+        len = recvfrom (fd, msg, LSD_MAX_PKT, 0, (struct sockaddr *) &sin, &sin_len);
+        if (len <= 0)
+            break;
+        msg[len] = '\0';
+
+        tbfs_lsd_on_message (lsd, &sin, msg);
+    }
+}
+/*}}}*/
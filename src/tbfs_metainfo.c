@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "tbfs_metainfo.h"
+#include "tbfs_bencode.h"
+
+/*{{{ struct */
+// .torrent file, only piece hashes are kept: the file is unmapped once they are copied out,
+// a mapping per torrent would hit vm.max_map_count
+struct _Metainfo {
+    GBytes *block; // arena block holding pieces
+    const guint8 *pieces; // SHA1 of every piece
+
+    guint32 piece_count;
+    gchar info_hash[2 * SHA_DIGEST_LENGTH + 1];
+};
+
+// piece tables are packed into shared blocks, a block is freed with the last Metainfo using it
+#define MI_ARENA_BLOCK_SIZE (16 * 1024 * 1024)
+#define MI_ARENA_MAX_TABLE (MI_ARENA_BLOCK_SIZE / 16) // larger tables get a block of their own
+
+// metainfo is loaded by the main thread only, blocks are released from any thread
+static struct {
+    GBytes *block;
+    guint8 *data;
+    gsize used;
+} mi_arena;
+
+#define MI_LOG "metainfo"
+/*}}}*/
+
+/*{{{ arena */
+// returns the copy, *block gets a reference to the block holding it
+static const guint8 *tbfs_metainfo_arena_copy (const guint8 *src, gsize len, GBytes **block)
+{
+    guint8 *copy;
+
+    if (len > MI_ARENA_MAX_TABLE) {
+        *block = g_bytes_new (src, len);
+        return g_bytes_get_data (*block, NULL);
+    }
+
+    if (!mi_arena.block || mi_arena.used + len > MI_ARENA_BLOCK_SIZE) {
+        if (mi_arena.block)
+            g_bytes_unref (mi_arena.block);
+        mi_arena.data = g_malloc (MI_ARENA_BLOCK_SIZE);
+        mi_arena.block = g_bytes_new_take (mi_arena.data, MI_ARENA_BLOCK_SIZE);
+        mi_arena.used = 0;
+    }
+
+    copy = mi_arena.data + mi_arena.used;
+    memcpy (copy, src, len);
+    mi_arena.used += len;
+    *block = g_bytes_ref (mi_arena.block);
+
+    return copy;
+}
+/*}}}*/
+
+/*{{{ parse */
+static gboolean tbfs_metainfo_get_int (const guint8 *buf, const BToken *tokens, guint dict, const gchar *key, gint64 *i)
+{
+    gint idx = btoken_dict_get (buf, tokens, dict, key);
+
+    return idx >= 0 && btoken_get_int (buf, &tokens[idx], i) && *i >= 0;
+}
+
+// "length" of a single file torrent or the sum of "files" lengths
+static gboolean tbfs_metainfo_get_length (const guint8 *buf, const BToken *tokens, guint info, guint64 *total)
+{
+    gint64 len;
+    gint files;
+    guint i, n;
+
+    if (tbfs_metainfo_get_int (buf, tokens, info, "length", &len)) {
+        *total = len;
+        return TRUE;
+    }
+
+    files = btoken_dict_get (buf, tokens, info, "files");
+    if (files < 0 || tokens[files].type != BT_LIST)
+        return FALSE;
+
+    *total = 0;
+    for (i = files + 1, n = 0; n < tokens[files].children; i = tokens[i].next, n++) {
+        if (!tbfs_metainfo_get_int (buf, tokens, i, "length", &len))
+            return FALSE;
+        *total += len;
+    }
+
+    return TRUE;
+}
+
+// piece hashes are copied into the arena
+static gboolean tbfs_metainfo_parse (Metainfo *mi, const guint8 *buf, const BToken *tokens)
+{
+    const guint8 *pieces;
+    gsize pieces_len;
+    gint info, idx;
+    gint64 piece_length;
+    guint64 total_length;
+    guint8 sha1[SHA_DIGEST_LENGTH];
+
+    info = btoken_dict_get (buf, tokens, 0, "info");
+    if (info < 0 || tokens[info].type != BT_DICT)
+        return FALSE;
+
+    // info_hash is taken over the original bytes, re-encoding could change them
+    SHA1 (buf + tokens[info].offset, tokens[info].length, sha1);
+    sha1_to_hexstr (mi->info_hash, sha1);
+
+    if (!tbfs_metainfo_get_int (buf, tokens, info, "piece length", &piece_length) ||
+        !piece_length || piece_length > G_MAXUINT32)
+        return FALSE;
+
+    idx = btoken_dict_get (buf, tokens, info, "pieces");
+    pieces = idx >= 0 ? btoken_get_string (buf, &tokens[idx], &pieces_len) : NULL;
+    if (!pieces || !pieces_len || pieces_len % SHA_DIGEST_LENGTH)
+        return FALSE;
+    mi->piece_count = pieces_len / SHA_DIGEST_LENGTH;
+
+    if (!tbfs_metainfo_get_length (buf, tokens, info, &total_length) ||
+        (total_length + piece_length - 1) / piece_length != mi->piece_count)
+        return FALSE;
+
+    mi->pieces = tbfs_metainfo_arena_copy (pieces, pieces_len, &mi->block);
+
+    return TRUE;
+}
+/*}}}*/
+
+/*{{{ create / destroy */
+Metainfo *tbfs_metainfo_load (const gchar *path)
+{
+    Metainfo *mi;
+    GMappedFile *mfile;
+    GError *error = NULL;
+    BParser *parser;
+    const BToken *tokens;
+    const guint8 *data;
+    gsize len;
+    guint count;
+    gboolean ok;
+
+    mfile = g_mapped_file_new (path, FALSE, &error);
+    if (!mfile) {
+        LOG_err (MI_LOG, "Failed to open %s: %s", path, error->message);
+        g_error_free (error);
+        return NULL;
+    }
+
+    data = (const guint8 *) g_mapped_file_get_contents (mfile);
+    len = g_mapped_file_get_length (mfile);
+    mi = g_new0 (Metainfo, 1);
+
+    // only the token array is allocated, the file is parsed in place
+    parser = bparser_create ();
+    if (!data || bparser_feed (parser, data, len, NULL) <= 0) {
+        LOG_err (MI_LOG, "%s is not a valid bencoded file !", path);
+        ok = FALSE;
+    } else {
+        tokens = bparser_get_tokens (parser, &count);
+        ok = tokens[0].type == BT_DICT && tbfs_metainfo_parse (mi, data, tokens);
+        if (!ok)
+            LOG_err (MI_LOG, "%s is not a valid metainfo file !", path);
+    }
+    bparser_destroy (parser);
+    g_mapped_file_unref (mfile);
+
+    if (!ok) {
+        tbfs_metainfo_destroy (mi);
+        return NULL;
+    }
+
+    LOG_debug (MI_LOG, "[t: %s] Loaded %s: %u pieces", mi->info_hash, path, mi->piece_count);
+
+    return mi;
+}
+
+void tbfs_metainfo_destroy (Metainfo *mi)
+{
+    if (mi->block)
+        g_bytes_unref (mi->block);
+    g_free (mi);
+}
+/*}}}*/
+
+/*{{{ get */
+const gchar *tbfs_metainfo_get_info_hash (Metainfo *mi)
+{
+    return mi->info_hash;
+}
+
+guint32 tbfs_metainfo_get_piece_count (Metainfo *mi)
+{
+    return mi->piece_count;
+}
+
+// SHA_DIGEST_LENGTH bytes, NULL if piece_idx is out of range
+const guint8 *tbfs_metainfo_get_piece_hash (Metainfo *mi, guint32 piece_idx)
+{
+    if (piece_idx >= mi->piece_count)
+        return NULL;
+
+    return mi->pieces + (gsize) piece_idx * SHA_DIGEST_LENGTH;
+}
+/*}}}*/
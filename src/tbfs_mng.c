@@ -16,30 +16,69 @@
  */
 #include "tbfs_mng.h"
 #include "tbfs_torrent.h"
-#include "tbfs_tracker_client.h"
+#include "tbfs_tracker_tiers.h"
+#include "tbfs_shard.h"
+#include "tbfs_dht.h"
+#include "tbfs_lsd.h"
+#include "tbfs_metainfo.h"
 
 /*{{{ struct*/
 struct _TBFSMng {
     Application *app;
 
     struct event *ev_timer;
-    time_t tracker_last_checked;
-    gboolean tracker_being_checked;
 
     GHashTable *h_torrent_data;
+    WHeap *announce_heap; // TorrentData ordered by the next announce time
+
+    // cached configuration
+    gint32 torrent_check_sec;
+    gint32 announce_jitter_sec;
+    gint32 announce_max_sec;
+    gboolean scrape;
+    gboolean batch_announce;
+    guint batch_size;
+    gint32 backoff_max_sec;
+    guint32 piece_length; // used to report "left" bytes
+    gint32 dht_search_sec;
+
+    // shutdown: "stopped" is sent for all started torrents
+    gboolean stopping;
+    guint stop_pending;
+    TBFSMng_on_stopped_cb on_stopped_cb;
+    gpointer stopped_ctx;
 };
 
+typedef enum {
+    TEF_Started = 1 << 0,
+    TEF_Completed = 1 << 1,
+    TEF_Stopped = 1 << 2,
+} TorrentEventFlags;
+
 typedef struct {
     Torrent *torrent;
 
-    time_t last_checked;
-    gboolean being_checked;
+    WHeapNode announce_node; // queued unless being checked
+    time_t last_announced;
+    gint64 swarm_size; // seeders + leechers from the last scrape, -1 if unknown
+    gint32 interval; // tracker's intervals from the last announce, 0 if unknown
+    gint32 min_interval;
+    time_t dht_searched; // last DHT lookup
+
+    guint8 being_checked;
+    guint8 announced; // got at least one successful announce
+    guint8 failures; // failed announces in a row
+    guint8 events_sent; // TorrentEventFlags, every event is sent once
+    guint8 event; // TrackerEvent of the announce in flight
+    guint8 stop_waiting; // shutdown: "stopped" is sent once "started" announce in flight is replied
+    guint8 peers_wanted; // numwant became > 0 after an announce, the next check is a full announce
 } TorrentData;
 
 #define MNG_LOG "mng"
 
 static void tbfs_mng_on_timer_cb (evutil_socket_t fd, short events, void *arg);
 static void tbfs_mng_torrent_data_destroy (TorrentData *tdata);
+static void tbfs_mng_torrent_send_stopped (TBFSMng *mng, TorrentData *tdata);
 /*}}}*/
 
 /*{{{ create / destroy */
@@ -50,12 +89,22 @@ TBFSMng *tbfs_mng_create (Application *app)
 
     mng = g_new0 (TBFSMng, 1);
     mng->app = app;
-    mng->h_torrent_data = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) tbfs_mng_torrent_data_destroy);
-
-    mng->tracker_last_checked = 0;
-    mng->tracker_being_checked = FALSE;
-
-    mng->ev_timer = evtimer_new (application_get_evbase (app), tbfs_mng_on_timer_cb, mng);
+    // keyed by the binary info_hash inside the Torrent
+    mng->h_torrent_data = g_hash_table_new_full (sha1_hash, sha1_equal, NULL, (GDestroyNotify) tbfs_mng_torrent_data_destroy);
+    mng->announce_heap = wheap_create ();
+
+    mng->torrent_check_sec = conf_get_int (application_get_conf (app), "tracker.torrent_check_sec");
+    mng->announce_jitter_sec = conf_get_int (application_get_conf (app), "tracker.announce_jitter_sec");
+    mng->announce_max_sec = conf_get_int (application_get_conf (app), "tracker.announce_max_sec");
+    mng->scrape = conf_get_boolean (application_get_conf (app), "tracker.scrape");
+    mng->batch_announce = conf_get_boolean (application_get_conf (app), "tracker.batch_announce");
+    mng->batch_size = MAX (1, conf_get_int (application_get_conf (app), "tracker.batch_size"));
+    mng->backoff_max_sec = MAX (1, conf_get_int (application_get_conf (app), "tracker.backoff_max_sec"));
+    mng->piece_length = conf_get_int (application_get_conf (app), "torrent.piece_length");
+    mng->dht_search_sec = MAX (1, conf_get_int (application_get_conf (app), "dht.search_sec"));
+    mng->stopping = FALSE;
+
+    mng->ev_timer = event_new (application_get_evbase (app), -1, EV_PERSIST, tbfs_mng_on_timer_cb, mng);
 
     // start timer
     tv.tv_sec = conf_get_int (application_get_conf (mng->app), "tracker.check_sec");
@@ -68,6 +117,7 @@ TBFSMng *tbfs_mng_create (Application *app)
 void tbfs_mng_destroy (TBFSMng *mng)
 {
     event_free (mng->ev_timer);
+    wheap_destroy (mng->announce_heap);
     g_hash_table_destroy (mng->h_torrent_data);
     g_free (mng);
 }
@@ -78,8 +128,13 @@ static TorrentData *tbfs_mng_torrent_data_create (Torrent *torrent)
 
     tdata = g_new0 (TorrentData, 1);
     tdata->torrent = torrent;
-    tdata->last_checked = 0;
+    wheap_node_init (&tdata->announce_node, tdata);
     tdata->being_checked = FALSE;
+    tdata->announced = FALSE;
+    tdata->swarm_size = -1;
+    tdata->failures = 0;
+    tdata->events_sent = 0;
+    tdata->event = TE_none;
 
     return tdata;
 }
@@ -92,11 +147,29 @@ static void tbfs_mng_torrent_data_destroy (TorrentData *tdata)
 /*}}}*/
 
 /*{{{ get / set */
+// per torrent memory used by TBFSMng
+gsize tbfs_mng_torrent_data_sizeof (void)
+{
+    return sizeof (TorrentData);
+}
+
+// info_hash is a hex string
+static TorrentData *tbfs_mng_torrent_data_lookup (TBFSMng *mng, const gchar *info_hash)
+{
+    uint8_t sha1[SHA_DIGEST_LENGTH];
+
+    if (!sha1_hexstr_is_valid (info_hash))
+        return NULL;
+
+    hexstr_to_sha1 (sha1, info_hash);
+    return g_hash_table_lookup (mng->h_torrent_data, sha1);
+}
+
 Torrent *tbfs_mng_torrent_get (TBFSMng *mng, const gchar *info_hash)
 {
     TorrentData *tdata;
 
-    tdata = g_hash_table_lookup (mng->h_torrent_data, info_hash);
+    tdata = tbfs_mng_torrent_data_lookup (mng, info_hash);
     if (tdata)
         return tdata->torrent;
     else
@@ -105,97 +178,566 @@ Torrent *tbfs_mng_torrent_get (TBFSMng *mng, const gchar *info_hash)
 /*}}}*/
 
 /*{{{ on_timer_cb */
+typedef struct {
+    Torrent *torrent;
+    gchar *peer_id;
+    GArray *a_peer_addrs; // PeerAddr
+    gboolean local;
+} TorrentPeersData;
 
-// Tracker cb function
-static void tbfs_mng_on_torrent_checked_cb (gboolean status, TBFSMng *mng, gchar *info_hash, GList *l_peer_addrs)
+static void tbfs_mng_torrent_peers_data_free (TorrentPeersData *pdata)
+{
+    g_array_free (pdata->a_peer_addrs, TRUE);
+    g_free (pdata->peer_id);
+    g_free (pdata);
+}
+
+// runs in the torrent's shard
+static void tbfs_mng_on_torrent_peers_task (TorrentPeersData *pdata)
+{
+    if (pdata->local)
+        tbfs_torrent_add_local_peer_endpoints (pdata->torrent, pdata->peer_id,
+            (const PeerEndpoint *) pdata->a_peer_addrs->data, pdata->a_peer_addrs->len);
+    else
+        tbfs_torrent_add_peer_endpoints (pdata->torrent, pdata->peer_id,
+            (const PeerEndpoint *) pdata->a_peer_addrs->data, pdata->a_peer_addrs->len);
+
+    tbfs_torrent_peers_updated (pdata->torrent);
+
+    tbfs_mng_torrent_peers_data_free (pdata);
+}
+
+// peers from trackers, DHT or LSD are passed to the shard which owns the torrent
+static void tbfs_mng_torrent_add_peers (TBFSMng *mng, TorrentData *tdata, const PeerEndpoint *endpoints, guint count,
+    gboolean local)
+{
+    TorrentPeersData *pdata;
+
+    pdata = g_new0 (TorrentPeersData, 1);
+    pdata->torrent = tdata->torrent;
+    pdata->local = local;
+    pdata->peer_id = g_strdup (conf_get_string (application_get_conf (mng->app), "peer.default_id"));
+    pdata->a_peer_addrs = g_array_sized_new (FALSE, FALSE, sizeof (PeerAddr), count);
+    g_array_append_vals (pdata->a_peer_addrs, endpoints, count);
+
+    tbfs_shard_run_full (tbfs_torrent_get_shard (tdata->torrent), (ShardTaskFunc) tbfs_mng_on_torrent_peers_task, pdata,
+        (GDestroyNotify) tbfs_mng_torrent_peers_data_free);
+}
+
+// Dht cb function
+static void tbfs_mng_on_dht_peers_cb (const gchar *info_hash, const PeerEndpoint *endpoints, guint count, TBFSMng *mng)
 {
     TorrentData *tdata;
-    GList *l;
 
-    if (!status) {
-        LOG_err (MNG_LOG, "[t: %s] Failed to check torrent !", info_hash);
+    tdata = tbfs_mng_torrent_data_lookup (mng, info_hash);
+    if (!tdata || mng->stopping)
         return;
-    }
 
-    tdata = g_hash_table_lookup (mng->h_torrent_data, info_hash);
+    LOG_debug (MNG_LOG, "[t: %s] Got %u peers from DHT", info_hash, count);
+
+    tbfs_mng_torrent_add_peers (mng, tdata, endpoints, count, FALSE);
+}
+
+// peers announced on the local segment
+void tbfs_mng_add_local_peers (TBFSMng *mng, const gchar *info_hash, const PeerEndpoint *endpoints, guint count)
+{
+    TorrentData *tdata;
+
+    tdata = tbfs_mng_torrent_data_lookup (mng, info_hash);
+    if (!tdata || mng->stopping)
+        return;
+
+    tbfs_mng_torrent_add_peers (mng, tdata, endpoints, count, TRUE);
+}
+
+// hibernated torrent which doesn't want peers, DHT and LSD leave it to the tracker
+static gboolean tbfs_mng_torrent_is_dormant (TorrentData *tdata)
+{
+    return !tbfs_torrent_get_numwant (tdata->torrent) && !tbfs_torrent_is_active (tdata->torrent);
+}
+
+// DHT lookups run next to tracker announces, but not more often than dht_search_sec
+static void tbfs_mng_torrent_dht_search (TBFSMng *mng, TorrentData *tdata, time_t now)
+{
+    Dht *dht = application_get_dht (mng->app);
+
+    if (!dht || now - tdata->dht_searched < mng->dht_search_sec || tbfs_mng_torrent_is_dormant (tdata))
+        return;
+
+    tdata->dht_searched = now;
+    tbfs_dht_get_peers (dht, tbfs_torrent_get_info_hash (tdata->torrent), TRUE,
+        (Dht_on_peers_cb) tbfs_mng_on_dht_peers_cb, mng);
+}
+
+// random delay, so torrents registered together don't announce in lockstep
+static gint64 tbfs_mng_announce_jitter (TBFSMng *mng)
+{
+    if (mng->announce_jitter_sec <= 0)
+        return 0;
+
+    return g_random_int_range (0, mng->announce_jitter_sec + 1);
+}
+
+static void tbfs_mng_announce_schedule (TBFSMng *mng, TorrentData *tdata, gint64 delay)
+{
+    wheap_push (mng->announce_heap, &tdata->announce_node, time (NULL) + delay + tbfs_mng_announce_jitter (mng));
+}
+
+// time between full announces: tracker's interval capped by announce_max_sec, never below min interval
+static gint64 tbfs_mng_announce_interval (TBFSMng *mng, TorrentData *tdata)
+{
+    gint64 interval;
+
+    if (tdata->interval > 0)
+        interval = MIN (tdata->interval, mng->announce_max_sec);
+    else
+        interval = mng->scrape ? mng->announce_max_sec : mng->torrent_check_sec;
+
+    return MAX (interval, tdata->min_interval);
+}
+
+// exponential backoff, a random half of the delay spreads out retries
+static gint64 tbfs_mng_backoff_delay (TBFSMng *mng, TorrentData *tdata)
+{
+    gint64 delay;
+
+    delay = (gint64) MAX (1, mng->torrent_check_sec) << MIN (tdata->failures - 1, 20);
+    delay = MIN (delay, mng->backoff_max_sec);
+    delay = delay / 2 + g_random_int_range (0, delay / 2 + 1);
+
+    return MAX (delay, tdata->min_interval);
+}
+
+// event which must be sent with the next announce
+static TrackerEvent tbfs_mng_torrent_next_event (TorrentData *tdata)
+{
+    if (!(tdata->events_sent & TEF_Started))
+        return TE_started;
+    if (!(tdata->events_sent & TEF_Completed) && tbfs_torrent_is_complete (tdata->torrent))
+        return TE_completed;
+
+    return TE_none;
+}
+
+// Tracker cb function
+static void tbfs_mng_on_torrent_checked_cb (gboolean status, TBFSMng *mng, gchar *info_hash,
+    const TrackerAnnounceReply *reply)
+{
+    TorrentData *tdata;
+    gint64 delay;
+
+    tdata = tbfs_mng_torrent_data_lookup (mng, info_hash);
     if (!tdata || !tdata->torrent) {
         LOG_err (MNG_LOG, "[t: %s] Torrent does not exist !", info_hash);
         return;
     }
 
+    tdata->being_checked = FALSE;
+    if (mng->stopping) {
+        // tracker could have registered us even if the reply was lost
+        if (tdata->stop_waiting) {
+            tdata->stop_waiting = FALSE;
+            tbfs_mng_torrent_send_stopped (mng, tdata);
+        }
+        return;
+    }
+
+    if (!status) {
+        if (tdata->failures < G_MAXUINT8)
+            tdata->failures++;
+        delay = tbfs_mng_backoff_delay (mng, tdata);
+
+        LOG_err (MNG_LOG, "[t: %s] Failed to check torrent (%s), retrying in %"G_GINT64_FORMAT" sec !", info_hash,
+            reply && reply->failure_reason ? reply->failure_reason : "no response", delay);
+        tbfs_mng_announce_schedule (mng, tdata, delay);
+        return;
+    }
+
+    tdata->failures = 0;
+    tdata->interval = reply->interval;
+    tdata->min_interval = reply->min_interval;
+    if (tdata->event == TE_started)
+        tdata->events_sent |= TEF_Started;
+    else if (tdata->event == TE_completed)
+        tdata->events_sent |= TEF_Completed;
+
+    tdata->announced = TRUE;
+    tdata->last_announced = time (NULL);
+
+    // in scrape mode torrent is scraped between full announces
+    delay = mng->scrape ? mng->torrent_check_sec : tbfs_mng_announce_interval (mng, tdata);
+    // peers became wanted while this announce was in flight
+    if (tdata->peers_wanted)
+        delay = MIN (delay, tdata->min_interval);
+    tbfs_mng_announce_schedule (mng, tdata, delay);
+
     LOG_debug (MNG_LOG, "[t: %s] Torrent is checked !", info_hash);
 
-    for (l = g_list_first (l_peer_addrs); l; l = g_list_next (l)) {
-        PeerAddr *addr = (PeerAddr *) l->data;
-        
-        // add peer
-        tbfs_torrent_add_peer_addr (tdata->torrent, 
-            conf_get_string (application_get_conf (mng->app), "peer.default_id"),
-            addr->addr4, addr->port
-        );
+    tbfs_mng_torrent_add_peers (mng, tdata, reply->peer_addrs, reply->peer_count, FALSE);
+}
+
+// counters of the torrent, peers are not requested for "stopped"
+static void tbfs_mng_torrent_get_stats (TBFSMng *mng, Torrent *torrent, TrackerEvent event, TrackerAnnounceStats *stats)
+{
+    stats->uploaded = tbfs_torrent_get_uploaded (torrent);
+    stats->downloaded = tbfs_torrent_get_downloaded (torrent);
+    stats->left = (guint64) tbfs_torrent_get_pieces_missing (torrent) * mng->piece_length;
+    stats->numwant = event == TE_stopped ? 0 : tbfs_torrent_get_numwant (torrent);
+}
+
+// sends announces with the same event, batch_size torrents per request if batch announce is enabled
+static void tbfs_mng_send_announces (TBFSMng *mng, GPtrArray *a_info_hashes, TrackerEvent event,
+    TrackerClient_on_request_done_cb on_request_done_cb)
+{
+    TrackerTiers *tiers = application_get_tracker_tiers (mng->app);
+    TrackerAnnounceStats *stats;
+    guint i, count;
+
+    stats = g_new0 (TrackerAnnounceStats, a_info_hashes->len);
+    for (i = 0; i < a_info_hashes->len; i++) {
+        TorrentData *tdata = tbfs_mng_torrent_data_lookup (mng, g_ptr_array_index (a_info_hashes, i));
+
+        tbfs_mng_torrent_get_stats (mng, tdata->torrent, event, &stats[i]);
     }
 
-    tbfs_torrent_peers_updated (tdata->torrent);
+    for (i = 0; i < a_info_hashes->len; i += count) {
+        count = mng->batch_announce ? MIN (mng->batch_size, a_info_hashes->len - i) : 1;
+
+        if (count == 1)
+            tbfs_tracker_tiers_send_request (tiers, g_ptr_array_index (a_info_hashes, i), &stats[i], event,
+                on_request_done_cb, mng
+            );
+        else
+            tbfs_tracker_tiers_send_batch_request (tiers, (const gchar **) a_info_hashes->pdata + i, &stats[i], count, event,
+                on_request_done_cb, mng
+            );
+    }
 
-    tdata->being_checked = FALSE;
-    tdata->last_checked = time (NULL);
+    g_free (stats);
+}
+
+// announce torrents, grouped by the event each of them has to send
+static void tbfs_mng_announce_torrents (TBFSMng *mng, GPtrArray *a_info_hashes)
+{
+    GPtrArray *a_event[TE_none + 1];
+    guint i;
+
+    for (i = 0; i <= TE_none; i++)
+        a_event[i] = g_ptr_array_new ();
+
+    for (i = 0; i < a_info_hashes->len; i++) {
+        const gchar *info_hash = g_ptr_array_index (a_info_hashes, i);
+        TorrentData *tdata;
+
+        tdata = tbfs_mng_torrent_data_lookup (mng, info_hash);
+        if (!tdata)
+            continue;
+
+        tdata->event = tbfs_mng_torrent_next_event (tdata);
+        tdata->peers_wanted = FALSE;
+        // BEP 3: "completed" is not sent if torrent was complete when started
+        if (tdata->event == TE_started && tbfs_torrent_is_complete (tdata->torrent))
+            tdata->events_sent |= TEF_Completed;
+
+        g_ptr_array_add (a_event[tdata->event], (gpointer) info_hash);
+    }
+
+    for (i = 0; i <= TE_none; i++) {
+        tbfs_mng_send_announces (mng, a_event[i], i, (TrackerClient_on_request_done_cb) tbfs_mng_on_torrent_checked_cb);
+        g_ptr_array_free (a_event[i], TRUE);
+    }
 }
 
-static void tbfs_mng_foreach_torrent (G_GNUC_UNUSED gpointer key, gpointer value, gpointer user_data)
+typedef struct {
+    TBFSMng *mng;
+    GPtrArray *a_info_hashes; // scraped torrents
+} MngScrapeData;
+
+// Tracker cb function
+// torrents with unchanged swarm skip the announce, the rest (and torrents missing in the reply) are announced
+static void tbfs_mng_on_torrents_scraped_cb (gboolean status, MngScrapeData *sdata, TrackerScrapeInfo *infos, guint count)
 {
-    TBFSMng *mng = (TBFSMng *) user_data;
-    TorrentData *tdata = (TorrentData *) value;
+    TBFSMng *mng = sdata->mng;
+    GPtrArray *a_announce;
     time_t now = time (NULL);
+    guint i, j;
+
+    if (mng->stopping) {
+        g_ptr_array_free (sdata->a_info_hashes, TRUE);
+        g_free (sdata);
+        return;
+    }
 
-    if (!tdata->being_checked && now >= tdata->last_checked &&
-        now - tdata->last_checked >= conf_get_int (application_get_conf (mng->app), "tracker.torrent_check_sec")) {
+    if (!status)
+        LOG_err (MNG_LOG, "Failed to scrape %u torrents !", sdata->a_info_hashes->len);
+
+    a_announce = g_ptr_array_new_with_free_func (g_free);
+
+    for (i = 0; i < sdata->a_info_hashes->len; i++) {
+        const gchar *info_hash = g_ptr_array_index (sdata->a_info_hashes, i);
+        TrackerScrapeInfo *info = NULL;
+        TorrentData *tdata;
+        gint64 swarm_size;
+
+        tdata = tbfs_mng_torrent_data_lookup (mng, info_hash);
+        if (!tdata)
+            continue;
+
+        for (j = 0; j < count; j++) {
+            if (!strcmp (infos[j].info_hash, info_hash)) {
+                info = &infos[j];
+                break;
+            }
+        }
+
+        if (info) {
+            swarm_size = info->complete + info->incomplete;
+
+            if (tdata->swarm_size < 0 || tdata->swarm_size == swarm_size) {
+                LOG_debug (MNG_LOG, "[t: %s] Swarm is not changed (%"G_GINT64_FORMAT" peers)", info_hash, swarm_size);
+                tdata->swarm_size = swarm_size;
+                tdata->being_checked = FALSE;
+                tbfs_mng_announce_schedule (mng, tdata, mng->torrent_check_sec);
+                continue;
+            }
+
+            // tracker's min interval is not passed yet, swarm_size is kept to announce later
+            if (now - tdata->last_announced < tdata->min_interval) {
+                tdata->being_checked = FALSE;
+                tbfs_mng_announce_schedule (mng, tdata, tdata->last_announced + tdata->min_interval - now);
+                continue;
+            }
+
+            tdata->swarm_size = swarm_size;
+        }
+
+        g_ptr_array_add (a_announce, g_strdup (tbfs_torrent_get_info_hash (tdata->torrent)));
+    }
 
-        tdata->being_checked = TRUE;
-    
-        LOG_debug (MNG_LOG, "[t: %s] Checking torrent..", tbfs_torrent_get_info_hash (tdata->torrent));
+    tbfs_mng_announce_torrents (mng, a_announce);
 
-        // XXX:
-        tbfs_tracker_client_send_request (application_get_tracker_client (mng->app), 
-            tbfs_torrent_get_info_hash (tdata->torrent), TE_started, 
-            (TrackerClient_on_request_done_cb)tbfs_mng_on_torrent_checked_cb, mng
+    g_ptr_array_free (a_announce, TRUE);
+    g_ptr_array_free (sdata->a_info_hashes, TRUE);
+    g_free (sdata);
+}
+
+static void tbfs_mng_scrape_torrents (TBFSMng *mng, GPtrArray *a_info_hashes)
+{
+    guint i, j, count;
+
+    for (i = 0; i < a_info_hashes->len; i += count) {
+        MngScrapeData *sdata;
+
+        count = MIN (mng->batch_size, a_info_hashes->len - i);
+
+        sdata = g_new0 (MngScrapeData, 1);
+        sdata->mng = mng;
+        sdata->a_info_hashes = g_ptr_array_new_with_free_func (g_free);
+        for (j = i; j < i + count; j++)
+            g_ptr_array_add (sdata->a_info_hashes, g_strdup (g_ptr_array_index (a_info_hashes, j)));
+
+        tbfs_tracker_tiers_scrape (application_get_tracker_tiers (mng->app),
+            (const gchar **) a_info_hashes->pdata + i, count,
+            (TrackerClient_on_scrape_done_cb) tbfs_mng_on_torrents_scraped_cb, sdata
         );
     }
 }
 
+// full announce is required if torrent was never announced, has an event to send or its interval passed
+static gboolean tbfs_mng_torrent_can_scrape (TBFSMng *mng, TorrentData *tdata, time_t now)
+{
+    return mng->scrape && tdata->announced && !tdata->peers_wanted && tbfs_mng_torrent_next_event (tdata) == TE_none &&
+        now - tdata->last_announced < tbfs_mng_announce_interval (mng, tdata);
+}
+
 static void tbfs_mng_on_timer_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
 {
     TBFSMng *mng = (TBFSMng *) arg;
-    struct timeval tv;
+    WHeapNode *node;
+    time_t now = time (NULL);
+    GPtrArray *a_announce;
+    GPtrArray *a_scrape;
+
+    a_announce = g_ptr_array_new_with_free_func (g_free);
+    a_scrape = g_ptr_array_new_with_free_func (g_free);
+
+    // only torrents which are due are touched
+    while ((node = wheap_peek (mng->announce_heap)) && node->key <= now) {
+        TorrentData *tdata = (TorrentData *) node->data;
+
+        wheap_pop (mng->announce_heap);
+        tdata->being_checked = TRUE;
+    
+        LOG_debug (MNG_LOG, "[t: %s] Checking torrent..", tbfs_torrent_get_info_hash (tdata->torrent));
+
+        tbfs_mng_torrent_dht_search (mng, tdata, now);
+        if (application_get_lsd (mng->app) && !tbfs_mng_torrent_is_dormant (tdata))
+            tbfs_lsd_announce (application_get_lsd (mng->app), tbfs_torrent_get_info_hash (tdata->torrent));
+
+        if (tbfs_mng_torrent_can_scrape (mng, tdata, now))
+            g_ptr_array_add (a_scrape, g_strdup (tbfs_torrent_get_info_hash (tdata->torrent)));
+        else
+            g_ptr_array_add (a_announce, g_strdup (tbfs_torrent_get_info_hash (tdata->torrent)));
+    }
+
+    tbfs_mng_scrape_torrents (mng, a_scrape);
+    tbfs_mng_announce_torrents (mng, a_announce);
+
+    g_ptr_array_free (a_scrape, TRUE);
+    g_ptr_array_free (a_announce, TRUE);
+}
+/*}}}*/
+
+/*{{{ wants peers */
+typedef struct {
+    TBFSMng *mng;
+    uint8_t sha1[SHA_DIGEST_LENGTH];
+} MngWantsPeersData;
+
+// runs in the main loop
+static void tbfs_mng_on_torrent_wants_peers_task (MngWantsPeersData *wdata)
+{
+    TBFSMng *mng = wdata->mng;
+    TorrentData *tdata;
     time_t now = time (NULL);
+    gint64 next;
+
+    tdata = g_hash_table_lookup (mng->h_torrent_data, wdata->sha1);
+    g_free (wdata);
 
-    // tracker
-    if (!mng->tracker_being_checked && g_hash_table_size (mng->h_torrent_data) &&
-        now - mng->tracker_last_checked >= conf_get_int (application_get_conf (mng->app), "tracker.check_sec")) 
-    {
-        mng->tracker_being_checked = TRUE;
+    // the first announce is already scheduled and reports numwant
+    if (!tdata || mng->stopping || !tdata->announced)
+        return;
+
+    tdata->peers_wanted = TRUE;
+    // rescheduled once the reply arrives
+    if (tdata->being_checked)
+        return;
 
-        LOG_debug (MNG_LOG, "Checking tracker..");
-        g_hash_table_foreach (mng->h_torrent_data, tbfs_mng_foreach_torrent, mng);
-        mng->tracker_being_checked = FALSE;
-        mng->tracker_last_checked = time (NULL);
+    next = MAX (now, tdata->last_announced + tdata->min_interval);
+    if (!wheap_node_is_queued (&tdata->announce_node) || next < tdata->announce_node.key) {
+        LOG_debug (MNG_LOG, "[t: %s] Torrent wants peers, announcing in %"G_GINT64_FORMAT" sec",
+            tbfs_torrent_get_info_hash (tdata->torrent), next - now);
+        wheap_push (mng->announce_heap, &tdata->announce_node, next);
     }
+}
 
-    // re-start timer
-    tv.tv_sec = conf_get_int (application_get_conf (mng->app), "tracker.check_sec");
-    tv.tv_usec = 0;
-    event_add (mng->ev_timer, &tv);
+// numwant of the torrent went from 0 up, announces with numwant 0 returned no peers
+// can be called from any thread
+void tbfs_mng_torrent_wants_peers (TBFSMng *mng, Torrent *torrent)
+{
+    MngWantsPeersData *wdata;
+
+    wdata = g_new0 (MngWantsPeersData, 1);
+    wdata->mng = mng;
+    memcpy (wdata->sha1, tbfs_torrent_get_sha1 (torrent), SHA_DIGEST_LENGTH);
+
+    tbfs_shard_run_full (tbfs_shard_pool_get_main (application_get_shard_pool (mng->app)),
+        (ShardTaskFunc) tbfs_mng_on_torrent_wants_peers_task, wdata, g_free);
+}
+/*}}}*/
+
+/*{{{ stop */
+// Tracker cb function
+static void tbfs_mng_on_torrent_stopped_cb (gboolean status, TBFSMng *mng, gchar *info_hash,
+    G_GNUC_UNUSED const TrackerAnnounceReply *reply)
+{
+    if (!status)
+        LOG_msg (MNG_LOG, "[t: %s] Failed to send stopped event", info_hash);
+
+    if (mng->stop_pending && !--mng->stop_pending && mng->on_stopped_cb)
+        mng->on_stopped_cb (mng->stopped_ctx);
+}
+
+// torrent which was waiting for its "started" reply, stop_pending already counts it
+static void tbfs_mng_torrent_send_stopped (TBFSMng *mng, TorrentData *tdata)
+{
+    GPtrArray *a_stop;
+
+    tdata->events_sent |= TEF_Stopped;
+
+    a_stop = g_ptr_array_new_with_free_func (g_free);
+    g_ptr_array_add (a_stop, g_strdup (tbfs_torrent_get_info_hash (tdata->torrent)));
+    tbfs_mng_send_announces (mng, a_stop, TE_stopped, (TrackerClient_on_request_done_cb) tbfs_mng_on_torrent_stopped_cb);
+    g_ptr_array_free (a_stop, TRUE);
+}
+
+// sends "stopped" once for every started torrent, on_stopped_cb is called when all of them are replied
+// torrents with "started" announce in flight are stopped after its reply, the caller limits the total wait
+void tbfs_mng_stop (TBFSMng *mng, TBFSMng_on_stopped_cb on_stopped_cb, gpointer ctx)
+{
+    GHashTableIter iter;
+    gpointer value;
+    GPtrArray *a_stop;
+    guint waiting = 0;
+
+    mng->stopping = TRUE;
+    mng->on_stopped_cb = on_stopped_cb;
+    mng->stopped_ctx = ctx;
+    event_del (mng->ev_timer);
+
+    a_stop = g_ptr_array_new_with_free_func (g_free);
+    g_hash_table_iter_init (&iter, mng->h_torrent_data);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        TorrentData *tdata = (TorrentData *) value;
+
+        if (tdata->events_sent & TEF_Stopped)
+            continue;
+
+        if (!(tdata->events_sent & TEF_Started)) {
+            if (tdata->being_checked && tdata->event == TE_started) {
+                tdata->stop_waiting = TRUE;
+                waiting++;
+            }
+            continue;
+        }
+
+        tdata->events_sent |= TEF_Stopped;
+        g_ptr_array_add (a_stop, g_strdup (tbfs_torrent_get_info_hash (tdata->torrent)));
+    }
+
+    LOG_msg (MNG_LOG, "Stopping %u torrents, %u are waiting for \"started\" reply ..", a_stop->len, waiting);
+
+    mng->stop_pending = a_stop->len + waiting;
+    if (a_stop->len)
+        tbfs_mng_send_announces (mng, a_stop, TE_stopped, (TrackerClient_on_request_done_cb) tbfs_mng_on_torrent_stopped_cb);
+    else if (!mng->stop_pending && on_stopped_cb)
+        on_stopped_cb (ctx);
+
+    g_ptr_array_free (a_stop, TRUE);
 }
 /*}}}*/
 
 /*{{{ torrent registration */
+// runs in the torrent's shard
+static void tbfs_mng_on_torrent_register_task (Torrent *torrent)
+{
+    tbfs_shard_torrent_add (tbfs_torrent_get_shard (torrent), torrent);
+}
+
 // adds and new torrent
 Torrent *tbfs_mng_torrent_register (TBFSMng *mng, const gchar *info_hash, guint32 total_pieces)
+{
+    Torrent *torrent;
+
+    torrent = tbfs_mng_torrent_register_delayed (mng, info_hash, total_pieces, 0);
+
+    // local nodes don't have to wait for the first announce,
+    // restored torrents are left to their checks
+    if (torrent && application_get_lsd (mng->app))
+        tbfs_lsd_announce_new (application_get_lsd (mng->app), info_hash);
+
+    return torrent;
+}
+
+// adds a new torrent, the first announce is sent after announce_delay seconds
+Torrent *tbfs_mng_torrent_register_delayed (TBFSMng *mng, const gchar *info_hash, guint32 total_pieces, gint64 announce_delay)
 {
     TorrentData *tdata;
     Torrent *torrent;
 
     // search for existing torrent
-    tdata = g_hash_table_lookup (mng->h_torrent_data, info_hash);
+    tdata = tbfs_mng_torrent_data_lookup (mng, info_hash);
     if (tdata) {
         //XXX:
         LOG_msg (MNG_LOG, "[t: %s] Torrent already exist !", info_hash);
@@ -210,10 +752,102 @@ Torrent *tbfs_mng_torrent_register (TBFSMng *mng, const gchar *info_hash, guint3
 
     tdata = tbfs_mng_torrent_data_create (torrent);
 
-    g_hash_table_insert (mng->h_torrent_data, (gchar *)tbfs_torrent_get_info_hash (torrent), tdata);
+    g_hash_table_insert (mng->h_torrent_data, (gpointer) tbfs_torrent_get_sha1 (torrent), tdata);
+    tbfs_mng_announce_schedule (mng, tdata, announce_delay);
+
+    // make torrent visible to the shard's peer connections
+    tbfs_shard_run (tbfs_torrent_get_shard (torrent), (ShardTaskFunc) tbfs_mng_on_torrent_register_task, torrent);
 
     LOG_debug (MNG_LOG, "[t: %s] Registering torrent", info_hash);
 
     return torrent;
 }
 /*}}}*/
+
+/*{{{ metainfo */
+typedef struct {
+    Torrent *torrent;
+    Metainfo *mi;
+    gboolean seed;
+} MetainfoAddData;
+
+// task never ran, Metainfo wasn't passed to the torrent
+static void tbfs_mng_metainfo_add_data_free (MetainfoAddData *data)
+{
+    tbfs_metainfo_destroy (data->mi);
+    g_free (data);
+}
+
+// runs in the torrent's shard
+static void tbfs_mng_on_metainfo_add_task (MetainfoAddData *data)
+{
+    tbfs_torrent_set_metainfo (data->torrent, data->mi);
+
+    // we hold all pieces of this torrent
+    if (data->seed) {
+        guint32 i, total_pieces = tbfs_torrent_get_total_pieces (data->torrent);
+
+        for (i = 0; i < total_pieces; i++)
+            tbfs_torrent_set_piece_have (data->torrent, i);
+    }
+
+    g_free (data);
+}
+
+// registers torrents of all .torrent files in dir, torrents which already exist get their piece hashes
+guint tbfs_mng_load_metainfo_dir (TBFSMng *mng, const gchar *dir, gboolean seed)
+{
+    GDir *gdir;
+    GError *error = NULL;
+    const gchar *fname;
+    guint loaded = 0;
+
+    gdir = g_dir_open (dir, 0, &error);
+    if (!gdir) {
+        LOG_err (MNG_LOG, "Failed to open metainfo directory %s: %s", dir, error->message);
+        g_error_free (error);
+        return 0;
+    }
+
+    while ((fname = g_dir_read_name (gdir))) {
+        MetainfoAddData *data;
+        Metainfo *mi;
+        Torrent *torrent;
+        gchar *path;
+        const gchar *info_hash;
+
+        if (!g_str_has_suffix (fname, ".torrent"))
+            continue;
+
+        path = g_build_filename (dir, fname, NULL);
+        mi = tbfs_metainfo_load (path);
+        g_free (path);
+        if (!mi)
+            continue;
+
+        info_hash = tbfs_metainfo_get_info_hash (mi);
+        torrent = tbfs_mng_torrent_get (mng, info_hash);
+        if (!torrent)
+            torrent = tbfs_mng_torrent_register (mng, info_hash, tbfs_metainfo_get_piece_count (mi));
+        if (!torrent || tbfs_torrent_get_total_pieces (torrent) != tbfs_metainfo_get_piece_count (mi)) {
+            LOG_err (MNG_LOG, "[t: %s] Failed to register torrent of %s !", info_hash, fname);
+            tbfs_metainfo_destroy (mi);
+            continue;
+        }
+
+        data = g_new0 (MetainfoAddData, 1);
+        data->torrent = torrent;
+        data->mi = mi;
+        data->seed = seed;
+        tbfs_shard_run_full (tbfs_torrent_get_shard (torrent), (ShardTaskFunc) tbfs_mng_on_metainfo_add_task, data,
+            (GDestroyNotify) tbfs_mng_metainfo_add_data_free);
+        loaded++;
+    }
+
+    g_dir_close (gdir);
+
+    LOG_msg (MNG_LOG, "Loaded %u torrents from %s", loaded, dir);
+
+    return loaded;
+}
+/*}}}*/
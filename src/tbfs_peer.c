@@ -18,15 +18,17 @@
 #include "tbfs_peer_client.h"
 
 /*{{{ struct */
+// fields are ordered to avoid padding, sockaddr_in is built only when connecting
 struct _Peer {
     PeerMng *mng;
-    gchar peer_id[PEER_ID_LENGTH + 1];
     PeerClient *client;
-    PeerType type;
 
-    struct sockaddr_in sin;
+    PeerEndpoint endpoint; // network byte order
+    guint8 type; // PeerType
+    guint8 request_sent;
+    guint8 local; // found on the local segment, contacted first
 
-    gboolean request_sent;
+    gchar peer_id[PEER_ID_LENGTH + 1];
 };
 
 #define PEER_LOG "peer"
@@ -42,10 +44,8 @@ Peer *tbfs_peer_create (PeerMng *mng, const gchar *peer_id, guint32 addr, guint1
     peer->mng = mng;
     strncpy (peer->peer_id, peer_id, PEER_ID_LENGTH);
 
-    memset (&peer->sin, 0, sizeof (struct sockaddr_in));
-    peer->sin.sin_family = AF_INET;
-    peer->sin.sin_addr.s_addr = addr;
-    peer->sin.sin_port = port;
+    peer->endpoint.addr = addr;
+    peer->endpoint.port = port;
 
     peer->request_sent = FALSE;
 
@@ -54,6 +54,10 @@ Peer *tbfs_peer_create (PeerMng *mng, const gchar *peer_id, guint32 addr, guint1
 
 void tbfs_peer_destroy (Peer *peer)
 {
+    if (peer->client) {
+        tbfs_peer_client_destroy (peer->client);
+        peer->client = NULL;
+    }
     g_free (peer);
 }
 /*}}}*/
@@ -69,6 +73,53 @@ const gchar *tbfs_peer_get_info_hash (Peer *peer)
     return tbfs_peer_mng_get_info_hash (peer->mng);
 }
 
+void tbfs_peer_get_addr (Peer *peer, guint32 *addr, guint16 *port)
+{
+    *addr = peer->endpoint.addr;
+    *port = peer->endpoint.port;
+}
+
+const PeerEndpoint *tbfs_peer_get_endpoint (Peer *peer)
+{
+    return &peer->endpoint;
+}
+
+gboolean tbfs_peer_is_local (Peer *peer)
+{
+    return peer->local;
+}
+
+void tbfs_peer_set_local (Peer *peer, gboolean local)
+{
+    peer->local = local;
+}
+
+gsize tbfs_peer_sizeof (void)
+{
+    return sizeof (Peer);
+}
+
+guint tbfs_peer_endpoint_hash (gconstpointer v)
+{
+    const PeerEndpoint *ep = (const PeerEndpoint *) v;
+
+    return (ep->addr * 2654435761u) ^ ep->port;
+}
+
+gboolean tbfs_peer_endpoint_equal (gconstpointer a, gconstpointer b)
+{
+    const PeerEndpoint *ep_a = (const PeerEndpoint *) a;
+    const PeerEndpoint *ep_b = (const PeerEndpoint *) b;
+
+    return ep_a->addr == ep_b->addr && ep_a->port == ep_b->port;
+}
+
+// called by PeerClient when it's destroyed
+void tbfs_peer_set_client (Peer *peer, PeerClient *client)
+{
+    peer->client = client;
+}
+
 /*}}}*/
 
 // call from tbfs_peer_mng_peers_updated ()
@@ -79,7 +130,15 @@ void tbfs_peer_on_pieces_request_cb (Peer *peer)
         return;
 
     if (!peer->client) {
-        peer->client = tbfs_peer_client_create_with_addr (tbfs_peer_mng_get_app (peer->mng), &peer->sin);
+        struct sockaddr_in sin;
+
+        memset (&sin, 0, sizeof (struct sockaddr_in));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = peer->endpoint.addr;
+        sin.sin_port = peer->endpoint.port;
+
+        peer->client = tbfs_peer_client_create_with_addr (tbfs_peer_mng_get_app (peer->mng),
+            tbfs_peer_mng_get_shard (peer->mng), &sin);
 
         if (!peer->client) {
             LOG_msg (PEER_LOG, "Peer is unavailable !");
@@ -18,6 +18,8 @@
 #include "tbfs_mng.h"
 #include "tbfs_torrent.h"
 #include "tbfs_bitfield.h"
+#include "tbfs_super_seed.h"
+#include "tbfs_shard.h"
 
 /*{{{ structs */
 typedef enum {
@@ -33,17 +35,22 @@ typedef enum {
     PCRS_Continue = 1,
 } PeerClientReadingState;
 
+// small fields are packed after the strings to avoid padding
 struct _PeerClient {
     Application *app;
+    Shard *shard;
     Peer *peer;
+    Torrent *torrent; // set when client is Ready, receives traffic accounting
 
     struct bufferevent *bev;
 
-    PeerClientState state;
-    PeerClientReadingState read_state;
-    
     gchar hs_info_hash[2 * SHA_DIGEST_LENGTH + 1];
     gchar hs_peer_id[PEER_ID_LENGTH + 1];
+
+    guint8 state; // PeerClientState
+    guint8 read_state; // PeerClientReadingState
+    guint8 super_seeding; // registered in torrent's SuperSeed
+    guint8 attached; // counted in torrent's connected clients
 };
 
 // Peer wire protocol
@@ -51,6 +58,8 @@ typedef enum {
     PMT_Choke = 0,
     PMT_Unchoke = 1,
     PMT_Interested = 2,
+    PMT_Have = 4,
+    PMT_Bitfield = 5,
     PMT_Request = 6,
 
     PMT_KeepAlive = 80,
@@ -61,20 +70,25 @@ typedef enum {
 static void tbfs_peer_client_on_write_cb (struct bufferevent *bev, void *ctx);
 static void tbfs_peer_client_on_read_cb (struct bufferevent *bev, void *ctx);
 static void tbfs_peer_client_on_event_cb (struct bufferevent *bev, short what, void *ctx);
+static void tbfs_peer_client_on_traffic_cb (struct evbuffer *buf, const struct evbuffer_cb_info *info, void *ctx);
 /*}}}*/
 
 /*{{{ create / destroy */
-PeerClient *tbfs_peer_client_create (Application *app, evutil_socket_t fd)
+PeerClient *tbfs_peer_client_create (Application *app, Shard *shard, evutil_socket_t fd)
 {
     PeerClient *client;
 
     client = g_new0 (PeerClient, 1);
     client->app = app;
+    client->shard = shard;
     client->peer = NULL;
+    client->torrent = NULL;
     client->state = PCS_Connecting;
     client->read_state = PCRS_NewPacket;
+    client->super_seeding = FALSE;
+    client->attached = FALSE;
 
-    client->bev = bufferevent_socket_new (application_get_evbase (app), 
+    client->bev = bufferevent_socket_new (tbfs_shard_get_evbase (shard), 
         fd, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS | BEV_OPT_UNLOCK_CALLBACKS);
 
     if (!client->bev) {
@@ -90,6 +104,10 @@ PeerClient *tbfs_peer_client_create (Application *app, evutil_socket_t fd)
         client
     );
 
+    // count bytes read from and written to the socket
+    evbuffer_add_cb (bufferevent_get_input (client->bev), tbfs_peer_client_on_traffic_cb, client);
+    evbuffer_add_cb (bufferevent_get_output (client->bev), tbfs_peer_client_on_traffic_cb, client);
+
     bufferevent_enable (client->bev, EV_READ|EV_WRITE);
 
     LOG_debug (PCLI_LOG, "[pc: %p] PeerClient created !", client);
@@ -101,11 +119,11 @@ PeerClient *tbfs_peer_client_create (Application *app, evutil_socket_t fd)
     return client;
 }
 
-PeerClient *tbfs_peer_client_create_with_addr (Application *app, struct sockaddr_in *sin)
+PeerClient *tbfs_peer_client_create_with_addr (Application *app, Shard *shard, struct sockaddr_in *sin)
 {
     PeerClient *client;
 
-    client = tbfs_peer_client_create (app, -1);
+    client = tbfs_peer_client_create (app, shard, -1);
     if (!client) {
         return NULL;
     }
@@ -127,8 +145,25 @@ void tbfs_peer_client_destroy (PeerClient *client)
 {
 
     LOG_debug (PCLI_LOG, "[pc: %p] PeerClient destroying !", client);
-    if (client->bev)
+
+    if (client->super_seeding || client->attached) {
+        Torrent *torrent;
+
+        torrent = tbfs_shard_torrent_get (client->shard, client->hs_info_hash);
+        if (torrent && client->super_seeding && tbfs_torrent_get_super_seed (torrent))
+            tbfs_super_seed_peer_remove (tbfs_torrent_get_super_seed (torrent), client);
+        if (torrent && client->attached)
+            tbfs_torrent_client_disconnected (torrent);
+    }
+
+    if (client->peer)
+        tbfs_peer_set_client (client->peer, NULL);
+
+    if (client->bev) {
+        evbuffer_remove_cb (bufferevent_get_input (client->bev), tbfs_peer_client_on_traffic_cb, client);
+        evbuffer_remove_cb (bufferevent_get_output (client->bev), tbfs_peer_client_on_traffic_cb, client);
         bufferevent_free (client->bev);
+    }
     g_free (client);
 }
 /*}}}*/
@@ -206,6 +241,19 @@ static gboolean tbfs_peer_client_request_parse (PeerClient *client, struct evbuf
 
     return TRUE;
 }
+
+static gboolean tbfs_peer_client_have_parse (PeerClient *client, struct evbuffer *inbuf, guint32 *idx)
+{
+    guint32 n_idx;
+
+    if (evbuffer_remove (inbuf, &n_idx, 4) != 4) {
+        LOG_err (PCLI_LOG, "Failed to read Have pecket !");
+        return FALSE;
+    }
+    *idx = g_ntohl (n_idx);
+
+    return TRUE;
+}
 /*}}}*/
 
 /*{{{ encoders */
@@ -242,7 +290,7 @@ static struct evbuffer *tbfs_peer_client_handshake_pkg_create (PeerClient *clien
 
     pstrlen = strlen (pstr);
 
-    torrent = tbfs_mng_torrent_get (application_get_mng (client->app), client->hs_info_hash);
+    torrent = tbfs_shard_torrent_get (client->shard, client->hs_info_hash);
     if (!torrent) {
         LOG_err (PCLI_LOG, "[pc: %p] Cant find Torrent, info_hash: %s !", client, client->hs_info_hash);
         return NULL;
@@ -333,41 +381,170 @@ static struct evbuffer *tbfs_peer_client_request_pkg_create (PeerClient *client,
     return outbuf;
 }
 
-
-static struct evbuffer *tbfs_peer_client_bitfield_pkg_create (PeerClient *client)
+static struct evbuffer *tbfs_peer_client_have_pkg_create (PeerClient *client, guint32 idx)
 {
     struct evbuffer *outbuf;
-    guint32 len;
+    guint32 len = sizeof (uint8_t) + sizeof (uint32_t);
     guint32 n_len;
-    guint8 msg = 5;
-    Torrent *torrent;
-    Bitfield *bf;
-    const guint8 *bits;
-
-    torrent = tbfs_mng_torrent_get (application_get_mng (client->app), client->hs_info_hash);
-    if (!torrent) {
-        LOG_err (PCLI_LOG, "[pc: %p] Cant find Torrent, info_hash: %s !", client, client->hs_info_hash);
-        return NULL;
-    }
-
-    bf = tbfs_torrent_get_bitfield_pieces_have (torrent);
-    if (!bf) {
-        LOG_err (PCLI_LOG, "[pc: %p] Cant find Torrent's pieces bitfield !", client);
-        return NULL;
-    }
-
-    len = tbfs_bitfield_get_length (bf) + 1; // + type
-    bits = tbfs_bitfield_get_bits (bf);
+    guint8 msg = 4;
+    guint32 n_idx;
 
+    n_idx = g_htonl (idx);
     n_len = g_htonl (len);
 
     outbuf = evbuffer_new ();
     evbuffer_add (outbuf, &n_len, 4);
     evbuffer_add (outbuf, &msg, 1);
-    evbuffer_add (outbuf, bits, len - 1); // - type
+    evbuffer_add (outbuf, &n_idx, 4);
+
     return outbuf;
 }
+
+static void tbfs_peer_client_on_bitfield_sent (G_GNUC_UNUSED const void *data, G_GNUC_UNUSED size_t datalen, void *extra)
+{
+    g_bytes_unref ((GBytes *) extra);
+}
+
+// Bitfield message is encoded once per torrent and shared by all connections until have bitfield changes
+static gboolean tbfs_peer_client_bitfield_pkg_add (PeerClient *client, struct evbuffer *outbuf)
+{
+    GBytes *msg;
+    const guint8 *data;
+    gsize size;
+
+    msg = tbfs_torrent_get_bitfield_msg (client->torrent);
+    if (!msg) {
+        Bitfield *bf;
+        guint8 *buf;
+        guint32 len;
+        guint32 n_len;
+
+        bf = tbfs_torrent_get_bitfield_pieces_have (client->torrent);
+        if (!bf) {
+            LOG_err (PCLI_LOG, "[pc: %p] Cant find Torrent's pieces bitfield !", client);
+            return FALSE;
+        }
+
+        len = tbfs_bitfield_get_length (bf) + 1; // + type
+        n_len = g_htonl (len);
+
+        buf = g_malloc (4 + len);
+        memcpy (buf, &n_len, 4);
+        buf[4] = PMT_Bitfield;
+        memcpy (buf + 5, tbfs_bitfield_peek_bits (bf), len - 1); // - type
+
+        msg = g_bytes_new_take (buf, 4 + len);
+        tbfs_torrent_set_bitfield_msg (client->torrent, msg);
+    }
+
+    data = g_bytes_get_data (msg, &size);
+
+    // outbuf keeps a reference until the message is written out
+    if (evbuffer_add_reference (outbuf, data, size, tbfs_peer_client_on_bitfield_sent, g_bytes_ref (msg)) < 0) {
+        g_bytes_unref (msg);
+        return FALSE;
+    }
+
+    return TRUE;
+}
 /*}}}*/
+
+// used by super-seeding to reveal pieces one by one
+void tbfs_peer_client_send_have (PeerClient *client, guint32 piece_idx)
+{
+    struct evbuffer *outbuf;
+
+    outbuf = tbfs_peer_client_have_pkg_create (client, piece_idx);
+    bufferevent_write_buffer (client->bev, outbuf);
+    LOG_debug (PCLI_LOG, "[pc: %p] Have package is sent, piece: %u", client, piece_idx);
+    evbuffer_free (outbuf);
+}
+/*}}}*/
+
+/*{{{ handoff */
+typedef struct {
+    Application *app;
+    Shard *shard;
+    evutil_socket_t fd;
+    gchar info_hash[2 * SHA_DIGEST_LENGTH + 1];
+    struct evbuffer *inbuf; // data received after the handshake
+} PeerClientHandoff;
+
+// socket wasn't taken over by a PeerClient
+static void tbfs_peer_client_handoff_free (PeerClientHandoff *hoff)
+{
+    evutil_closesocket (hoff->fd);
+    evbuffer_free (hoff->inbuf);
+    g_free (hoff);
+}
+
+// runs in the destination shard's thread
+static void tbfs_peer_client_on_handoff_task (PeerClientHandoff *hoff)
+{
+    PeerClient *client;
+    struct evbuffer *outbuf;
+
+    client = tbfs_peer_client_create (hoff->app, hoff->shard, hoff->fd);
+    if (!client) {
+        tbfs_peer_client_handoff_free (hoff);
+        return;
+    }
+    strncpy (client->hs_info_hash, hoff->info_hash, 2 * SHA_DIGEST_LENGTH);
+
+    if (!tbfs_shard_torrent_get (client->shard, client->hs_info_hash)) {
+        LOG_msg (PCLI_LOG, "[pc: %p] Torrent %s does not exist !", client, client->hs_info_hash);
+        tbfs_peer_client_destroy (client);
+        evbuffer_free (hoff->inbuf);
+        g_free (hoff);
+        return;
+    }
+
+    LOG_debug (PCLI_LOG, "[pc: %p] PeerClient is moved to shard %u", client, tbfs_shard_get_id (client->shard));
+
+    client->state = PCS_ReadingPeerID;
+
+    outbuf = tbfs_peer_client_handshake_pkg_create (client);
+    bufferevent_write_buffer (client->bev, outbuf);
+    LOG_debug (PCLI_LOG, "[pc: %p] Handshake package is sent !", client);
+    evbuffer_free (outbuf);
+
+    if (evbuffer_get_length (hoff->inbuf)) {
+        evbuffer_prepend_buffer (bufferevent_get_input (client->bev), hoff->inbuf);
+        tbfs_peer_client_on_read_cb (client->bev, client);
+    }
+
+    evbuffer_free (hoff->inbuf);
+    g_free (hoff);
+}
+
+// returns TRUE if client belongs to another shard, client is destroyed in this case
+static gboolean tbfs_peer_client_handoff (PeerClient *client)
+{
+    Shard *shard;
+    PeerClientHandoff *hoff;
+
+    shard = tbfs_shard_pool_get_shard (application_get_shard_pool (client->app), client->hs_info_hash);
+    if (shard == client->shard)
+        return FALSE;
+
+    hoff = g_new0 (PeerClientHandoff, 1);
+    hoff->app = client->app;
+    hoff->shard = shard;
+    hoff->fd = bufferevent_getfd (client->bev);
+    strncpy (hoff->info_hash, client->hs_info_hash, 2 * SHA_DIGEST_LENGTH);
+    hoff->inbuf = evbuffer_new ();
+    evbuffer_add_buffer (hoff->inbuf, bufferevent_get_input (client->bev));
+
+    // detach socket, so it's not closed by bufferevent_free ()
+    bufferevent_disable (client->bev, EV_READ | EV_WRITE);
+    bufferevent_setfd (client->bev, -1);
+    tbfs_peer_client_destroy (client);
+
+    tbfs_shard_run_full (shard, (ShardTaskFunc) tbfs_peer_client_on_handoff_task, hoff,
+        (GDestroyNotify) tbfs_peer_client_handoff_free);
+
+    return TRUE;
+}
 /*}}}*/
 
 /*{{{ on_read_cb / on_write_cb / on_event_cb */
@@ -401,8 +578,12 @@ static void tbfs_peer_client_on_read_cb (struct bufferevent *bev, void *ctx)
         }
         LOG_debug (PCLI_LOG, "[pc: %p] Handshake is parsed !", client);
 
+        // incoming connection: move it to the shard which owns the torrent
+        if (!client->peer && tbfs_peer_client_handoff (client))
+            return;
+
         // check if Torrent exists
-        torrent = tbfs_mng_torrent_get (application_get_mng (client->app), client->hs_info_hash);
+        torrent = tbfs_shard_torrent_get (client->shard, client->hs_info_hash);
         if (!torrent) {
             LOG_msg (PCLI_LOG, "[pc: %p] Torrent %s does not exist !", client, client->hs_info_hash);
             tbfs_peer_client_destroy (client);
@@ -426,6 +607,7 @@ static void tbfs_peer_client_on_read_cb (struct bufferevent *bev, void *ctx)
     if (client->state == PCS_ReadingPeerID && inlen) {
         struct evbuffer *outbuf = NULL;
         const gchar *self_id;
+        Torrent *torrent;
 
         if (!tbfs_peer_client_handshake_peerid_parse (client, inbuf)) {
             LOG_err (PCLI_LOG, "[pc: %p] Failed to parse PeerID !", client);
@@ -442,7 +624,21 @@ static void tbfs_peer_client_on_read_cb (struct bufferevent *bev, void *ctx)
             return;
         }
 
+        torrent = tbfs_shard_torrent_get (client->shard, client->hs_info_hash);
+        if (!torrent) {
+            LOG_msg (PCLI_LOG, "[pc: %p] Torrent %s does not exist !", client, client->hs_info_hash);
+            tbfs_peer_client_destroy (client);
+            return;
+        }
+
         client->state = PCS_Ready;
+        client->torrent = torrent;
+
+        // incoming connection keeps torrent active
+        if (!client->peer) {
+            client->attached = TRUE;
+            tbfs_torrent_client_connected (torrent);
+        }
 
         // leecher
         if (client->peer) {
@@ -456,17 +652,19 @@ static void tbfs_peer_client_on_read_cb (struct bufferevent *bev, void *ctx)
             LOG_debug (PCLI_LOG, "[pc: %p] Interested package is sent !", client);
             evbuffer_free (outbuf);
 
+        // super-seeder: pieces are revealed one by one with Have messages
+        } else if (tbfs_torrent_get_super_seed (torrent)) {
+            client->super_seeding = TRUE;
+            tbfs_super_seed_peer_add (tbfs_torrent_get_super_seed (torrent), client);
+
         // seeder
         } else {
-            outbuf = tbfs_peer_client_bitfield_pkg_create (client);
-            if (!outbuf) {
+            if (!tbfs_peer_client_bitfield_pkg_add (client, bufferevent_get_output (bev))) {
                 LOG_err (PCLI_LOG, "[pc: %p] Failed to create bitfield package !", client);
                 tbfs_peer_client_destroy (client);
                 return;
             }
-            bufferevent_write_buffer (bev, outbuf);
             LOG_debug (PCLI_LOG, "[pc: %p] Bitfield package is sent !", client);
-            evbuffer_free (outbuf);
         }
 
         inlen = evbuffer_get_length (inbuf);
@@ -500,6 +698,36 @@ static void tbfs_peer_client_on_read_cb (struct bufferevent *bev, void *ctx)
                 evbuffer_free (outbuf);
             }
         } else if (msg_type == PMT_Interested) {
+        } else if (msg_type == PMT_Have) {
+            guint32 idx;
+            Torrent *torrent;
+
+            if (!tbfs_peer_client_have_parse (client, inbuf, &idx)) {
+                LOG_err (PCLI_LOG, "[pc: %p] Failed to parse Have package !", client);
+                tbfs_peer_client_destroy (client);
+                return;
+            }
+
+            torrent = tbfs_shard_torrent_get (client->shard, client->hs_info_hash);
+            if (client->super_seeding && torrent && tbfs_torrent_get_super_seed (torrent))
+                tbfs_super_seed_peer_have (tbfs_torrent_get_super_seed (torrent), client, idx);
+        } else if (msg_type == PMT_Bitfield) {
+            guint32 bits_len = msg_len - 1; // - type
+            const guint8 *bits;
+            Torrent *torrent;
+
+            bits = bits_len ? evbuffer_pullup (inbuf, bits_len) : NULL;
+            if (!bits) {
+                LOG_err (PCLI_LOG, "[pc: %p] Failed to read Bitfield package !", client);
+                tbfs_peer_client_destroy (client);
+                return;
+            }
+
+            torrent = tbfs_shard_torrent_get (client->shard, client->hs_info_hash);
+            if (client->super_seeding && torrent && tbfs_torrent_get_super_seed (torrent))
+                tbfs_super_seed_peer_bitfield (tbfs_torrent_get_super_seed (torrent), client, bits, bits_len);
+
+            evbuffer_drain (inbuf, bits_len);
         } else if (msg_type == PMT_Request) {
             guint32 idx, begin, len;
             if (!tbfs_peer_client_request_parse (client, inbuf, &idx, &begin, &len)) {
@@ -559,4 +787,20 @@ static void tbfs_peer_client_on_event_cb (struct bufferevent *bev, short what, v
 }
 /*}}}*/
 
+/*{{{ on_traffic_cb */
+// input grows by bytes read from the socket, output shrinks by bytes written to it
+static void tbfs_peer_client_on_traffic_cb (struct evbuffer *buf, const struct evbuffer_cb_info *info, void *ctx)
+{
+    PeerClient *client = (PeerClient *) ctx;
+
+    if (!client->torrent)
+        return;
+
+    if (buf == bufferevent_get_input (client->bev))
+        tbfs_torrent_add_transferred (client->torrent, 0, info->n_added);
+    else
+        tbfs_torrent_add_transferred (client->torrent, info->n_deleted, 0);
+}
+/*}}}*/
+
 /*}}}*/
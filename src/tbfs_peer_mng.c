@@ -22,7 +22,7 @@ struct _PeerMng {
     Application *app;
     Torrent *torrent;
 
-    GHashTable *h_peer_addrs; // IP addr hash 
+    GHashTable *h_peers; // PeerEndpoint -> Peer, owns peers
     GHashTable *h_peer_id; // PeerID
     gint peer_count;
 
@@ -35,15 +35,10 @@ struct _PeerMng {
 
 };
 
-typedef struct {
-    GHashTable *h_peers;
-} PeerAddr;
-
 typedef void (*peer_func) (Peer *peer, gpointer data1, gpointer data2);
 
 #define PMNG_LOG "pmng"
 
-static void tbfs_peer_mng_addr_destroy (PeerAddr *addr);
 static void tbfs_peer_mng_on_timer_cb (evutil_socket_t fd, short events, void *arg);
 static void tbfs_peer_mng_peer_foreach (PeerMng *mng, peer_func func, gpointer data1, gpointer data2);
 /*}}}*/
@@ -57,7 +52,7 @@ PeerMng *tbfs_peer_mng_create (Application *app, Torrent *torrent)
     mng = g_new0 (PeerMng, 1);
     mng->app = app;
     mng->torrent = torrent;
-    mng->h_peer_addrs = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)tbfs_peer_mng_addr_destroy);
+    mng->h_peers = g_hash_table_new_full (tbfs_peer_endpoint_hash, tbfs_peer_endpoint_equal, NULL, (GDestroyNotify)tbfs_peer_destroy);
     mng->h_peer_id = g_hash_table_new (g_str_hash, g_str_equal);
     mng->peer_count = 0;
     mng->q_pieces_wanted = g_queue_new ();
@@ -65,7 +60,7 @@ PeerMng *tbfs_peer_mng_create (Application *app, Torrent *torrent)
     mng->peers_last_checked = 0;
     mng->peers_being_checked = FALSE;
 
-    mng->ev_timer = evtimer_new (application_get_evbase (app), tbfs_peer_mng_on_timer_cb, mng);
+    mng->ev_timer = evtimer_new (tbfs_torrent_get_evbase (torrent), tbfs_peer_mng_on_timer_cb, mng);
 
     // start timer
     tv.tv_sec = conf_get_int (application_get_conf (mng->app), "peer_client.check_sec");
@@ -80,7 +75,7 @@ void tbfs_peer_mng_destroy (PeerMng *mng)
     event_free (mng->ev_timer);
     g_queue_free (mng->q_pieces_wanted);
     g_hash_table_destroy (mng->h_peer_id);
-    g_hash_table_destroy (mng->h_peer_addrs);
+    g_hash_table_destroy (mng->h_peers);
     g_free (mng);
 }
 /*}}}*/
@@ -91,37 +86,64 @@ Application *tbfs_peer_mng_get_app (PeerMng *mng)
 }
 
 /*{{{ Peers */
-static void tbfs_peer_mng_addr_destroy (PeerAddr *addr)
-{
-    g_hash_table_destroy (addr->h_peers);
-    g_free (addr);
-}
-
 void tbfs_peer_mng_peer_add (PeerMng *mng, const gchar *peer_id, guint32 addr, guint16 port)
 {
-    PeerAddr *p_addr;
-    Peer *existing_peer;
+    PeerEndpoint endpoint;
 
-    LOG_debug (PMNG_LOG, "[t: %s] Adding peer: %s", tbfs_torrent_get_info_hash (mng->torrent), peer_id);
+    endpoint.addr = addr;
+    endpoint.port = port;
 
-    p_addr = g_hash_table_lookup (mng->h_peer_addrs, GUINT_TO_POINTER (addr));
-    if (!p_addr) {
-        p_addr = g_new0 (PeerAddr, 1);
-        p_addr->h_peers = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)tbfs_peer_destroy);
-        g_hash_table_insert (mng->h_peer_addrs, GUINT_TO_POINTER (addr), p_addr);
-    }
+    tbfs_peer_mng_peers_add (mng, peer_id, &endpoint, 1);
+}
+
+static guint tbfs_peer_mng_peers_add_full (PeerMng *mng, const gchar *peer_id, const PeerEndpoint *endpoints, guint count,
+    gboolean local)
+{
+    guint i;
+    guint added = 0;
 
-    existing_peer = g_hash_table_lookup (p_addr->h_peers, GUINT_TO_POINTER (port));
-    if (existing_peer) {
-        LOG_debug (PMNG_LOG, "Peer already exist: %u:%d", addr, port);
-    } else {
+    for (i = 0; i < count; i++) {
         Peer *peer;
-        peer = tbfs_peer_create (mng, peer_id, addr, port);
-        g_hash_table_insert (p_addr->h_peers, GUINT_TO_POINTER (port), peer);
+
+        peer = g_hash_table_lookup (mng->h_peers, &endpoints[i]);
+        if (peer) {
+            if (local)
+                tbfs_peer_set_local (peer, TRUE);
+            continue;
+        }
+
+        peer = tbfs_peer_create (mng, peer_id, endpoints[i].addr, endpoints[i].port);
+        tbfs_peer_set_local (peer, local);
+        // key points into the Peer
+        g_hash_table_insert (mng->h_peers, (gpointer) tbfs_peer_get_endpoint (peer), peer);
         // XXX: check if exists
         g_hash_table_insert (mng->h_peer_id, (gpointer) tbfs_peer_get_id (peer), peer);
         mng->peer_count++;
+        added++;
     }
+
+    LOG_debug (PMNG_LOG, "[t: %s] Added %u of %u %speers", tbfs_torrent_get_info_hash (mng->torrent), added, count,
+        local ? "local " : "");
+
+    return added;
+}
+
+// adds peers which are not known yet, returns the number of added peers
+guint tbfs_peer_mng_peers_add (PeerMng *mng, const gchar *peer_id, const PeerEndpoint *endpoints, guint count)
+{
+    return tbfs_peer_mng_peers_add_full (mng, peer_id, endpoints, count, FALSE);
+}
+
+// peers on the local segment (LSD), already known peers are marked local too
+guint tbfs_peer_mng_local_peers_add (PeerMng *mng, const gchar *peer_id, const PeerEndpoint *endpoints, guint count)
+{
+    return tbfs_peer_mng_peers_add_full (mng, peer_id, endpoints, count, TRUE);
+}
+
+static void tbfs_peer_mng_request_cb (Peer *peer, gpointer local, G_GNUC_UNUSED gpointer data)
+{
+    if (tbfs_peer_is_local (peer) == GPOINTER_TO_INT (local))
+        tbfs_peer_on_pieces_request_cb (peer);
 }
 
 // launch "pieces" requests to peers
@@ -132,7 +154,7 @@ void tbfs_peer_mng_peers_updated (PeerMng *mng)
     LOG_debug (PMNG_LOG, "[t: %s] Peers are updated, sending requests ..", tbfs_torrent_get_info_hash (mng->torrent));
 
     bf_want = tbfs_torrent_get_bitfield_pieces_want (mng->torrent);
-    if (!tbfs_bitfield_get_set_bits (bf_want)) {
+    if (!bf_want || !tbfs_bitfield_get_set_bits (bf_want)) {
         LOG_debug (PMNG_LOG, "[t: %s] No pieces wanted !", tbfs_torrent_get_info_hash (mng->torrent));
         return;
     }
@@ -142,7 +164,9 @@ void tbfs_peer_mng_peers_updated (PeerMng *mng)
         return;
     }
 
-    tbfs_peer_mng_peer_foreach (mng, (peer_func)tbfs_peer_on_pieces_request_cb, NULL, NULL);
+    // local peers are asked first
+    tbfs_peer_mng_peer_foreach (mng, (peer_func) tbfs_peer_mng_request_cb, GINT_TO_POINTER (TRUE), NULL);
+    tbfs_peer_mng_peer_foreach (mng, (peer_func) tbfs_peer_mng_request_cb, GINT_TO_POINTER (FALSE), NULL);
 }
 
 gint tbfs_peer_mng_peer_count (PeerMng *mng)
@@ -159,6 +183,11 @@ const gchar *tbfs_peer_mng_get_info_hash (PeerMng *mng)
 {
     return tbfs_torrent_get_info_hash (mng->torrent);
 }
+
+Shard *tbfs_peer_mng_get_shard (PeerMng *mng)
+{
+    return tbfs_torrent_get_shard (mng->torrent);
+}
 /*}}}*/
 
 /*{{{ Peers Foreach */
@@ -168,7 +197,7 @@ typedef struct {
     gpointer data2;
 } PeerMngForeachData;
 
-static void tbfs_peer_mng_peer_foreach_port (G_GNUC_UNUSED gpointer key, gpointer value, gpointer user_data)
+static void tbfs_peer_mng_peer_foreach_cb (G_GNUC_UNUSED gpointer key, gpointer value, gpointer user_data)
 {
     PeerMngForeachData *data = (PeerMngForeachData *) user_data;
     Peer *peer = (Peer *) value;
@@ -176,14 +205,6 @@ static void tbfs_peer_mng_peer_foreach_port (G_GNUC_UNUSED gpointer key, gpointe
     data->func (peer, data->data1, data->data2);
 }
 
-static void tbfs_peer_mng_peer_foreach_addr (G_GNUC_UNUSED gpointer key, gpointer value, gpointer user_data)
-{
-    PeerMngForeachData *data = (PeerMngForeachData *) user_data;
-    PeerAddr *p_addr = (PeerAddr *) value;
-
-    g_hash_table_foreach (p_addr->h_peers, tbfs_peer_mng_peer_foreach_port, data);
-}
-
 static void tbfs_peer_mng_peer_foreach (PeerMng *mng, peer_func func, gpointer data1, gpointer data2)
 {
     PeerMngForeachData *data;
@@ -192,10 +213,20 @@ static void tbfs_peer_mng_peer_foreach (PeerMng *mng, peer_func func, gpointer d
     data->data1 = data1;
     data->data2 = data2;
 
-    g_hash_table_foreach (mng->h_peer_addrs, tbfs_peer_mng_peer_foreach_addr, data);
+    g_hash_table_foreach (mng->h_peers, tbfs_peer_mng_peer_foreach_cb, data);
 
     g_free (data);
 }
+
+static void tbfs_peer_mng_foreach_peer_cb (Peer *peer, PeerMngForeachFunc func, gpointer data)
+{
+    func (peer, data);
+}
+
+void tbfs_peer_mng_foreach_peer (PeerMng *mng, PeerMngForeachFunc func, gpointer data)
+{
+    tbfs_peer_mng_peer_foreach (mng, (peer_func) tbfs_peer_mng_foreach_peer_cb, func, data);
+}
 /*}}}*/
 
 /*{{{ on_timer_cb */
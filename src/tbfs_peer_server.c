@@ -16,6 +16,7 @@
  */
 #include "tbfs_peer_server.h"
 #include "tbfs_peer_client.h"
+#include "tbfs_shard.h"
 
 struct _PeerServer {
     Application *app;
@@ -81,7 +82,8 @@ static void tbfs_peer_server_on_connection_cb (G_GNUC_UNUSED struct evconnlisten
         g_ntohs (((struct sockaddr_in *)address)->sin_port)
     );
 
-    client = tbfs_peer_client_create (server->app, fd);
+    // handshake is read in the main loop, then the client is moved to the torrent's shard
+    client = tbfs_peer_client_create (server->app, tbfs_shard_pool_get_main (application_get_shard_pool (server->app)), fd);
     if (!client) {
         close (fd);
         return;
@@ -0,0 +1,412 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "tbfs_shard.h"
+#include "tbfs_torrent.h"
+
+/*{{{ struct */
+typedef struct _ShardTask ShardTask;
+
+struct _ShardTask {
+    ShardTaskFunc func;
+    gpointer data;
+    GDestroyNotify cancel; // frees data of a task which never ran, can be NULL
+    ShardTask *next;
+};
+
+// each Shard runs its own event_base, torrents are assigned to shards by info_hash
+struct _Shard {
+    ShardPool *pool;
+    guint id;
+
+    struct event_base *evbase;
+    gboolean own_evbase; // FALSE for the main loop
+    GThread *thread; // NULL if running in the main thread
+
+    // lock-free MPSC queue: producers push on the stack, the shard takes the whole stack at once
+    ShardTask *q_tasks;
+    struct event *ev_wake;
+
+    GHashTable *h_torrents; // accessed only from the shard's thread
+    GHashTable *h_active_torrents; // torrents with PeerMng, checked for idleness
+    struct event *ev_idle_timer;
+    gint32 idle_sec;
+};
+
+struct _ShardPool {
+    Application *app;
+
+    Shard *main; // application event loop
+    Shard **shards;
+    guint count;
+};
+
+#define SHARD_LOG "shard"
+
+static Shard *tbfs_shard_create (ShardPool *pool, guint id, struct event_base *evbase);
+static void tbfs_shard_destroy (Shard *shard);
+static void tbfs_shard_on_wake_cb (evutil_socket_t fd, short events, void *arg);
+static void tbfs_shard_on_idle_timer_cb (evutil_socket_t fd, short events, void *arg);
+/*}}}*/
+
+/*{{{ create / destroy */
+ShardPool *tbfs_shard_pool_create (Application *app)
+{
+    ShardPool *pool;
+    gint count;
+    guint i;
+
+    pool = g_new0 (ShardPool, 1);
+    pool->app = app;
+
+    pool->main = tbfs_shard_create (pool, 0, application_get_evbase (app));
+    if (!pool->main) {
+        g_free (pool);
+        return NULL;
+    }
+
+    count = conf_get_int (application_get_conf (app), "app.shards");
+    if (count <= 0)
+        count = 1;
+
+    pool->count = count;
+    pool->shards = g_new0 (Shard *, pool->count);
+
+    // a single shard runs inside the main loop, no threads are used
+    if (pool->count == 1) {
+        pool->shards[0] = pool->main;
+        LOG_debug (SHARD_LOG, "Running single shard in the main loop");
+        return pool;
+    }
+
+    for (i = 0; i < pool->count; i++) {
+        struct event_base *evbase;
+
+        evbase = event_base_new ();
+        if (!evbase) {
+            LOG_err (SHARD_LOG, "Failed to create event base for shard %u !", i);
+            tbfs_shard_pool_destroy (pool);
+            return NULL;
+        }
+
+        pool->shards[i] = tbfs_shard_create (pool, i, evbase);
+        if (!pool->shards[i]) {
+            event_base_free (evbase);
+            tbfs_shard_pool_destroy (pool);
+            return NULL;
+        }
+        pool->shards[i]->own_evbase = TRUE;
+    }
+
+    LOG_msg (SHARD_LOG, "Created %u shards", pool->count);
+
+    return pool;
+}
+
+void tbfs_shard_pool_destroy (ShardPool *pool)
+{
+    guint i;
+
+    tbfs_shard_pool_stop (pool);
+
+    for (i = 0; i < pool->count; i++) {
+        if (pool->shards[i] && pool->shards[i] != pool->main)
+            tbfs_shard_destroy (pool->shards[i]);
+    }
+    g_free (pool->shards);
+
+    if (pool->main)
+        tbfs_shard_destroy (pool->main);
+
+    g_free (pool);
+}
+
+static Shard *tbfs_shard_create (ShardPool *pool, guint id, struct event_base *evbase)
+{
+    Shard *shard;
+
+    shard = g_new0 (Shard, 1);
+    shard->pool = pool;
+    shard->id = id;
+    shard->evbase = evbase;
+    shard->own_evbase = FALSE;
+    shard->thread = NULL;
+    shard->q_tasks = NULL;
+    shard->h_torrents = g_hash_table_new (sha1_hash, sha1_equal);
+    shard->h_active_torrents = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    shard->ev_wake = event_new (evbase, -1, 0, tbfs_shard_on_wake_cb, shard);
+    if (!shard->ev_wake) {
+        LOG_err (SHARD_LOG, "Failed to create wake event for shard %u !", id);
+        g_hash_table_destroy (shard->h_active_torrents);
+        g_hash_table_destroy (shard->h_torrents);
+        g_free (shard);
+        return NULL;
+    }
+
+    // 0 disables hibernation
+    shard->idle_sec = conf_get_int (application_get_conf (pool->app), "torrent.idle_sec");
+    if (shard->idle_sec > 0) {
+        struct timeval tv;
+
+        shard->ev_idle_timer = event_new (evbase, -1, EV_PERSIST, tbfs_shard_on_idle_timer_cb, shard);
+        tv.tv_sec = shard->idle_sec;
+        tv.tv_usec = 0;
+        event_add (shard->ev_idle_timer, &tv);
+    }
+
+    return shard;
+}
+
+static void tbfs_shard_destroy (Shard *shard)
+{
+    ShardTask *task;
+
+    // drop tasks which were never executed, objects they point to may be gone already
+    task = shard->q_tasks;
+    while (task) {
+        ShardTask *next = task->next;
+        if (task->cancel)
+            task->cancel (task->data);
+        g_free (task);
+        task = next;
+    }
+
+    if (shard->ev_idle_timer)
+        event_free (shard->ev_idle_timer);
+    event_free (shard->ev_wake);
+    g_hash_table_destroy (shard->h_active_torrents);
+    g_hash_table_destroy (shard->h_torrents);
+    if (shard->own_evbase)
+        event_base_free (shard->evbase);
+    g_free (shard);
+}
+/*}}}*/
+
+/*{{{ start / stop */
+static gpointer tbfs_shard_thread_func (gpointer data)
+{
+    Shard *shard = (Shard *) data;
+
+    LOG_debug (SHARD_LOG, "[shard: %u] Started", shard->id);
+    event_base_loop (shard->evbase, EVLOOP_NO_EXIT_ON_EMPTY);
+    LOG_debug (SHARD_LOG, "[shard: %u] Stopped", shard->id);
+
+    return NULL;
+}
+
+gboolean tbfs_shard_pool_start (ShardPool *pool)
+{
+    guint i;
+
+    for (i = 0; i < pool->count; i++) {
+        Shard *shard = pool->shards[i];
+        GError *error = NULL;
+
+        if (shard == pool->main || shard->thread)
+            continue;
+
+        shard->thread = g_thread_try_new ("tbfs_shard", tbfs_shard_thread_func, shard, &error);
+        if (!shard->thread) {
+            LOG_err (SHARD_LOG, "Failed to start shard %u: %s", i, error ? error->message : "");
+            if (error)
+                g_error_free (error);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// must be called from the main thread
+void tbfs_shard_pool_stop (ShardPool *pool)
+{
+    guint i;
+
+    for (i = 0; i < pool->count; i++) {
+        Shard *shard = pool->shards[i];
+
+        if (!shard || !shard->thread)
+            continue;
+
+        event_base_loopexit (shard->evbase, NULL);
+        g_thread_join (shard->thread);
+        shard->thread = NULL;
+    }
+}
+/*}}}*/
+
+/*{{{ get / set */
+guint tbfs_shard_pool_get_count (ShardPool *pool)
+{
+    return pool->count;
+}
+
+// returns NULL if info_hash is not a valid hex string
+Shard *tbfs_shard_pool_get_shard (ShardPool *pool, const gchar *info_hash)
+{
+    uint8_t sha1[SHA_DIGEST_LENGTH];
+    guint32 key;
+
+    if (!sha1_hexstr_is_valid (info_hash)) {
+        LOG_err (SHARD_LOG, "Invalid info_hash: %s !", info_hash ? info_hash : "");
+        return NULL;
+    }
+
+    if (pool->count == 1)
+        return pool->shards[0];
+
+    // SHA1 is uniformly distributed, any 4 bytes will do
+    hexstr_to_sha1 (sha1, info_hash);
+    memcpy (&key, sha1, sizeof (key));
+
+    return pool->shards[key % pool->count];
+}
+
+Shard *tbfs_shard_pool_get_main (ShardPool *pool)
+{
+    return pool->main;
+}
+
+Shard *tbfs_shard_pool_get_shard_nth (ShardPool *pool, guint n)
+{
+    if (n >= pool->count)
+        return NULL;
+
+    return pool->shards[n];
+}
+
+struct event_base *tbfs_shard_get_evbase (Shard *shard)
+{
+    return shard->evbase;
+}
+
+guint tbfs_shard_get_id (Shard *shard)
+{
+    return shard->id;
+}
+/*}}}*/
+
+/*{{{ tasks */
+// can be called from any thread
+void tbfs_shard_run (Shard *shard, ShardTaskFunc func, gpointer data)
+{
+    tbfs_shard_run_full (shard, func, data, NULL);
+}
+
+// cancel is called instead of func if the shard is destroyed before the task runs
+void tbfs_shard_run_full (Shard *shard, ShardTaskFunc func, gpointer data, GDestroyNotify cancel)
+{
+    ShardTask *task;
+    ShardTask *head;
+
+    task = g_new0 (ShardTask, 1);
+    task->func = func;
+    task->data = data;
+    task->cancel = cancel;
+
+    do {
+        head = g_atomic_pointer_get (&shard->q_tasks);
+        task->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange (&shard->q_tasks, head, task));
+
+    // queue was empty: the shard is not going to look at it unless woken up
+    if (!head)
+        event_active (shard->ev_wake, EV_READ, 0);
+}
+
+static void tbfs_shard_on_wake_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    Shard *shard = (Shard *) arg;
+    ShardTask *head;
+    ShardTask *prev = NULL;
+
+    // take all queued tasks
+    do {
+        head = g_atomic_pointer_get (&shard->q_tasks);
+    } while (!g_atomic_pointer_compare_and_exchange (&shard->q_tasks, head, NULL));
+
+    // stack -> FIFO
+    while (head) {
+        ShardTask *next = head->next;
+        head->next = prev;
+        prev = head;
+        head = next;
+    }
+
+    while (prev) {
+        ShardTask *next = prev->next;
+        prev->func (prev->data);
+        g_free (prev);
+        prev = next;
+    }
+}
+/*}}}*/
+
+/*{{{ torrents */
+// must be called from the shard's thread
+void tbfs_shard_torrent_add (Shard *shard, Torrent *torrent)
+{
+    // key is the binary info_hash inside the Torrent
+    g_hash_table_insert (shard->h_torrents, (gpointer) tbfs_torrent_get_sha1 (torrent), torrent);
+}
+
+Torrent *tbfs_shard_torrent_get (Shard *shard, const gchar *info_hash)
+{
+    uint8_t sha1[SHA_DIGEST_LENGTH];
+
+    if (!sha1_hexstr_is_valid (info_hash))
+        return NULL;
+
+    hexstr_to_sha1 (sha1, info_hash);
+    return g_hash_table_lookup (shard->h_torrents, sha1);
+}
+
+// func is called with the binary info_hash and Torrent, must be called from the shard's thread
+void tbfs_shard_torrent_foreach (Shard *shard, GHFunc func, gpointer data)
+{
+    g_hash_table_foreach (shard->h_torrents, func, data);
+}
+
+// only active torrents are visited by the idle timer
+void tbfs_shard_torrent_set_active (Shard *shard, Torrent *torrent)
+{
+    g_hash_table_insert (shard->h_active_torrents, torrent, torrent);
+}
+
+guint tbfs_shard_get_active_count (Shard *shard)
+{
+    return g_hash_table_size (shard->h_active_torrents);
+}
+
+static gboolean tbfs_shard_on_idle_torrent (G_GNUC_UNUSED gpointer key, gpointer value, gpointer user_data)
+{
+    Shard *shard = (Shard *) user_data;
+
+    return tbfs_torrent_try_hibernate ((Torrent *) value, time (NULL), shard->idle_sec);
+}
+
+static void tbfs_shard_on_idle_timer_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    Shard *shard = (Shard *) arg;
+    guint count;
+
+    count = g_hash_table_foreach_remove (shard->h_active_torrents, tbfs_shard_on_idle_torrent, shard);
+    if (count)
+        LOG_debug (SHARD_LOG, "[shard: %u] Hibernated %u torrents, %u active", shard->id, count,
+            g_hash_table_size (shard->h_active_torrents));
+}
+/*}}}*/
@@ -0,0 +1,479 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "tbfs_snapshot.h"
+#include "tbfs_mng.h"
+#include "tbfs_torrent.h"
+#include "tbfs_bitfield.h"
+#include "tbfs_shard.h"
+
+/*{{{ struct */
+// Snapshot file layout, all integers are in host byte order:
+//   header: magic[8] torrent_count:u32
+//   record: len:u32 (bytes which follow)
+//           info_hash[20] total_pieces:u32 flags:u8
+//           have[(total_pieces + 7) / 8] [want[(total_pieces + 7) / 8] if SNF_Want]
+//           peer_count:u32 { addr:u32 port:u16 peer_id[20] } * peer_count
+// Records are self-contained, so loader can hand out slices of the mapped file.
+#define SNAPSHOT_MAGIC "TBFSSNP1"
+#define SNAPSHOT_MAGIC_LEN 8
+#define SNAPSHOT_HEADER_LEN (SNAPSHOT_MAGIC_LEN + 4)
+#define SNAPSHOT_PEER_LEN TORRENT_PEER_RECORD_LEN
+
+typedef enum {
+    SNF_SuperSeed = 1 << 0,
+    SNF_Want = 1 << 1,
+} SnapshotFlags;
+
+typedef struct _SnapshotJob SnapshotJob;
+
+struct _Snapshot {
+    Application *app;
+
+    gchar *path;
+    struct event *ev_timer;
+
+    SnapshotJob *job; // NULL unless saving is in progress
+    guint32 max_peers; // per torrent
+};
+
+// one job per save, accessed only from the main thread
+struct _SnapshotJob {
+    Snapshot *snap;
+    Snapshot_on_saved_cb on_saved_cb; // NULL if nobody waits for the file
+    gpointer saved_ctx;
+    guint pending; // shards which didn't send their part yet
+    guint32 torrent_count;
+    GByteArray *buf;
+    gint64 started;
+};
+
+// serialized torrents of a single shard
+typedef struct {
+    SnapshotJob *job;
+    Shard *shard;
+    guint32 max_peers;
+    guint32 torrent_count;
+    GByteArray *buf;
+} SnapshotShardData;
+
+#define SNAP_LOG "snap"
+
+static void tbfs_snapshot_on_timer_cb (evutil_socket_t fd, short events, void *arg);
+/*}}}*/
+
+/*{{{ create / destroy */
+Snapshot *tbfs_snapshot_create (Application *app)
+{
+    Snapshot *snap;
+    gint32 interval;
+
+    snap = g_new0 (Snapshot, 1);
+    snap->app = app;
+    snap->path = g_build_filename (conf_get_string (application_get_conf (app), "storage.dir"),
+        conf_get_string (application_get_conf (app), "snapshot.file"), NULL);
+    snap->max_peers = conf_get_int (application_get_conf (app), "snapshot.max_peers");
+    snap->job = NULL;
+
+    // 0 disables periodic snapshots
+    interval = conf_get_int (application_get_conf (app), "snapshot.interval_sec");
+    if (interval > 0) {
+        struct timeval tv;
+
+        snap->ev_timer = event_new (application_get_evbase (app), -1, EV_PERSIST, tbfs_snapshot_on_timer_cb, snap);
+        tv.tv_sec = interval;
+        tv.tv_usec = 0;
+        event_add (snap->ev_timer, &tv);
+    }
+
+    return snap;
+}
+
+// shards must be stopped, so parts of unfinished job won't arrive
+void tbfs_snapshot_destroy (Snapshot *snap)
+{
+    if (snap->ev_timer)
+        event_free (snap->ev_timer);
+    if (snap->job) {
+        g_byte_array_free (snap->job->buf, TRUE);
+        g_free (snap->job);
+    }
+    g_free (snap->path);
+    g_free (snap);
+}
+/*}}}*/
+
+/*{{{ save */
+static void snapshot_buf_add_u32 (GByteArray *buf, guint32 val)
+{
+    g_byte_array_append (buf, (const guint8 *) &val, sizeof (val));
+}
+
+typedef struct {
+    GByteArray *buf;
+    guint32 max_peers;
+    guint32 count;
+} SnapshotPeersData;
+
+static void tbfs_snapshot_peer_write (const gchar *id, guint32 addr, guint16 port, SnapshotPeersData *pdata)
+{
+    guint8 peer_id[PEER_ID_LENGTH];
+
+    if (pdata->count >= pdata->max_peers)
+        return;
+
+    memset (peer_id, 0, sizeof (peer_id));
+    strncpy ((gchar *) peer_id, id, PEER_ID_LENGTH);
+
+    snapshot_buf_add_u32 (pdata->buf, addr);
+    g_byte_array_append (pdata->buf, (const guint8 *) &port, sizeof (port));
+    g_byte_array_append (pdata->buf, peer_id, PEER_ID_LENGTH);
+    pdata->count++;
+}
+
+// runs in the torrent's shard
+static void tbfs_snapshot_torrent_write (const uint8_t *sha1, Torrent *torrent, SnapshotShardData *sdata)
+{
+    GByteArray *buf = sdata->buf;
+    Bitfield *bf_have;
+    Bitfield *bf_want;
+    guint8 flags = 0;
+    guint rec_start;
+    guint count_pos;
+    guint32 rec_len;
+    guint32 total_pieces;
+    SnapshotPeersData pdata;
+
+    bf_have = tbfs_torrent_get_bitfield_pieces_have (torrent);
+    bf_want = tbfs_torrent_get_bitfield_pieces_want (torrent);
+
+    if (tbfs_torrent_get_super_seed (torrent))
+        flags |= SNF_SuperSeed;
+    if (bf_want)
+        flags |= SNF_Want;
+
+    // record length is patched when record is complete
+    rec_start = buf->len;
+    snapshot_buf_add_u32 (buf, 0);
+
+    g_byte_array_append (buf, sha1, SHA_DIGEST_LENGTH);
+    total_pieces = tbfs_torrent_get_total_pieces (torrent);
+    snapshot_buf_add_u32 (buf, total_pieces);
+    g_byte_array_append (buf, &flags, 1);
+
+    g_byte_array_append (buf, tbfs_bitfield_peek_bits (bf_have), tbfs_bitfield_get_length (bf_have));
+    if (bf_want)
+        g_byte_array_append (buf, tbfs_bitfield_peek_bits (bf_want), tbfs_bitfield_get_length (bf_want));
+
+    // most recent peers, hibernated torrents keep theirs too
+    count_pos = buf->len;
+    snapshot_buf_add_u32 (buf, 0);
+    pdata.buf = buf;
+    pdata.max_peers = sdata->max_peers;
+    pdata.count = 0;
+    tbfs_torrent_foreach_known_peer (torrent, (TorrentPeerFunc) tbfs_snapshot_peer_write, &pdata);
+    memcpy (buf->data + count_pos, &pdata.count, sizeof (guint32));
+
+    rec_len = buf->len - rec_start - sizeof (guint32);
+    memcpy (buf->data + rec_start, &rec_len, sizeof (guint32));
+
+    sdata->torrent_count++;
+}
+
+static void tbfs_snapshot_write_file (Snapshot *snap, SnapshotJob *job)
+{
+    GError *error = NULL;
+
+    memcpy (job->buf->data + SNAPSHOT_MAGIC_LEN, &job->torrent_count, sizeof (guint32));
+
+    // g_file_set_contents () writes a temporary file and renames it over the old one
+    if (!g_file_set_contents (snap->path, (const gchar *) job->buf->data, job->buf->len, &error)) {
+        LOG_err (SNAP_LOG, "Failed to write snapshot %s: %s", snap->path, error->message);
+        g_error_free (error);
+        return;
+    }
+
+    LOG_msg (SNAP_LOG, "Snapshot saved: %u torrents, %u bytes, %"G_GINT64_FORMAT" ms",
+        job->torrent_count, job->buf->len, (g_get_monotonic_time () - job->started) / 1000);
+}
+
+// the job itself is freed by tbfs_snapshot_destroy ()
+static void tbfs_snapshot_shard_data_free (SnapshotShardData *sdata)
+{
+    g_byte_array_free (sdata->buf, TRUE);
+    g_free (sdata);
+}
+
+// runs in the main thread
+static void tbfs_snapshot_on_shard_done_task (SnapshotShardData *sdata)
+{
+    SnapshotJob *job = sdata->job;
+    Snapshot *snap = job->snap;
+
+    g_byte_array_append (job->buf, sdata->buf->data, sdata->buf->len);
+    job->torrent_count += sdata->torrent_count;
+    job->pending--;
+
+    tbfs_snapshot_shard_data_free (sdata);
+
+    if (job->pending)
+        return;
+
+    tbfs_snapshot_write_file (snap, job);
+
+    snap->job = NULL;
+    if (job->on_saved_cb)
+        job->on_saved_cb (job->saved_ctx);
+    g_byte_array_free (job->buf, TRUE);
+    g_free (job);
+}
+
+// runs in the shard
+static void tbfs_snapshot_on_shard_task (SnapshotShardData *sdata)
+{
+    tbfs_shard_torrent_foreach (sdata->shard, (GHFunc) tbfs_snapshot_torrent_write, sdata);
+
+    tbfs_shard_run_full (tbfs_shard_pool_get_main (application_get_shard_pool (sdata->job->snap->app)),
+        (ShardTaskFunc) tbfs_snapshot_on_shard_done_task, sdata, (GDestroyNotify) tbfs_snapshot_shard_data_free);
+}
+
+// every shard serializes its own torrents, the main thread writes the file
+// on_saved_cb is called once the file is written or failed to, shards must be running till then
+void tbfs_snapshot_save (Snapshot *snap, Snapshot_on_saved_cb on_saved_cb, gpointer ctx)
+{
+    ShardPool *pool = application_get_shard_pool (snap->app);
+    SnapshotJob *job;
+    guint i;
+
+    if (snap->job) {
+        LOG_debug (SNAP_LOG, "Snapshot is being saved, skipping");
+        if (on_saved_cb && !snap->job->on_saved_cb) {
+            snap->job->on_saved_cb = on_saved_cb;
+            snap->job->saved_ctx = ctx;
+        }
+        return;
+    }
+
+    job = g_new0 (SnapshotJob, 1);
+    job->snap = snap;
+    job->on_saved_cb = on_saved_cb;
+    job->saved_ctx = ctx;
+    job->pending = tbfs_shard_pool_get_count (pool);
+    job->started = g_get_monotonic_time ();
+    job->buf = g_byte_array_new ();
+    g_byte_array_append (job->buf, (const guint8 *) SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    snapshot_buf_add_u32 (job->buf, 0);
+    snap->job = job;
+
+    for (i = 0; i < tbfs_shard_pool_get_count (pool); i++) {
+        SnapshotShardData *sdata;
+
+        sdata = g_new0 (SnapshotShardData, 1);
+        sdata->job = job;
+        sdata->shard = tbfs_shard_pool_get_shard_nth (pool, i);
+        sdata->max_peers = snap->max_peers;
+        sdata->buf = g_byte_array_new ();
+
+        tbfs_shard_run_full (sdata->shard, (ShardTaskFunc) tbfs_snapshot_on_shard_task, sdata,
+            (GDestroyNotify) tbfs_snapshot_shard_data_free);
+    }
+}
+
+static void tbfs_snapshot_on_timer_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    Snapshot *snap = (Snapshot *) arg;
+
+    tbfs_snapshot_save (snap, NULL, NULL);
+}
+/*}}}*/
+
+/*{{{ load */
+typedef struct {
+    Torrent *torrent;
+    GBytes *record; // slice of the mapped snapshot file
+} SnapshotRestoreData;
+
+static void tbfs_snapshot_restore_data_free (SnapshotRestoreData *rdata)
+{
+    g_bytes_unref (rdata->record);
+    g_free (rdata);
+}
+
+// runs in the torrent's shard, record is already validated
+static void tbfs_snapshot_on_restore_task (SnapshotRestoreData *rdata)
+{
+    Torrent *torrent = rdata->torrent;
+    const guint8 *data;
+    gsize len;
+    guint32 total_pieces;
+    guint64 bf_len;
+    guint32 peer_count;
+    guint32 i;
+    guint8 flags;
+    const guint8 *bits_have;
+    const guint8 *bits_want = NULL;
+
+    data = g_bytes_get_data (rdata->record, &len);
+
+    data += SHA_DIGEST_LENGTH;
+    memcpy (&total_pieces, data, sizeof (guint32)); data += sizeof (guint32);
+    flags = *data; data++;
+    bf_len = (total_pieces + 7u) / 8u;
+
+    bits_have = data; data += bf_len;
+    if (flags & SNF_Want) {
+        bits_want = data;
+        data += bf_len;
+    }
+
+    tbfs_torrent_set_pieces_have_bits (torrent, bits_have, bf_len);
+    if (flags & SNF_SuperSeed)
+        tbfs_torrent_set_super_seed (torrent, TRUE);
+
+    // rebuild wanted queue, torrent becomes active if anything is still missing
+    if (bits_want) {
+        for (i = 0; i < total_pieces; i++) {
+            gboolean want = (bits_want[i >> 3u] & (0x80 >> (i & 7u))) != 0;
+            gboolean have = (bits_have[i >> 3u] & (0x80 >> (i & 7u))) != 0;
+
+            if (want && !have)
+                tbfs_torrent_add_piece (torrent, i);
+        }
+    }
+
+    // peer records are stored the way torrent keeps them
+    memcpy (&peer_count, data, sizeof (guint32)); data += sizeof (guint32);
+    tbfs_torrent_add_known_peers (torrent, data, peer_count);
+
+    tbfs_snapshot_restore_data_free (rdata);
+}
+
+// checks that record fields fit into record length
+static gboolean tbfs_snapshot_record_validate (const guint8 *data, guint32 len, guint32 *total_pieces)
+{
+    guint32 bf_len;
+    guint32 peer_count;
+    gsize need;
+    guint8 flags;
+
+    need = SHA_DIGEST_LENGTH + sizeof (guint32) + 1;
+    if (len < need)
+        return FALSE;
+
+    memcpy (total_pieces, data + SHA_DIGEST_LENGTH, sizeof (guint32));
+    flags = data[SHA_DIGEST_LENGTH + sizeof (guint32)];
+    bf_len = ((guint64) *total_pieces + 7u) / 8u;
+
+    // bitfield must fit into the record, checked before it's added to need
+    if (bf_len > len)
+        return FALSE;
+
+    need += bf_len;
+    if (flags & SNF_Want)
+        need += bf_len;
+    need += sizeof (guint32);
+    if (len < need)
+        return FALSE;
+
+    memcpy (&peer_count, data + need - sizeof (guint32), sizeof (guint32));
+
+    return len == need + (gsize) peer_count * SNAPSHOT_PEER_LEN;
+}
+
+// registers torrents from the snapshot file, returns FALSE if file is missing or broken
+gboolean tbfs_snapshot_load (Snapshot *snap, TBFSMng *mng)
+{
+    GMappedFile *mfile;
+    GBytes *bytes;
+    GError *error = NULL;
+    const guint8 *data;
+    gsize len;
+    gsize pos;
+    guint32 torrent_count;
+    guint32 restored = 0;
+    guint32 i;
+    gint32 spread_sec;
+    gint64 started = g_get_monotonic_time ();
+
+    if (!g_file_test (snap->path, G_FILE_TEST_EXISTS)) {
+        LOG_debug (SNAP_LOG, "Snapshot %s does not exist", snap->path);
+        return FALSE;
+    }
+
+    mfile = g_mapped_file_new (snap->path, FALSE, &error);
+    if (!mfile) {
+        LOG_err (SNAP_LOG, "Failed to open snapshot %s: %s", snap->path, error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    // records keep a reference to the mapping until they are restored
+    bytes = g_mapped_file_get_bytes (mfile);
+    g_mapped_file_unref (mfile);
+
+    data = g_bytes_get_data (bytes, &len);
+    if (len < SNAPSHOT_HEADER_LEN || memcmp (data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN)) {
+        LOG_err (SNAP_LOG, "Snapshot %s has unknown format !", snap->path);
+        g_bytes_unref (bytes);
+        return FALSE;
+    }
+    memcpy (&torrent_count, data + SNAPSHOT_MAGIC_LEN, sizeof (guint32));
+
+    // restored torrents already know their peers, spread announces over time
+    spread_sec = conf_get_int (application_get_conf (snap->app), "snapshot.announce_spread_sec");
+
+    pos = SNAPSHOT_HEADER_LEN;
+    for (i = 0; i < torrent_count; i++) {
+        gchar info_hash[2 * SHA_DIGEST_LENGTH + 1];
+        SnapshotRestoreData *rdata;
+        Torrent *torrent;
+        guint32 rec_len;
+        guint32 total_pieces;
+
+        if (pos + sizeof (guint32) > len)
+            break;
+        memcpy (&rec_len, data + pos, sizeof (guint32));
+        pos += sizeof (guint32);
+
+        if (pos + rec_len > len || !tbfs_snapshot_record_validate (data + pos, rec_len, &total_pieces)) {
+            LOG_err (SNAP_LOG, "Snapshot %s is truncated, %u of %u torrents restored !", snap->path, restored, torrent_count);
+            break;
+        }
+
+        sha1_to_hexstr (info_hash, data + pos);
+
+        torrent = tbfs_mng_torrent_register_delayed (mng, info_hash, total_pieces,
+            spread_sec > 0 ? g_random_int_range (0, spread_sec + 1) : 0);
+        if (torrent) {
+            rdata = g_new0 (SnapshotRestoreData, 1);
+            rdata->torrent = torrent;
+            rdata->record = g_bytes_new_from_bytes (bytes, pos, rec_len);
+            tbfs_shard_run_full (tbfs_torrent_get_shard (torrent), (ShardTaskFunc) tbfs_snapshot_on_restore_task, rdata,
+                (GDestroyNotify) tbfs_snapshot_restore_data_free);
+            restored++;
+        }
+
+        pos += rec_len;
+    }
+
+    g_bytes_unref (bytes);
+
+    LOG_msg (SNAP_LOG, "Snapshot loaded: %u torrents, %"G_GINT64_FORMAT" ms",
+        restored, (g_get_monotonic_time () - started) / 1000);
+
+    return TRUE;
+}
+/*}}}*/
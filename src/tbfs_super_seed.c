@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "tbfs_super_seed.h"
+#include "tbfs_bitfield.h"
+
+/*{{{ struct */
+// BEP 16: instead of a full bitfield every peer is offered one piece at a time,
+// a new piece is revealed only after the previous one was seen on another peer
+struct _SuperSeed {
+    Torrent *torrent;
+    guint32 total_pieces;
+
+    guint32 *piece_advertised; // how many times piece was offered to peers
+    guint32 *piece_seen; // how many peers reported HAVE for piece
+    guint32 next_piece; // round-robin position for the next offer
+
+    GHashTable *h_peers; // PeerClient -> SuperSeedPeer
+};
+
+typedef struct {
+    PeerClient *client;
+    Bitfield *bf_have; // pieces reported by peer
+    gint64 piece_idx; // currently offered piece, -1 if none
+} SuperSeedPeer;
+
+#define SSEED_LOG "sseed"
+
+static void tbfs_super_seed_peer_destroy (SuperSeedPeer *speer);
+/*}}}*/
+
+/*{{{ create / destroy */
+SuperSeed *tbfs_super_seed_create (Torrent *torrent)
+{
+    SuperSeed *ss;
+
+    ss = g_new0 (SuperSeed, 1);
+    ss->torrent = torrent;
+    ss->total_pieces = tbfs_bitfield_get_bit_count (tbfs_torrent_get_bitfield_pieces_have (torrent));
+    ss->piece_advertised = g_new0 (guint32, ss->total_pieces);
+    ss->piece_seen = g_new0 (guint32, ss->total_pieces);
+    ss->next_piece = 0;
+    ss->h_peers = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) tbfs_super_seed_peer_destroy);
+
+    LOG_debug (SSEED_LOG, "[t: %s] Super-seeding enabled", tbfs_torrent_get_info_hash (torrent));
+
+    return ss;
+}
+
+void tbfs_super_seed_destroy (SuperSeed *ss)
+{
+    g_hash_table_destroy (ss->h_peers);
+    g_free (ss->piece_advertised);
+    g_free (ss->piece_seen);
+    g_free (ss);
+}
+
+static void tbfs_super_seed_peer_destroy (SuperSeedPeer *speer)
+{
+    tbfs_bitfield_destroy (speer->bf_have);
+    g_free (speer);
+}
+/*}}}*/
+
+/*{{{ advertise */
+// returns the least distributed piece we have and peer does not, -1 if none
+static gint64 tbfs_super_seed_piece_pick (SuperSeed *ss, SuperSeedPeer *speer)
+{
+    Bitfield *bf_have;
+    gint64 best = -1;
+    guint32 best_score = G_MAXUINT32;
+    guint32 pass;
+
+    bf_have = tbfs_torrent_get_bitfield_pieces_have (ss->torrent);
+
+    // pieces we have and peer does not, starting at next_piece and wrapping around
+    for (pass = 0; pass < 2 && best_score; pass++) {
+        guint32 end = pass ? ss->next_piece : ss->total_pieces;
+        gint64 idx;
+
+        for (idx = tbfs_bitfield_find_next_and_not (bf_have, speer->bf_have, pass ? 0 : ss->next_piece);
+             idx >= 0 && idx < end;
+             idx = tbfs_bitfield_find_next_and_not (bf_have, speer->bf_have, idx + 1)) {
+            guint32 score;
+
+            if (idx == speer->piece_idx)
+                continue;
+
+            score = ss->piece_advertised[idx] + ss->piece_seen[idx];
+            if (score < best_score) {
+                best = idx;
+                best_score = score;
+                // never offered and nobody has it yet, can't do better
+                if (!score)
+                    break;
+            }
+        }
+    }
+
+    if (best >= 0)
+        ss->next_piece = (best + 1) % ss->total_pieces;
+
+    return best;
+}
+
+static void tbfs_super_seed_advertise (SuperSeed *ss, SuperSeedPeer *speer)
+{
+    gint64 piece_idx;
+
+    piece_idx = tbfs_super_seed_piece_pick (ss, speer);
+    if (piece_idx < 0) {
+        LOG_debug (SSEED_LOG, "[t: %s] No more pieces to offer to [pc: %p]",
+            tbfs_torrent_get_info_hash (ss->torrent), speer->client);
+        speer->piece_idx = -1;
+        return;
+    }
+
+    speer->piece_idx = piece_idx;
+    ss->piece_advertised[piece_idx]++;
+
+    LOG_debug (SSEED_LOG, "[t: %s] Offering piece %"G_GINT64_FORMAT" to [pc: %p]",
+        tbfs_torrent_get_info_hash (ss->torrent), piece_idx, speer->client);
+
+    tbfs_peer_client_send_have (speer->client, (guint32) piece_idx);
+}
+/*}}}*/
+
+/*{{{ peers */
+void tbfs_super_seed_peer_add (SuperSeed *ss, PeerClient *client)
+{
+    SuperSeedPeer *speer;
+
+    if (g_hash_table_lookup (ss->h_peers, client))
+        return;
+
+    speer = g_new0 (SuperSeedPeer, 1);
+    speer->client = client;
+    speer->bf_have = tbfs_bitfield_create (ss->total_pieces);
+    speer->piece_idx = -1;
+
+    g_hash_table_insert (ss->h_peers, client, speer);
+
+    tbfs_super_seed_advertise (ss, speer);
+}
+
+void tbfs_super_seed_peer_remove (SuperSeed *ss, PeerClient *client)
+{
+    g_hash_table_remove (ss->h_peers, client);
+}
+
+// peer's Bitfield message: pieces it already has are never offered to it
+void tbfs_super_seed_peer_bitfield (SuperSeed *ss, PeerClient *client, const guint8 *bits, guint32 len)
+{
+    SuperSeedPeer *speer;
+    Bitfield *bf;
+    gint64 idx;
+
+    speer = g_hash_table_lookup (ss->h_peers, client);
+    if (!speer)
+        return;
+
+    bf = tbfs_bitfield_create (ss->total_pieces);
+    if (!tbfs_bitfield_set_bits (bf, bits, len)) {
+        LOG_err (SSEED_LOG, "[t: %s] Invalid bitfield from [pc: %p]", tbfs_torrent_get_info_hash (ss->torrent), client);
+        tbfs_bitfield_destroy (bf);
+        return;
+    }
+
+    for (idx = tbfs_bitfield_find_next_and_not (bf, speer->bf_have, 0); idx >= 0;
+         idx = tbfs_bitfield_find_next_and_not (bf, speer->bf_have, idx + 1))
+        ss->piece_seen[idx]++;
+
+    tbfs_bitfield_or (speer->bf_have, bf);
+    tbfs_bitfield_destroy (bf);
+
+    // the piece offered on connect turned out to be known already
+    if (speer->piece_idx >= 0 && tbfs_bitfield_get_bit (speer->bf_have, speer->piece_idx))
+        tbfs_super_seed_advertise (ss, speer);
+}
+
+void tbfs_super_seed_peer_have (SuperSeed *ss, PeerClient *client, guint32 piece_idx)
+{
+    SuperSeedPeer *speer;
+    GHashTableIter iter;
+    gpointer value;
+
+    if (piece_idx >= ss->total_pieces) {
+        LOG_err (SSEED_LOG, "[t: %s] Invalid piece index: %u", tbfs_torrent_get_info_hash (ss->torrent), piece_idx);
+        return;
+    }
+
+    speer = g_hash_table_lookup (ss->h_peers, client);
+    if (!speer)
+        return;
+
+    if (tbfs_bitfield_get_bit (speer->bf_have, piece_idx))
+        return;
+
+    tbfs_bitfield_set_bit (speer->bf_have, piece_idx);
+    ss->piece_seen[piece_idx]++;
+
+    // the piece reached another peer: reveal a new one to everybody who got it from us
+    g_hash_table_iter_init (&iter, ss->h_peers);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        SuperSeedPeer *other = (SuperSeedPeer *) value;
+
+        if (other != speer && other->piece_idx == (gint64) piece_idx)
+            tbfs_super_seed_advertise (ss, other);
+    }
+
+    // nobody else to propagate to, don't stall the only peer
+    if (speer->piece_idx == (gint64) piece_idx && g_hash_table_size (ss->h_peers) == 1)
+        tbfs_super_seed_advertise (ss, speer);
+}
+/*}}}*/
@@ -16,60 +16,428 @@
  */
 #include "tbfs_torrent.h"
 #include "tbfs_peer_mng.h"
+#include "tbfs_super_seed.h"
+#include "tbfs_shard.h"
+#include "tbfs_metainfo.h"
+#include "tbfs_mng.h"
 
 /*{{{ structs */
+// have bitfield is allocated together with the Torrent, right after the struct
 struct _Torrent {
     Application *app;
-    gchar *info_hash;
+    Shard *shard; // all torrent's objects live in the shard's thread
 
-    guint32 total_pieces;
-    Bitfield *bf_pieces_want;
+    Bitfield *bf_pieces_want; // NULL until a piece is wanted
     Bitfield *bf_pieces_have;
 
-    PeerMng *pmng;
+    PeerMng *pmng; // NULL while torrent is hibernated
+    SuperSeed *ss; // NULL unless super-seeding
+    Metainfo *mi; // piece hashes, NULL unless loaded from a .torrent file
+    GBytes *bf_msg; // encoded Bitfield message of have bitfield, NULL until first sent
+    GBytes *known_peers; // TORRENT_PEER_RECORD_LEN records kept while hibernated, NULL if none
+
+    time_t last_active;
+    guint32 total_pieces;
+    gint32 clients; // connected incoming peer clients
+
+    // read by TBFSMng for announces, atomic
+    guint64 uploaded; // bytes, peer wire traffic
+    guint64 downloaded;
+    gint pieces_missing;
+    gint numwant; // peers still needed
+
+    uint8_t info_hash[SHA_DIGEST_LENGTH]; // binary, hex form is built on demand
 };
+
+#define TORRENT_LOG "torrent"
 /*}}}*/
 
 /*{{{ create / destroy */
 Torrent *tbfs_torrent_create (Application *app, const gchar *info_hash, guint32 total_pieces)
 {
     Torrent *torrent;
+    Shard *shard;
 
-    torrent = g_new0 (Torrent, 1);
+    shard = tbfs_shard_pool_get_shard (application_get_shard_pool (app), info_hash);
+    if (!shard)
+        return NULL;
+
+    torrent = g_malloc0 (tbfs_torrent_sizeof (total_pieces));
     torrent->app = app;
-    torrent->info_hash = g_strdup (info_hash);
-    torrent->bf_pieces_want = tbfs_bitfield_create (total_pieces);
-    torrent->bf_pieces_have = tbfs_bitfield_create (total_pieces);
+    hexstr_to_sha1 (torrent->info_hash, info_hash);
+    torrent->shard = shard;
+    torrent->total_pieces = total_pieces;
+    torrent->bf_pieces_have = tbfs_bitfield_init ((guint8 *) torrent + sizeof (Torrent), total_pieces);
+
+    // dormant until pieces are wanted or peers connect
+    torrent->bf_pieces_want = NULL;
+    torrent->pmng = NULL;
+    torrent->ss = NULL;
+    torrent->mi = NULL;
+    torrent->bf_msg = NULL;
+    torrent->known_peers = NULL;
+    torrent->last_active = 0;
+    torrent->clients = 0;
+    torrent->uploaded = 0;
+    torrent->downloaded = 0;
+    torrent->pieces_missing = total_pieces;
+    torrent->numwant = 0;
 
-    torrent->pmng = tbfs_peer_mng_create (app, torrent);
+    if (conf_get_boolean (application_get_conf (app), "torrent.super_seed"))
+        tbfs_torrent_set_super_seed (torrent, TRUE);
 
     return torrent;
 }
 
 void tbfs_torrent_destroy (Torrent *torrent)
 {
-    tbfs_peer_mng_destroy (torrent->pmng);
-    tbfs_bitfield_destroy (torrent->bf_pieces_want);
-    tbfs_bitfield_destroy (torrent->bf_pieces_have);
-    g_free (torrent->info_hash);
+    if (torrent->ss)
+        tbfs_super_seed_destroy (torrent->ss);
+    if (torrent->pmng)
+        tbfs_peer_mng_destroy (torrent->pmng);
+    if (torrent->bf_pieces_want)
+        tbfs_bitfield_destroy (torrent->bf_pieces_want);
+    if (torrent->mi)
+        tbfs_metainfo_destroy (torrent->mi);
+    if (torrent->bf_msg)
+        g_bytes_unref (torrent->bf_msg);
+    if (torrent->known_peers)
+        g_bytes_unref (torrent->known_peers);
     g_free (torrent);
 }
+
+// memory used by a dormant torrent
+gsize tbfs_torrent_sizeof (guint32 total_pieces)
+{
+    return sizeof (Torrent) + tbfs_bitfield_sizeof (total_pieces);
+}
 /*}}}*/
 
-const gchar *tbfs_torrent_get_info_hash (Torrent *torrent)
+const uint8_t *tbfs_torrent_get_sha1 (Torrent *torrent)
 {
     return torrent->info_hash;
 }
 
+static GPrivate torrent_hex_buf = G_PRIVATE_INIT (g_free);
+
+// hex info_hash in a per-thread buffer, valid until the next call from the same thread
+const gchar *tbfs_torrent_get_info_hash (Torrent *torrent)
+{
+    gchar *hex = g_private_get (&torrent_hex_buf);
+
+    if (!hex) {
+        hex = g_malloc (2 * SHA_DIGEST_LENGTH + 1);
+        g_private_set (&torrent_hex_buf, hex);
+    }
+    sha1_to_hexstr (hex, torrent->info_hash);
+
+    return hex;
+}
+
+guint32 tbfs_torrent_get_total_pieces (Torrent *torrent)
+{
+    return torrent->total_pieces;
+}
+
+// NULL if torrent is hibernated
+PeerMng *tbfs_torrent_get_peer_mng (Torrent *torrent)
+{
+    return torrent->pmng;
+}
+
+Shard *tbfs_torrent_get_shard (Torrent *torrent)
+{
+    return torrent->shard;
+}
+
+// torrent takes ownership of mi
+void tbfs_torrent_set_metainfo (Torrent *torrent, Metainfo *mi)
+{
+    if (torrent->mi)
+        tbfs_metainfo_destroy (torrent->mi);
+    torrent->mi = mi;
+}
+
+Metainfo *tbfs_torrent_get_metainfo (Torrent *torrent)
+{
+    return torrent->mi;
+}
+
+struct event_base *tbfs_torrent_get_evbase (Torrent *torrent)
+{
+    return tbfs_shard_get_evbase (torrent->shard);
+}
+
+/*{{{ known peers */
+// record: addr:u32 port:u16 peer_id[20], the same as peers are saved in snapshot
+static void tbfs_torrent_peer_record_append (GByteArray *buf, const gchar *peer_id, guint32 addr, guint16 port)
+{
+    guint8 id[PEER_ID_LENGTH];
+
+    memset (id, 0, sizeof (id));
+    strncpy ((gchar *) id, peer_id, PEER_ID_LENGTH);
+
+    g_byte_array_append (buf, (const guint8 *) &addr, sizeof (addr));
+    g_byte_array_append (buf, (const guint8 *) &port, sizeof (port));
+    g_byte_array_append (buf, id, PEER_ID_LENGTH);
+}
+
+static void tbfs_torrent_peer_record_read (const guint8 *rec, gchar *peer_id, guint32 *addr, guint16 *port)
+{
+    memcpy (addr, rec, sizeof (guint32));
+    memcpy (port, rec + sizeof (guint32), sizeof (guint16));
+    memcpy (peer_id, rec + sizeof (guint32) + sizeof (guint16), PEER_ID_LENGTH);
+    peer_id[PEER_ID_LENGTH] = '\0';
+}
+
+typedef struct {
+    GByteArray *buf;
+    guint max_peers;
+    guint count;
+} TorrentPeersPackData;
+
+static void tbfs_torrent_peer_pack (Peer *peer, TorrentPeersPackData *pdata)
+{
+    guint32 addr;
+    guint16 port;
+
+    if (pdata->count >= pdata->max_peers)
+        return;
+
+    tbfs_peer_get_addr (peer, &addr, &port);
+    tbfs_torrent_peer_record_append (pdata->buf, tbfs_peer_get_id (peer), addr, port);
+    pdata->count++;
+}
+
+// up to torrent.max_peers peers of PeerMng, NULL if there are none
+static GBytes *tbfs_torrent_peers_pack (Torrent *torrent)
+{
+    TorrentPeersPackData pdata;
+
+    if (!tbfs_peer_mng_peer_count (torrent->pmng))
+        return NULL;
+
+    pdata.buf = g_byte_array_new ();
+    pdata.max_peers = MAX (0, conf_get_int (application_get_conf (torrent->app), "torrent.max_peers"));
+    pdata.count = 0;
+    tbfs_peer_mng_foreach_peer (torrent->pmng, (PeerMngForeachFunc) tbfs_torrent_peer_pack, &pdata);
+
+    if (!pdata.count) {
+        g_byte_array_free (pdata.buf, TRUE);
+        return NULL;
+    }
+
+    return g_byte_array_free_to_bytes (pdata.buf);
+}
+
+static void tbfs_torrent_peers_unpack (Torrent *torrent, const guint8 *recs, gsize len)
+{
+    gchar peer_id[PEER_ID_LENGTH + 1];
+    guint32 addr;
+    guint16 port;
+    gsize pos;
+
+    for (pos = 0; pos + TORRENT_PEER_RECORD_LEN <= len; pos += TORRENT_PEER_RECORD_LEN) {
+        tbfs_torrent_peer_record_read (recs + pos, peer_id, &addr, &port);
+        tbfs_peer_mng_peer_add (torrent->pmng, peer_id, addr, port);
+    }
+}
+/*}}}*/
+
+/*{{{ activate / hibernate */
+// creates PeerMng, must be called from the shard's thread
+static void tbfs_torrent_activate (Torrent *torrent)
+{
+    torrent->last_active = time (NULL);
+
+    if (torrent->pmng)
+        return;
+
+    LOG_debug (TORRENT_LOG, "[t: %s] Activating torrent", tbfs_torrent_get_info_hash (torrent));
+
+    g_atomic_pointer_set (&torrent->pmng, tbfs_peer_mng_create (torrent->app, torrent));
+    tbfs_shard_torrent_set_active (torrent->shard, torrent);
+
+    // peers known before hibernation
+    if (torrent->known_peers) {
+        const guint8 *recs;
+        gsize len;
+
+        recs = g_bytes_get_data (torrent->known_peers, &len);
+        tbfs_torrent_peers_unpack (torrent, recs, len);
+        g_bytes_unref (torrent->known_peers);
+        torrent->known_peers = NULL;
+    }
+}
+
+// peers are only needed to download wanted pieces, the rest of peers connect to us
+static void tbfs_torrent_update_numwant (Torrent *torrent)
+{
+    gint numwant = 0;
+    gint old;
+
+    if (torrent->bf_pieces_want && torrent->pmng && g_atomic_int_get (&torrent->pieces_missing) > 0)
+        numwant = MAX (0, conf_get_int (application_get_conf (torrent->app), "torrent.max_peers") -
+            tbfs_peer_mng_peer_count (torrent->pmng));
+
+    old = g_atomic_int_get (&torrent->numwant);
+    g_atomic_int_set (&torrent->numwant, numwant);
+
+    // the last announce didn't ask for peers, don't wait for its interval
+    if (!old && numwant > 0 && application_get_mng (torrent->app))
+        tbfs_mng_torrent_wants_peers (application_get_mng (torrent->app), torrent);
+}
+
+// may be called from the main thread
+gboolean tbfs_torrent_is_active (Torrent *torrent)
+{
+    return g_atomic_pointer_get (&torrent->pmng) != NULL;
+}
+
+// TRUE if there are wanted pieces which we don't have yet
+static gboolean tbfs_torrent_has_wanted_pieces (Torrent *torrent)
+{
+    if (!torrent->bf_pieces_want || !tbfs_bitfield_get_set_bits (torrent->bf_pieces_want))
+        return FALSE;
+
+    return tbfs_bitfield_find_next_and_not (torrent->bf_pieces_want, torrent->bf_pieces_have, 0) >= 0;
+}
+
+// drops PeerMng of the torrent which was idle for idle_sec
+// returns TRUE if torrent is hibernated
+gboolean tbfs_torrent_try_hibernate (Torrent *torrent, time_t now, gint32 idle_sec)
+{
+    if (!torrent->pmng)
+        return TRUE;
+
+    if (torrent->clients > 0 || now - torrent->last_active < idle_sec)
+        return FALSE;
+
+    if (tbfs_torrent_has_wanted_pieces (torrent)) {
+        torrent->last_active = now;
+        return FALSE;
+    }
+
+    LOG_debug (TORRENT_LOG, "[t: %s] Hibernating torrent", tbfs_torrent_get_info_hash (torrent));
+
+    // most recent peers survive hibernation, so they can be saved in snapshot
+    torrent->known_peers = tbfs_torrent_peers_pack (torrent);
+    tbfs_peer_mng_destroy (torrent->pmng);
+    g_atomic_pointer_set (&torrent->pmng, NULL);
+
+    if (torrent->bf_pieces_want) {
+        tbfs_bitfield_destroy (torrent->bf_pieces_want);
+        torrent->bf_pieces_want = NULL;
+    }
+
+    tbfs_torrent_set_bitfield_msg (torrent, NULL);
+    tbfs_torrent_update_numwant (torrent);
+
+    return TRUE;
+}
+
+// incoming peer connection for this torrent is established
+void tbfs_torrent_client_connected (Torrent *torrent)
+{
+    torrent->clients++;
+    tbfs_torrent_activate (torrent);
+}
+
+void tbfs_torrent_client_disconnected (Torrent *torrent)
+{
+    if (torrent->clients > 0)
+        torrent->clients--;
+    torrent->last_active = time (NULL);
+}
+/*}}}*/
+
 void tbfs_torrent_add_piece (Torrent *torrent, guint32 piece_id)
 {
+    if (!torrent->bf_pieces_want)
+        torrent->bf_pieces_want = tbfs_bitfield_create (torrent->total_pieces);
+
     tbfs_bitfield_set_bit (torrent->bf_pieces_want, piece_id);
+    tbfs_torrent_activate (torrent);
+    tbfs_torrent_update_numwant (torrent);
 
     // notify peer manager that a new piece is added
     // XXX: check that his is a new ?
     tbfs_peer_mng_torrent_piece_added (torrent->pmng, piece_id);
 }
 
+static void tbfs_torrent_update_complete (Torrent *torrent)
+{
+    g_atomic_int_set (&torrent->pieces_missing, torrent->total_pieces - tbfs_bitfield_get_set_bits (torrent->bf_pieces_have));
+    tbfs_torrent_update_numwant (torrent);
+}
+
+// piece is stored locally and can be served to peers
+void tbfs_torrent_set_piece_have (Torrent *torrent, guint32 piece_id)
+{
+    if (!tbfs_bitfield_get_bit (torrent->bf_pieces_have, piece_id)) {
+        tbfs_bitfield_set_bit (torrent->bf_pieces_have, piece_id);
+        tbfs_torrent_set_bitfield_msg (torrent, NULL);
+    }
+    tbfs_torrent_update_complete (torrent);
+}
+
+// replaces have bitfield, used when restoring a torrent
+void tbfs_torrent_set_pieces_have_bits (Torrent *torrent, const guint8 *bits, guint32 len)
+{
+    tbfs_bitfield_set_bits (torrent->bf_pieces_have, bits, len);
+    tbfs_torrent_set_bitfield_msg (torrent, NULL);
+    tbfs_torrent_update_complete (torrent);
+}
+
+// can be called from any thread
+gboolean tbfs_torrent_is_complete (Torrent *torrent)
+{
+    return g_atomic_int_get (&torrent->pieces_missing) == 0;
+}
+
+guint32 tbfs_torrent_get_pieces_missing (Torrent *torrent)
+{
+    return g_atomic_int_get (&torrent->pieces_missing);
+}
+
+gint32 tbfs_torrent_get_numwant (Torrent *torrent)
+{
+    return g_atomic_int_get (&torrent->numwant);
+}
+
+// glib has no 64-bit atomics, gcc builtins are used
+void tbfs_torrent_add_transferred (Torrent *torrent, guint64 uploaded, guint64 downloaded)
+{
+    if (uploaded)
+        __atomic_fetch_add (&torrent->uploaded, uploaded, __ATOMIC_RELAXED);
+    if (downloaded)
+        __atomic_fetch_add (&torrent->downloaded, downloaded, __ATOMIC_RELAXED);
+}
+
+guint64 tbfs_torrent_get_uploaded (Torrent *torrent)
+{
+    return __atomic_load_n (&torrent->uploaded, __ATOMIC_RELAXED);
+}
+
+guint64 tbfs_torrent_get_downloaded (Torrent *torrent)
+{
+    return __atomic_load_n (&torrent->downloaded, __ATOMIC_RELAXED);
+}
+
+void tbfs_torrent_set_super_seed (Torrent *torrent, gboolean super_seed)
+{
+    if (super_seed && !torrent->ss) {
+        torrent->ss = tbfs_super_seed_create (torrent);
+    } else if (!super_seed && torrent->ss) {
+        tbfs_super_seed_destroy (torrent->ss);
+        torrent->ss = NULL;
+    }
+}
+
+SuperSeed *tbfs_torrent_get_super_seed (Torrent *torrent)
+{
+    return torrent->ss;
+}
 
 Bitfield *tbfs_torrent_get_bitfield_pieces_have (Torrent *torrent)
 {
@@ -81,20 +449,129 @@ Bitfield *tbfs_torrent_get_bitfield_pieces_want (Torrent *torrent)
     return torrent->bf_pieces_want;
 }
 
+// cached wire-encoded Bitfield message, NULL if have bitfield changed since it was built
+GBytes *tbfs_torrent_get_bitfield_msg (Torrent *torrent)
+{
+    return torrent->bf_msg;
+}
+
+// takes ownership of msg, NULL drops the cached message
+void tbfs_torrent_set_bitfield_msg (Torrent *torrent, GBytes *msg)
+{
+    if (torrent->bf_msg)
+        g_bytes_unref (torrent->bf_msg);
+    torrent->bf_msg = msg;
+}
+
 
+// peers from tracker are kept only by active torrents
 void tbfs_torrent_add_peer_addr (Torrent *torrent, const gchar *peer_id, guint32 addr, guint16 port)
 {
+    if (!torrent->pmng)
+        return;
+
     tbfs_peer_mng_peer_add (torrent->pmng, peer_id, addr, port);
+    tbfs_torrent_update_numwant (torrent);
+}
+
+void tbfs_torrent_add_peer_endpoints (Torrent *torrent, const gchar *peer_id, const PeerEndpoint *endpoints, guint count)
+{
+    if (!torrent->pmng)
+        return;
+
+    tbfs_peer_mng_peers_add (torrent->pmng, peer_id, endpoints, count);
+    tbfs_torrent_update_numwant (torrent);
+}
+
+void tbfs_torrent_add_local_peer_endpoints (Torrent *torrent, const gchar *peer_id, const PeerEndpoint *endpoints, guint count)
+{
+    if (!torrent->pmng)
+        return;
+
+    tbfs_peer_mng_local_peers_add (torrent->pmng, peer_id, endpoints, count);
+    tbfs_torrent_update_numwant (torrent);
 }
 
 void tbfs_torrent_peers_updated (Torrent *torrent)
 {
+    if (!torrent->pmng)
+        return;
+
+    tbfs_peer_mng_peers_updated (torrent->pmng);
+}
+
+typedef struct {
+    TorrentPeerFunc func;
+    gpointer data;
+} TorrentPeerForeachData;
+
+static void tbfs_torrent_foreach_peer_cb (Peer *peer, TorrentPeerForeachData *fdata)
+{
+    guint32 addr;
+    guint16 port;
+
+    tbfs_peer_get_addr (peer, &addr, &port);
+    fdata->func (tbfs_peer_get_id (peer), addr, port, fdata->data);
+}
+
+// peers of PeerMng, or peers kept while the torrent is hibernated
+void tbfs_torrent_foreach_known_peer (Torrent *torrent, TorrentPeerFunc func, gpointer data)
+{
+    gchar peer_id[PEER_ID_LENGTH + 1];
+    const guint8 *recs;
+    gsize len;
+    gsize pos;
+
+    if (torrent->pmng) {
+        TorrentPeerForeachData fdata;
+
+        fdata.func = func;
+        fdata.data = data;
+        tbfs_peer_mng_foreach_peer (torrent->pmng, (PeerMngForeachFunc) tbfs_torrent_foreach_peer_cb, &fdata);
+        return;
+    }
+
+    if (!torrent->known_peers)
+        return;
+
+    recs = g_bytes_get_data (torrent->known_peers, &len);
+    for (pos = 0; pos + TORRENT_PEER_RECORD_LEN <= len; pos += TORRENT_PEER_RECORD_LEN) {
+        guint32 addr;
+        guint16 port;
+
+        tbfs_torrent_peer_record_read (recs + pos, peer_id, &addr, &port);
+        func (peer_id, addr, port, data);
+    }
+}
+
+// count records of TORRENT_PEER_RECORD_LEN, hibernated torrent keeps them until it's activated
+void tbfs_torrent_add_known_peers (Torrent *torrent, const guint8 *recs, guint count)
+{
+    if (!count)
+        return;
+
+    if (!torrent->pmng) {
+        if (torrent->known_peers)
+            g_bytes_unref (torrent->known_peers);
+        torrent->known_peers = g_bytes_new (recs, (gsize) count * TORRENT_PEER_RECORD_LEN);
+        return;
+    }
+
+    tbfs_torrent_peers_unpack (torrent, recs, (gsize) count * TORRENT_PEER_RECORD_LEN);
+    tbfs_torrent_update_numwant (torrent);
     tbfs_peer_mng_peers_updated (torrent->pmng);
 }
 
 void tbfs_torrent_info_print (Torrent *torrent, struct evbuffer *buf, PrintFormat *print_format)
 {
-    evbuffer_add_printf (buf, "info_hash: %s\n", torrent->info_hash);
+    evbuffer_add_printf (buf, "info_hash: %s\n", tbfs_torrent_get_info_hash (torrent));
+    evbuffer_add_printf (buf, "active: %s\n", torrent->pmng ? "yes" : "no");
+    evbuffer_add_printf (buf, "clients: %d\n", torrent->clients);
+    evbuffer_add_printf (buf, "uploaded: %"G_GUINT64_FORMAT"\n", tbfs_torrent_get_uploaded (torrent));
+    evbuffer_add_printf (buf, "downloaded: %"G_GUINT64_FORMAT"\n", tbfs_torrent_get_downloaded (torrent));
+    if (!torrent->pmng)
+        return;
+
     evbuffer_add_printf (buf, "peers: %d\n", tbfs_peer_mng_peer_count (torrent->pmng));
     tbfs_peer_mng_info_print (torrent->pmng, buf, print_format);
 }
@@ -17,25 +17,85 @@
 #include "tbfs_tracker_client.h"
 #include "tbfs_bencode.h"
 #include "tbfs_mng.h"
+#include "tbfs_udp_tracker.h"
+#include "tbfs_dns_cache.h"
+
+// keep-alive connection to the tracker, evhttp sends queued requests one by one
+typedef struct {
+    TrackerClient *client;
+    struct evhttp_connection *evcon;
+    guint in_flight;
+    GQueue *q_requests; // TrackerRequestData in flight on this connection
+    guint32 addr; // cached address evcon connects to, 0 if evcon resolves the host name itself
+    gboolean failed; // transport failure, evcon is rebuilt with the next cached address
+} TrackerConn;
 
 struct _TrackerClient {
     Application *app;
 
-    struct evhttp_connection *evcon;
+    GPtrArray *a_conns; // TrackerConn pool
+    GQueue *q_pending; // TrackerRequestData waiting for a free request slot
+    GQueue *q_retry; // TrackerRequestData waiting for a retry delay to expire
+    guint in_flight;
+    guint max_requests; // concurrent requests for the whole pool
+    gint32 retries;
+    gint32 retry_delay_sec; // doubled with every attempt
+
+    gchar *url;
+    gchar *host;
+    gint port;
+    gchar *announce_path;
+    gchar *scrape_path; // NULL if tracker doesn't support scrape
+
+    UdpTracker *udp; // set for udp:// trackers
+    struct event *ev_reset; // rebuilds idle connections outside of evhttp callbacks
 };
 
+typedef enum {
+    TRT_Announce = 0,
+    TRT_BatchAnnounce = 1,
+    TRT_Scrape = 2,
+} TrackerRequestType;
+
+typedef struct {
+    TrackerClient *client;
+    TrackerRequestType type;
+    GPtrArray *a_info_hashes; // one or more info_hashes, hex strings
+
+    gchar *uri;
+    TrackerConn *conn; // NULL unless request is in flight
+    gint attempt;
+    struct event *ev_retry; // NULL until the first retry
+
+    struct evbuffer *body; // response received so far
+    BParser *parser; // parses body as it arrives
+
+    TrackerClient_on_request_done_cb on_request_done_cb;
+    TrackerClient_on_scrape_done_cb on_scrape_done_cb;
+    gpointer ctx;
+} TrackerRequestData;
+
 #define TCLI_LOG "tcli"
 
 static void tbfs_tracker_client_on_close_cb (struct evhttp_connection *evcon, void *ctx);
 static void tbfs_tracker_client_on_send_request_cb (struct evhttp_request *req, void *ctx);
+static void tbfs_tracker_client_on_chunk_cb (struct evhttp_request *req, void *ctx);
+static void tbfs_tracker_conn_destroy (TrackerConn *conn);
+static void tr_data_destroy (TrackerRequestData *tr_data);
 
-TrackerClient *tbfs_tracker_client_create (Application *app)
+// connects to a cached address of the host if there is one, so reconnects don't wait for DNS
+static gboolean tbfs_tracker_conn_connect (TrackerConn *conn)
 {
-    TrackerClient *client;
+    TrackerClient *client = conn->client;
+    Application *app = client->app;
     struct bufferevent *bev;
+    gchar s_addr[INET_ADDRSTRLEN];
+    const gchar *address = client->host;
 
-    client = g_new0 (TrackerClient, 1);
-    client->app = app;
+    conn->addr = 0;
+    conn->failed = FALSE;
+    if (tbfs_dns_cache_lookup (application_get_dns_cache (app), client->host, &conn->addr))
+        address = evutil_inet_ntop (AF_INET, &conn->addr, s_addr, sizeof (s_addr));
 
     bev = bufferevent_socket_new (
         application_get_evbase (app),
@@ -45,199 +105,863 @@ TrackerClient *tbfs_tracker_client_create (Application *app)
 
     if (!bev) {
         LOG_err (TCLI_LOG, "Failed to create bufferevent !");
-        g_free (client);
-        return NULL;
+        return FALSE;
     }
 
-    client->evcon = evhttp_connection_base_bufferevent_new (
+    conn->evcon = evhttp_connection_base_bufferevent_new (
         application_get_evbase (app),
         application_get_dnsbase (app),
         bev,
-        conf_get_string (application_get_conf (app), "tracker.host"),
-        conf_get_int (application_get_conf (app), "tracker.port")
+        address,
+        client->port
     );
 
-    if (!client->evcon) {
+    if (!conn->evcon) {
         LOG_err (TCLI_LOG, "Failed to create evhttp_connection !");
-        g_free (client);
+        return FALSE;
+    }
+
+    // per-request timeout
+    // failed requests are retried by the client with a delay, see tracker.retries
+    evhttp_connection_set_timeout (conn->evcon, conf_get_int (application_get_conf (app), "tracker.timeout"));
+
+    evhttp_connection_set_closecb (conn->evcon, tbfs_tracker_client_on_close_cb, conn);
+
+    LOG_debug (TCLI_LOG, "[evcon: %p] Tracker connection to %s:%d (%s)", conn->evcon, address, client->port, client->host);
+
+    return TRUE;
+}
+
+static TrackerConn *tbfs_tracker_conn_create (TrackerClient *client)
+{
+    TrackerConn *conn;
+
+    conn = g_new0 (TrackerConn, 1);
+    conn->client = client;
+    conn->q_requests = g_queue_new ();
+
+    if (!tbfs_tracker_conn_connect (conn)) {
+        tbfs_tracker_conn_destroy (conn);
         return NULL;
     }
 
-    evhttp_connection_set_timeout (client->evcon, conf_get_int (application_get_conf (app), "tracker.timeout"));
-    evhttp_connection_set_retries (client->evcon, conf_get_int (application_get_conf (app), "tracker.retries"));
+    return conn;
+}
+
+// failed connection, host got resolved or its address is gone from DNS
+static gboolean tbfs_tracker_conn_needs_reset (TrackerConn *conn)
+{
+    DnsCache *cache = application_get_dns_cache (conn->client->app);
+    guint32 addr;
+
+    if (conn->failed)
+        return TRUE;
+    if (!conn->addr)
+        return tbfs_dns_cache_lookup (cache, conn->client->host, &addr);
+
+    return !tbfs_dns_cache_contains (cache, conn->client->host, conn->addr);
+}
+
+// connections with requests in flight are left for the next check
+static void tbfs_tracker_client_on_reset_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    TrackerClient *client = (TrackerClient *) arg;
+    guint i;
+
+    for (i = 0; i < client->a_conns->len; i++) {
+        TrackerConn *conn = g_ptr_array_index (client->a_conns, i);
 
-    evhttp_connection_set_closecb (client->evcon, tbfs_tracker_client_on_close_cb, client);
+        if (conn->in_flight || !tbfs_tracker_conn_needs_reset (conn))
+            continue;
+
+        evhttp_connection_free (conn->evcon);
+        conn->evcon = NULL;
+        if (!tbfs_tracker_conn_connect (conn))
+            conn->failed = TRUE;
+    }
+}
+
+static void tbfs_tracker_client_check_conns (TrackerClient *client)
+{
+    struct timeval tv = { 0, 0 };
+    guint i;
+
+    for (i = 0; i < client->a_conns->len; i++) {
+        if (tbfs_tracker_conn_needs_reset (g_ptr_array_index (client->a_conns, i))) {
+            evtimer_add (client->ev_reset, &tv);
+            return;
+        }
+    }
+}
+
+// freeing evcon cancels its requests without calling their callbacks
+static void tbfs_tracker_conn_destroy (TrackerConn *conn)
+{
+    if (conn->evcon)
+        evhttp_connection_free (conn->evcon);
+    g_queue_free_full (conn->q_requests, (GDestroyNotify) tr_data_destroy);
+    g_free (conn);
+}
+
+// scrape URL is derived from the announce URL by replacing the last "announce" with "scrape"
+static gchar *tbfs_tracker_client_get_scrape_path (const gchar *announce_path)
+{
+    const gchar *p;
+    const gchar *last = NULL;
+
+    for (p = strstr (announce_path, "announce"); p; p = strstr (p + 1, "announce"))
+        last = p;
+
+    if (!last)
+        return NULL;
+
+    return g_strdup_printf ("%.*sscrape%s", (int) (last - announce_path), announce_path, last + strlen ("announce"));
+}
+
+// parses http:// or udp:// tracker URL
+static gboolean tbfs_tracker_client_set_url (TrackerClient *client, const gchar *url)
+{
+    struct evhttp_uri *uri;
+    const gchar *scheme;
+    const gchar *path;
+
+    uri = evhttp_uri_parse (url);
+    if (!uri || !evhttp_uri_get_host (uri) || !evhttp_uri_get_scheme (uri)) {
+        LOG_err (TCLI_LOG, "Invalid tracker URL: %s !", url);
+        if (uri)
+            evhttp_uri_free (uri);
+        return FALSE;
+    }
+
+    scheme = evhttp_uri_get_scheme (uri);
+
+    // UDP tracker is selected by URL scheme
+    if (!g_ascii_strcasecmp (scheme, "udp")) {
+        if (evhttp_uri_get_port (uri) > 0)
+            client->udp = tbfs_udp_tracker_create (client->app, evhttp_uri_get_host (uri), evhttp_uri_get_port (uri));
+        else
+            LOG_err (TCLI_LOG, "UDP tracker URL requires port: %s !", url);
+        evhttp_uri_free (uri);
+        return client->udp != NULL;
+    }
+
+    if (g_ascii_strcasecmp (scheme, "http")) {
+        LOG_err (TCLI_LOG, "Unsupported tracker URL: %s !", url);
+        evhttp_uri_free (uri);
+        return FALSE;
+    }
+
+    client->host = g_strdup (evhttp_uri_get_host (uri));
+    client->port = evhttp_uri_get_port (uri) > 0 ? evhttp_uri_get_port (uri) : 80;
+    path = evhttp_uri_get_path (uri);
+    client->announce_path = g_strdup (path && *path ? path : "/announce");
+    client->scrape_path = tbfs_tracker_client_get_scrape_path (client->announce_path);
+
+    evhttp_uri_free (uri);
+
+    return TRUE;
+}
+
+// url is NULL for the tracker from tracker.host and tracker.port, or tracker.announce_url if it's udp://
+TrackerClient *tbfs_tracker_client_create (Application *app, const gchar *url)
+{
+    TrackerClient *client;
+    gint i, conn_count;
+
+    client = g_new0 (TrackerClient, 1);
+    client->app = app;
+
+    if (!url && !g_ascii_strncasecmp (conf_get_string (application_get_conf (app), "tracker.announce_url"), "udp://", 6))
+        url = conf_get_string (application_get_conf (app), "tracker.announce_url");
+
+    if (url) {
+        client->url = g_strdup (url);
+        if (!tbfs_tracker_client_set_url (client, url)) {
+            tbfs_tracker_client_destroy (client);
+            return NULL;
+        }
+
+        if (client->udp)
+            return client;
+    } else {
+        client->host = g_strdup (conf_get_string (application_get_conf (app), "tracker.host"));
+        client->port = conf_get_int (application_get_conf (app), "tracker.port");
+        client->announce_path = g_strdup ("/announce");
+        client->scrape_path = g_strdup ("/scrape");
+        client->url = g_strdup_printf ("http://%s:%d%s", client->host, client->port, client->announce_path);
+    }
+
+    client->a_conns = g_ptr_array_new_with_free_func ((GDestroyNotify) tbfs_tracker_conn_destroy);
+    client->q_pending = g_queue_new ();
+    client->q_retry = g_queue_new ();
+    client->in_flight = 0;
+    client->max_requests = MAX (1, conf_get_int (application_get_conf (app), "tracker.max_requests"));
+    client->retries = conf_get_int (application_get_conf (app), "tracker.retries");
+    client->retry_delay_sec = MAX (1, conf_get_int (application_get_conf (app), "tracker.retry_delay_sec"));
+    client->ev_reset = evtimer_new (application_get_evbase (app), tbfs_tracker_client_on_reset_cb, client);
+
+    conn_count = MAX (1, conf_get_int (application_get_conf (app), "tracker.connections"));
+    for (i = 0; i < conn_count; i++) {
+        TrackerConn *conn;
+
+        conn = tbfs_tracker_conn_create (client);
+        if (!conn) {
+            tbfs_tracker_client_destroy (client);
+            return NULL;
+        }
+        g_ptr_array_add (client->a_conns, conn);
+    }
 
     return client;
 }
 
 void tbfs_tracker_client_destroy (TrackerClient *client)
 {
-    if (client->evcon)
-        evhttp_connection_free (client->evcon);
+    // requests are dropped, callbacks are not called during shutdown
+    if (client->a_conns)
+        g_ptr_array_free (client->a_conns, TRUE);
+    if (client->ev_reset)
+        event_free (client->ev_reset);
+    if (client->q_pending)
+        g_queue_free_full (client->q_pending, (GDestroyNotify) tr_data_destroy);
+    if (client->q_retry)
+        g_queue_free_full (client->q_retry, (GDestroyNotify) tr_data_destroy);
+    if (client->udp)
+        tbfs_udp_tracker_destroy (client->udp);
+    g_free (client->host);
+    g_free (client->announce_path);
+    g_free (client->scrape_path);
+    g_free (client->url);
     g_free (client);
 }
 
+const gchar *tbfs_tracker_client_get_url (TrackerClient *client)
+{
+    return client->url;
+}
+
 static void tbfs_tracker_client_on_close_cb (struct evhttp_connection *evcon, void *ctx)
 {
-    TrackerClient *client = (TrackerClient *) ctx;
+    TrackerConn *conn = (TrackerConn *) ctx;
 
-    LOG_msg (TCLI_LOG, "[evcon: %p client: %p] Connection closed", evcon, client);
+    LOG_msg (TCLI_LOG, "[evcon: %p client: %p] Connection closed", evcon, conn->client);
 }
 
-typedef struct {
-    TrackerClient *client;
-    gchar *info_hash;
+/*{{{ TrackerRequestData */
 
-    TrackerClient_on_request_done_cb on_request_done_cb;
-    gpointer ctx;
-} TrackerRequestData;
+static TrackerRequestData *tr_data_create (TrackerClient *client, TrackerRequestType type,
+    const gchar **info_hashes, guint count, gpointer ctx)
+{
+    TrackerRequestData *tr_data;
+    guint i;
+
+    tr_data = g_new0 (TrackerRequestData, 1);
+    tr_data->client = client;
+    tr_data->type = type;
+    tr_data->a_info_hashes = g_ptr_array_new_with_free_func (g_free);
+    for (i = 0; i < count; i++)
+        g_ptr_array_add (tr_data->a_info_hashes, g_strdup (info_hashes[i]));
+    tr_data->ctx = ctx;
+    tr_data->body = evbuffer_new ();
+    tr_data->parser = bparser_create ();
+
+    return tr_data;
+}
 
 static void tr_data_destroy (TrackerRequestData *tr_data)
 {
-    g_free (tr_data->info_hash);
+    g_ptr_array_free (tr_data->a_info_hashes, TRUE);
+    if (tr_data->ev_retry)
+        event_free (tr_data->ev_retry);
+    evbuffer_free (tr_data->body);
+    bparser_destroy (tr_data->parser);
+    g_free (tr_data->uri);
     g_free (tr_data);
 }
 
-//http://10.0.0.211:6969/announce?info_hash=0w%baNH%058M%3ae%eaL%3cTu%15Np%933&peer_id=-TR2770-pmk1smsjhy7t&port=55735&uploaded=0&downloaded=0&left=0&numwant=80&key=2b565f82&compact=1&supportcrypto=1&event=started
-void tbfs_tracker_client_send_request (TrackerClient *client, const gchar *info_hash, TrackerEvent event_type, 
-    TrackerClient_on_request_done_cb on_request_done_cb, gpointer ctx)
+static gchar *tr_data_get_info_hash (TrackerRequestData *tr_data, guint i)
+{
+    return (gchar *) g_ptr_array_index (tr_data->a_info_hashes, i);
+}
+
+// report failure for every info_hash of the request and destroy it
+static void tr_data_fail_reason (TrackerRequestData *tr_data, const gchar *failure_reason)
+{
+    TrackerAnnounceReply reply;
+    guint i;
+
+    memset (&reply, 0, sizeof (reply));
+    reply.failure_reason = failure_reason;
+
+    if (tr_data->type == TRT_Scrape) {
+        tr_data->on_scrape_done_cb (FALSE, tr_data->ctx, NULL, 0);
+    } else {
+        for (i = 0; i < tr_data->a_info_hashes->len; i++)
+            tr_data->on_request_done_cb (FALSE, tr_data->ctx, tr_data_get_info_hash (tr_data, i),
+                failure_reason ? &reply : NULL);
+    }
+
+    tr_data_destroy (tr_data);
+}
+
+static void tr_data_fail (TrackerRequestData *tr_data)
+{
+    tr_data_fail_reason (tr_data, NULL);
+}
+/*}}}*/
+
+/*{{{ send requests */
+// appends "info_hash=xxx&" for every info_hash of the request
+static void tbfs_tracker_client_uri_add_info_hashes (GString *uri, TrackerRequestData *tr_data)
 {
-    struct evhttp_request *req;
-    int res;
-    gchar *uri = NULL;
-    gchar s_event[10];
     gchar escaped_info_hash[SHA_DIGEST_LENGTH*3 + 1];
-    TrackerRequestData *tr_data;
     uint8_t sha1[SHA_DIGEST_LENGTH];
+    guint i;
 
-    tr_data = g_new0 (TrackerRequestData, 1);
-    tr_data->client = client;
-    tr_data->info_hash = g_strdup (info_hash);
-    tr_data->on_request_done_cb = on_request_done_cb;
-    tr_data->ctx = ctx;
+    for (i = 0; i < tr_data->a_info_hashes->len; i++) {
+        hexstr_to_sha1 (sha1, tr_data_get_info_hash (tr_data, i));
+        escape_sha1 (escaped_info_hash, sha1);
+        g_string_append_printf (uri, "info_hash=%s&", escaped_info_hash);
+    }
+}
+
+// connection with the least requests in flight, failed ones are used only if all have failed
+static TrackerConn *tbfs_tracker_client_get_conn (TrackerClient *client)
+{
+    TrackerConn *best = NULL;
+    guint i;
+
+    for (i = 0; i < client->a_conns->len; i++) {
+        TrackerConn *conn = g_ptr_array_index (client->a_conns, i);
+
+        if (!conn->evcon)
+            continue;
+        if (!best || (best->failed && !conn->failed) ||
+            (best->failed == conn->failed && conn->in_flight < best->in_flight))
+            best = conn;
+    }
+
+    return best;
+}
+
+static void tbfs_tracker_client_send (TrackerClient *client, TrackerRequestData *tr_data)
+{
+    struct evhttp_request *req;
+    TrackerConn *conn;
+    int res;
 
     req = evhttp_request_new (tbfs_tracker_client_on_send_request_cb, tr_data);
     if (!req) {
         LOG_err (TCLI_LOG, "Failed to create HTTP request object !");
-        tr_data->on_request_done_cb (FALSE, tr_data->ctx, tr_data->info_hash, NULL);
-        tr_data_destroy (tr_data);
+        tr_data_fail (tr_data);
+        return;
+    }
+
+    evhttp_request_set_chunked_cb (req, tbfs_tracker_client_on_chunk_cb);
+    evhttp_add_header (evhttp_request_get_output_headers (req), "Host", client->host);
+    evhttp_add_header (evhttp_request_get_output_headers (req), "Connection", "keep-alive");
+
+    // leftovers of a failed attempt
+    evbuffer_drain (tr_data->body, evbuffer_get_length (tr_data->body));
+    bparser_reset (tr_data->parser);
+
+    conn = tbfs_tracker_client_get_conn (client);
+    if (!conn) {
+        LOG_err (TCLI_LOG, "No connection to tracker %s !", client->url);
+        evhttp_request_free (req);
+        tr_data_fail (tr_data);
         return;
     }
 
+    LOG_debug (TCLI_LOG, "[evcon: %p] Sending request to tracker %s: %s", conn->evcon, client->url, tr_data->uri);
+
+    res = evhttp_make_request (conn->evcon, req, EVHTTP_REQ_GET, tr_data->uri);
+    if (res < 0) {
+        LOG_err (TCLI_LOG, "Failed execute HTTP request !");
+        tr_data_fail (tr_data);
+        return;
+    }
+
+    tr_data->conn = conn;
+    g_queue_push_tail (conn->q_requests, tr_data);
+    conn->in_flight++;
+    client->in_flight++;
+}
+
+// sends queued requests while there are free slots
+static void tbfs_tracker_client_send_pending (TrackerClient *client)
+{
+    TrackerRequestData *tr_data;
+
+    while (client->in_flight < client->max_requests && (tr_data = g_queue_pop_head (client->q_pending)))
+        tbfs_tracker_client_send (client, tr_data);
+}
+
+static void tbfs_tracker_client_make_request (TrackerClient *client, TrackerRequestData *tr_data, const gchar *uri)
+{
+    tr_data->uri = g_strdup (uri);
+
+    tbfs_tracker_client_check_conns (client);
+    g_queue_push_tail (client->q_pending, tr_data);
+    tbfs_tracker_client_send_pending (client);
+}
+
+// batch request carries a single set of counters: sums of all torrents, the largest numwant
+static void tbfs_tracker_client_stats_merge (TrackerAnnounceStats *total, const TrackerAnnounceStats *stats, guint count)
+{
+    guint i;
+
+    memset (total, 0, sizeof (TrackerAnnounceStats));
+    total->numwant = -1;
+
+    for (i = 0; i < count; i++) {
+        total->uploaded += stats[i].uploaded;
+        total->downloaded += stats[i].downloaded;
+        total->left += stats[i].left;
+        total->numwant = MAX (total->numwant, stats[i].numwant);
+    }
+}
+
+static void tbfs_tracker_client_announce (TrackerClient *client, TrackerRequestData *tr_data,
+    const TrackerAnnounceStats *stats, TrackerEvent event_type)
+{
+    GString *uri;
+    gchar s_event[10];
+
     if (event_type == TE_started) {
         strcpy (s_event, "started");
     } else if (event_type == TE_completed) {
         strcpy (s_event, "completed");
     } else if (event_type == TE_stopped) {
         strcpy (s_event, "stopped");
+    } else if (event_type == TE_none) {
+        s_event[0] = '\0';
     } else {
         LOG_err (TCLI_LOG, "Unknown tracker event type: %d !", event_type);
-        tr_data->on_request_done_cb (FALSE, tr_data->ctx, tr_data->info_hash, NULL);
-        tr_data_destroy (tr_data);
+        tr_data_fail (tr_data);
         return;
     }
 
-    hexstr_to_sha1 (sha1, info_hash);
-    escape_sha1 (escaped_info_hash, sha1);
-
-    uri = g_strdup_printf ("/announce?info_hash=%s&peer_id=%s&port=%d&uploaded=0&downloaded=0&left=0&numwant=80&event=%s&compact=%d",
-        escaped_info_hash,
+    uri = g_string_new (client->announce_path);
+    g_string_append_c (uri, strchr (client->announce_path, '?') ? '&' : '?');
+    tbfs_tracker_client_uri_add_info_hashes (uri, tr_data);
+    g_string_append_printf (uri, "peer_id=%s&port=%d&uploaded=%"G_GUINT64_FORMAT"&downloaded=%"G_GUINT64_FORMAT
+        "&left=%"G_GUINT64_FORMAT"&compact=%d",
         conf_get_string (application_get_conf (client->app), "peer.peer_id"),
         conf_get_int (application_get_conf (client->app), "peer_server.port"),
-        s_event,
+        stats->uploaded, stats->downloaded, stats->left,
         conf_get_boolean (application_get_conf (client->app), "tracker.compact") ? 1 : 0
     );
+    if (stats->numwant >= 0)
+        g_string_append_printf (uri, "&numwant=%d", stats->numwant);
+    // regular announce has no event
+    if (s_event[0])
+        g_string_append_printf (uri, "&event=%s", s_event);
+
+    tbfs_tracker_client_make_request (client, tr_data, uri->str);
+    g_string_free (uri, TRUE);
+}
 
-    LOG_debug (TCLI_LOG, "Sending request to tracker: %s", uri);
+//http://10.0.0.211:6969/announce?info_hash=0w%baNH%058M%3ae%eaL%3cTu%15Np%933&peer_id=-TR2770-pmk1smsjhy7t&port=55735&uploaded=0&downloaded=0&left=0&numwant=80&key=2b565f82&compact=1&supportcrypto=1&event=started
+void tbfs_tracker_client_send_request (TrackerClient *client, const gchar *info_hash, const TrackerAnnounceStats *stats,
+    TrackerEvent event_type, TrackerClient_on_request_done_cb on_request_done_cb, gpointer ctx)
+{
+    TrackerRequestData *tr_data;
+
+    if (client->udp) {
+        tbfs_udp_tracker_announce (client->udp, info_hash, stats, event_type, on_request_done_cb, ctx);
+        return;
+    }
 
-    res = evhttp_make_request (client->evcon, req, EVHTTP_REQ_GET, uri);
-    g_free (uri);
+    tr_data = tr_data_create (client, TRT_Announce, &info_hash, 1, ctx);
+    tr_data->on_request_done_cb = on_request_done_cb;
 
-    if (res < 0) {
-        LOG_err (TCLI_LOG, "Failed execute HTTP request !");
-        tr_data->on_request_done_cb (FALSE, tr_data->ctx, tr_data->info_hash, NULL);
-        tr_data_destroy (tr_data);
+    tbfs_tracker_client_announce (client, tr_data, stats, event_type);
+}
+
+// Announce several torrents with a single request.
+// Tracker (or a local stand-in) must accept repeated info_hash parameters and reply with
+// d5:filesd20:<info_hash>d5:peers<compact peers>e...ee
+// stats has an entry for every info_hash
+// on_request_done_cb () is called for every info_hash
+void tbfs_tracker_client_send_batch_request (TrackerClient *client, const gchar **info_hashes, const TrackerAnnounceStats *stats,
+    guint count, TrackerEvent event_type, TrackerClient_on_request_done_cb on_request_done_cb, gpointer ctx)
+{
+    TrackerRequestData *tr_data;
+    TrackerAnnounceStats total;
+    guint i;
+
+    // UDP announces are cheap enough to be sent one by one
+    if (client->udp) {
+        for (i = 0; i < count; i++)
+            tbfs_udp_tracker_announce (client->udp, info_hashes[i], &stats[i], event_type, on_request_done_cb, ctx);
         return;
     }
+
+    tr_data = tr_data_create (client, TRT_BatchAnnounce, info_hashes, count, ctx);
+    tr_data->on_request_done_cb = on_request_done_cb;
+
+    tbfs_tracker_client_stats_merge (&total, stats, count);
+    tbfs_tracker_client_announce (client, tr_data, &total, event_type);
 }
 
-// handle responce from Tracker
-static void tbfs_tracker_client_on_send_request_cb (struct evhttp_request *req, void *ctx)
+// Scrape several torrents with a single request
+//http://10.0.0.211:6969/scrape?info_hash=xxx&info_hash=yyy
+void tbfs_tracker_client_scrape (TrackerClient *client, const gchar **info_hashes, guint count,
+    TrackerClient_on_scrape_done_cb on_scrape_done_cb, gpointer ctx)
 {
-    TrackerRequestData *tr_data = (TrackerRequestData *) ctx;
-    struct evbuffer *inbuf;
-    BValue *bval, *bpeers;
+    TrackerRequestData *tr_data;
+    GString *uri;
+
+    if (client->udp) {
+        tbfs_udp_tracker_scrape (client->udp, info_hashes, count, on_scrape_done_cb, ctx);
+        return;
+    }
+
+    if (!client->scrape_path) {
+        LOG_debug (TCLI_LOG, "Tracker %s does not support scrape", client->url);
+        on_scrape_done_cb (FALSE, ctx, NULL, 0);
+        return;
+    }
+
+    tr_data = tr_data_create (client, TRT_Scrape, info_hashes, count, ctx);
+    tr_data->on_scrape_done_cb = on_scrape_done_cb;
+
+    uri = g_string_new (client->scrape_path);
+    g_string_append_c (uri, strchr (client->scrape_path, '?') ? '&' : '?');
+    tbfs_tracker_client_uri_add_info_hashes (uri, tr_data);
+    // remove trailing "&"
+    g_string_truncate (uri, uri->len - 1);
+
+    tbfs_tracker_client_make_request (client, tr_data, uri->str);
+    g_string_free (uri, TRUE);
+}
+/*}}}*/
+
+/*{{{ parse responses */
+// decodes 6-byte compact peer records into array, returns NULL if length is invalid
+PeerAddr *tbfs_tracker_client_decode_peers (const guint8 *compact, gsize len, guint *count)
+{
+    PeerAddr *peer_addrs;
+    guint i;
+
+    *count = 0;
+    if (len % 6 != 0)
+        return NULL;
+
+    *count = len / 6;
+    // never NULL for valid (possibly empty) list
+    peer_addrs = g_new (PeerAddr, *count + 1);
+
+    for (i = 0; i < *count; i++) {
+        memcpy (&peer_addrs[i].addr, compact, 4);
+        memcpy (&peer_addrs[i].port, compact + 4, 2);
+        compact += 6;
+    }
+
+    return peer_addrs;
+}
+
+// decodes compact "peers" key of the dict
+static PeerAddr *tbfs_tracker_client_parse_peers (BValue *bdict, guint *count)
+{
+    BValue *bpeers;
     guint8 *s_peers;
     gint32 peers_len;
-    gint i;
-    const uint8_t * walk;
-    GList *l_peer_addrs = NULL;
 
-    if (!tr_data || !req) {
+    *count = 0;
+
+    if (!bvalue_is_dict (bdict))
+        return NULL;
+
+    bpeers = bvalue_dict_get_value (bdict, "peers");
+    if (!bpeers || !bvalue_is_string (bpeers))
+        return NULL;
+
+    s_peers = bvalue_get_binary_string (bpeers, &peers_len);
+
+    return tbfs_tracker_client_decode_peers (s_peers, peers_len, count);
+}
+
+// returns "files" entry for info_hash
+static BValue *tbfs_tracker_client_get_file (BValue *bfiles, const gchar *info_hash)
+{
+    uint8_t sha1[SHA_DIGEST_LENGTH];
+
+    hexstr_to_sha1 (sha1, info_hash);
+
+    return bvalue_dict_get_value_binary (bfiles, sha1, SHA_DIGEST_LENGTH);
+}
+
+static gint64 tbfs_tracker_client_dict_get_int (BValue *bdict, const gchar *key)
+{
+    BValue *bval;
+
+    bval = bvalue_dict_get_value (bdict, key);
+    if (!bval || !bvalue_is_int (bval))
+        return 0;
+
+    return bvalue_get_int (bval);
+}
+
+static gint32 tbfs_tracker_client_interval (gint64 interval)
+{
+    return (gint32) CLAMP (interval, 0, G_MAXINT32);
+}
+
+// single announce: keys are read straight from the buffer, no BValue tree is built
+static void tbfs_tracker_client_on_announce_response (TrackerRequestData *tr_data, const guint8 *buf, gsize len)
+{
+    TrackerAnnounceReply reply;
+    const guint8 *s;
+    gsize s_len;
+    gint64 interval;
+    PeerAddr *peer_addrs = NULL;
+
+    memset (&reply, 0, sizeof (reply));
+
+    s = bvalue_raw_dict_get_string (buf, len, "failure reason", &s_len);
+    if (s) {
+        gchar *failure_reason = g_strndup ((const gchar *) s, s_len);
+
+        LOG_err (TCLI_LOG, "Tracker failure: %s", failure_reason);
+        tr_data_fail_reason (tr_data, failure_reason);
+        g_free (failure_reason);
+        return;
+    }
+
+    s = bvalue_raw_dict_get_string (buf, len, "peers", &s_len);
+    if (s)
+        peer_addrs = tbfs_tracker_client_decode_peers (s, s_len, &reply.peer_count);
+
+    if (!peer_addrs) {
+        LOG_err (TCLI_LOG, "Failed to parse Tracker response !");
+        tr_data_fail (tr_data);
+        return;
+    }
+
+    if (bvalue_raw_dict_get_int (buf, len, "interval", &interval))
+        reply.interval = tbfs_tracker_client_interval (interval);
+    if (bvalue_raw_dict_get_int (buf, len, "min interval", &interval))
+        reply.min_interval = tbfs_tracker_client_interval (interval);
+    reply.peer_addrs = peer_addrs;
+
+    LOG_debug (TCLI_LOG, "Got peers: %u (interval: %d, min interval: %d)", reply.peer_count, reply.interval, reply.min_interval);
+
+    tr_data->on_request_done_cb (TRUE, tr_data->ctx, tr_data_get_info_hash (tr_data, 0), &reply);
+    g_free (peer_addrs);
+    tr_data_destroy (tr_data);
+}
+
+static void tbfs_tracker_client_on_batch_announce_response (TrackerRequestData *tr_data, BValue *bval)
+{
+    TrackerAnnounceReply reply;
+    BValue *bfiles;
+    BValue *breason;
+    guint i;
+
+    breason = bvalue_dict_get_value (bval, "failure reason");
+    if (breason && bvalue_is_string (breason)) {
+        LOG_err (TCLI_LOG, "Tracker failure: %s", bvalue_get_string (breason));
+        tr_data_fail_reason (tr_data, bvalue_get_string (breason));
+        return;
+    }
+
+    memset (&reply, 0, sizeof (reply));
+    reply.interval = tbfs_tracker_client_interval (tbfs_tracker_client_dict_get_int (bval, "interval"));
+    reply.min_interval = tbfs_tracker_client_interval (tbfs_tracker_client_dict_get_int (bval, "min interval"));
+
+    bfiles = bvalue_dict_get_value (bval, "files");
+    if (!bfiles || !bvalue_is_dict (bfiles)) {
+        LOG_err (TCLI_LOG, "Tracker does not support batch announce !");
+        tr_data_fail (tr_data);
+        return;
+    }
+
+    for (i = 0; i < tr_data->a_info_hashes->len; i++) {
+        gchar *info_hash = tr_data_get_info_hash (tr_data, i);
+        BValue *bfile;
+        PeerAddr *peer_addrs = NULL;
+
+        bfile = tbfs_tracker_client_get_file (bfiles, info_hash);
+        if (bfile)
+            peer_addrs = tbfs_tracker_client_parse_peers (bfile, &reply.peer_count);
+        if (!peer_addrs) {
+            LOG_err (TCLI_LOG, "[t: %s] Torrent is missing in batch response !", info_hash);
+            tr_data->on_request_done_cb (FALSE, tr_data->ctx, info_hash, NULL);
+            continue;
+        }
+
+        reply.peer_addrs = peer_addrs;
+        tr_data->on_request_done_cb (TRUE, tr_data->ctx, info_hash, &reply);
+        g_free (peer_addrs);
+    }
+
+    tr_data_destroy (tr_data);
+}
+
+static void tbfs_tracker_client_on_scrape_response (TrackerRequestData *tr_data, BValue *bval)
+{
+    TrackerScrapeInfo *infos;
+    guint count = 0;
+    BValue *bfiles;
+    BValue *breason;
+    guint i;
+
+    breason = bvalue_dict_get_value (bval, "failure reason");
+    if (breason && bvalue_is_string (breason)) {
+        LOG_err (TCLI_LOG, "Tracker scrape failure: %s", bvalue_get_string (breason));
+        tr_data_fail (tr_data);
+        return;
+    }
+
+    bfiles = bvalue_dict_get_value (bval, "files");
+    if (!bfiles || !bvalue_is_dict (bfiles)) {
+        LOG_err (TCLI_LOG, "Failed to parse Tracker scrape response !");
+        tr_data_fail (tr_data);
+        return;
+    }
+
+    infos = g_new0 (TrackerScrapeInfo, tr_data->a_info_hashes->len);
+    for (i = 0; i < tr_data->a_info_hashes->len; i++) {
+        gchar *info_hash = tr_data_get_info_hash (tr_data, i);
+        BValue *bfile;
+
+        bfile = tbfs_tracker_client_get_file (bfiles, info_hash);
+        if (!bfile || !bvalue_is_dict (bfile))
+            continue;
+
+        strncpy (infos[count].info_hash, info_hash, 2 * SHA_DIGEST_LENGTH);
+        infos[count].complete = tbfs_tracker_client_dict_get_int (bfile, "complete");
+        infos[count].incomplete = tbfs_tracker_client_dict_get_int (bfile, "incomplete");
+        infos[count].downloaded = tbfs_tracker_client_dict_get_int (bfile, "downloaded");
+        count++;
+    }
+
+    LOG_debug (TCLI_LOG, "Scraped %u of %u torrents", count, tr_data->a_info_hashes->len);
+
+    tr_data->on_scrape_done_cb (TRUE, tr_data->ctx, infos, count);
+
+    g_free (infos);
+    tr_data_destroy (tr_data);
+}
+
+// body is parsed while it arrives, evhttp drains its input buffer after this callback
+static void tbfs_tracker_client_on_chunk_cb (struct evhttp_request *req, void *ctx)
+{
+    TrackerRequestData *tr_data = (TrackerRequestData *) ctx;
+
+    evbuffer_add_buffer (tr_data->body, evhttp_request_get_input_buffer (req));
+    if (evhttp_request_get_response_code (req) == 200)
+        bparser_feed_buffer (tr_data->parser, tr_data->body);
+}
+
+// handle responce from Tracker
+static void tbfs_tracker_client_on_response (TrackerRequestData *tr_data, struct evhttp_request *req)
+{
+    BValue *bval;
+    gint res;
+
+    if (!req) {
         LOG_err (TCLI_LOG, "Failed to get tracker response !");
-        tr_data->on_request_done_cb (FALSE, tr_data->ctx, tr_data->info_hash, NULL);
-        tr_data_destroy (tr_data);
+        tr_data_fail (tr_data);
         return;
     }
 
     if (evhttp_request_get_response_code (req) != 200) {
         LOG_err (TCLI_LOG, "Got response from tracker: (%d) %s",
             evhttp_request_get_response_code (req), evhttp_request_get_response_code_line (req));
-        tr_data->on_request_done_cb (FALSE, tr_data->ctx, tr_data->info_hash, NULL);
-        tr_data_destroy (tr_data);
+        tr_data_fail (tr_data);
         return;
     }
 
-    inbuf = evhttp_request_get_input_buffer (req);
-
-    LOG_debug (TCLI_LOG, "Got response from tracker (%zd bytes): %s", evbuffer_get_length (inbuf), evbuffer_pullup (inbuf, -1));
+    LOG_debug (TCLI_LOG, "Got response from tracker (%zd bytes)", evbuffer_get_length (tr_data->body));
 
-    bval = bvalue_create_from_buff (inbuf);
-    if (!bval || !bvalue_is_dict (bval)) {
-        LOG_err (TCLI_LOG, "Failed to parse Tracker response !");
-        tr_data->on_request_done_cb (FALSE, tr_data->ctx, tr_data->info_hash, NULL);
-        tr_data_destroy (tr_data);
+    // catches up if the body wasn't delivered in chunks
+    res = bparser_feed_buffer (tr_data->parser, tr_data->body);
+    if (res <= 0) {
+        LOG_err (TCLI_LOG, "Failed to parse Tracker response: %s !", res == BTOKEN_ERROR_PART ? "truncated" : "invalid");
+        tr_data_fail (tr_data);
         return;
     }
 
-    bpeers = bvalue_dict_get_value (bval, "peers");
-    if (!bpeers || !bvalue_is_string (bpeers)) {
-        LOG_err (TCLI_LOG, "Failed to parse Tracker response !");
-        bvalue_destroy (bval);
-        tr_data->on_request_done_cb (FALSE, tr_data->ctx, tr_data->info_hash, NULL);
-        tr_data_destroy (tr_data);
+    if (tr_data->type == TRT_Announce) {
+        gsize len = bparser_get_length (tr_data->parser);
+
+        tbfs_tracker_client_on_announce_response (tr_data, evbuffer_pullup (tr_data->body, len), len);
         return;
     }
 
-    s_peers = bvalue_get_binary_string (bpeers, &peers_len);
-    if (peers_len % 6 != 0) {
+    bval = bvalue_create_from_parser (tr_data->parser, tr_data->body);
+    if (!bval || !bvalue_is_dict (bval)) {
         LOG_err (TCLI_LOG, "Failed to parse Tracker response !");
-        bvalue_destroy (bval);
-        tr_data->on_request_done_cb (FALSE, tr_data->ctx, tr_data->info_hash, NULL);
-        tr_data_destroy (tr_data);
+        if (bval)
+            bvalue_destroy (bval);
+        tr_data_fail (tr_data);
         return;
     }
 
-    LOG_debug (TCLI_LOG, "Got peers: %d", peers_len / 6);
+    if (tr_data->type == TRT_Scrape)
+        tbfs_tracker_client_on_scrape_response (tr_data, bval);
+    else
+        tbfs_tracker_client_on_batch_announce_response (tr_data, bval);
+
+    bvalue_destroy (bval);
+}
+
+static void tbfs_tracker_client_on_retry_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    TrackerRequestData *tr_data = (TrackerRequestData *) arg;
+    TrackerClient *client = tr_data->client;
 
-    walk = s_peers;
-    for (i = 0; i < peers_len / 6; i++) {
-        PeerAddr *addr;
+    g_queue_remove (client->q_retry, tr_data);
+    g_queue_push_head (client->q_pending, tr_data);
+    tbfs_tracker_client_send_pending (client);
+}
 
-        addr = g_new0 (PeerAddr, 1);
+// resends the request after retry_delay_sec, doubled with every attempt
+static void tbfs_tracker_client_retry (TrackerClient *client, TrackerRequestData *tr_data)
+{
+    struct timeval tv;
 
-        memcpy (&addr->addr4, walk, 4); walk += 4;
-        memcpy (&addr->port, walk, 2); walk += 2;
+    if (!tr_data->ev_retry)
+        tr_data->ev_retry = evtimer_new (application_get_evbase (client->app), tbfs_tracker_client_on_retry_cb, tr_data);
 
-        l_peer_addrs = g_list_append (l_peer_addrs, addr);
+    tv.tv_sec = MIN ((gint64) client->retry_delay_sec << MIN (tr_data->attempt - 1, 16),
+        (gint64) conf_get_int (application_get_conf (client->app), "tracker.backoff_max_sec"));
+    tv.tv_usec = 0;
+
+    g_queue_push_tail (client->q_retry, tr_data);
+    evtimer_add (tr_data->ev_retry, &tv);
+}
+
+static void tbfs_tracker_client_on_send_request_cb (struct evhttp_request *req, void *ctx)
+{
+    TrackerRequestData *tr_data = (TrackerRequestData *) ctx;
+    TrackerClient *client = tr_data->client;
+    TrackerConn *conn = tr_data->conn;
+    int code;
+
+    // request slot is free
+    g_queue_remove (conn->q_requests, tr_data);
+    conn->in_flight--;
+    tr_data->conn = NULL;
+    client->in_flight--;
+
+    // connection failure, timeout or overloaded tracker
+    code = req ? evhttp_request_get_response_code (req) : 0;
+    if (!code) {
+        conn->failed = TRUE;
+        tbfs_tracker_client_check_conns (client);
     }
-    
-    bvalue_destroy (bval);
-    
-    tr_data->on_request_done_cb (TRUE, tr_data->ctx, tr_data->info_hash, l_peer_addrs);
-    // free the list
-    g_list_foreach (l_peer_addrs, (GFunc) g_free, NULL);
-    
-    tr_data_destroy (tr_data);
+    if ((code == 0 || code >= 500) && tr_data->attempt < client->retries) {
+        tr_data->attempt++;
+        LOG_msg (TCLI_LOG, "Tracker request failed (%d), retrying (%d of %d) ..", code, tr_data->attempt, client->retries);
+        tbfs_tracker_client_retry (client, tr_data);
+    } else {
+        tbfs_tracker_client_on_response (tr_data, req);
+    }
+
+    tbfs_tracker_client_send_pending (client);
 }
+/*}}}*/
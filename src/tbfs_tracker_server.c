@@ -0,0 +1,570 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "tbfs_tracker_server.h"
+#include "tbfs_bencode.h"
+#include "tbfs_peer.h"
+
+/*{{{ struct */
+// Embedded tracker: /announce and /scrape backed by an in-memory swarm table.
+// Only compact peer lists (BEP 23) are served. Several info_hash parameters in
+// one announce get a batch reply, the same format TrackerClient expects:
+//   d5:filesd20:<info_hash>d8:completei..e10:incompletei..e5:peers..ee..e8:intervali..e..e
+struct _TrackerServer {
+    Application *app;
+
+    struct evhttp *httpd; // own listener, NULL if mounted on cmd_server
+    GHashTable *h_swarms; // info_hash (GBytes, 20 bytes) -> Swarm
+    struct event *ev_expire;
+
+    gint32 interval;
+    gint32 min_interval;
+    gint32 peer_ttl; // peers which didn't announce for so long are dropped
+    guint32 default_numwant;
+    guint32 max_numwant;
+};
+
+typedef struct {
+    GHashTable *h_peers; // PeerEndpoint -> SwarmPeer, owns peers
+    guint32 seeders;
+    guint32 downloaded; // "completed" events
+} Swarm;
+
+typedef struct {
+    PeerEndpoint endpoint;
+    time_t last_seen;
+    guint8 seeder;
+} SwarmPeer;
+
+// parsed announce or scrape query
+typedef struct {
+    GPtrArray *a_info_hashes; // GBytes
+    guint16 port;
+    gint64 left; // -1 if not set
+    gchar event[12];
+    gint32 numwant; // -1 if not set
+} TrackerQuery;
+
+#define TSRV_LOG "tsrv"
+
+static void tbfs_tracker_server_on_announce_cb (struct evhttp_request *req, void *ctx);
+static void tbfs_tracker_server_on_scrape_cb (struct evhttp_request *req, void *ctx);
+static void tbfs_tracker_server_on_expire_cb (evutil_socket_t fd, short events, void *arg);
+/*}}}*/
+
+/*{{{ create / destroy */
+static void tbfs_tracker_server_swarm_destroy (Swarm *swarm)
+{
+    g_hash_table_destroy (swarm->h_peers);
+    g_free (swarm);
+}
+
+// requests are served on cmd_server's httpd unless tracker_server.port is set
+TrackerServer *tbfs_tracker_server_create (Application *app, struct evhttp *cmd_httpd)
+{
+    TrackerServer *server;
+    ConfData *conf = application_get_conf (app);
+    struct evhttp *httpd = cmd_httpd;
+    struct timeval tv;
+
+    server = g_new0 (TrackerServer, 1);
+    server->app = app;
+    server->interval = MAX (1, conf_get_int (conf, "tracker_server.interval_sec"));
+    server->min_interval = MAX (0, conf_get_int (conf, "tracker_server.min_interval_sec"));
+    server->peer_ttl = server->interval * 2;
+    server->default_numwant = conf_get_uint (conf, "tracker_server.numwant");
+    server->max_numwant = MAX (1, conf_get_int (conf, "tracker_server.max_numwant"));
+    server->h_swarms = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+        (GDestroyNotify) g_bytes_unref, (GDestroyNotify) tbfs_tracker_server_swarm_destroy);
+
+    if (conf_get_int (conf, "tracker_server.port") > 0) {
+        server->httpd = evhttp_new (application_get_evbase (app));
+        if (evhttp_bind_socket (server->httpd,
+            conf_get_string (conf, "tracker_server.listen"),
+            conf_get_int (conf, "tracker_server.port")) == -1)
+        {
+            LOG_err (TSRV_LOG, "Failed to bind tracker server to: %s:%d",
+                conf_get_string (conf, "tracker_server.listen"), conf_get_int (conf, "tracker_server.port"));
+            tbfs_tracker_server_destroy (server);
+            return NULL;
+        }
+        httpd = server->httpd;
+    }
+
+    evhttp_set_cb (httpd, "/announce", tbfs_tracker_server_on_announce_cb, server);
+    evhttp_set_cb (httpd, "/scrape", tbfs_tracker_server_on_scrape_cb, server);
+
+    server->ev_expire = event_new (application_get_evbase (app), -1, EV_PERSIST, tbfs_tracker_server_on_expire_cb, server);
+    tv.tv_sec = MIN (server->interval, 60);
+    tv.tv_usec = 0;
+    event_add (server->ev_expire, &tv);
+
+    LOG_msg (TSRV_LOG, "Embedded tracker is serving /announce (interval: %d sec)", server->interval);
+
+    return server;
+}
+
+void tbfs_tracker_server_destroy (TrackerServer *server)
+{
+    if (server->ev_expire)
+        event_free (server->ev_expire);
+    if (server->httpd)
+        evhttp_free (server->httpd);
+    g_hash_table_destroy (server->h_swarms);
+    g_free (server);
+}
+
+guint tbfs_tracker_server_get_swarm_count (TrackerServer *server)
+{
+    return g_hash_table_size (server->h_swarms);
+}
+/*}}}*/
+
+/*{{{ query */
+static gint hexchar_value (gchar c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// info_hash is binary, evhttp_parse_query_str () can't be used as it stops at %00
+static GByteArray *tbfs_tracker_server_url_decode (const gchar *s, gsize len)
+{
+    GByteArray *out;
+    gsize i;
+
+    out = g_byte_array_sized_new (len);
+    for (i = 0; i < len; i++) {
+        guint8 c = s[i];
+
+        if (s[i] == '%' && i + 2 < len &&
+            hexchar_value (s[i + 1]) >= 0 && hexchar_value (s[i + 2]) >= 0) {
+            c = (hexchar_value (s[i + 1]) << 4) | hexchar_value (s[i + 2]);
+            i += 2;
+        } else if (s[i] == '+') {
+            c = ' ';
+        }
+        g_byte_array_append (out, &c, 1);
+    }
+
+    return out;
+}
+
+static void tbfs_tracker_server_query_free (TrackerQuery *q)
+{
+    g_ptr_array_free (q->a_info_hashes, TRUE);
+}
+
+// unknown parameters are ignored
+static void tbfs_tracker_server_query_parse (TrackerQuery *q, const gchar *query)
+{
+    gchar **params;
+    gint i;
+
+    memset (q, 0, sizeof (TrackerQuery));
+    q->a_info_hashes = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+    q->left = -1;
+    q->numwant = -1;
+
+    if (!query)
+        return;
+
+    params = g_strsplit (query, "&", -1);
+    for (i = 0; params[i]; i++) {
+        gchar *eq = strchr (params[i], '=');
+        GByteArray *value;
+        gchar *s_value;
+
+        if (!eq)
+            continue;
+        *eq = '\0';
+        value = tbfs_tracker_server_url_decode (eq + 1, strlen (eq + 1));
+
+        if (!strcmp (params[i], "info_hash")) {
+            if (value->len == SHA_DIGEST_LENGTH)
+                g_ptr_array_add (q->a_info_hashes, g_bytes_new (value->data, value->len));
+            g_byte_array_free (value, TRUE);
+            continue;
+        }
+
+        g_byte_array_append (value, (const guint8 *) "", 1);
+        s_value = (gchar *) value->data;
+
+        if (!strcmp (params[i], "port"))
+            q->port = (guint16) atoi (s_value);
+        else if (!strcmp (params[i], "left"))
+            q->left = g_ascii_strtoll (s_value, NULL, 10);
+        else if (!strcmp (params[i], "numwant"))
+            q->numwant = atoi (s_value);
+        else if (!strcmp (params[i], "event"))
+            g_strlcpy (q->event, s_value, sizeof (q->event));
+
+        g_byte_array_free (value, TRUE);
+    }
+    g_strfreev (params);
+}
+/*}}}*/
+
+/*{{{ replies */
+static void tbfs_tracker_server_send_failure (struct evhttp_request *req, const gchar *reason)
+{
+    struct evbuffer *evb;
+    BEncoder enc;
+
+    LOG_debug (TSRV_LOG, "Rejecting request: %s", reason);
+
+    evb = evbuffer_new ();
+    bencoder_init_evbuffer (&enc, evb);
+    bencoder_begin_dict (&enc);
+    bencoder_key (&enc, "failure reason");
+    bencoder_string (&enc, reason);
+    bencoder_end (&enc);
+    evhttp_send_reply (req, HTTP_OK, "OK", evb);
+    evbuffer_free (evb);
+}
+
+static void tbfs_tracker_server_send_reply (struct evhttp_request *req, BEncoder *enc, struct evbuffer *evb)
+{
+    if (!bencoder_finish (enc)) {
+        tbfs_tracker_server_send_failure (req, "internal error");
+        return;
+    }
+
+    evhttp_add_header (evhttp_request_get_output_headers (req), "Content-Type", "text/plain");
+    evhttp_send_reply (req, HTTP_OK, "OK", evb);
+}
+
+typedef struct {
+    GByteArray *peers;
+    const PeerEndpoint *self;
+    gboolean skip_seeders; // seeders don't need each other
+    guint32 left;
+} SwarmPeersData;
+
+static void tbfs_tracker_server_add_peer (G_GNUC_UNUSED gpointer key, gpointer value, gpointer data)
+{
+    SwarmPeer *peer = (SwarmPeer *) value;
+    SwarmPeersData *pdata = (SwarmPeersData *) data;
+
+    if (!pdata->left || tbfs_peer_endpoint_equal (&peer->endpoint, pdata->self))
+        return;
+    if (pdata->skip_seeders && peer->seeder)
+        return;
+
+    g_byte_array_append (pdata->peers, (const guint8 *) &peer->endpoint.addr, 4);
+    g_byte_array_append (pdata->peers, (const guint8 *) &peer->endpoint.port, 2);
+    pdata->left--;
+}
+
+static void tbfs_tracker_server_add_counts (BEncoder *enc, Swarm *swarm)
+{
+    bencoder_key (enc, "complete");
+    bencoder_int (enc, swarm->seeders);
+    bencoder_key (enc, "incomplete");
+    bencoder_int (enc, g_hash_table_size (swarm->h_peers) - swarm->seeders);
+}
+
+// compact "peers" string, the requester itself is skipped
+static void tbfs_tracker_server_add_peers (BEncoder *enc, Swarm *swarm, const PeerEndpoint *self,
+    gboolean seeder, guint32 numwant)
+{
+    SwarmPeersData pdata;
+
+    pdata.peers = g_byte_array_sized_new (MIN (numwant, g_hash_table_size (swarm->h_peers)) * 6);
+    pdata.self = self;
+    pdata.skip_seeders = seeder;
+    pdata.left = numwant;
+    g_hash_table_foreach (swarm->h_peers, tbfs_tracker_server_add_peer, &pdata);
+
+    bencoder_key (enc, "peers");
+    bencoder_binary (enc, pdata.peers->data, pdata.peers->len);
+    g_byte_array_free (pdata.peers, TRUE);
+}
+
+static void tbfs_tracker_server_add_intervals (TrackerServer *server, BEncoder *enc)
+{
+    bencoder_key (enc, "interval");
+    bencoder_int (enc, server->interval);
+    if (server->min_interval) {
+        bencoder_key (enc, "min interval");
+        bencoder_int (enc, server->min_interval);
+    }
+}
+
+// sorted dict keys are required, so multi torrent output is ordered by info_hash
+static gint tbfs_tracker_server_info_hash_cmp (gconstpointer a, gconstpointer b)
+{
+    return g_bytes_compare (*(GBytes **) a, *(GBytes **) b);
+}
+/*}}}*/
+
+/*{{{ announce */
+// registers the peer in the swarm or removes it on "stopped", always returns the swarm
+static Swarm *tbfs_tracker_server_swarm_update (TrackerServer *server, GBytes *info_hash,
+    const PeerEndpoint *endpoint, TrackerQuery *q)
+{
+    Swarm *swarm;
+    SwarmPeer *peer;
+    gboolean seeder = q->left == 0;
+
+    swarm = g_hash_table_lookup (server->h_swarms, info_hash);
+    if (!swarm) {
+        swarm = g_new0 (Swarm, 1);
+        swarm->h_peers = g_hash_table_new_full (tbfs_peer_endpoint_hash, tbfs_peer_endpoint_equal, NULL, g_free);
+        g_hash_table_insert (server->h_swarms, g_bytes_ref (info_hash), swarm);
+    }
+
+    peer = g_hash_table_lookup (swarm->h_peers, endpoint);
+
+    if (!strcmp (q->event, "stopped")) {
+        if (peer) {
+            if (peer->seeder)
+                swarm->seeders--;
+            g_hash_table_remove (swarm->h_peers, endpoint);
+        }
+        return swarm;
+    }
+
+    if (!strcmp (q->event, "completed"))
+        swarm->downloaded++;
+
+    if (!peer) {
+        peer = g_new0 (SwarmPeer, 1);
+        peer->endpoint = *endpoint;
+        // key points into the SwarmPeer
+        g_hash_table_insert (swarm->h_peers, &peer->endpoint, peer);
+    } else if (peer->seeder) {
+        swarm->seeders--;
+    }
+
+    peer->seeder = seeder;
+    if (seeder)
+        swarm->seeders++;
+    peer->last_seen = time (NULL);
+
+    return swarm;
+}
+
+static gboolean tbfs_tracker_server_get_endpoint (struct evhttp_request *req, TrackerQuery *q, PeerEndpoint *endpoint)
+{
+    char *address = NULL;
+    ev_uint16_t port;
+    struct in_addr addr;
+
+    evhttp_connection_get_peer (evhttp_request_get_connection (req), &address, &port);
+    if (!address || inet_pton (AF_INET, address, &addr) != 1)
+        return FALSE;
+
+    endpoint->addr = addr.s_addr;
+    endpoint->port = htons (q->port);
+
+    return TRUE;
+}
+
+static void tbfs_tracker_server_on_announce_cb (struct evhttp_request *req, void *ctx)
+{
+    TrackerServer *server = (TrackerServer *) ctx;
+    TrackerQuery q;
+    PeerEndpoint endpoint;
+    struct evbuffer *evb;
+    BEncoder enc;
+    guint32 numwant;
+    guint i;
+
+    tbfs_tracker_server_query_parse (&q, evhttp_uri_get_query (evhttp_request_get_evhttp_uri (req)));
+
+    if (!q.a_info_hashes->len) {
+        tbfs_tracker_server_send_failure (req, "invalid info_hash");
+        tbfs_tracker_server_query_free (&q);
+        return;
+    }
+    if (!q.port || !tbfs_tracker_server_get_endpoint (req, &q, &endpoint)) {
+        tbfs_tracker_server_send_failure (req, "invalid peer address");
+        tbfs_tracker_server_query_free (&q);
+        return;
+    }
+
+    numwant = q.numwant < 0 ? server->default_numwant : (guint32) q.numwant;
+    numwant = MIN (numwant, server->max_numwant);
+    // leaving peer needs no peers
+    if (!strcmp (q.event, "stopped"))
+        numwant = 0;
+
+    evb = evbuffer_new ();
+    bencoder_init_evbuffer (&enc, evb);
+
+    // single torrent
+    if (q.a_info_hashes->len == 1) {
+        Swarm *swarm;
+
+        swarm = tbfs_tracker_server_swarm_update (server, g_ptr_array_index (q.a_info_hashes, 0), &endpoint, &q);
+
+        bencoder_begin_dict (&enc);
+        tbfs_tracker_server_add_counts (&enc, swarm);
+        tbfs_tracker_server_add_intervals (server, &enc);
+        tbfs_tracker_server_add_peers (&enc, swarm, &endpoint, q.left == 0, numwant);
+        bencoder_end (&enc);
+
+    // batch announce
+    } else {
+        g_ptr_array_sort (q.a_info_hashes, tbfs_tracker_server_info_hash_cmp);
+
+        bencoder_begin_dict (&enc);
+        bencoder_key (&enc, "files");
+        bencoder_begin_dict (&enc);
+        for (i = 0; i < q.a_info_hashes->len; i++) {
+            GBytes *info_hash = g_ptr_array_index (q.a_info_hashes, i);
+            Swarm *swarm;
+            gsize len;
+            gconstpointer data = g_bytes_get_data (info_hash, &len);
+
+            // duplicates are not allowed in a dict
+            if (i && g_bytes_equal (info_hash, g_ptr_array_index (q.a_info_hashes, i - 1)))
+                continue;
+
+            swarm = tbfs_tracker_server_swarm_update (server, info_hash, &endpoint, &q);
+
+            bencoder_key_binary (&enc, data, len);
+            bencoder_begin_dict (&enc);
+            tbfs_tracker_server_add_counts (&enc, swarm);
+            tbfs_tracker_server_add_peers (&enc, swarm, &endpoint, q.left == 0, numwant);
+            bencoder_end (&enc);
+        }
+        bencoder_end (&enc);
+        tbfs_tracker_server_add_intervals (server, &enc);
+        bencoder_end (&enc);
+    }
+
+    LOG_debug (TSRV_LOG, "Announce of %u torrents, event: %s", q.a_info_hashes->len, q.event[0] ? q.event : "none");
+
+    tbfs_tracker_server_send_reply (req, &enc, evb);
+    evbuffer_free (evb);
+    tbfs_tracker_server_query_free (&q);
+}
+/*}}}*/
+
+/*{{{ scrape */
+static void tbfs_tracker_server_add_scrape_file (BEncoder *enc, GBytes *info_hash, Swarm *swarm)
+{
+    gsize len;
+    gconstpointer data = g_bytes_get_data (info_hash, &len);
+
+    bencoder_key_binary (enc, data, len);
+    bencoder_begin_dict (enc);
+    bencoder_key (enc, "complete");
+    bencoder_int (enc, swarm->seeders);
+    bencoder_key (enc, "downloaded");
+    bencoder_int (enc, swarm->downloaded);
+    bencoder_key (enc, "incomplete");
+    bencoder_int (enc, g_hash_table_size (swarm->h_peers) - swarm->seeders);
+    bencoder_end (enc);
+}
+
+static void tbfs_tracker_server_on_scrape_cb (struct evhttp_request *req, void *ctx)
+{
+    TrackerServer *server = (TrackerServer *) ctx;
+    TrackerQuery q;
+    struct evbuffer *evb;
+    BEncoder enc;
+    guint i;
+
+    tbfs_tracker_server_query_parse (&q, evhttp_uri_get_query (evhttp_request_get_evhttp_uri (req)));
+
+    // full scrape
+    if (!q.a_info_hashes->len) {
+        GHashTableIter iter;
+        gpointer key;
+
+        g_hash_table_iter_init (&iter, server->h_swarms);
+        while (g_hash_table_iter_next (&iter, &key, NULL))
+            g_ptr_array_add (q.a_info_hashes, g_bytes_ref ((GBytes *) key));
+    }
+    g_ptr_array_sort (q.a_info_hashes, tbfs_tracker_server_info_hash_cmp);
+
+    evb = evbuffer_new ();
+    bencoder_init_evbuffer (&enc, evb);
+    bencoder_begin_dict (&enc);
+    bencoder_key (&enc, "files");
+    bencoder_begin_dict (&enc);
+    for (i = 0; i < q.a_info_hashes->len; i++) {
+        GBytes *info_hash = g_ptr_array_index (q.a_info_hashes, i);
+        Swarm *swarm;
+
+        // duplicates are not allowed in a dict
+        if (i && g_bytes_equal (info_hash, g_ptr_array_index (q.a_info_hashes, i - 1)))
+            continue;
+
+        swarm = g_hash_table_lookup (server->h_swarms, info_hash);
+        if (swarm)
+            tbfs_tracker_server_add_scrape_file (&enc, info_hash, swarm);
+    }
+    bencoder_end (&enc);
+    bencoder_end (&enc);
+
+    tbfs_tracker_server_send_reply (req, &enc, evb);
+    evbuffer_free (evb);
+    tbfs_tracker_server_query_free (&q);
+}
+/*}}}*/
+
+/*{{{ expire */
+typedef struct {
+    time_t now;
+    gint32 peer_ttl;
+    Swarm *swarm;
+} SwarmExpireData;
+
+static gboolean tbfs_tracker_server_peer_expired (G_GNUC_UNUSED gpointer key, gpointer value, gpointer data)
+{
+    SwarmPeer *peer = (SwarmPeer *) value;
+    SwarmExpireData *edata = (SwarmExpireData *) data;
+
+    if (edata->now - peer->last_seen < edata->peer_ttl)
+        return FALSE;
+
+    if (peer->seeder)
+        edata->swarm->seeders--;
+
+    return TRUE;
+}
+
+static gboolean tbfs_tracker_server_swarm_expire (G_GNUC_UNUSED gpointer key, gpointer value, gpointer data)
+{
+    Swarm *swarm = (Swarm *) value;
+    SwarmExpireData *edata = (SwarmExpireData *) data;
+
+    edata->swarm = swarm;
+    g_hash_table_foreach_remove (swarm->h_peers, tbfs_tracker_server_peer_expired, edata);
+
+    return g_hash_table_size (swarm->h_peers) == 0;
+}
+
+// drops peers which didn't announce for peer_ttl and empty swarms
+static void tbfs_tracker_server_on_expire_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    TrackerServer *server = (TrackerServer *) arg;
+    SwarmExpireData edata;
+
+    edata.now = time (NULL);
+    edata.peer_ttl = server->peer_ttl;
+    g_hash_table_foreach_remove (server->h_swarms, tbfs_tracker_server_swarm_expire, &edata);
+}
+/*}}}*/
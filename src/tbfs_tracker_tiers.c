@@ -0,0 +1,452 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "tbfs_tracker_tiers.h"
+
+/*{{{ struct */
+// BEP 12: trackers are grouped in tiers, trackers within a tier are shuffled once.
+// An announce goes to the first "parallel" trackers of a tier, the next tier is tried
+// if none of them replied within tier_timeout_sec. Peers from all responders are merged.
+struct _TrackerTiers {
+    Application *app;
+
+    GPtrArray *a_tiers; // GPtrArray of TrackerClient
+    guint parallel;
+    gint32 tier_timeout_sec;
+
+    GHashTable *h_ops; // announces in flight, freed on shutdown as clients drop their callbacks
+};
+
+// announce of one or more torrents
+typedef struct {
+    TrackerTiers *tiers;
+    GPtrArray *a_info_hashes;
+    GArray *a_stats; // TrackerAnnounceStats, one per info_hash
+    TrackerEvent event_type;
+    TrackerClient_on_request_done_cb on_request_done_cb;
+    gpointer ctx;
+
+    GHashTable *h_results; // info_hash -> TiersResult
+
+    guint tier; // current tier
+    guint tier_pending; // callbacks expected from the current tier
+    guint pending; // callbacks expected from all tiers
+    gboolean succeeded; // at least one tracker replied
+    gboolean finished; // on_request_done_cb is called
+    gint busy; // > 0 while sending, op must not be destroyed
+
+    GPtrArray *a_calls; // TiersCall, all tiers
+    struct event *ev_timeout;
+} TiersAnnounce;
+
+// request to a single tracker
+typedef struct {
+    TiersAnnounce *op;
+    TrackerClient *client;
+    guint tier;
+    guint remaining; // callbacks expected from this tracker
+    gboolean ok;
+} TiersCall;
+
+typedef struct {
+    gboolean ok;
+    GArray *a_peer_addrs; // PeerAddr
+    gint32 interval; // the longest intervals of all replies
+    gint32 min_interval;
+    gchar *failure_reason; // the last one, reported if no tracker succeeded
+} TiersResult;
+
+#define TIERS_LOG "tiers"
+
+static void tbfs_tracker_tiers_announce_start_tier (TiersAnnounce *op, guint tier);
+static void tbfs_tracker_tiers_announce_destroy (TiersAnnounce *op);
+static void tbfs_tracker_tiers_on_timeout_cb (evutil_socket_t fd, short events, void *arg);
+/*}}}*/
+
+/*{{{ create / destroy */
+// shuffle trackers within a tier
+static void tbfs_tracker_tiers_shuffle (GPtrArray *a_tier)
+{
+    guint i;
+
+    for (i = a_tier->len; i > 1; i--) {
+        guint j = g_random_int_range (0, i);
+        gpointer tmp = a_tier->pdata[i - 1];
+
+        a_tier->pdata[i - 1] = a_tier->pdata[j];
+        a_tier->pdata[j] = tmp;
+    }
+}
+
+// tracker.tiers: tiers are separated by ';', trackers within a tier by ','
+// "http://a/announce,http://b/announce;udp://c:6969"
+// if empty, the single tracker from tracker.host / tracker.port is used
+TrackerTiers *tbfs_tracker_tiers_create (Application *app)
+{
+    TrackerTiers *tiers;
+    const gchar *s_tiers;
+    gchar **tier_strs;
+    guint i, j;
+
+    tiers = g_new0 (TrackerTiers, 1);
+    tiers->app = app;
+    tiers->a_tiers = g_ptr_array_new_with_free_func ((GDestroyNotify) g_ptr_array_unref);
+    tiers->h_ops = g_hash_table_new (g_direct_hash, g_direct_equal);
+    tiers->parallel = MAX (1, conf_get_int (application_get_conf (app), "tracker.tier_parallel"));
+    tiers->tier_timeout_sec = conf_get_int (application_get_conf (app), "tracker.tier_timeout_sec");
+
+    s_tiers = conf_get_string (application_get_conf (app), "tracker.tiers");
+    tier_strs = g_strsplit (s_tiers ? s_tiers : "", ";", -1);
+
+    for (i = 0; tier_strs[i]; i++) {
+        gchar **urls;
+        GPtrArray *a_tier;
+
+        a_tier = g_ptr_array_new_with_free_func ((GDestroyNotify) tbfs_tracker_client_destroy);
+        urls = g_strsplit (tier_strs[i], ",", -1);
+        for (j = 0; urls[j]; j++) {
+            TrackerClient *client;
+
+            g_strstrip (urls[j]);
+            if (!*urls[j])
+                continue;
+
+            client = tbfs_tracker_client_create (app, urls[j]);
+            if (!client) {
+                LOG_err (TIERS_LOG, "Failed to create tracker client for %s !", urls[j]);
+                continue;
+            }
+            g_ptr_array_add (a_tier, client);
+        }
+        g_strfreev (urls);
+
+        if (a_tier->len) {
+            tbfs_tracker_tiers_shuffle (a_tier);
+            g_ptr_array_add (tiers->a_tiers, a_tier);
+        } else {
+            g_ptr_array_unref (a_tier);
+        }
+    }
+    g_strfreev (tier_strs);
+
+    // single tracker
+    if (!tiers->a_tiers->len) {
+        GPtrArray *a_tier;
+        TrackerClient *client;
+
+        client = tbfs_tracker_client_create (app, NULL);
+        if (!client) {
+            tbfs_tracker_tiers_destroy (tiers);
+            return NULL;
+        }
+
+        a_tier = g_ptr_array_new_with_free_func ((GDestroyNotify) tbfs_tracker_client_destroy);
+        g_ptr_array_add (a_tier, client);
+        g_ptr_array_add (tiers->a_tiers, a_tier);
+    }
+
+    LOG_debug (TIERS_LOG, "Using %u tracker tiers", tiers->a_tiers->len);
+
+    return tiers;
+}
+
+void tbfs_tracker_tiers_destroy (TrackerTiers *tiers)
+{
+    GList *ops, *l;
+
+    // clients drop pending requests without calling back
+    g_ptr_array_free (tiers->a_tiers, TRUE);
+
+    ops = g_hash_table_get_keys (tiers->h_ops);
+    for (l = ops; l; l = l->next)
+        tbfs_tracker_tiers_announce_destroy ((TiersAnnounce *) l->data);
+    g_list_free (ops);
+    g_hash_table_destroy (tiers->h_ops);
+    g_free (tiers);
+}
+/*}}}*/
+
+/*{{{ results */
+static void tiers_result_destroy (TiersResult *result)
+{
+    g_array_free (result->a_peer_addrs, TRUE);
+    g_free (result->failure_reason);
+    g_free (result);
+}
+
+// merges peers, duplicates from different trackers are dropped by PeerMng on insert
+static void tiers_result_add_reply (TiersResult *result, const TrackerAnnounceReply *reply)
+{
+    g_array_append_vals (result->a_peer_addrs, reply->peer_addrs, reply->peer_count);
+    result->interval = MAX (result->interval, reply->interval);
+    result->min_interval = MAX (result->min_interval, reply->min_interval);
+}
+
+static void tiers_result_set_failure (TiersResult *result, const gchar *failure_reason)
+{
+    g_free (result->failure_reason);
+    result->failure_reason = g_strdup (failure_reason);
+}
+/*}}}*/
+
+/*{{{ announce */
+static void tbfs_tracker_tiers_announce_destroy (TiersAnnounce *op)
+{
+    g_hash_table_remove (op->tiers->h_ops, op);
+    g_ptr_array_free (op->a_calls, TRUE);
+    event_free (op->ev_timeout);
+    g_hash_table_destroy (op->h_results);
+    g_ptr_array_free (op->a_info_hashes, TRUE);
+    g_array_free (op->a_stats, TRUE);
+    g_free (op);
+}
+
+// late replies are still expected, op is destroyed after the last one
+static void tbfs_tracker_tiers_announce_check_done (TiersAnnounce *op)
+{
+    if (!op->busy && op->finished && !op->pending)
+        tbfs_tracker_tiers_announce_destroy (op);
+}
+
+static void tbfs_tracker_tiers_announce_finish (TiersAnnounce *op)
+{
+    guint i;
+
+    op->finished = TRUE;
+    evtimer_del (op->ev_timeout);
+
+    for (i = 0; i < op->a_info_hashes->len; i++) {
+        gchar *info_hash = g_ptr_array_index (op->a_info_hashes, i);
+        TiersResult *result = g_hash_table_lookup (op->h_results, info_hash);
+        TrackerAnnounceReply reply;
+
+        memset (&reply, 0, sizeof (reply));
+        reply.peer_addrs = (const PeerAddr *) result->a_peer_addrs->data;
+        reply.peer_count = result->a_peer_addrs->len;
+        reply.interval = result->interval;
+        reply.min_interval = result->min_interval;
+        reply.failure_reason = result->ok ? NULL : result->failure_reason;
+
+        op->on_request_done_cb (result->ok, op->ctx, info_hash,
+            (result->ok || result->failure_reason) ? &reply : NULL);
+    }
+}
+
+// BEP 12: tracker which replied is moved to the front of its tier
+static void tbfs_tracker_tiers_promote (TrackerTiers *tiers, guint tier, TrackerClient *client)
+{
+    GPtrArray *a_tier = g_ptr_array_index (tiers->a_tiers, tier);
+    guint i;
+
+    for (i = 0; i < a_tier->len; i++) {
+        if (g_ptr_array_index (a_tier, i) != client)
+            continue;
+
+        memmove (a_tier->pdata + 1, a_tier->pdata, i * sizeof (gpointer));
+        a_tier->pdata[0] = client;
+        return;
+    }
+}
+
+// TrackerClient cb function, called once per info_hash
+static void tbfs_tracker_tiers_on_announce_cb (gboolean status, TiersCall *call, gchar *info_hash,
+    const TrackerAnnounceReply *reply)
+{
+    TiersAnnounce *op = call->op;
+    TiersResult *result;
+
+    op->busy++;
+
+    result = g_hash_table_lookup (op->h_results, info_hash);
+    if (status && result && !op->finished) {
+        result->ok = TRUE;
+        tiers_result_add_reply (result, reply);
+        op->succeeded = TRUE;
+    } else if (!status && result && !op->finished && reply && reply->failure_reason) {
+        tiers_result_set_failure (result, reply->failure_reason);
+    }
+    if (status)
+        call->ok = TRUE;
+
+    op->pending--;
+    if (call->tier == op->tier)
+        op->tier_pending--;
+
+    call->remaining--;
+    if (!call->remaining) {
+        if (call->ok)
+            tbfs_tracker_tiers_promote (op->tiers, call->tier, call->client);
+        else
+            LOG_msg (TIERS_LOG, "Tracker %s failed", tbfs_tracker_client_get_url (call->client));
+    }
+
+    // all trackers of the current tier replied
+    if (!op->finished && !op->tier_pending) {
+        if (op->succeeded)
+            tbfs_tracker_tiers_announce_finish (op);
+        else
+            tbfs_tracker_tiers_announce_start_tier (op, op->tier + 1);
+    }
+
+    op->busy--;
+    tbfs_tracker_tiers_announce_check_done (op);
+}
+
+static void tbfs_tracker_tiers_announce_start_tier (TiersAnnounce *op, guint tier)
+{
+    TrackerTiers *tiers = op->tiers;
+    GPtrArray *a_tier;
+    GPtrArray *a_calls;
+    guint count = op->a_info_hashes->len;
+    guint i;
+
+    if (tier >= tiers->a_tiers->len) {
+        LOG_err (TIERS_LOG, "All tracker tiers failed !");
+        tbfs_tracker_tiers_announce_finish (op);
+        return;
+    }
+
+    a_tier = g_ptr_array_index (tiers->a_tiers, tier);
+    op->tier = tier;
+    op->tier_pending = 0;
+
+    // count all expected replies first, a tracker could fail right away
+    a_calls = g_ptr_array_new ();
+    for (i = 0; i < MIN (tiers->parallel, a_tier->len); i++) {
+        TiersCall *call;
+
+        call = g_new0 (TiersCall, 1);
+        call->op = op;
+        call->client = g_ptr_array_index (a_tier, i);
+        call->tier = tier;
+        call->remaining = count;
+        g_ptr_array_add (a_calls, call);
+        g_ptr_array_add (op->a_calls, call);
+
+        op->pending += count;
+        op->tier_pending += count;
+    }
+
+    op->busy++;
+    for (i = 0; i < a_calls->len; i++) {
+        TiersCall *call = g_ptr_array_index (a_calls, i);
+        TrackerClient *client = call->client;
+
+        if (count == 1)
+            tbfs_tracker_client_send_request (client, g_ptr_array_index (op->a_info_hashes, 0),
+                (const TrackerAnnounceStats *) op->a_stats->data, op->event_type,
+                (TrackerClient_on_request_done_cb) tbfs_tracker_tiers_on_announce_cb, call);
+        else
+            tbfs_tracker_client_send_batch_request (client, (const gchar **) op->a_info_hashes->pdata,
+                (const TrackerAnnounceStats *) op->a_stats->data, count, op->event_type,
+                (TrackerClient_on_request_done_cb) tbfs_tracker_tiers_on_announce_cb, call);
+    }
+    op->busy--;
+    g_ptr_array_free (a_calls, TRUE);
+
+    // don't wait for slow trackers once one replied, quick failover to the next tier otherwise
+    if (!op->finished && tiers->tier_timeout_sec > 0) {
+        struct timeval tv;
+
+        tv.tv_sec = tiers->tier_timeout_sec;
+        tv.tv_usec = 0;
+        evtimer_add (op->ev_timeout, &tv);
+    }
+}
+
+static void tbfs_tracker_tiers_on_timeout_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    TiersAnnounce *op = (TiersAnnounce *) arg;
+
+    if (op->finished)
+        return;
+
+    op->busy++;
+    if (op->succeeded) {
+        // don't wait for slow trackers
+        tbfs_tracker_tiers_announce_finish (op);
+    } else if (op->tier + 1 < op->tiers->a_tiers->len) {
+        LOG_msg (TIERS_LOG, "Tracker tier %u timed out, trying the next one", op->tier);
+        tbfs_tracker_tiers_announce_start_tier (op, op->tier + 1);
+    } else {
+        // last tier: keep waiting for the pending replies
+        LOG_msg (TIERS_LOG, "Tracker tier %u timed out, no more tiers", op->tier);
+    }
+    op->busy--;
+
+    tbfs_tracker_tiers_announce_check_done (op);
+}
+
+// on_request_done_cb () is called once for every info_hash
+void tbfs_tracker_tiers_send_batch_request (TrackerTiers *tiers, const gchar **info_hashes, const TrackerAnnounceStats *stats,
+    guint count, TrackerEvent event_type, TrackerClient_on_request_done_cb on_request_done_cb, gpointer ctx)
+{
+    TiersAnnounce *op;
+    guint i;
+
+    op = g_new0 (TiersAnnounce, 1);
+    op->tiers = tiers;
+    op->event_type = event_type;
+    op->on_request_done_cb = on_request_done_cb;
+    op->ctx = ctx;
+    op->a_info_hashes = g_ptr_array_new_with_free_func (g_free);
+    op->a_stats = g_array_sized_new (FALSE, FALSE, sizeof (TrackerAnnounceStats), count);
+    op->h_results = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) tiers_result_destroy);
+    op->a_calls = g_ptr_array_new_with_free_func (g_free);
+    op->ev_timeout = evtimer_new (application_get_evbase (tiers->app), tbfs_tracker_tiers_on_timeout_cb, op);
+
+    for (i = 0; i < count; i++) {
+        TiersResult *result;
+        gchar *info_hash;
+
+        if (g_hash_table_lookup (op->h_results, info_hashes[i]))
+            continue;
+
+        info_hash = g_strdup (info_hashes[i]);
+        g_ptr_array_add (op->a_info_hashes, info_hash);
+        g_array_append_vals (op->a_stats, &stats[i], 1);
+
+        result = g_new0 (TiersResult, 1);
+        result->a_peer_addrs = g_array_new (FALSE, FALSE, sizeof (PeerAddr));
+        g_hash_table_insert (op->h_results, info_hash, result);
+    }
+
+    g_hash_table_insert (tiers->h_ops, op, op);
+
+    op->busy++;
+    tbfs_tracker_tiers_announce_start_tier (op, 0);
+    op->busy--;
+
+    tbfs_tracker_tiers_announce_check_done (op);
+}
+
+void tbfs_tracker_tiers_send_request (TrackerTiers *tiers, const gchar *info_hash, const TrackerAnnounceStats *stats,
+    TrackerEvent event_type, TrackerClient_on_request_done_cb on_request_done_cb, gpointer ctx)
+{
+    tbfs_tracker_tiers_send_batch_request (tiers, &info_hash, stats, 1, event_type, on_request_done_cb, ctx);
+}
+/*}}}*/
+
+/*{{{ scrape */
+// scrape is only a hint, the first tracker of the first tier is asked
+void tbfs_tracker_tiers_scrape (TrackerTiers *tiers, const gchar **info_hashes, guint count,
+    TrackerClient_on_scrape_done_cb on_scrape_done_cb, gpointer ctx)
+{
+    GPtrArray *a_tier = g_ptr_array_index (tiers->a_tiers, 0);
+
+    tbfs_tracker_client_scrape (g_ptr_array_index (a_tier, 0), info_hashes, count, on_scrape_done_cb, ctx);
+}
+/*}}}*/
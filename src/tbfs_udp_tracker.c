@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "tbfs_udp_tracker.h"
+#include "tbfs_dns_cache.h"
+
+/*{{{ struct */
+// BEP 15: UDP Tracker Protocol
+#define UDP_TRACKER_PROTOCOL_ID 0x41727101980LL
+#define UDP_TRACKER_CONN_ID_TTL 60 // seconds
+#define UDP_TRACKER_MAX_PKT 2048
+#define UDP_TRACKER_MAX_SCRAPE 74 // info_hashes per scrape packet
+
+typedef enum {
+    UTA_Connect = 0,
+    UTA_Announce = 1,
+    UTA_Scrape = 2,
+    UTA_Error = 3,
+} UdpTrackerAction;
+
+struct _UdpTracker {
+    Application *app;
+
+    gchar *host;
+    struct sockaddr_in sin;
+    evutil_socket_t fd;
+    struct event *ev_read;
+
+    guint64 conn_id;
+    time_t conn_id_time;
+    gboolean connecting;
+
+    GHashTable *h_requests; // transaction_id -> UdpTrackerRequest, requests in flight
+    GQueue *q_waiting; // requests waiting for connection_id
+
+    gint32 timeout_sec;
+    gint32 retries;
+};
+
+typedef struct {
+    UdpTracker *ut;
+    UdpTrackerAction action;
+    guint32 tid;
+    struct sockaddr_in sin; // tracker address the last attempt was sent to
+
+    GPtrArray *a_info_hashes; // one for announce, up to UDP_TRACKER_MAX_SCRAPE for scrape
+    TrackerEvent event_type;
+    TrackerAnnounceStats stats;
+
+    TrackerClient_on_request_done_cb on_request_done_cb;
+    TrackerClient_on_scrape_done_cb on_scrape_done_cb;
+    gpointer ctx;
+
+    struct event *ev_timeout;
+    gint attempt;
+} UdpTrackerRequest;
+
+#define UTR_LOG "udp_tr"
+
+static void tbfs_udp_tracker_on_read_cb (evutil_socket_t fd, short events, void *arg);
+static void tbfs_udp_tracker_on_timeout_cb (evutil_socket_t fd, short events, void *arg);
+static void tbfs_udp_tracker_request_send (UdpTrackerRequest *req);
+static void tbfs_udp_tracker_request_fail (UdpTrackerRequest *req);
+/*}}}*/
+
+/*{{{ create / destroy */
+UdpTracker *tbfs_udp_tracker_create (Application *app, const gchar *host, gint port)
+{
+    UdpTracker *ut;
+    struct evutil_addrinfo hints;
+    struct evutil_addrinfo *ai = NULL;
+    gchar s_port[10];
+    int res;
+
+    ut = g_new0 (UdpTracker, 1);
+    ut->app = app;
+    ut->fd = -1;
+    ut->host = g_strdup (host);
+    ut->h_requests = g_hash_table_new (g_direct_hash, g_direct_equal);
+    ut->q_waiting = g_queue_new ();
+    ut->timeout_sec = conf_get_int (application_get_conf (app), "tracker.udp_timeout_sec");
+    ut->retries = conf_get_int (application_get_conf (app), "tracker.retries");
+
+    // resolved at startup, later connects take the address from DnsCache
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    g_snprintf (s_port, sizeof (s_port), "%d", port);
+    res = evutil_getaddrinfo (host, s_port, &hints, &ai);
+    if (res || !ai) {
+        LOG_err (UTR_LOG, "Failed to resolve UDP tracker address %s: %s", host, evutil_gai_strerror (res));
+        tbfs_udp_tracker_destroy (ut);
+        return NULL;
+    }
+    memcpy (&ut->sin, ai->ai_addr, sizeof (struct sockaddr_in));
+    evutil_freeaddrinfo (ai);
+
+    ut->fd = socket (AF_INET, SOCK_DGRAM, 0);
+    if (ut->fd < 0) {
+        LOG_err (UTR_LOG, "Failed to create UDP socket: %s", strerror (errno));
+        tbfs_udp_tracker_destroy (ut);
+        return NULL;
+    }
+    evutil_make_socket_nonblocking (ut->fd);
+
+    // all requests are multiplexed on the one socket
+    ut->ev_read = event_new (application_get_evbase (app), ut->fd, EV_READ | EV_PERSIST, tbfs_udp_tracker_on_read_cb, ut);
+    event_add (ut->ev_read, NULL);
+
+    LOG_debug (UTR_LOG, "UDP tracker: %s:%d", inet_ntoa (ut->sin.sin_addr), port);
+
+    return ut;
+}
+
+static void tbfs_udp_tracker_request_destroy (UdpTrackerRequest *req)
+{
+    if (req->ev_timeout)
+        event_free (req->ev_timeout);
+    if (req->a_info_hashes)
+        g_ptr_array_free (req->a_info_hashes, TRUE);
+    g_free (req);
+}
+
+void tbfs_udp_tracker_destroy (UdpTracker *ut)
+{
+    GList *l_reqs, *l;
+
+    l_reqs = g_hash_table_get_values (ut->h_requests);
+    for (l = l_reqs; l; l = g_list_next (l))
+        tbfs_udp_tracker_request_destroy ((UdpTrackerRequest *) l->data);
+    g_list_free (l_reqs);
+    g_hash_table_destroy (ut->h_requests);
+
+    g_queue_foreach (ut->q_waiting, (GFunc) tbfs_udp_tracker_request_destroy, NULL);
+    g_queue_free (ut->q_waiting);
+
+    if (ut->ev_read)
+        event_free (ut->ev_read);
+    if (ut->fd >= 0)
+        evutil_closesocket (ut->fd);
+    g_free (ut->host);
+    g_free (ut);
+}
+/*}}}*/
+
+/*{{{ requests */
+static UdpTrackerRequest *tbfs_udp_tracker_request_create (UdpTracker *ut, UdpTrackerAction action, gpointer ctx)
+{
+    UdpTrackerRequest *req;
+
+    req = g_new0 (UdpTrackerRequest, 1);
+    req->ut = ut;
+    req->action = action;
+    req->ctx = ctx;
+    req->attempt = 0;
+    req->ev_timeout = evtimer_new (application_get_evbase (ut->app), tbfs_udp_tracker_on_timeout_cb, req);
+    if (action != UTA_Connect)
+        req->a_info_hashes = g_ptr_array_new_with_free_func (g_free);
+
+    return req;
+}
+
+static gboolean tbfs_udp_tracker_conn_id_valid (UdpTracker *ut)
+{
+    return ut->conn_id && time (NULL) - ut->conn_id_time < UDP_TRACKER_CONN_ID_TTL;
+}
+
+// sends request if connection_id is known, otherwise queues it and connects
+static void tbfs_udp_tracker_request_start (UdpTracker *ut, UdpTrackerRequest *req)
+{
+    if (tbfs_udp_tracker_conn_id_valid (ut)) {
+        tbfs_udp_tracker_request_send (req);
+        return;
+    }
+
+    g_queue_push_tail (ut->q_waiting, req);
+
+    if (!ut->connecting) {
+        UdpTrackerRequest *conn_req;
+        guint32 addr;
+
+        // tracker may have moved, the next A record is tried with every new connection_id
+        if (tbfs_dns_cache_lookup (application_get_dns_cache (ut->app), ut->host, &addr))
+            ut->sin.sin_addr.s_addr = addr;
+
+        ut->connecting = TRUE;
+        conn_req = tbfs_udp_tracker_request_create (ut, UTA_Connect, NULL);
+        tbfs_udp_tracker_request_send (conn_req);
+    }
+}
+
+static guint8 *udp_put_u32 (guint8 *p, guint32 val)
+{
+    val = htonl (val);
+    memcpy (p, &val, 4);
+    return p + 4;
+}
+
+static guint8 *udp_put_u64 (guint8 *p, guint64 val)
+{
+    val = GUINT64_TO_BE (val);
+    memcpy (p, &val, 8);
+    return p + 8;
+}
+
+static guint32 udp_get_u32 (const guint8 *p)
+{
+    guint32 val;
+
+    memcpy (&val, p, 4);
+    return ntohl (val);
+}
+
+// (re)sends request with a new transaction_id and arms retransmit timer
+static void tbfs_udp_tracker_request_send (UdpTrackerRequest *req)
+{
+    UdpTracker *ut = req->ut;
+    guint8 pkt[UDP_TRACKER_MAX_PKT];
+    guint8 *p = pkt;
+    struct timeval tv;
+    guint i;
+
+    g_hash_table_remove (ut->h_requests, GUINT_TO_POINTER (req->tid));
+    do {
+        req->tid = g_random_int ();
+    } while (g_hash_table_lookup (ut->h_requests, GUINT_TO_POINTER (req->tid)));
+
+    if (req->action == UTA_Connect)
+        p = udp_put_u64 (p, UDP_TRACKER_PROTOCOL_ID);
+    else
+        p = udp_put_u64 (p, ut->conn_id);
+    p = udp_put_u32 (p, req->action);
+    p = udp_put_u32 (p, req->tid);
+
+    if (req->action == UTA_Announce) {
+        const gchar *peer_id = conf_get_string (application_get_conf (ut->app), "peer.peer_id");
+        guint32 event;
+        guint16 port;
+
+        hexstr_to_sha1 (p, g_ptr_array_index (req->a_info_hashes, 0)); p += SHA_DIGEST_LENGTH;
+        memset (p, 0, PEER_ID_LENGTH);
+        memcpy (p, peer_id, MIN (strlen (peer_id), PEER_ID_LENGTH)); p += PEER_ID_LENGTH;
+        p = udp_put_u64 (p, req->stats.downloaded);
+        p = udp_put_u64 (p, req->stats.left);
+        p = udp_put_u64 (p, req->stats.uploaded);
+
+        if (req->event_type == TE_completed)
+            event = 1;
+        else if (req->event_type == TE_started)
+            event = 2;
+        else if (req->event_type == TE_stopped)
+            event = 3;
+        else
+            event = 0;
+        p = udp_put_u32 (p, event);
+        p = udp_put_u32 (p, 0); // IP address, default
+        p = udp_put_u32 (p, 0); // key
+        p = udp_put_u32 (p, (guint32) req->stats.numwant); // -1: default
+        port = htons (conf_get_int (application_get_conf (ut->app), "peer_server.port"));
+        memcpy (p, &port, 2); p += 2;
+
+    } else if (req->action == UTA_Scrape) {
+        for (i = 0; i < req->a_info_hashes->len; i++) {
+            hexstr_to_sha1 (p, g_ptr_array_index (req->a_info_hashes, i));
+            p += SHA_DIGEST_LENGTH;
+        }
+    }
+
+    g_hash_table_insert (ut->h_requests, GUINT_TO_POINTER (req->tid), req);
+
+    // ut->sin can change with the next connect, reply is matched against this one
+    req->sin = ut->sin;
+    if (sendto (ut->fd, pkt, p - pkt, 0, (struct sockaddr *) &req->sin, sizeof (struct sockaddr_in)) < 0)
+        LOG_err (UTR_LOG, "Failed to send UDP tracker request: %s", strerror (errno));
+
+    // BEP 15: timeout is 15 * 2 ^ n seconds
+    tv.tv_sec = ut->timeout_sec << MIN (req->attempt, 8);
+    tv.tv_usec = 0;
+    evtimer_add (req->ev_timeout, &tv);
+}
+
+static void tbfs_udp_tracker_on_timeout_cb (G_GNUC_UNUSED evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    UdpTrackerRequest *req = (UdpTrackerRequest *) arg;
+
+    req->attempt++;
+    if (req->attempt > req->ut->retries) {
+        LOG_err (UTR_LOG, "UDP tracker request timed out (action %d) !", req->action);
+        g_hash_table_remove (req->ut->h_requests, GUINT_TO_POINTER (req->tid));
+        tbfs_udp_tracker_request_fail (req);
+        return;
+    }
+
+    LOG_debug (UTR_LOG, "Retransmitting UDP tracker request (action %d, attempt %d)", req->action, req->attempt);
+
+    // connection_id could expire while we were waiting
+    if (req->action != UTA_Connect && !tbfs_udp_tracker_conn_id_valid (req->ut)) {
+        g_hash_table_remove (req->ut->h_requests, GUINT_TO_POINTER (req->tid));
+        tbfs_udp_tracker_request_start (req->ut, req);
+        return;
+    }
+
+    tbfs_udp_tracker_request_send (req);
+}
+
+// reports failure to the caller and destroys request
+// connect failure fails all requests waiting for connection_id
+static void tbfs_udp_tracker_request_fail_reason (UdpTrackerRequest *req, const gchar *failure_reason)
+{
+    UdpTracker *ut = req->ut;
+    TrackerAnnounceReply reply;
+    guint i;
+
+    memset (&reply, 0, sizeof (reply));
+    reply.failure_reason = failure_reason;
+
+    if (req->action == UTA_Connect) {
+        UdpTrackerRequest *waiting;
+
+        ut->connecting = FALSE;
+        while ((waiting = g_queue_pop_head (ut->q_waiting)))
+            tbfs_udp_tracker_request_fail_reason (waiting, failure_reason);
+    } else if (req->action == UTA_Announce) {
+        for (i = 0; i < req->a_info_hashes->len; i++)
+            req->on_request_done_cb (FALSE, req->ctx, g_ptr_array_index (req->a_info_hashes, i),
+                failure_reason ? &reply : NULL);
+    } else if (req->action == UTA_Scrape) {
+        req->on_scrape_done_cb (FALSE, req->ctx, NULL, 0);
+    }
+
+    tbfs_udp_tracker_request_destroy (req);
+}
+
+static void tbfs_udp_tracker_request_fail (UdpTrackerRequest *req)
+{
+    tbfs_udp_tracker_request_fail_reason (req, NULL);
+}
+
+void tbfs_udp_tracker_announce (UdpTracker *ut, const gchar *info_hash, const TrackerAnnounceStats *stats, TrackerEvent event_type,
+    TrackerClient_on_request_done_cb on_request_done_cb, gpointer ctx)
+{
+    UdpTrackerRequest *req;
+
+    req = tbfs_udp_tracker_request_create (ut, UTA_Announce, ctx);
+    g_ptr_array_add (req->a_info_hashes, g_strdup (info_hash));
+    req->event_type = event_type;
+    req->stats = *stats;
+    req->on_request_done_cb = on_request_done_cb;
+
+    tbfs_udp_tracker_request_start (ut, req);
+}
+
+// a single packet holds up to UDP_TRACKER_MAX_SCRAPE info_hashes,
+// the rest are left out of the reply, as if tracker didn't know them
+void tbfs_udp_tracker_scrape (UdpTracker *ut, const gchar **info_hashes, guint count,
+    TrackerClient_on_scrape_done_cb on_scrape_done_cb, gpointer ctx)
+{
+    UdpTrackerRequest *req;
+    guint i;
+
+    if (count > UDP_TRACKER_MAX_SCRAPE)
+        LOG_debug (UTR_LOG, "Scraping only %d of %u torrents", UDP_TRACKER_MAX_SCRAPE, count);
+
+    req = tbfs_udp_tracker_request_create (ut, UTA_Scrape, ctx);
+    for (i = 0; i < MIN (count, UDP_TRACKER_MAX_SCRAPE); i++)
+        g_ptr_array_add (req->a_info_hashes, g_strdup (info_hashes[i]));
+    req->on_scrape_done_cb = on_scrape_done_cb;
+
+    tbfs_udp_tracker_request_start (ut, req);
+}
+/*}}}*/
+
+/*{{{ responses */
+static void tbfs_udp_tracker_on_connect_response (UdpTracker *ut, UdpTrackerRequest *req, const guint8 *data, gssize len)
+{
+    UdpTrackerRequest *waiting;
+    guint64 conn_id;
+
+    if (len < 16) {
+        tbfs_udp_tracker_request_fail (req);
+        return;
+    }
+
+    memcpy (&conn_id, data + 8, 8);
+    ut->conn_id = GUINT64_FROM_BE (conn_id);
+    ut->conn_id_time = time (NULL);
+    ut->connecting = FALSE;
+
+    LOG_debug (UTR_LOG, "Got connection_id, sending %u requests", g_queue_get_length (ut->q_waiting));
+
+    tbfs_udp_tracker_request_destroy (req);
+
+    while ((waiting = g_queue_pop_head (ut->q_waiting)))
+        tbfs_udp_tracker_request_send (waiting);
+}
+
+static void tbfs_udp_tracker_on_announce_response (UdpTrackerRequest *req, const guint8 *data, gssize len)
+{
+    TrackerAnnounceReply reply;
+    PeerAddr *peer_addrs = NULL;
+
+    memset (&reply, 0, sizeof (reply));
+
+    // action, transaction_id, interval, leechers, seeders
+    if (len >= 20)
+        peer_addrs = tbfs_tracker_client_decode_peers (data + 20, len - 20, &reply.peer_count);
+    if (!peer_addrs) {
+        tbfs_udp_tracker_request_fail (req);
+        return;
+    }
+
+    reply.peer_addrs = peer_addrs;
+    reply.interval = (gint32) MIN (udp_get_u32 (data + 8), (guint32) G_MAXINT32);
+
+    LOG_debug (UTR_LOG, "Got peers: %u (interval: %d seeders: %u leechers: %u)", reply.peer_count,
+        reply.interval, udp_get_u32 (data + 16), udp_get_u32 (data + 12));
+
+    req->on_request_done_cb (TRUE, req->ctx, g_ptr_array_index (req->a_info_hashes, 0), &reply);
+
+    g_free (peer_addrs);
+    tbfs_udp_tracker_request_destroy (req);
+}
+
+static void tbfs_udp_tracker_on_scrape_response (UdpTrackerRequest *req, const guint8 *data, gssize len)
+{
+    TrackerScrapeInfo *infos;
+    guint count;
+    guint i;
+
+    // seeders, completed, leechers for every info_hash in request order
+    count = MIN ((len - 8) / 12, (gssize) req->a_info_hashes->len);
+    infos = g_new0 (TrackerScrapeInfo, MAX (count, 1));
+    for (i = 0; i < count; i++) {
+        const guint8 *p = data + 8 + i * 12;
+
+        strncpy (infos[i].info_hash, g_ptr_array_index (req->a_info_hashes, i), 2 * SHA_DIGEST_LENGTH);
+        infos[i].complete = udp_get_u32 (p);
+        infos[i].downloaded = udp_get_u32 (p + 4);
+        infos[i].incomplete = udp_get_u32 (p + 8);
+    }
+
+    req->on_scrape_done_cb (TRUE, req->ctx, infos, count);
+
+    g_free (infos);
+    tbfs_udp_tracker_request_destroy (req);
+}
+
+static void tbfs_udp_tracker_on_read_cb (evutil_socket_t fd, G_GNUC_UNUSED short events, void *arg)
+{
+    UdpTracker *ut = (UdpTracker *) arg;
+    guint8 data[UDP_TRACKER_MAX_PKT];
+    struct sockaddr_in sin;
+    socklen_t sin_len;
+    gssize len;
+
+    // drain the socket
+    for (;;) {
+        UdpTrackerRequest *req;
+        guint32 action;
+        guint32 tid;
+
+        sin_len = sizeof (sin);
+        len = recvfrom (fd, data, sizeof (data), 0, (struct sockaddr *) &sin, &sin_len);
+        if (len < 0)
+            break;
+
+        if (len < 8)
+            continue;
+
+        action = udp_get_u32 (data);
+        tid = udp_get_u32 (data + 4);
+
+        // reply must come from the address the request was sent to
+        req = g_hash_table_lookup (ut->h_requests, GUINT_TO_POINTER (tid));
+        if (!req || sin.sin_addr.s_addr != req->sin.sin_addr.s_addr || sin.sin_port != req->sin.sin_port) {
+            LOG_debug (UTR_LOG, "Unknown transaction_id: %u", tid);
+            continue;
+        }
+        g_hash_table_remove (ut->h_requests, GUINT_TO_POINTER (tid));
+        evtimer_del (req->ev_timeout);
+
+        if (action == UTA_Error) {
+            gchar *failure_reason = g_strndup ((const gchar *) data + 8, len - 8);
+
+            LOG_err (UTR_LOG, "UDP tracker error: %s", failure_reason);
+            // connection_id could be rejected, get a new one for the next requests
+            ut->conn_id = 0;
+            tbfs_udp_tracker_request_fail_reason (req, failure_reason);
+            g_free (failure_reason);
+            continue;
+        }
+
+        if (action != req->action) {
+            LOG_err (UTR_LOG, "Unexpected UDP tracker action: %u !", action);
+            tbfs_udp_tracker_request_fail (req);
+            continue;
+        }
+
+        if (action == UTA_Connect)
+            tbfs_udp_tracker_on_connect_response (ut, req, data, len);
+        else if (action == UTA_Announce)
+            tbfs_udp_tracker_on_announce_response (req, data, len);
+        else
+            tbfs_udp_tracker_on_scrape_response (req, data, len);
+    }
+}
+/*}}}*/
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2012-2013 Paul Ionkin <paul.ionkin@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#include "wutils.h"
+
+// binary min-heap, nodes are owned by the caller and keep their position in the heap
+struct _WHeap {
+    GPtrArray *a_nodes;
+};
+
+#define WHEAP_NOT_QUEUED G_MAXUINT
+
+WHeap *wheap_create (void)
+{
+    WHeap *heap;
+
+    heap = g_new0 (WHeap, 1);
+    heap->a_nodes = g_ptr_array_new ();
+
+    return heap;
+}
+
+void wheap_destroy (WHeap *heap)
+{
+    guint i;
+
+    for (i = 0; i < heap->a_nodes->len; i++) {
+        WHeapNode *node = (WHeapNode *) g_ptr_array_index (heap->a_nodes, i);
+        node->idx = WHEAP_NOT_QUEUED;
+    }
+    g_ptr_array_free (heap->a_nodes, TRUE);
+    g_free (heap);
+}
+
+void wheap_node_init (WHeapNode *node, gpointer data)
+{
+    node->key = 0;
+    node->idx = WHEAP_NOT_QUEUED;
+    node->data = data;
+}
+
+static void wheap_swap (WHeap *heap, guint a, guint b)
+{
+    WHeapNode *na = (WHeapNode *) g_ptr_array_index (heap->a_nodes, a);
+    WHeapNode *nb = (WHeapNode *) g_ptr_array_index (heap->a_nodes, b);
+
+    g_ptr_array_index (heap->a_nodes, a) = nb;
+    g_ptr_array_index (heap->a_nodes, b) = na;
+    nb->idx = a;
+    na->idx = b;
+}
+
+static void wheap_sift_up (WHeap *heap, guint idx)
+{
+    while (idx > 0) {
+        guint parent = (idx - 1) / 2;
+        WHeapNode *n = (WHeapNode *) g_ptr_array_index (heap->a_nodes, idx);
+        WHeapNode *p = (WHeapNode *) g_ptr_array_index (heap->a_nodes, parent);
+
+        if (p->key <= n->key)
+            break;
+
+        wheap_swap (heap, idx, parent);
+        idx = parent;
+    }
+}
+
+static void wheap_sift_down (WHeap *heap, guint idx)
+{
+    guint len = heap->a_nodes->len;
+
+    for (;;) {
+        guint left = 2 * idx + 1;
+        guint right = left + 1;
+        guint smallest = idx;
+
+        if (left < len &&
+            ((WHeapNode *) g_ptr_array_index (heap->a_nodes, left))->key <
+            ((WHeapNode *) g_ptr_array_index (heap->a_nodes, smallest))->key)
+            smallest = left;
+        if (right < len &&
+            ((WHeapNode *) g_ptr_array_index (heap->a_nodes, right))->key <
+            ((WHeapNode *) g_ptr_array_index (heap->a_nodes, smallest))->key)
+            smallest = right;
+
+        if (smallest == idx)
+            break;
+
+        wheap_swap (heap, idx, smallest);
+        idx = smallest;
+    }
+}
+
+void wheap_push (WHeap *heap, WHeapNode *node, gint64 key)
+{
+    if (node->idx != WHEAP_NOT_QUEUED) {
+        wheap_update (heap, node, key);
+        return;
+    }
+
+    node->key = key;
+    node->idx = heap->a_nodes->len;
+    g_ptr_array_add (heap->a_nodes, node);
+    wheap_sift_up (heap, node->idx);
+}
+
+void wheap_remove (WHeap *heap, WHeapNode *node)
+{
+    guint idx = node->idx;
+    guint last;
+
+    if (idx == WHEAP_NOT_QUEUED)
+        return;
+
+    last = heap->a_nodes->len - 1;
+    if (idx != last)
+        wheap_swap (heap, idx, last);
+
+    g_ptr_array_remove_index_fast (heap->a_nodes, last);
+    node->idx = WHEAP_NOT_QUEUED;
+
+    if (idx != last) {
+        wheap_sift_down (heap, idx);
+        wheap_sift_up (heap, idx);
+    }
+}
+
+void wheap_update (WHeap *heap, WHeapNode *node, gint64 key)
+{
+    gint64 old_key = node->key;
+
+    if (node->idx == WHEAP_NOT_QUEUED) {
+        wheap_push (heap, node, key);
+        return;
+    }
+
+    node->key = key;
+    if (key < old_key)
+        wheap_sift_up (heap, node->idx);
+    else
+        wheap_sift_down (heap, node->idx);
+}
+
+WHeapNode *wheap_peek (WHeap *heap)
+{
+    if (!heap->a_nodes->len)
+        return NULL;
+
+    return (WHeapNode *) g_ptr_array_index (heap->a_nodes, 0);
+}
+
+WHeapNode *wheap_pop (WHeap *heap)
+{
+    WHeapNode *node;
+
+    node = wheap_peek (heap);
+    if (node)
+        wheap_remove (heap, node);
+
+    return node;
+}
+
+gboolean wheap_node_is_queued (WHeapNode *node)
+{
+    return node->idx != WHEAP_NOT_QUEUED;
+}
+
+guint wheap_size (WHeap *heap)
+{
+    return heap->a_nodes->len;
+}